@@ -2,14 +2,13 @@
 #include "logging.hpp"
 #include "rate_prompt.hpp"
 
-#include <fstream>
-#include <functional>
-#include <sstream>
 #include <string>
 #include <vector>
-#include <numeric>
 
-#include <clang-c/Index.h>
+// This is defined by the CMakeLists.txt
+#ifdef ENABLE_CPP_SUPPORT
+    #include <clang-c/Index.h>
+#endif // ENABLE_CPP_SUPPORT
 
 namespace analysis {
 
@@ -17,6 +16,8 @@ namespace analysis {
 //------------------------------------------------------------------------------
 // AST Parsing
 
+#ifdef ENABLE_CPP_SUPPORT
+
 struct VisitorClientData
 {
     std::vector<CXCursor> FunctionCursors;
@@ -67,51 +68,15 @@ void functions_in_file(VisitorClientData* data, CXCursor cursor) {
     clang_visitChildren(cursor, cursor_visitor, data);
 }
 
-std::string function_source(const CXCursor& node, const std::string& file_contents) {
-    CXSourceRange extent = clang_getCursorExtent(node);
-    CXSourceLocation start = clang_getRangeStart(extent);
-    CXSourceLocation end = clang_getRangeEnd(extent);
-
-    unsigned start_offset, end_offset;
-    clang_getSpellingLocation(start, nullptr, nullptr, nullptr, &start_offset);
-    clang_getSpellingLocation(end, nullptr, nullptr, nullptr, &end_offset);
-
-    std::string func_src = file_contents.substr(start_offset, end_offset - start_offset);
-
-    std::vector<std::string> lines;
-    std::istringstream iss(file_contents.substr(0, start_offset));
-    for (std::string line; std::getline(iss, line);) {
-        lines.push_back(line);
-    }
-
-    std::vector<std::string> comments;
-    for (auto it = lines.rbegin(); it != lines.rend(); ++it) {
-        std::string stripped = *it;
-        stripped.erase(0, stripped.find_first_not_of(" \t\n\v\f\r"));
-        stripped.erase(stripped.find_last_not_of(" \t\n\v\f\r") + 1);
-
-        if (stripped.rfind("//", 0) == 0 || stripped.rfind("/*", 0) == 0 || stripped.rfind("*/", 0) == stripped.size() - 2) {
-            comments.push_back(*it);
-        } else {
-            break;
-        }
-    }
-
-    std::reverse(comments.begin(), comments.end());
-    std::string comment_str = std::accumulate(comments.begin(), comments.end(), std::string(),
-        [](const std::string& a, const std::string& b) {
-            return a + (a.length() > 0 ? "\n" : "") + b;
-        });
-
-    return (comment_str.empty() ? "" : comment_str + "\n") + func_src;
-}
-
-void extract_cpp_functions(
+bool extract_cpp_functions(
     std::string file_path,
     const char* file_contents,
     size_t size,
-    std::function<void(const std::string &)> func_processor)
+    const std::vector<std::string>& compile_args,
+    std::vector<FunctionRecord>& out_records)
 {
+    out_records.clear();
+
     CXIndex index = clang_createIndex(0, 0);
 
     // Create an unsaved file with mmap content
@@ -121,20 +86,38 @@ void extract_cpp_functions(
     unsaved_file.Contents = file_contents;
     unsaved_file.Length = size;
 
-    CXTranslationUnit tu = clang_parseTranslationUnit(index, file_path.c_str(), nullptr, 0, &unsaved_file, 1, CXTranslationUnit_None);
+    std::vector<const char*> args;
+    for (const auto& arg : compile_args) {
+        args.push_back(arg.c_str());
+    }
+
+    CXTranslationUnit tu = clang_parseTranslationUnit(index, file_path.c_str(), args.data(), static_cast<int>( args.size() ), &unsaved_file, 1, CXTranslationUnit_None);
+    if (!tu) {
+        BOOST_LOG_TRIVIAL(error) << "libclang failed to parse " << file_path;
+        clang_disposeIndex(index);
+        return false;
+    }
 
     VisitorClientData client_data;
     client_data.ExpectedFilePath = file_path;
     functions_in_file(&client_data, clang_getTranslationUnitCursor(tu));
     for (const auto& cursor : client_data.FunctionCursors) {
-        std::string code = function_source(cursor, file_contents);
-        func_processor(code);
+        CXSourceRange extent = clang_getCursorExtent(cursor);
+
+        unsigned start_offset, end_offset;
+        clang_getSpellingLocation(clang_getRangeStart(extent), nullptr, nullptr, nullptr, &start_offset);
+        clang_getSpellingLocation(clang_getRangeEnd(extent), nullptr, nullptr, nullptr, &end_offset);
+
+        out_records.push_back(make_function_record(file_contents, start_offset, end_offset));
     }
 
     clang_disposeTranslationUnit(tu);
     clang_disposeIndex(index);
+    return true;
 }
 
+#endif // ENABLE_CPP_SUPPORT
+
 
 //------------------------------------------------------------------------------
 // Prompt Generation
@@ -190,5 +173,22 @@ void ask_cpp_expert_score(
     return create_conversation_template(out_prompt, out_stop_strs, messages, custom_start, user_role, assistant_role);
 }
 
+size_t ask_cpp_expert_score_shared_length(
+    const std::string& user_role,
+    const std::string& assistant_role)
+{
+    // Two prompts whose code differs in its first character differ exactly where the code starts
+    std::string prompt_a, prompt_b;
+    std::vector<std::string> stop_strs;
+    ask_cpp_expert_score(prompt_a, stop_strs, "a", user_role, assistant_role);
+    ask_cpp_expert_score(prompt_b, stop_strs, "b", user_role, assistant_role);
+
+    size_t length = 0;
+    while (length < prompt_a.size() && prompt_a[length] == prompt_b[length]) {
+        ++length;
+    }
+    return length;
+}
+
 
 } // namespace analysis
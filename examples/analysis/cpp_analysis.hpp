@@ -1,9 +1,10 @@
 #ifndef CPP_ANALYZE_HPP
 #define CPP_ANALYZE_HPP
 
+#include "function_record.hpp"
+
 #include <vector>
 #include <string>
-#include <functional>
 
 namespace analysis {
 
@@ -11,12 +12,18 @@ namespace analysis {
 //------------------------------------------------------------------------------
 // AST Parsing
 
-// Extract all CPP functions from a file provided as a memory buffer
-void extract_cpp_functions(
+#ifdef ENABLE_CPP_SUPPORT
+
+// Extract all CPP functions from a file provided as a memory buffer.
+// Returns false if libclang could not parse the file.
+bool extract_cpp_functions(
     std::string file_path,
     const char* file_contents,
     size_t size,
-    std::function<void(const std::string &)> func_processor);
+    const std::vector<std::string>& compile_args,
+    std::vector<FunctionRecord>& out_records);
+
+#endif // ENABLE_CPP_SUPPORT
 
 
 //------------------------------------------------------------------------------
@@ -30,6 +37,12 @@ void ask_cpp_expert_score(
     const std::string& user_role_ = "Human",
     const std::string& assistant_role_ = "Expert");
 
+// Returns the length of the start that every prompt from ask_cpp_expert_score()
+// shares, which is everything before the code
+size_t ask_cpp_expert_score_shared_length(
+    const std::string& user_role = "Human",
+    const std::string& assistant_role = "Expert");
+
 
 } // namespace analysis
 
@@ -0,0 +1,618 @@
+#include "cpp_lexer.hpp"
+
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Lexer
+
+enum class TokenKind
+{
+    Identifier,
+    Number,
+    Literal,
+    Punct,
+};
+
+struct Token
+{
+    TokenKind Kind;
+    uint32_t Offset;
+    uint32_t Length;
+};
+
+static bool is_ident_start(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$' ||
+           static_cast<unsigned char>(c) >= 0x80;
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool is_ident_char(char c)
+{
+    return is_ident_start(c) || is_digit(c);
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
+}
+
+class CppLexer
+{
+public:
+    CppLexer(const char* contents, size_t size)
+        : Contents(contents)
+        , Size(size)
+    {
+    }
+
+    void Tokenize(std::vector<Token>& tokens);
+
+protected:
+    const char* Contents;
+    size_t Size;
+    size_t Pos = 0;
+
+    // Only whitespace and comments seen since the last newline
+    bool AtLineStart = true;
+
+    char Peek(size_t ahead = 0) const
+    {
+        return Pos + ahead < Size ? Contents[Pos + ahead] : '\0';
+    }
+
+    bool IsTextAt(size_t at, const char* s) const
+    {
+        const size_t n = strlen(s);
+        return at + n <= Size && memcmp(Contents + at, s, n) == 0;
+    }
+
+    void SkipLineComment();
+    void SkipBlockComment();
+    void SkipQuoted(char quote);
+    void SkipRawString();
+    void SkipToEndOfLine();
+
+    // Returns the directive name of the preprocessor line at Pos, which points at '#'
+    std::string ReadDirective();
+    void SkipPreprocessorLine();
+    void SkipDisabledBlock();
+};
+
+void CppLexer::SkipLineComment()
+{
+    while (Pos < Size && Contents[Pos] != '\n') {
+        // Backslash-newline continues a line comment
+        if (Contents[Pos] == '\\' && Peek(1) == '\n') {
+            ++Pos;
+        }
+        ++Pos;
+    }
+}
+
+void CppLexer::SkipBlockComment()
+{
+    Pos += 2;
+    while (Pos < Size && !(Contents[Pos] == '*' && Peek(1) == '/')) {
+        ++Pos;
+    }
+    Pos = Pos + 2 < Size ? Pos + 2 : Size;
+}
+
+void CppLexer::SkipQuoted(char quote)
+{
+    ++Pos;
+    while (Pos < Size) {
+        const char c = Contents[Pos];
+        if (c == '\\') {
+            Pos += 2;
+            continue;
+        }
+        if (c == quote) {
+            ++Pos;
+            return;
+        }
+        if (c == '\n') {
+            // Unterminated: recover at the end of the line
+            return;
+        }
+        ++Pos;
+    }
+    Pos = Size;
+}
+
+void CppLexer::SkipRawString()
+{
+    // R"delim( ... )delim"
+    const size_t delim_start = ++Pos;
+    while (Pos < Size && Contents[Pos] != '(' && Contents[Pos] != '\n' && Pos - delim_start <= 16) {
+        ++Pos;
+    }
+    if (Pos >= Size || Contents[Pos] != '(') {
+        return;
+    }
+
+    std::string terminator = ")";
+    terminator.append(Contents + delim_start, Pos - delim_start);
+    terminator += '"';
+
+    const size_t end = std::string_view(Contents + Pos, Size - Pos).find(terminator);
+    Pos = end != std::string_view::npos ? Pos + end + terminator.size() : Size;
+}
+
+void CppLexer::SkipToEndOfLine()
+{
+    while (Pos < Size && Contents[Pos] != '\n') {
+        ++Pos;
+    }
+}
+
+std::string CppLexer::ReadDirective()
+{
+    size_t p = Pos + 1;
+    while (p < Size && is_blank(Contents[p])) {
+        ++p;
+    }
+    const size_t start = p;
+    while (p < Size && is_ident_char(Contents[p])) {
+        ++p;
+    }
+    std::string directive(Contents + start, p - start);
+
+    // Fold "#if 0" into a pseudo-directive so it can be skipped
+    if (directive == "if") {
+        while (p < Size && is_blank(Contents[p])) {
+            ++p;
+        }
+        if (p < Size && Contents[p] == '0' && (p + 1 >= Size || !is_ident_char(Contents[p + 1]))) {
+            directive = "if0";
+        }
+    }
+
+    return directive;
+}
+
+void CppLexer::SkipPreprocessorLine()
+{
+    while (Pos < Size && Contents[Pos] != '\n') {
+        const char c = Contents[Pos];
+        if (c == '\\' && Peek(1) == '\n') {
+            Pos += 2;
+        } else if (c == '\\' && Peek(1) == '\r' && Peek(2) == '\n') {
+            Pos += 3;
+        } else if (c == '/' && Peek(1) == '*') {
+            SkipBlockComment();
+        } else if (c == '/' && Peek(1) == '/') {
+            SkipLineComment();
+        } else if (c == '"' || c == '\'') {
+            SkipQuoted(c);
+        } else {
+            ++Pos;
+        }
+    }
+}
+
+void CppLexer::SkipDisabledBlock()
+{
+    // Pos is at the '#' of an "#if 0" line
+    SkipPreprocessorLine();
+
+    int depth = 0;
+    while (Pos < Size) {
+        ++Pos; // newline
+
+        size_t p = Pos;
+        while (p < Size && is_blank(Contents[p])) {
+            ++p;
+        }
+
+        if (p < Size && Contents[p] == '#') {
+            Pos = p;
+            const std::string directive = ReadDirective();
+            if (directive == "if" || directive == "if0" || directive == "ifdef" || directive == "ifndef") {
+                ++depth;
+            } else if (directive == "endif") {
+                if (depth-- == 0) {
+                    SkipPreprocessorLine();
+                    return;
+                }
+            } else if (depth == 0 && (directive == "else" || directive == "elif")) {
+                // Resume lexing with the enabled branch
+                SkipPreprocessorLine();
+                return;
+            }
+        }
+
+        SkipToEndOfLine();
+    }
+}
+
+void CppLexer::Tokenize(std::vector<Token>& tokens)
+{
+    while (Pos < Size) {
+        const char c = Contents[Pos];
+
+        if (c == '\n') {
+            AtLineStart = true;
+            ++Pos;
+            continue;
+        }
+        if (is_blank(c)) {
+            ++Pos;
+            continue;
+        }
+        if (c == '/' && Peek(1) == '/') {
+            SkipLineComment();
+            continue;
+        }
+        if (c == '/' && Peek(1) == '*') {
+            SkipBlockComment();
+            continue;
+        }
+        if (c == '#' && AtLineStart) {
+            if (ReadDirective() == "if0") {
+                SkipDisabledBlock();
+            } else {
+                SkipPreprocessorLine();
+            }
+            continue;
+        }
+
+        AtLineStart = false;
+
+        const size_t start = Pos;
+        TokenKind kind;
+
+        if (is_ident_start(c)) {
+            while (Pos < Size && is_ident_char(Contents[Pos])) {
+                ++Pos;
+            }
+
+            // Encoding prefixes turn the identifier into a literal: u8"..", LR"(..)", etc
+            const size_t len = Pos - start;
+            const char next = Peek();
+            const bool raw = Contents[Pos - 1] == 'R' && len <= 3;
+            const bool prefix = len <= 3 && (
+                (len == 1 && (c == 'L' || c == 'u' || c == 'U' || c == 'R')) ||
+                (len == 2 && (IsTextAt(start, "u8") || IsTextAt(start, "LR") || IsTextAt(start, "uR") || IsTextAt(start, "UR"))) ||
+                (len == 3 && IsTextAt(start, "u8R")));
+
+            if (prefix && raw && next == '"') {
+                SkipRawString();
+                kind = TokenKind::Literal;
+            } else if (prefix && !raw && (next == '"' || next == '\'')) {
+                SkipQuoted(next);
+                kind = TokenKind::Literal;
+            } else {
+                kind = TokenKind::Identifier;
+            }
+        } else if (is_digit(c) || (c == '.' && is_digit(Peek(1)))) {
+            ++Pos;
+            while (Pos < Size) {
+                const char d = Contents[Pos];
+                if (is_ident_char(d) || d == '.' || (d == '\'' && is_ident_char(Peek(1)))) {
+                    ++Pos;
+                } else if ((d == '+' || d == '-') && strchr("eEpP", Contents[Pos - 1])) {
+                    ++Pos;
+                } else {
+                    break;
+                }
+            }
+            kind = TokenKind::Number;
+        } else if (c == '"' || c == '\'') {
+            SkipQuoted(c);
+            kind = TokenKind::Literal;
+        } else {
+            if (IsTextAt(Pos, "::") || IsTextAt(Pos, "->")) {
+                Pos += 2;
+            } else if (IsTextAt(Pos, "...")) {
+                Pos += 3;
+            } else {
+                ++Pos;
+            }
+            kind = TokenKind::Punct;
+        }
+
+        tokens.push_back({kind, static_cast<uint32_t>( start ), static_cast<uint32_t>( Pos - start )});
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Declaration Parser
+
+// Identifiers that can precede '(' at declaration scope without making it a function
+static const char* const kNonFunctionKeywords[] = {
+    "if", "for", "while", "switch", "catch", "return", "sizeof", "alignof", "alignas",
+    "decltype", "noexcept", "throw", "typeid", "static_assert", "requires",
+    "__attribute__", "__declspec", "__asm__", "asm", "_Alignas", "_Static_assert",
+};
+
+/*
+    Walks declaration scopes (file, namespace, class and extern "C" bodies)
+    and classifies each '{' as a function body, a nested scope, or an
+    initializer/enum body that is skipped.
+*/
+class DeclarationParser
+{
+public:
+    DeclarationParser(const char* contents, const std::vector<Token>& tokens, std::vector<FunctionRecord>& out)
+        : Contents(contents)
+        , Tokens(tokens)
+        , Out(out)
+    {
+    }
+
+    void Parse()
+    {
+        ParseScope(0, true);
+    }
+
+protected:
+    const char* Contents;
+    const std::vector<Token>& Tokens;
+    std::vector<FunctionRecord>& Out;
+
+    // State of the declaration being scanned
+    struct Declaration
+    {
+        size_t Begin = 0;
+
+        // Saw name(...) followed only by tokens that may precede a function body
+        bool HasCandidate = false;
+        bool AfterArrow = false; // trailing return type
+        bool InitList = false;   // constructor initializer list
+
+        bool HasAssign = false;
+        bool IsNamespace = false;
+        bool IsClass = false;
+        bool IsEnum = false;
+        size_t LastOperator = SIZE_MAX;
+    };
+
+    bool Is(size_t i, const char* text) const
+    {
+        const Token& t = Tokens[i];
+        return t.Length == strlen(text) && memcmp(Contents + t.Offset, text, t.Length) == 0;
+    }
+
+    bool IsPunct(size_t i, char c) const
+    {
+        const Token& t = Tokens[i];
+        return t.Kind == TokenKind::Punct && t.Length == 1 && Contents[t.Offset] == c;
+    }
+
+    // Returns the index after the group closed by the matching `close`.
+    // Mismatched brackets inside are ignored; only `open` and `close` are counted.
+    size_t SkipGroup(size_t i, char open, char close) const
+    {
+        int depth = 0;
+        for (; i < Tokens.size(); ++i) {
+            if (IsPunct(i, open)) {
+                ++depth;
+            } else if (IsPunct(i, close) && --depth == 0) {
+                return i + 1;
+            }
+        }
+        return Tokens.size();
+    }
+
+    // Skips "template<...>" starting at the '<'
+    size_t SkipTemplateParameters(size_t i) const
+    {
+        int depth = 0;
+        for (; i < Tokens.size(); ++i) {
+            if (IsPunct(i, '(')) {
+                i = SkipGroup(i, '(', ')') - 1;
+            } else if (IsPunct(i, '<')) {
+                ++depth;
+            } else if (IsPunct(i, '>') && --depth == 0) {
+                return i + 1;
+            } else if (IsPunct(i, ';') || IsPunct(i, '{')) {
+                return i;
+            }
+        }
+        return Tokens.size();
+    }
+
+    bool IsFunctionName(size_t i, const Declaration& decl) const
+    {
+        if (i < decl.Begin) {
+            return false;
+        }
+
+        const Token& t = Tokens[i];
+        if (t.Kind == TokenKind::Identifier) {
+            for (const char* keyword : kNonFunctionKeywords) {
+                if (Is(i, keyword)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Template specialization f<T>(...) or an operator symbol: operator<<(...)
+        return IsPunct(i, '>') ||
+               (t.Kind == TokenKind::Punct && decl.LastOperator != SIZE_MAX && i - decl.LastOperator <= 3);
+    }
+
+    // Only qualifiers like const, noexcept, override, & or macros may sit
+    // between the parameter list and the body, until -> or ':' is seen
+    void CheckTail(size_t i, Declaration& decl) const
+    {
+        if (!decl.HasCandidate || decl.InitList || decl.AfterArrow) {
+            return;
+        }
+        if (Is(i, "->")) {
+            decl.AfterArrow = true;
+        } else if (Tokens[i].Kind != TokenKind::Identifier && !IsPunct(i, '&')) {
+            decl.HasCandidate = false;
+        }
+    }
+
+    void AddFunction(size_t begin, size_t close_brace)
+    {
+        const Token& first = Tokens[begin];
+        const Token& last = Tokens[close_brace];
+        Out.push_back(make_function_record(Contents, first.Offset, last.Offset + last.Length));
+    }
+
+    // Returns the index after the '}' closing this scope
+    size_t ParseScope(size_t i, bool top_level);
+};
+
+size_t DeclarationParser::ParseScope(size_t i, bool top_level)
+{
+    Declaration decl;
+    decl.Begin = i;
+
+    while (i < Tokens.size()) {
+        const Token& t = Tokens[i];
+
+        if (t.Kind == TokenKind::Punct && t.Length == 1) {
+            const char c = Contents[t.Offset];
+
+            if (c == '}') {
+                if (!top_level) {
+                    return i + 1;
+                }
+                decl = Declaration();
+                decl.Begin = ++i;
+                continue;
+            }
+
+            if (c == ';') {
+                decl = Declaration();
+                decl.Begin = ++i;
+                continue;
+            }
+
+            if (c == '(') {
+                if (decl.InitList) {
+                    // Member initializer: x_(1)
+                } else if (i > 0 && IsFunctionName(i - 1, decl)) {
+                    decl.HasCandidate = true;
+                    decl.AfterArrow = false;
+                } else if (!decl.AfterArrow && i > 0 && Tokens[i - 1].Kind != TokenKind::Identifier) {
+                    decl.HasCandidate = false;
+                }
+                i = SkipGroup(i, '(', ')');
+                continue;
+            }
+
+            if (c == ':') {
+                // Access specifier ends the previous declaration
+                if (i > 0 && i - 1 >= decl.Begin && (Is(i - 1, "public") || Is(i - 1, "private") || Is(i - 1, "protected"))) {
+                    decl = Declaration();
+                    decl.Begin = ++i;
+                    continue;
+                }
+                if (decl.HasCandidate && !decl.AfterArrow) {
+                    decl.InitList = true;
+                }
+                ++i;
+                continue;
+            }
+
+            if (c == '=' && (decl.LastOperator == SIZE_MAX || i - decl.LastOperator > 3)) {
+                decl.HasAssign = true;
+            }
+
+            if (c == '{') {
+                const bool after_name = i > 0 && (Tokens[i - 1].Kind == TokenKind::Identifier || IsPunct(i - 1, '>'));
+
+                // Member initializer in a constructor: x_{1}
+                if (decl.InitList && after_name) {
+                    i = SkipGroup(i, '{', '}');
+                    continue;
+                }
+
+                const bool extern_block = i >= 2 && i - 2 >= decl.Begin &&
+                    Is(i - 2, "extern") && Tokens[i - 1].Kind == TokenKind::Literal;
+
+                if (decl.IsNamespace || extern_block) {
+                    i = ParseScope(i + 1, false);
+                    decl = Declaration();
+                    decl.Begin = i;
+                    continue;
+                }
+
+                if (decl.HasCandidate && !decl.HasAssign && !decl.IsEnum) {
+                    const size_t end = SkipGroup(i, '{', '}');
+                    if (end <= Tokens.size() && IsPunct(end - 1, '}')) {
+                        AddFunction(decl.Begin, end - 1);
+                    }
+                    i = end;
+                    decl = Declaration();
+                    decl.Begin = i;
+                    continue;
+                }
+
+                if (decl.IsClass && !decl.HasAssign && !decl.IsEnum) {
+                    // Declarators may follow the class body, so the declaration ends at ';'
+                    i = ParseScope(i + 1, false);
+                    continue;
+                }
+
+                // Initializer list, enum body, or something unrecognized
+                i = SkipGroup(i, '{', '}');
+                continue;
+            }
+        }
+
+        if (t.Kind == TokenKind::Identifier) {
+            if (Is(i, "template") && i + 1 < Tokens.size() && IsPunct(i + 1, '<')) {
+                i = SkipTemplateParameters(i + 1);
+                continue;
+            }
+
+            if (Is(i, "namespace")) {
+                decl.IsNamespace = true;
+            } else if (Is(i, "class") || Is(i, "struct") || Is(i, "union")) {
+                decl.IsClass = true;
+            } else if (Is(i, "enum")) {
+                decl.IsEnum = true;
+            } else if (Is(i, "operator")) {
+                decl.LastOperator = i;
+            }
+        }
+
+        CheckTail(i, decl);
+        ++i;
+    }
+
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Lexical Parsing
+
+void extract_cpp_functions_lexical(
+    const char* file_contents,
+    size_t size,
+    std::vector<FunctionRecord>& out_records)
+{
+    out_records.clear();
+
+    std::vector<Token> tokens;
+    tokens.reserve(size / 4);
+
+    CppLexer lexer(file_contents, size);
+    lexer.Tokenize(tokens);
+
+    DeclarationParser parser(file_contents, tokens, out_records);
+    parser.Parse();
+}
+
+
+} // namespace analysis
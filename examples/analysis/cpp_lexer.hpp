@@ -0,0 +1,32 @@
+#ifndef CPP_LEXER_HPP
+#define CPP_LEXER_HPP
+
+#include "function_record.hpp"
+
+#include <vector>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Lexical Parsing
+
+/*
+    Extract all C/C++ function definitions from a file provided as a memory
+    buffer, without libclang.
+
+    The file is tokenized by a hand-written lexer (comments, string and raw
+    string literals, preprocessor lines and #if 0 blocks are skipped) and
+    function bodies are found by brace matching.  This is heuristic, but it
+    needs no include paths and is an order of magnitude faster than parsing
+    the translation unit, which makes it a good fit for triage of huge trees.
+*/
+void extract_cpp_functions_lexical(
+    const char* file_contents,
+    size_t size,
+    std::vector<FunctionRecord>& out_records);
+
+
+} // namespace analysis
+
+#endif // CPP_LEXER_HPP
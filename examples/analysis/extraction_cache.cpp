@@ -0,0 +1,177 @@
+#include "extraction_cache.hpp"
+#include "shared_file.hpp"
+#include "logging.hpp"
+
+#include <filesystem>
+#include <fstream>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Extraction Cache
+
+static const uint32_t kExtractionCacheMagic = 0x4345414c; // 'LAEC'
+static const uint32_t kExtractionCacheVersion = 2;
+
+uint64_t extraction_cache_key(
+    const char* file_contents,
+    size_t size,
+    const std::vector<std::string>& compile_args,
+    const std::string& extractor_name)
+{
+    uint64_t key = hash_string(extractor_name);
+    for (const auto& arg : compile_args) {
+        // Include the terminator so {"-Da", "b"} and {"-D", "ab"} differ
+        key = hash_bytes(arg.c_str(), arg.size() + 1, key);
+    }
+    return hash_bytes(file_contents, size, key);
+}
+
+// Reads every entry of a cache file into `entries`.  Returns false if the
+// file exists but could not be read.  A missing file has no entries.
+template<typename Entry>
+static bool read_entries(const std::string& file_path, std::unordered_map<uint64_t, Entry>& entries)
+{
+    entries.clear();
+
+    const bool read = read_cache_file(file_path, "extraction cache", kExtractionCacheMagic, kExtractionCacheVersion, [&](std::istream& in) {
+        uint64_t key = 0;
+        int64_t last_used = 0;
+        uint32_t record_count = 0;
+        if (!read_pod(in, key) || !read_pod(in, last_used) || !read_pod(in, record_count)) {
+            return false;
+        }
+
+        Entry& entry = entries[key];
+        entry.LastUsed = last_used;
+        entry.Records.resize(record_count);
+        for (auto& record : entry.Records) {
+            if (!read_pod(in, record.CommentOffset) || !read_pod(in, record.StartOffset) ||
+                !read_pod(in, record.EndOffset) || !read_pod(in, record.SourceHash)) {
+                return false;
+            }
+        }
+        return true;
+    });
+
+    if (!read) {
+        entries.clear();
+    }
+    return read;
+}
+
+bool ExtractionCache::Load(const std::string& cache_file_path)
+{
+    FilePath = cache_file_path;
+    ScanTime = unix_time_now();
+
+    if (!read_entries(FilePath, Entries)) {
+        return false;
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "Loaded " << Entries.size() << " files from extraction cache " << FilePath;
+    return true;
+}
+
+bool ExtractionCache::Save()
+{
+    if (FilePath.empty()) {
+        return false;
+    }
+
+    // Other workers may save the same file, so reading their entries and
+    // replacing the file must not interleave with theirs
+    FileLock lock;
+    if (!lock.Lock(FilePath + ".lock")) {
+        return false;
+    }
+
+    std::unordered_map<uint64_t, Entry> saved;
+    read_entries(FilePath, saved);
+    for (auto& it : saved) {
+        Entry& entry = Entries[it.first];
+        if (it.second.LastUsed > entry.LastUsed) {
+            entry = std::move(it.second);
+        }
+    }
+
+    const int64_t oldest = ScanTime - kCacheRetentionSeconds;
+
+    uint64_t entry_count = 0;
+    for (const auto& it : Entries) {
+        if (it.second.LastUsed >= oldest) {
+            ++entry_count;
+        }
+    }
+
+    // Write to a temporary file and rename it so a crash never leaves a partial cache
+    const std::string temp_path = temp_path_for(FilePath);
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write extraction cache: " << temp_path;
+            return false;
+        }
+
+        write_pod(out, kExtractionCacheMagic);
+        write_pod(out, kExtractionCacheVersion);
+        write_pod(out, entry_count);
+
+        for (const auto& it : Entries) {
+            if (it.second.LastUsed < oldest) {
+                continue;
+            }
+
+            write_pod(out, it.first);
+            write_pod(out, it.second.LastUsed);
+            write_pod(out, static_cast<uint32_t>( it.second.Records.size() ));
+            for (const auto& record : it.second.Records) {
+                write_pod(out, record.CommentOffset);
+                write_pod(out, record.StartOffset);
+                write_pod(out, record.EndOffset);
+                write_pod(out, record.SourceHash);
+            }
+        }
+
+        if (!out) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write extraction cache: " << temp_path;
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp_path, FilePath, ec);
+    if (ec) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to replace extraction cache " << FilePath << ": " << ec.message();
+        std::filesystem::remove(temp_path, ec);
+        return false;
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "Saved " << entry_count << " files to extraction cache " << FilePath;
+    return true;
+}
+
+bool ExtractionCache::Find(uint64_t key, std::vector<FunctionRecord>& records)
+{
+    auto it = Entries.find(key);
+    if (it == Entries.end()) {
+        ++Misses;
+        return false;
+    }
+
+    it->second.LastUsed = ScanTime;
+    records = it->second.Records;
+    ++Hits;
+    return true;
+}
+
+void ExtractionCache::Insert(uint64_t key, const std::vector<FunctionRecord>& records)
+{
+    Entry& entry = Entries[key];
+    entry.Records = records;
+    entry.LastUsed = ScanTime;
+}
+
+
+} // namespace analysis
@@ -0,0 +1,72 @@
+#ifndef EXTRACTION_CACHE_HPP
+#define EXTRACTION_CACHE_HPP
+
+#include "function_record.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Extraction Cache
+
+// Cache key for the functions extracted from one file.
+// Changing the file contents, the compile arguments or the extractor misses.
+uint64_t extraction_cache_key(
+    const char* file_contents,
+    size_t size,
+    const std::vector<std::string>& compile_args,
+    const std::string& extractor_name);
+
+/*
+    On-disk cache of extracted function records, so that rescans of unchanged
+    files skip parsing entirely.
+
+    Worker processes may share the cache file.  Save() merges in the entries
+    that other workers saved since Load() while holding a lock on the file,
+    and entries that no scan used for kCacheRetentionSeconds are dropped, so
+    the file tracks recent scans instead of growing forever.
+*/
+class ExtractionCache
+{
+public:
+    // Returns false if the file exists but could not be read.
+    // A missing file is an empty cache.
+    bool Load(const std::string& cache_file_path);
+
+    // Atomically replaces the cache file with this cache merged with the
+    // entries saved by other processes
+    bool Save();
+
+    // Returns true and fills `records` on a hit
+    bool Find(uint64_t key, std::vector<FunctionRecord>& records);
+
+    void Insert(uint64_t key, const std::vector<FunctionRecord>& records);
+
+    int Hits = 0;
+    int Misses = 0;
+
+protected:
+    std::string FilePath;
+
+    struct Entry
+    {
+        std::vector<FunctionRecord> Records;
+
+        // unix_time_now() of the last scan that used the entry
+        int64_t LastUsed = 0;
+    };
+
+    std::unordered_map<uint64_t, Entry> Entries;
+
+    // Start of this scan, the LastUsed of every entry it uses
+    int64_t ScanTime = 0;
+};
+
+
+} // namespace analysis
+
+#endif // EXTRACTION_CACHE_HPP
@@ -0,0 +1,110 @@
+#include "function_record.hpp"
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Hashing
+
+uint64_t hash_bytes(const void* data, size_t bytes, uint64_t seed)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+
+    uint64_t h = seed;
+    for (size_t i = 0; i < bytes; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+
+//------------------------------------------------------------------------------
+// Function Record
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static bool is_comment_line(const char* begin, const char* end)
+{
+    while (begin < end && is_space(*begin)) {
+        ++begin;
+    }
+    while (end > begin && is_space(end[-1])) {
+        --end;
+    }
+
+    if (end - begin < 2) {
+        return false;
+    }
+
+    // Starts with // or /*, or ends with */
+    return (begin[0] == '/' && (begin[1] == '/' || begin[1] == '*')) ||
+           (end[-2] == '*' && end[-1] == '/');
+}
+
+size_t find_leading_comment_offset(const char* file_contents, size_t start_offset)
+{
+    // Only indentation may precede the function on its first line
+    size_t line_start = start_offset;
+    while (line_start > 0 && file_contents[line_start - 1] != '\n') {
+        if (!is_space(file_contents[line_start - 1])) {
+            return start_offset;
+        }
+        --line_start;
+    }
+
+    // Walk up through the comment lines directly above the function
+    size_t comment_offset = start_offset;
+    while (line_start > 0) {
+        const size_t prev_end = line_start - 1;
+        size_t prev_start = prev_end;
+        while (prev_start > 0 && file_contents[prev_start - 1] != '\n') {
+            --prev_start;
+        }
+
+        if (!is_comment_line(file_contents + prev_start, file_contents + prev_end)) {
+            break;
+        }
+
+        comment_offset = prev_start;
+        line_start = prev_start;
+    }
+
+    return comment_offset;
+}
+
+FunctionRecord make_function_record(
+    const char* file_contents,
+    size_t start_offset,
+    size_t end_offset)
+{
+    FunctionRecord record;
+    record.CommentOffset = static_cast<uint32_t>( find_leading_comment_offset(file_contents, start_offset) );
+    record.StartOffset = static_cast<uint32_t>( start_offset );
+    record.EndOffset = static_cast<uint32_t>( end_offset );
+    record.SourceHash = hash_bytes(file_contents + record.CommentOffset, record.EndOffset - record.CommentOffset);
+    return record;
+}
+
+std::string function_code(const FunctionRecord& record, const char* file_contents)
+{
+    return std::string(file_contents + record.CommentOffset, record.EndOffset - record.CommentOffset);
+}
+
+int function_line(const FunctionRecord& record, const char* file_contents)
+{
+    int line = 1;
+    for (uint32_t i = 0; i < record.StartOffset; ++i) {
+        if (file_contents[i] == '\n') {
+            ++line;
+        }
+    }
+    return line;
+}
+
+
+} // namespace analysis
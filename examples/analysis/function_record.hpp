@@ -0,0 +1,63 @@
+#ifndef FUNCTION_RECORD_HPP
+#define FUNCTION_RECORD_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Hashing
+
+// 64-bit FNV-1a hash.  Stable across builds, so it is safe to persist.
+uint64_t hash_bytes(const void* data, size_t bytes, uint64_t seed = 0xcbf29ce484222325ULL);
+
+inline uint64_t hash_string(const std::string& s, uint64_t seed = 0xcbf29ce484222325ULL)
+{
+    return hash_bytes(s.data(), s.size(), seed);
+}
+
+
+//------------------------------------------------------------------------------
+// Function Record
+
+/*
+    Location of one function definition within a source file.
+
+    This is what the extractors produce, so it can be cached without keeping
+    any parser state around.  Offsets are in bytes from the start of the file.
+*/
+struct FunctionRecord
+{
+    // Start of the comment block above the function.
+    // Equal to StartOffset if there is no leading comment.
+    uint32_t CommentOffset = 0;
+
+    // Extent of the function definition
+    uint32_t StartOffset = 0;
+    uint32_t EndOffset = 0;
+
+    // hash_bytes() of the function source returned by function_code()
+    uint64_t SourceHash = 0;
+};
+
+// Finds the start of the comment lines directly above `start_offset`
+size_t find_leading_comment_offset(const char* file_contents, size_t start_offset);
+
+// Fills in the comment span and source hash for a function extent
+FunctionRecord make_function_record(
+    const char* file_contents,
+    size_t start_offset,
+    size_t end_offset);
+
+// Returns the function source including its leading comments
+std::string function_code(const FunctionRecord& record, const char* file_contents);
+
+// Returns the 1-based line number where the function definition starts
+int function_line(const FunctionRecord& record, const char* file_contents);
+
+
+} // namespace analysis
+
+#endif // FUNCTION_RECORD_HPP
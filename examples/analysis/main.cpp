@@ -1,53 +1,283 @@
 #include "logging.hpp"
 #include "walk_directory.hpp"
 #include "oracle.hpp"
-
-// This is defined by the CMakeLists.txt
-#ifdef ENABLE_CPP_SUPPORT
-    #include "cpp_analysis.hpp"
-#endif // ENABLE_CPP_SUPPORT
-
+#include "extraction_cache.hpp"
+#include "cpp_analysis.hpp"
+#include "cpp_lexer.hpp"
+#include "near_duplicates.hpp"
+#include "work_queue.hpp"
+#include "token_counter.hpp"
+
+#include <algorithm>
 #include <memory>
+#include <thread>
 #include <boost/program_options.hpp>
 #include <boost/scope_exit.hpp>
 #include <boost/filesystem.hpp>
 
 #define DEFAULT_MODEL "../models/ggml-LLaMa-65B-q4_0.bin"
 
+// This is defined by the CMakeLists.txt
+#ifdef ENABLE_CPP_SUPPORT
+    #define DEFAULT_EXTRACTOR "clang"
+#else
+    #define DEFAULT_EXTRACTOR "lexical"
+#endif // ENABLE_CPP_SUPPORT
+
 using namespace analysis;
 
+static const char* kCppExtensions[] = {
+    "cc", "hh", "ii", "inl", "cpp", "cxx", "hpp", "hxx", "c", "h"
+};
+
+// Prompt sizes are planned from the tokens of the prompt without the code plus
+// the tokens of the code.  The rating prompt is tokenized as a whole, where the
+// tokens at both ends of the code can merge or split differently, so a planned
+// size is an estimate within this many tokens.
+static const uint32_t kPromptTokenSlack = 4;
+
 
 //------------------------------------------------------------------------------
 // Application
 
-void main_analysis(
-    const std::string& path_,
-    const std::string& model_,
-    float threshold = 0.5f)
+struct AnalysisSettings
+{
+    std::string Path;
+    std::string Model;
+
+    // Minimum threshold to declare a bug
+    float Threshold = 0.5f;
+
+    // Directory for caches that speed up rescans.  Empty disables caching.
+    std::string CacheDir;
+
+    // Extra arguments passed to the C++ parser, e.g. include paths
+    std::vector<std::string> CompileArgs;
+
+    // How functions are found in C++ files: "clang" or "lexical"
+    std::string Extractor = DEFAULT_EXTRACTOR;
+
+    // Functions whose embeddings are at least this similar (cosine) share one
+    // rating.  Zero disables near-duplicate clustering.
+    float ClusterSimilarity = 0.f;
+
+    // Shared directory for splitting the scan across worker processes.
+    // Empty scans everything in this process.
+    std::string QueueDir;
+    int BatchSize = 16;
+    int LeaseSeconds = 600;
+
+    // Extract functions without loading the model or rating anything
+    bool DryRun = false;
+
+    // Count prompt tokens for every function with a vocab-only context
+    // before loading the model
+    bool CountTokens = false;
+    int TokenizerThreads = 1;
+};
+
+// Group of near-duplicate functions that share the rating of the first one
+struct FunctionCluster
+{
+    // "file:line" of the representative that was rated
+    std::string Representative;
+
+    bool Rated = false;
+    float Rating = 0.f;
+
+    // "file:line" of the other functions that reused the rating
+    std::vector<std::string> Members;
+};
+
+void log_scan_summary(const ScanResults& results, const std::string& path)
+{
+    const size_t total_bugs = results.Findings.size();
+    if (results.FilesChecked <= 0) {
+        BOOST_LOG_TRIVIAL(warning) << "No supported source files found in " << path;
+    } else if (total_bugs <= 0) {
+        BOOST_LOG_TRIVIAL(info) << "Checked " << results.FilesChecked << " files in " << path << " and found no bugs.";
+    } else {
+        BOOST_LOG_TRIVIAL(warning) << "Bugs found!  Checked " << results.FilesChecked << " files in " << path << " and found " << total_bugs << " bugs.";
+    }
+}
+
+void main_analysis(const AnalysisSettings& settings)
 {
+    const bool use_lexical_extractor = (settings.Extractor == "lexical");
+    if (!use_lexical_extractor && settings.Extractor != "clang") {
+        BOOST_LOG_TRIVIAL(error) << "Unknown extractor: " << settings.Extractor << " (expected clang or lexical)";
+        return;
+    }
+#ifndef ENABLE_CPP_SUPPORT
+    if (!use_lexical_extractor) {
+        BOOST_LOG_TRIVIAL(error) << "This build has no libclang support.  Use --extractor=lexical";
+        return;
+    }
+#endif // ENABLE_CPP_SUPPORT
+
     // Expand ~ and .. type stuff
-    BOOST_LOG_TRIVIAL(debug) << "Input path: " << path_;
-    BOOST_LOG_TRIVIAL(debug) << "Input model: " << model_;
-    std::string path = boost::filesystem::canonical(path_).string();
-    std::string model = boost::filesystem::canonical(model_).string();
+    BOOST_LOG_TRIVIAL(debug) << "Input path: " << settings.Path;
+    BOOST_LOG_TRIVIAL(debug) << "Input model: " << settings.Model;
+    std::string path = boost::filesystem::canonical(settings.Path).string();
     BOOST_LOG_TRIVIAL(debug) << "Canonicalized input path: " << path;
-    BOOST_LOG_TRIVIAL(debug) << "Canonicalized input model: " << model;
+    std::string model;
+    if (!settings.DryRun || settings.CountTokens) {
+        model = boost::filesystem::canonical(settings.Model).string();
+        BOOST_LOG_TRIVIAL(debug) << "Canonicalized input model: " << model;
+    }
+
+    // Skip parsing files that have not changed since the last scan.  Counting
+    // tokens visits every file before it is rated, so then the records are
+    // kept in memory for the second visit even without a cache directory.
+    std::unique_ptr<ExtractionCache> extraction_cache;
+    if (!settings.CacheDir.empty()) {
+        boost::filesystem::create_directories(settings.CacheDir);
+        extraction_cache = std::make_unique<ExtractionCache>();
+        if (!extraction_cache->Load((boost::filesystem::path(settings.CacheDir) / "extract.cache").string())) {
+            BOOST_LOG_TRIVIAL(warning) << "Starting with an empty extraction cache";
+        }
+    } else if (settings.CountTokens) {
+        extraction_cache = std::make_unique<ExtractionCache>();
+    }
+
+    // The lexical extractor ignores compile arguments, so they are not part of its key
+    const std::vector<std::string> no_compile_args;
+    const auto& key_args = use_lexical_extractor ? no_compile_args : settings.CompileArgs;
+
+    auto extract_records = [&](
+        const std::string& file_path,
+        const char* file_contents,
+        std::size_t file_length_in_bytes,
+        std::vector<FunctionRecord>& records)
+    {
+        const uint64_t cache_key = extraction_cache_key(file_contents, file_length_in_bytes, key_args, settings.Extractor);
+        if (extraction_cache && extraction_cache->Find(cache_key, records)) {
+            return;
+        }
+
+        bool extracted = true;
+        if (use_lexical_extractor) {
+            extract_cpp_functions_lexical(file_contents, file_length_in_bytes, records);
+        } else {
+#ifdef ENABLE_CPP_SUPPORT
+            extracted = extract_cpp_functions(file_path, file_contents, file_length_in_bytes, settings.CompileArgs, records);
+#else
+            (void)file_path;
+#endif // ENABLE_CPP_SUPPORT
+        }
+        if (extracted && extraction_cache) {
+            extraction_cache->Insert(cache_key, records);
+        }
+    };
 
-    // Load the model
     auto oracle = std::make_shared<Oracle>();
-    if (!oracle->Initialize(model)) {
+
+    // Count prompt tokens for every function before any model compute
+    std::unique_ptr<TokenCounter> token_counter;
+    uint32_t prompt_overhead = 0;
+    if (settings.CountTokens) {
+        token_counter = std::make_unique<TokenCounter>();
+        if (!token_counter->Initialize(model, settings.TokenizerThreads)) {
+            return;
+        }
+        if (!settings.CacheDir.empty() &&
+            !token_counter->LoadCache((boost::filesystem::path(settings.CacheDir) / "tokens.cache").string())) {
+            BOOST_LOG_TRIVIAL(warning) << "Starting with an empty token count cache";
+        }
+
+        // The prompt around each function is the same, so it is measured once
+        std::string prompt;
+        std::vector<std::string> stop_strs;
+        ask_cpp_expert_score(prompt, stop_strs, "");
+        prompt_overhead = token_counter->CountText(prompt);
+    }
+
+    // Counts the tokens of every function in `file_paths` and logs the plan for them
+    auto count_tokens = [&](const std::vector<std::string>& file_paths) {
+        std::vector<TokenCountJob> jobs;
+        auto count_handler = [&](
+            const std::string& file_path,
+            const char* file_contents,
+            std::size_t file_length_in_bytes,
+            int /*subdirectory_depth*/)
+        {
+            std::vector<FunctionRecord> records;
+            extract_records(file_path, file_contents, file_length_in_bytes, records);
+            for (const auto& record : records) {
+                jobs.push_back({record.SourceHash, function_code(record, file_contents)});
+            }
+        };
+
+        std::vector<SupportedFileType> count_file_types;
+        for (const char* ext : kCppExtensions) {
+            count_file_types.push_back({ext, count_handler});
+        }
+
+        for (const auto& file_path : file_paths) {
+            visit_file(count_file_types, file_path);
+        }
+
+        token_counter->CountTokens(jobs);
+
+        uint64_t total_tokens = 0;
+        uint32_t largest = 0;
+        int too_long = 0;
+        for (const auto& job : jobs) {
+            uint32_t count = 0;
+            token_counter->FindCount(job.SourceHash, count);
+            const uint32_t prompt_tokens = prompt_overhead + count;
+            total_tokens += prompt_tokens;
+            largest = std::max(largest, prompt_tokens);
+            if (prompt_tokens >= static_cast<uint32_t>( oracle->ContextSize() ) + kPromptTokenSlack) {
+                ++too_long;
+            }
+        }
+
+        BOOST_LOG_TRIVIAL(info) << "Token plan (estimated to within " << kPromptTokenSlack << " tokens per prompt): " << jobs.size() << " functions in " << file_paths.size() << " files need about " << total_tokens << " prompt tokens.  Largest prompt is about " << largest << " tokens, and " << too_long << " functions do not fit in the " << oracle->ContextSize() << " token context.";
+    };
+
+    // Without a queue the whole tree is planned before the model is loaded.
+    // Queue workers plan each batch they claim instead.
+    if (token_counter && settings.QueueDir.empty()) {
+        std::vector<SupportedFileType> file_types;
+        for (const char* ext : kCppExtensions) {
+            file_types.push_back({ext, nullptr});
+        }
+
+        std::vector<std::string> file_paths;
+        list_supported_files(file_types, path, file_paths);
+        count_tokens(file_paths);
+    }
+
+    // Load the model
+    const bool use_clusters = !settings.DryRun && settings.ClusterSimilarity > 0.f;
+    if (settings.DryRun) {
+        BOOST_LOG_TRIVIAL(info) << "Dry run: functions will be extracted but not rated";
+    } else if (!oracle->Initialize(model, use_clusters)) {
         BOOST_LOG_TRIVIAL(error) << "Failed to initialize oracle";
         return;
     }
 
-    int files_checked = 0;
+    // The rating prompts only differ from where the code starts, the start before it is
+    // what the oracle keeps in its prefix cache
+    const size_t prompt_shared_length = ask_cpp_expert_score_shared_length();
 
-    std::vector<SupportedFileType> supported_file_types;
+    // Rate one representative per group of near-clones
+    std::unique_ptr<NearDuplicateIndex> near_duplicates;
+    std::vector<FunctionCluster> clusters;
+    if (use_clusters) {
+        near_duplicates = std::make_unique<NearDuplicateIndex>();
+        near_duplicates->Initialize(oracle->EmbeddingSize(), settings.ClusterSimilarity);
+    }
 
-#ifdef ENABLE_CPP_SUPPORT
-    BOOST_LOG_TRIVIAL(debug) << "Enabled C++ support.";
+    // Results for the current batch, or the whole scan without a queue
+    ScanResults results;
+
+    std::unique_ptr<LeaseWorkQueue> queue;
+
+    std::vector<SupportedFileType> supported_file_types;
 
-    int total_bugs = 0;
+    BOOST_LOG_TRIVIAL(debug) << "Enabled C++ support using the " << settings.Extractor << " extractor.";
 
     auto cpp_handler = [&](
         const std::string& file_path,
@@ -55,14 +285,61 @@ void main_analysis(
         std::size_t file_length_in_bytes,
         int subdirectory_depth)
     {
-        ++files_checked;
+        ++results.FilesChecked;
         BOOST_LOG_TRIVIAL(info) << std::string(subdirectory_depth * 2, ' ') << "* C++: " << file_path;
 
         int functions_checked = 0;
         int file_bugs = 0;
 
-        auto func_handler = [&](const std::string &code) {
+        auto func_handler = [&](const std::string &code, uint64_t source_hash, const std::string& location) {
             ++functions_checked;
+            ++results.FunctionsChecked;
+
+            if (queue) {
+                queue->RenewLease();
+            }
+            if (settings.DryRun) {
+                return;
+            }
+
+            // Skip prompts that cannot fit without running the model.  Only the
+            // ones that are too long even with the slack are skipped, the oracle
+            // checks the others against the tokens of the real prompt.
+            uint32_t token_count = 0;
+            if (token_counter && token_counter->FindCount(source_hash, token_count) &&
+                prompt_overhead + token_count >= static_cast<uint32_t>( oracle->ContextSize() ) + kPromptTokenSlack) {
+                BOOST_LOG_TRIVIAL(debug) << "Skipping function at " << location << ": its prompt is about " << prompt_overhead + token_count << " tokens, too long for the context";
+                return;
+            }
+
+            // An embedding pass is much cheaper than rating, so check for a near-clone first
+            int cluster_id = -1;
+            std::vector<float> embedding;
+            if (near_duplicates && oracle->QueryEmbedding(code, embedding)) {
+                float similarity = 0.f;
+                if (!near_duplicates->FindOrInsert(embedding.data(), cluster_id, similarity)) {
+                    FunctionCluster cluster;
+                    cluster.Representative = location;
+                    clusters.push_back(cluster);
+                } else if (!clusters[cluster_id].Rated) {
+                    // The representative could not be rated, so this function is rated
+                    // instead and takes its place if that works
+                    BOOST_LOG_TRIVIAL(trace) << "Function at " << location << " is a near-duplicate of unrated " << clusters[cluster_id].Representative << " (similarity " << similarity << ") and is rated in its place";
+                } else {
+                    FunctionCluster& cluster = clusters[cluster_id];
+                    cluster.Members.push_back(location);
+                    ++results.FunctionsReused;
+
+                    if (cluster.Rating < settings.Threshold) {
+                        BOOST_LOG_TRIVIAL(warning) << "Potential bug found in function at " << location << " (near-duplicate of " << cluster.Representative << ", similarity " << similarity << ") scored " << cluster.Rating << ":\n```cpp\n" << code << "\n```";
+                        ++file_bugs;
+                        results.Findings.push_back({location, cluster.Rating, cluster.Representative});
+                    } else {
+                        BOOST_LOG_TRIVIAL(trace) << "Function at " << location << " (near-duplicate of " << cluster.Representative << ", similarity " << similarity << ") scored " << cluster.Rating;
+                    }
+                    return;
+                }
+            }
 
             // Generate prompt for LLM
             std::string prompt;
@@ -70,18 +347,32 @@ void main_analysis(
             ask_cpp_expert_score(prompt, stop_strs, code);
 
             float rating = 0.f;
-            if (!oracle->QueryRating(prompt, rating)) {
+            if (!oracle->QueryRating(prompt, rating, prompt_shared_length)) {
                 BOOST_LOG_TRIVIAL(trace) << "Failed to rate a function from " << file_path << ":\n```cpp\n" << code << "\n```";
-            } else if (rating < threshold) {
+                return;
+            }
+
+            if (cluster_id >= 0) {
+                clusters[cluster_id].Representative = location;
+                clusters[cluster_id].Rated = true;
+                clusters[cluster_id].Rating = rating;
+            }
+
+            if (rating < settings.Threshold) {
                 BOOST_LOG_TRIVIAL(warning) << "Potential bug found in function from " << file_path << " scored " << rating << ":\n```cpp\n" << code << "\n```";
                 ++file_bugs;
-                ++total_bugs;
+                results.Findings.push_back({location, rating, ""});
             } else {
                 BOOST_LOG_TRIVIAL(trace) << "Function from " << file_path << " scored " << rating << ":\n```cpp\n" << code << "\n```";
             }
         };
 
-        extract_cpp_functions(file_path, file_contents, file_length_in_bytes, func_handler);
+        std::vector<FunctionRecord> records;
+        extract_records(file_path, file_contents, file_length_in_bytes, records);
+
+        for (const auto& record : records) {
+            func_handler(function_code(record, file_contents), record.SourceHash, file_path + ":" + std::to_string(function_line(record, file_contents)));
+        }
 
         if (file_bugs > 0) {
             BOOST_LOG_TRIVIAL(warning) << std::string(subdirectory_depth * 2, ' ') << "* Found " << file_bugs << " functions with bugs of " << functions_checked << " functions from " << file_path;
@@ -90,28 +381,107 @@ void main_analysis(
         }
     };
 
-    supported_file_types.push_back({"cc", cpp_handler});
-    supported_file_types.push_back({"hh", cpp_handler});
-    supported_file_types.push_back({"ii", cpp_handler});
-    supported_file_types.push_back({"inl", cpp_handler});
-    supported_file_types.push_back({"cpp", cpp_handler});
-    supported_file_types.push_back({"cxx", cpp_handler});
-    supported_file_types.push_back({"hpp", cpp_handler});
-    supported_file_types.push_back({"hxx", cpp_handler});
-    supported_file_types.push_back({"c", cpp_handler});
-    supported_file_types.push_back({"h", cpp_handler});
-#endif // ENABLE_CPP_SUPPORT
+    for (const char* ext : kCppExtensions) {
+        supported_file_types.push_back({ext, cpp_handler});
+    }
 
-    // Recursively check all files in the directory
-    walk_directory(supported_file_types, path);
+    ScanResults total;
 
-    if (files_checked <= 0) {
-        BOOST_LOG_TRIVIAL(warning) << "No supported source files found in " << path;
-    } else if (total_bugs <= 0) {
-        BOOST_LOG_TRIVIAL(info) << "Checked " << files_checked << " files in " << path << " and found no bugs.";
+    if (settings.QueueDir.empty()) {
+        // Recursively check all files in the directory
+        walk_directory(supported_file_types, path);
+        total = results;
     } else {
-        BOOST_LOG_TRIVIAL(warning) << "Bugs found!  Checked " << files_checked << " files in " << path << " and found " << total_bugs << " bugs.";
+        std::vector<std::string> file_paths;
+        list_supported_files(supported_file_types, path, file_paths);
+
+        queue = std::make_unique<LeaseWorkQueue>();
+        if (!queue->Initialize(settings.QueueDir, file_paths, settings.BatchSize, settings.LeaseSeconds)) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to join work queue in " << settings.QueueDir;
+            return;
+        }
+
+        int batch = 0;
+        while (queue->ClaimBatch(batch, file_paths)) {
+            if (token_counter) {
+                count_tokens(file_paths);
+            }
+
+            results = ScanResults();
+            for (const auto& file_path : file_paths) {
+                visit_file(supported_file_types, file_path);
+            }
+            queue->CompleteBatch(results);
+            total.Merge(results);
+        }
+
+        BOOST_LOG_TRIVIAL(info) << "No batches left.  Run with --merge to combine the results of all workers.";
+    }
+
+    if (extraction_cache && !settings.CacheDir.empty()) {
+        BOOST_LOG_TRIVIAL(info) << "Extraction cache: " << extraction_cache->Hits << " hits, " << extraction_cache->Misses << " misses";
+        extraction_cache->Save();
+    }
+
+    if (token_counter) {
+        BOOST_LOG_TRIVIAL(debug) << "Token count cache: " << token_counter->CacheHits << " hits, " << token_counter->CacheMisses << " misses";
+        token_counter->SaveCache();
+    }
+
+    if (near_duplicates) {
+        BOOST_LOG_TRIVIAL(info) << "Near-duplicate clustering: " << near_duplicates->Count() << " clusters, reused ratings for " << total.FunctionsReused << " functions";
+
+        for (const auto& cluster : clusters) {
+            if (!cluster.Rated || cluster.Rating >= settings.Threshold || cluster.Members.empty()) {
+                continue;
+            }
+
+            std::string members;
+            for (const auto& member : cluster.Members) {
+                members += "\n  " + member;
+            }
+            BOOST_LOG_TRIVIAL(warning) << "Function at " << cluster.Representative << " scored " << cluster.Rating << " and has " << cluster.Members.size() << " near-duplicates:" << members;
+        }
     }
+
+    log_scan_summary(total, path);
+}
+
+// Combines the results of every worker that shared `settings.QueueDir`
+void main_merge(const AnalysisSettings& settings)
+{
+    ScanResults merged;
+    int missing_batches = 0;
+    if (!merge_queue_results(settings.QueueDir, merged, missing_batches)) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to merge results in " << settings.QueueDir;
+        return;
+    }
+
+    if (missing_batches > 0) {
+        BOOST_LOG_TRIVIAL(warning) << missing_batches << " batches have no results yet.  Their files are not included.";
+    }
+
+    std::sort(merged.Findings.begin(), merged.Findings.end(), [](const Finding& a, const Finding& b) {
+        return a.Location < b.Location;
+    });
+    for (const auto& finding : merged.Findings) {
+        if (finding.DuplicateOf.empty()) {
+            BOOST_LOG_TRIVIAL(warning) << "Potential bug at " << finding.Location << " scored " << finding.Rating;
+        } else {
+            BOOST_LOG_TRIVIAL(warning) << "Potential bug at " << finding.Location << " scored " << finding.Rating << " (near-duplicate of " << finding.DuplicateOf << ")";
+        }
+    }
+
+    if (merged.FunctionsReused > 0) {
+        BOOST_LOG_TRIVIAL(info) << "Reused near-duplicate ratings for " << merged.FunctionsReused << " of " << merged.FunctionsChecked << " functions";
+    }
+
+    const std::string merged_path = (boost::filesystem::path(settings.QueueDir) / "merged.results").string();
+    if (merged.Write(merged_path)) {
+        BOOST_LOG_TRIVIAL(info) << "Wrote merged results to " << merged_path;
+    }
+
+    log_scan_summary(merged, settings.QueueDir);
 }
 
 
@@ -142,7 +512,18 @@ int main(int argc, char* argv[]) {
             ("verbose,v", po::value(&verbose_level)->zero_tokens(), "Increase verbosity of logging (can be specified multiple times)")
             ("threshold,t", po::value<float>()->default_value(0.5f), "Minimum threshold to declare a bug.  Values lower than this indicate a bug that should be reported.")
             ("path,p", po::value<std::string>(), "Path to the directory or file")
-            ("model,m", "Path to the model file.  Default: " DEFAULT_MODEL)
+            ("model,m", po::value<std::string>(), "Path to the model file.  Default: " DEFAULT_MODEL)
+            ("cache-dir", po::value<std::string>()->default_value(""), "Directory for caches that let rescans skip unchanged files.  Empty disables caching.")
+            ("clang-arg", po::value<std::vector<std::string>>()->composing(), "Extra argument passed to libclang, e.g. --clang-arg=-I/usr/include/foo (can be specified multiple times)")
+            ("extractor", po::value<std::string>()->default_value(DEFAULT_EXTRACTOR), "How to find functions in C++ files: clang (accurate, needs include paths) or lexical (fast, heuristic)")
+            ("queue-dir", po::value<std::string>()->default_value(""), "Shared directory for splitting the scan across worker processes.  Start any number of workers with the same path and --queue-dir, then run --merge.")
+            ("batch-size", po::value<int>()->default_value(16), "Files per work queue batch")
+            ("lease-seconds", po::value<int>()->default_value(600), "Seconds without progress before a worker's batch is handed to another worker.  Must be longer than rating the slowest function.")
+            ("merge", "Combine the results of all workers in --queue-dir and exit")
+            ("dry-run", "Extract functions without loading the model or rating them")
+            ("count-tokens", "Count prompt tokens for every function with a vocab-only model before rating, report the plan and skip prompts that cannot fit")
+            ("tokenizer-threads", po::value<int>()->default_value(static_cast<int>( std::thread::hardware_concurrency() )), "Threads for --count-tokens")
+            ("cluster-similarity", po::value<float>()->default_value(0.f), "Rate only one function per group of near-duplicates whose embeddings have at least this cosine similarity, e.g. 0.95.  Zero disables clustering.")
         ;
 
         po::positional_options_description positional;
@@ -152,9 +533,22 @@ int main(int argc, char* argv[]) {
         po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
         po::notify(vm);
 
-        std::string path = vm.count("path") > 0 ? vm["path"].as<std::string>() : "";
-        std::string model = vm.count("model") > 0 ? vm["model"].as<std::string>() : DEFAULT_MODEL;
-        float threshold = vm["threshold"].as<float>();
+        AnalysisSettings settings;
+        settings.Path = vm.count("path") > 0 ? vm["path"].as<std::string>() : "";
+        settings.Model = vm.count("model") > 0 ? vm["model"].as<std::string>() : DEFAULT_MODEL;
+        settings.Threshold = vm["threshold"].as<float>();
+        settings.CacheDir = vm["cache-dir"].as<std::string>();
+        if (vm.count("clang-arg") > 0) {
+            settings.CompileArgs = vm["clang-arg"].as<std::vector<std::string>>();
+        }
+        settings.Extractor = vm["extractor"].as<std::string>();
+        settings.ClusterSimilarity = vm["cluster-similarity"].as<float>();
+        settings.QueueDir = vm["queue-dir"].as<std::string>();
+        settings.BatchSize = std::max(1, vm["batch-size"].as<int>());
+        settings.LeaseSeconds = std::max(1, vm["lease-seconds"].as<int>());
+        settings.DryRun = vm.count("dry-run") > 0;
+        settings.CountTokens = vm.count("count-tokens") > 0;
+        settings.TokenizerThreads = std::max(1, vm["tokenizer-threads"].as<int>());
 
         int verbose = verbose_level.count;
 
@@ -162,13 +556,22 @@ int main(int argc, char* argv[]) {
 
         BOOST_LOG_TRIVIAL(info) << "analysis :: Static code analysis with AI.";
 
-        if (vm.count("help") || path.empty()) {
+        if (vm.count("merge")) {
+            if (settings.QueueDir.empty()) {
+                BOOST_LOG_TRIVIAL(error) << "--merge needs --queue-dir";
+                return -1;
+            }
+            main_merge(settings);
+            return 0;
+        }
+
+        if (vm.count("help") || settings.Path.empty()) {
             BOOST_LOG_TRIVIAL(info) << "Please specify a file or directory to scan!";
             BOOST_LOG_TRIVIAL(info) << desc;
             return -1;
         }
 
-        main_analysis(path, model, threshold);
+        main_analysis(settings);
     } catch (const po::error& e) {
         BOOST_LOG_TRIVIAL(error) << "Error parsing options: " << e.what() << std::endl;
         return -2;
@@ -0,0 +1,150 @@
+#include "near_duplicates.hpp"
+
+#include <cmath>
+#include <random>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Near-Duplicate Index
+
+// 256 floats per function is plenty to separate code at a 0.9+ cosine threshold
+static const int kProjectedSize = 256;
+
+// With 10 bits per table, two vectors 18 degrees apart (cosine 0.95) share a
+// bucket in a given table with p = 0.9^10 = 0.35, so across 16 tables the
+// chance of missing the match is 0.65^16 < 0.1%
+static const int kTables = 16;
+static const int kBitsPerTable = 10;
+
+// Below this many entries an exact scan is cheaper than hashing
+static const int kExactScanLimit = 256;
+
+static float dot(const float* a, const float* b, int n)
+{
+    float sum = 0.f;
+    for (int i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+void NearDuplicateIndex::Initialize(int embedding_size, float similarity_threshold, uint64_t seed)
+{
+    EmbeddingSize = embedding_size;
+    SimilarityThreshold = similarity_threshold;
+
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<float> normal(0.f, 1.f);
+
+    Projection.resize(static_cast<size_t>(kProjectedSize) * EmbeddingSize);
+    for (auto& x : Projection) {
+        x = normal(rng);
+    }
+
+    Hyperplanes.resize(static_cast<size_t>(kTables) * kBitsPerTable * kProjectedSize);
+    for (auto& x : Hyperplanes) {
+        x = normal(rng);
+    }
+
+    Entries.clear();
+    EntryCount = 0;
+    Buckets.assign(kTables, {});
+    VisitedStamp.clear();
+    QueryStamp = 0;
+}
+
+void NearDuplicateIndex::Project(const float* embedding, std::vector<float>& projected) const
+{
+    projected.resize(kProjectedSize);
+
+    float norm = 0.f;
+    for (int i = 0; i < kProjectedSize; ++i) {
+        projected[i] = dot(&Projection[static_cast<size_t>(i) * EmbeddingSize], embedding, EmbeddingSize);
+        norm += projected[i] * projected[i];
+    }
+
+    // Unit length, so a dot product is the cosine similarity
+    const float scale = norm > 0.f ? 1.f / std::sqrt(norm) : 0.f;
+    for (auto& x : projected) {
+        x *= scale;
+    }
+}
+
+uint32_t NearDuplicateIndex::BucketKey(int table, const float* projected) const
+{
+    uint32_t key = 0;
+    for (int bit = 0; bit < kBitsPerTable; ++bit) {
+        const float* plane = &Hyperplanes[(static_cast<size_t>(table) * kBitsPerTable + bit) * kProjectedSize];
+        if (dot(plane, projected, kProjectedSize) >= 0.f) {
+            key |= 1u << bit;
+        }
+    }
+    return key;
+}
+
+float NearDuplicateIndex::Similarity(int entry, const float* projected) const
+{
+    return dot(&Entries[static_cast<size_t>(entry) * kProjectedSize], projected, kProjectedSize);
+}
+
+bool NearDuplicateIndex::FindOrInsert(const float* embedding, int& id, float& similarity)
+{
+    std::vector<float> projected;
+    Project(embedding, projected);
+
+    uint32_t keys[kTables];
+    for (int table = 0; table < kTables; ++table) {
+        keys[table] = BucketKey(table, projected.data());
+    }
+
+    int best_entry = -1;
+    float best_similarity = -1.f;
+
+    auto consider = [&](int entry) {
+        const float s = Similarity(entry, projected.data());
+        if (s > best_similarity) {
+            best_similarity = s;
+            best_entry = entry;
+        }
+    };
+
+    if (EntryCount <= kExactScanLimit) {
+        for (int entry = 0; entry < EntryCount; ++entry) {
+            consider(entry);
+        }
+    } else {
+        ++QueryStamp;
+        for (int table = 0; table < kTables; ++table) {
+            auto it = Buckets[table].find(keys[table]);
+            if (it == Buckets[table].end()) {
+                continue;
+            }
+            for (int entry : it->second) {
+                if (VisitedStamp[entry] != QueryStamp) {
+                    VisitedStamp[entry] = QueryStamp;
+                    consider(entry);
+                }
+            }
+        }
+    }
+
+    if (best_entry >= 0 && best_similarity >= SimilarityThreshold) {
+        id = best_entry;
+        similarity = best_similarity;
+        return true;
+    }
+
+    id = EntryCount++;
+    similarity = 1.f;
+    Entries.insert(Entries.end(), projected.begin(), projected.end());
+    VisitedStamp.push_back(0);
+    for (int table = 0; table < kTables; ++table) {
+        Buckets[table][keys[table]].push_back(id);
+    }
+    return false;
+}
+
+
+} // namespace analysis
@@ -0,0 +1,69 @@
+#ifndef NEAR_DUPLICATES_HPP
+#define NEAR_DUPLICATES_HPP
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Near-Duplicate Index
+
+/*
+    Approximate nearest-neighbor index over function embeddings, used to rate
+    only one representative of each group of near-clones.
+
+    Model embeddings are reduced to a compact unit vector with a fixed random
+    projection, and candidates are found by random-hyperplane LSH: vectors
+    with a small angle between them land in the same bucket of at least one
+    table with high probability.  Candidates are then compared exactly by
+    cosine similarity.
+
+    Clustering is greedy: an embedding joins the most similar existing entry
+    if it is at least as similar as the threshold, otherwise it becomes a new
+    entry (the representative of a new cluster).
+*/
+class NearDuplicateIndex
+{
+public:
+    void Initialize(int embedding_size, float similarity_threshold, uint64_t seed = 0);
+
+    // Returns true if `embedding` matched an existing entry, which is written
+    // to `id` along with its cosine `similarity`.  Otherwise the embedding is
+    // added as a new entry and `id` receives its index (0, 1, 2, ...).
+    bool FindOrInsert(const float* embedding, int& id, float& similarity);
+
+    int Count() const { return EntryCount; }
+
+protected:
+    int EmbeddingSize = 0;
+    float SimilarityThreshold = 1.f;
+
+    // Random Gaussian projection, ProjectedSize x EmbeddingSize
+    std::vector<float> Projection;
+
+    // Random hyperplanes for each LSH table, (Tables * Bits) x ProjectedSize
+    std::vector<float> Hyperplanes;
+
+    // Unit-length projected embeddings, EntryCount x ProjectedSize
+    std::vector<float> Entries;
+    int EntryCount = 0;
+
+    // Bucket key -> entry indices, one map per LSH table
+    std::vector<std::unordered_map<uint32_t, std::vector<int>>> Buckets;
+
+    // Last query that visited each entry, to skip duplicate candidates
+    std::vector<uint32_t> VisitedStamp;
+    uint32_t QueryStamp = 0;
+
+    void Project(const float* embedding, std::vector<float>& projected) const;
+    uint32_t BucketKey(int table, const float* projected) const;
+    float Similarity(int entry, const float* projected) const;
+};
+
+
+} // namespace analysis
+
+#endif // NEAR_DUPLICATES_HPP
@@ -2,6 +2,8 @@
 #include "logging.hpp"
 #include "rate_prompt.hpp"
 
+#include <memory>
+
 // ggml headers
 #include "common.h"
 
@@ -11,20 +13,40 @@ namespace analysis {
 //------------------------------------------------------------------------------
 // Oracle
 
-bool Oracle::Initialize(const std::string& model_path)
+bool Oracle::Initialize(const std::string& model_path, bool enable_embeddings)
 {
     auto lparams = ::llama_context_default_params();
 
-    ContextLength = 2048;
-
     lparams.n_ctx      = ContextLength;
     lparams.n_parts    = 1;
     lparams.seed       = 666;
     lparams.logits_all = false;
     lparams.use_mmap   = true;
     lparams.use_mlock  = false;
+    lparams.embedding  = enable_embeddings;
+    lparams.prefix_cache_tokens = PrefixCacheTokens;
+
+    EmbeddingsEnabled = enable_embeddings;
 
     Context = ::llama_init_from_file(model_path.c_str(), lparams);
+    if (!Context) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to load model from " << model_path;
+        return false;
+    }
+
+    // A rating is only ever digits, a decimal point and whatever ends it,
+    // so logits are only computed for those tokens
+    std::vector<llama_token> rating_vocab = { ::llama_token_eos() };
+    const int n_vocab = ::llama_n_vocab(Context);
+    for (int i = 0; i < n_vocab; ++i) {
+        const std::string token = ::llama_token_to_str(Context, i);
+        if (!token.empty() && token.find_first_not_of("0123456789. \n") == std::string::npos) {
+            rating_vocab.push_back(i);
+        }
+    }
+    ::llama_set_output_vocab(Context, rating_vocab.data(), static_cast<int>( rating_vocab.size() ));
+
+    BOOST_LOG_TRIVIAL(debug) << "Rating vocabulary has " << rating_vocab.size() << " tokens";
 
     return true;
 }
@@ -32,12 +54,35 @@ bool Oracle::Initialize(const std::string& model_path)
 void Oracle::Shutdown()
 {
     if (Context) {
+        const llama_prefix_cache_stats stats = ::llama_prefix_cache_get_stats(Context);
+        BOOST_LOG_TRIVIAL(debug) << "Prefix cache: " << stats.n_hits << " hits in " << stats.n_lookups
+            << " lookups, " << stats.n_tokens_reused << " tokens reused, " << stats.n_evictions << " evictions";
+
         ::llama_free(Context);
         Context = nullptr;
     }
 }
 
-bool Oracle::QueryRating(std::string prompt, float& rating)
+// Evaluates tokens[first..] as sequence 0, at their positions in `tokens`,
+// with logits for the last one
+static bool decode_from(llama_context* context, const std::vector<llama_token>& tokens, int first, int num_threads)
+{
+    const int count = static_cast<int>( tokens.size() ) - first;
+
+    std::vector<llama_pos> pos(count);
+    std::vector<llama_seq_id> seq_id(count, 0);
+    std::unique_ptr<bool[]> logits(new bool[count]());
+    for (int i = 0; i < count; ++i) {
+        pos[i] = first + i;
+    }
+    logits[count - 1] = true;
+
+    llama_batch batch = { count, tokens.data() + first, pos.data(), seq_id.data(), logits.get() };
+
+    return ::llama_decode(context, batch, num_threads) == 0;
+}
+
+bool Oracle::QueryRating(std::string prompt, float& rating, size_t shared_length)
 {
     std::vector<llama_token> tokens = ::llama_tokenize(Context, prompt.c_str(), false);
     const int input_count = static_cast<int>( tokens.size() );
@@ -47,13 +92,34 @@ bool Oracle::QueryRating(std::string prompt, float& rating)
         return false;
     }
 
-    const int NumThreads = 24;
+    if (input_count == 0) {
+        return false;
+    }
+
+    // Prompts share the rating instructions around the text being rated, so
+    // the start of the prompt is usually in the prefix cache already.  The last
+    // token is always evaluated to get its logits.
+    const int cached_count = ::llama_prefix_cache_lookup(Context, 0, tokens.data(), input_count - 1);
 
-    if (::llama_eval(Context, tokens.data(), tokens.size(), 0, NumThreads)) {
-        BOOST_LOG_TRIVIAL(error) << "llama_eval failed";
+    if (!decode_from(Context, tokens, cached_count, NumThreads)) {
+        BOOST_LOG_TRIVIAL(error) << "llama_decode failed";
         return false;
     }
 
+    // Only the shared start is stored.  The code being rated is different in
+    // every prompt, so its tokens would never be looked up again and would
+    // only evict the shared ones.  The start is tokenized on its own and may
+    // end in another token than in the prompt, so only matching tokens count.
+    const std::vector<llama_token> shared_tokens = ::llama_tokenize(Context, prompt.substr(0, shared_length).c_str(), false);
+    int shared_count = 0;
+    while (shared_count < static_cast<int>( shared_tokens.size() ) && shared_count < input_count &&
+           shared_tokens[shared_count] == tokens[shared_count]) {
+        ++shared_count;
+    }
+    if (shared_count > 0) {
+        ::llama_prefix_cache_store(Context, 0, tokens.data(), shared_count);
+    }
+
     const int max_output_tokens = 4;
 
     std::string response;
@@ -88,8 +154,8 @@ bool Oracle::QueryRating(std::string prompt, float& rating)
 
         tokens.push_back(id);
 
-        if (::llama_eval(Context, tokens.data(), tokens.size(), 0, NumThreads)) {
-            BOOST_LOG_TRIVIAL(error) << "llama_eval failed";
+        if (!decode_from(Context, tokens, static_cast<int>( tokens.size() ) - 1, NumThreads)) {
+            BOOST_LOG_TRIVIAL(error) << "llama_decode failed";
             return false;
         }
     }
@@ -97,5 +163,45 @@ bool Oracle::QueryRating(std::string prompt, float& rating)
     return find_first_number_between_0_and_1(response, rating);
 }
 
+bool Oracle::QueryEmbedding(const std::string& text, std::vector<float>& embedding)
+{
+    if (!EmbeddingsEnabled) {
+        BOOST_LOG_TRIVIAL(error) << "Oracle was initialized without embeddings";
+        return false;
+    }
+
+    std::vector<llama_token> tokens = ::llama_tokenize(Context, text.c_str(), true);
+    const int input_count = static_cast<int>( tokens.size() );
+
+    if (input_count >= ContextLength) {
+        BOOST_LOG_TRIVIAL(debug) << "Input is too large to embed. Tokens=" << input_count;
+        return false;
+    }
+
+    // Decode without asking for logits so the output projection is skipped
+    std::vector<llama_pos> pos(input_count);
+    std::vector<llama_seq_id> seq_id(input_count, 0);
+    for (int i = 0; i < input_count; ++i) {
+        pos[i] = i;
+    }
+
+    llama_batch batch = { input_count, tokens.data(), pos.data(), seq_id.data(), nullptr };
+
+    ::llama_kv_cache_seq_rm(Context, 0, 0, -1);
+    if (::llama_decode(Context, batch, NumThreads) != 0) {
+        BOOST_LOG_TRIVIAL(error) << "llama_decode failed";
+        return false;
+    }
+
+    const float* data = ::llama_get_embeddings(Context);
+    embedding.assign(data, data + EmbeddingSize());
+    return true;
+}
+
+int Oracle::EmbeddingSize() const
+{
+    return ::llama_n_embd(Context);
+}
+
 
 } // namespace analysis
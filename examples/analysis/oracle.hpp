@@ -2,6 +2,7 @@
 #define ORACLE_HPP
 
 #include <string>
+#include <vector>
 
 // ggml headers
 #include "llama.h"
@@ -24,16 +25,37 @@ public:
         Shutdown();
     }
 
-    bool Initialize(const std::string& model_path);
+    // Set enable_embeddings to allow QueryEmbedding()
+    bool Initialize(const std::string& model_path, bool enable_embeddings = false);
     void Shutdown();
 
-    bool QueryRating(std::string prompt, float& rating);
+    // The first shared_length characters of prompt are the same for every prompt.
+    // Only their tokens are kept in the prefix cache.
+    bool QueryRating(std::string prompt, float& rating, size_t shared_length = 0);
+
+    // Runs `text` through the model without generating anything and returns
+    // the final hidden state (llama_get_embeddings).  Returns false if the
+    // text does not fit in the context or embeddings were not enabled.
+    bool QueryEmbedding(const std::string& text, std::vector<float>& embedding);
+
+    int EmbeddingSize() const;
+
+    int ContextSize() const { return ContextLength; }
 
 protected:
     llama_context* Context = nullptr;
 
     // Model context length (2048 for LLaMA)
-    int ContextLength = 0;
+    int ContextLength = 2048;
+
+    bool EmbeddingsEnabled = false;
+
+    // Tokens of K/V kept for the start that rating prompts share.  A token is
+    // about 2.5 MiB of F16 K/V with a 65B model, so this is a token count
+    // rather than a size, which would hold a different prompt length per model
+    int PrefixCacheTokens = 1024;
+
+    int NumThreads = 24;
 };
 
 
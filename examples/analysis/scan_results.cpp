@@ -0,0 +1,105 @@
+#include "scan_results.hpp"
+#include "shared_file.hpp"
+#include "logging.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Scan Results
+
+static const char* kScanResultsHeader = "analysis-results 1";
+
+void ScanResults::Merge(const ScanResults& other)
+{
+    FilesChecked += other.FilesChecked;
+    FunctionsChecked += other.FunctionsChecked;
+    FunctionsReused += other.FunctionsReused;
+    Findings.insert(Findings.end(), other.Findings.begin(), other.Findings.end());
+}
+
+bool ScanResults::Write(const std::string& file_path) const
+{
+    // A worker that took over an expired lease may be writing the same batch
+    const std::string temp_path = temp_path_for(file_path);
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write results: " << temp_path;
+            return false;
+        }
+
+        out << kScanResultsHeader << "\n";
+        out << "files_checked " << FilesChecked << "\n";
+        out << "functions_checked " << FunctionsChecked << "\n";
+        out << "functions_reused " << FunctionsReused << "\n";
+        for (const auto& finding : Findings) {
+            out << "finding\t" << finding.Rating << "\t" << finding.Location << "\t" << finding.DuplicateOf << "\n";
+        }
+
+        if (!out) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write results: " << temp_path;
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp_path, file_path, ec);
+    if (ec) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to replace results " << file_path << ": " << ec.message();
+        return false;
+    }
+    return true;
+}
+
+bool ScanResults::Read(const std::string& file_path)
+{
+    *this = ScanResults();
+
+    std::ifstream in(file_path);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != kScanResultsHeader) {
+        BOOST_LOG_TRIVIAL(error) << "Not a results file: " << file_path;
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        if (line.compare(0, 8, "finding\t") == 0) {
+            std::istringstream fields(line.substr(8));
+            std::string rating;
+            Finding finding;
+            std::getline(fields, rating, '\t');
+            std::getline(fields, finding.Location, '\t');
+            std::getline(fields, finding.DuplicateOf);
+            finding.Rating = std::strtof(rating.c_str(), nullptr);
+            Findings.push_back(finding);
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string name;
+        int value = 0;
+        if (!(fields >> name >> value)) {
+            BOOST_LOG_TRIVIAL(error) << "Bad line in results " << file_path << ": " << line;
+            return false;
+        }
+
+        if (name == "files_checked") {
+            FilesChecked = value;
+        } else if (name == "functions_checked") {
+            FunctionsChecked = value;
+        } else if (name == "functions_reused") {
+            FunctionsReused = value;
+        }
+    }
+
+    return true;
+}
+
+
+} // namespace analysis
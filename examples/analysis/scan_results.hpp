@@ -0,0 +1,55 @@
+#ifndef SCAN_RESULTS_HPP
+#define SCAN_RESULTS_HPP
+
+#include <string>
+#include <vector>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Scan Results
+
+// One function that scored below the bug threshold
+struct Finding
+{
+    // "file:line" of the function
+    std::string Location;
+
+    float Rating = 0.f;
+
+    // "file:line" of the function whose rating was reused, if any
+    std::string DuplicateOf;
+};
+
+/*
+    Findings and metrics for some part of a scan.
+
+    Workers write one of these per batch, and the merge step reads them all
+    back and combines them, so the format is a small line-based text file:
+
+        analysis-results 1
+        files_checked 12
+        functions_checked 140
+        functions_reused 3
+        finding <tab> 0.2 <tab> src/foo.cpp:120 <tab> src/bar.cpp:88
+*/
+struct ScanResults
+{
+    int FilesChecked = 0;
+    int FunctionsChecked = 0;
+    int FunctionsReused = 0;
+    std::vector<Finding> Findings;
+
+    void Merge(const ScanResults& other);
+
+    // Writes to a temporary file and renames it into place, so readers only
+    // ever see complete results
+    bool Write(const std::string& file_path) const;
+    bool Read(const std::string& file_path);
+};
+
+
+} // namespace analysis
+
+#endif // SCAN_RESULTS_HPP
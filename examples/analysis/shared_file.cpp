@@ -0,0 +1,183 @@
+#include "shared_file.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+    #include <process.h>
+#else
+    #include <unistd.h>
+#endif
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Files Shared Between Processes
+
+std::string current_worker_id()
+{
+    std::string host = "localhost";
+    int pid = 0;
+#ifdef _WIN32
+    if (const char* name = std::getenv("COMPUTERNAME")) {
+        host = name;
+    }
+    pid = _getpid();
+#else
+    char name[256] = {};
+    if (gethostname(name, sizeof(name) - 1) == 0 && name[0] != '\0') {
+        host = name;
+    }
+    pid = static_cast<int>( getpid() );
+#endif
+    return host + "-" + std::to_string(pid);
+}
+
+int64_t unix_time_now()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool create_exclusive(const std::string& path, const std::string& contents)
+{
+    // "x" is the C11 exclusive mode, which maps to O_CREAT | O_EXCL
+    FILE* file = std::fopen(path.c_str(), "wx");
+    if (!file) {
+        return false;
+    }
+    std::fputs(contents.c_str(), file);
+    std::fclose(file);
+    return true;
+}
+
+std::string read_file(const std::string& path)
+{
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static bool is_stale(const std::string& path, int stale_seconds)
+{
+    std::error_code ec;
+    const auto touched = std::filesystem::last_write_time(path, ec);
+    return !ec && std::filesystem::file_time_type::clock::now() - touched >= std::chrono::seconds(stale_seconds);
+}
+
+bool remove_stale_file(const std::string& path, int stale_seconds, std::string& out_contents)
+{
+    const std::string contents = read_file(path);
+    if (!is_stale(path, stale_seconds)) {
+        return false;
+    }
+
+    // Move the file aside first: only one process's rename can succeed
+    std::error_code ec;
+    const std::string stale_path = path + ".stale." + current_worker_id();
+    std::filesystem::rename(path, stale_path, ec);
+    if (ec) {
+        return false;
+    }
+
+    // Another process may have replaced the stale file between the check and
+    // the rename, and then this moved its fresh file.  A hard link puts it back
+    // only if nobody has created `path` again since.
+    if (read_file(stale_path) != contents || !is_stale(stale_path, stale_seconds)) {
+        std::filesystem::create_hard_link(stale_path, path, ec);
+        std::filesystem::remove(stale_path, ec);
+        return false;
+    }
+
+    std::filesystem::remove(stale_path, ec);
+    out_contents = contents;
+    return true;
+}
+
+std::string temp_path_for(const std::string& path)
+{
+    return path + ".tmp." + current_worker_id();
+}
+
+bool read_cache_file(
+    const std::string& file_path,
+    const std::string& cache_name,
+    uint32_t magic,
+    uint32_t version,
+    const std::function<bool(std::istream&)>& read_entry)
+{
+    std::ifstream in(file_path, std::ios::binary);
+    if (!in) {
+        BOOST_LOG_TRIVIAL(debug) << "No " << cache_name << " at " << file_path;
+        return true;
+    }
+
+    uint32_t file_magic = 0, file_version = 0;
+    uint64_t entry_count = 0;
+    if (!read_pod(in, file_magic) || !read_pod(in, file_version) || !read_pod(in, entry_count) ||
+        file_magic != magic || file_version != version) {
+        BOOST_LOG_TRIVIAL(warning) << "Ignoring incompatible " << cache_name << " at " << file_path;
+        return true;
+    }
+
+    for (uint64_t i = 0; i < entry_count; ++i) {
+        if (!read_entry(in) || !in) {
+            BOOST_LOG_TRIVIAL(error) << "Truncated " << cache_name << ": " << file_path;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FileLock::Lock(const std::string& lock_path, int stale_seconds)
+{
+    Unlock();
+
+    // Otherwise the exclusive create below would fail forever
+    std::error_code ec;
+    const auto parent = std::filesystem::absolute(lock_path, ec).parent_path();
+    if (ec || !std::filesystem::is_directory(parent, ec)) {
+        BOOST_LOG_TRIVIAL(error) << "No directory for lock file " << lock_path;
+        return false;
+    }
+
+    const std::string owner = current_worker_id();
+    while (!create_exclusive(lock_path, owner)) {
+        std::string stale_owner;
+        if (remove_stale_file(lock_path, stale_seconds, stale_owner)) {
+            BOOST_LOG_TRIVIAL(warning) << "Breaking stale lock " << lock_path << " of " << stale_owner;
+            continue;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    LockPath = lock_path;
+    return true;
+}
+
+void FileLock::Unlock()
+{
+    if (!LockPath.empty()) {
+        // Held for longer than stale_seconds, another process may own it now
+        if (read_file(LockPath) == current_worker_id()) {
+            std::error_code ec;
+            std::filesystem::remove(LockPath, ec);
+        } else {
+            BOOST_LOG_TRIVIAL(warning) << "Lock " << LockPath << " was taken over by another process";
+        }
+        LockPath.clear();
+    }
+}
+
+
+} // namespace analysis
@@ -0,0 +1,98 @@
+#ifndef SHARED_FILE_HPP
+#define SHARED_FILE_HPP
+
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Files Shared Between Processes
+
+// "host-pid" of this process, unique across machines that share a filesystem
+std::string current_worker_id();
+
+// Seconds since the Unix epoch
+int64_t unix_time_now();
+
+// Entries of the on-disk caches that no scan used for this long are dropped
+// when the cache is saved
+static const int64_t kCacheRetentionSeconds = 7 * 24 * 60 * 60;
+
+// Creates `path` only if it does not exist yet, atomically
+bool create_exclusive(const std::string& path, const std::string& contents);
+
+// Contents of a small text file such as a lock or lease, empty if it is missing
+std::string read_file(const std::string& path);
+
+/*
+    Removes `path` if it was last written `stale_seconds` ago or earlier, and
+    returns its former contents in `out_contents`.  Only one of several
+    processes doing this at once succeeds, and a file that another process
+    created after the age was checked is left in place.  Returns false if
+    nothing was removed.
+*/
+bool remove_stale_file(const std::string& path, int stale_seconds, std::string& out_contents);
+
+// Path for writing a new version of `path` before renaming it into place.
+// Unique to this process, so concurrent writers never share a temporary file.
+std::string temp_path_for(const std::string& path);
+
+// Values in the binary cache files are stored as their bytes in memory
+template<typename T>
+bool read_pod(std::istream& in, T& value)
+{
+    return !!in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+template<typename T>
+void write_pod(std::ostream& out, const T& value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Reads a binary cache file, which starts with `magic`, `version` and the
+// entry count, calling read_entry() for each entry.  A missing or
+// incompatible file has no entries.  Returns false if the file exists but
+// read_entry() failed, i.e. the file is truncated.
+bool read_cache_file(
+    const std::string& file_path,
+    const std::string& cache_name,
+    uint32_t magic,
+    uint32_t version,
+    const std::function<bool(std::istream&)>& read_entry);
+
+/*
+    Lock shared by every process that can see the lock file, including other
+    machines on a network filesystem.  It is held by creating the lock file
+    exclusively.  A lock file that is older than `stale_seconds` is assumed to
+    belong to a process that died while holding it, and is taken over.  The
+    lock file holds the worker id of its owner, so that a process whose lock
+    was taken over does not remove the new owner's lock file.
+*/
+class FileLock
+{
+public:
+    ~FileLock()
+    {
+        Unlock();
+    }
+
+    // Waits until the lock is free.  Returns false on filesystem errors.
+    bool Lock(const std::string& lock_path, int stale_seconds = 60);
+
+    // Removes the lock file if it still belongs to this process
+    void Unlock();
+
+protected:
+    std::string LockPath;
+};
+
+
+} // namespace analysis
+
+#endif // SHARED_FILE_HPP
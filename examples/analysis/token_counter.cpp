@@ -0,0 +1,239 @@
+#include "token_counter.hpp"
+#include "function_record.hpp"
+#include "shared_file.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Token Counter
+
+static const uint32_t kTokenCacheMagic = 0x4354414c; // 'LATC'
+static const uint32_t kTokenCacheVersion = 2;
+
+bool TokenCounter::Initialize(const std::string& model_path, int thread_count)
+{
+    auto lparams = ::llama_context_default_params();
+    lparams.vocab_only = true;
+    lparams.use_mmap   = true;
+
+    Context = ::llama_init_from_file(model_path.c_str(), lparams);
+    if (!Context) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to load vocabulary from " << model_path;
+        return false;
+    }
+
+    ThreadCount = std::max(1, thread_count);
+    ScanTime = unix_time_now();
+
+    VocabHash = 0;
+    const int n_vocab = ::llama_n_vocab(Context);
+    for (int i = 0; i < n_vocab; ++i) {
+        const char* token = ::llama_token_to_str(Context, i);
+        // Include the terminator so token boundaries affect the hash
+        VocabHash = hash_bytes(token, strlen(token) + 1, VocabHash);
+    }
+
+    return true;
+}
+
+void TokenCounter::Shutdown()
+{
+    if (Context) {
+        ::llama_free(Context);
+        Context = nullptr;
+    }
+}
+
+uint64_t TokenCounter::CacheKey(uint64_t source_hash) const
+{
+    return hash_bytes(&source_hash, sizeof(source_hash), VocabHash);
+}
+
+// Reads every count of a cache file into `counts`.  Returns false if the
+// file exists but could not be read.  A missing file has no counts.
+template<typename Entry>
+static bool read_counts(const std::string& file_path, std::unordered_map<uint64_t, Entry>& counts)
+{
+    counts.clear();
+
+    const bool read = read_cache_file(file_path, "token count cache", kTokenCacheMagic, kTokenCacheVersion, [&](std::istream& in) {
+        uint64_t key = 0;
+        uint32_t count = 0;
+        int64_t last_used = 0;
+        if (!read_pod(in, key) || !read_pod(in, count) || !read_pod(in, last_used)) {
+            return false;
+        }
+        counts[key].Count = count;
+        counts[key].LastUsed = last_used;
+        return true;
+    });
+
+    if (!read) {
+        counts.clear();
+    }
+    return read;
+}
+
+bool TokenCounter::LoadCache(const std::string& cache_file_path)
+{
+    CacheFilePath = cache_file_path;
+
+    if (!read_counts(CacheFilePath, Counts)) {
+        return false;
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "Loaded " << Counts.size() << " token counts from " << CacheFilePath;
+    return true;
+}
+
+bool TokenCounter::SaveCache()
+{
+    if (CacheFilePath.empty()) {
+        return false;
+    }
+
+    // Other workers may save the same file, so reading their counts and
+    // replacing the file must not interleave with theirs
+    FileLock lock;
+    if (!lock.Lock(CacheFilePath + ".lock")) {
+        return false;
+    }
+
+    std::unordered_map<uint64_t, Entry> saved;
+    read_counts(CacheFilePath, saved);
+    for (const auto& it : saved) {
+        Entry& entry = Counts[it.first];
+        if (it.second.LastUsed > entry.LastUsed) {
+            entry = it.second;
+        }
+    }
+
+    const int64_t oldest = ScanTime - kCacheRetentionSeconds;
+
+    uint64_t entry_count = 0;
+    for (const auto& it : Counts) {
+        if (it.second.LastUsed >= oldest) {
+            ++entry_count;
+        }
+    }
+
+    const std::string temp_path = temp_path_for(CacheFilePath);
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write token count cache: " << temp_path;
+            return false;
+        }
+
+        write_pod(out, kTokenCacheMagic);
+        write_pod(out, kTokenCacheVersion);
+        write_pod(out, entry_count);
+        for (const auto& it : Counts) {
+            if (it.second.LastUsed >= oldest) {
+                write_pod(out, it.first);
+                write_pod(out, it.second.Count);
+                write_pod(out, it.second.LastUsed);
+            }
+        }
+
+        if (!out) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write token count cache: " << temp_path;
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp_path, CacheFilePath, ec);
+    if (ec) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to replace token count cache " << CacheFilePath << ": " << ec.message();
+        std::filesystem::remove(temp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+uint32_t TokenCounter::CountText(const std::string& text) const
+{
+    // SentencePiece never produces more tokens than bytes.
+    // No BOS, so counts of pieces of a prompt add up to the prompt.
+    std::vector<llama_token> tokens(text.size() + 1);
+    const int n = ::llama_tokenize(Context, text.c_str(), tokens.data(), static_cast<int>( tokens.size() ), false);
+    return static_cast<uint32_t>( n < 0 ? -n : n );
+}
+
+void TokenCounter::CountTokens(const std::vector<TokenCountJob>& jobs)
+{
+    // Skip cached and repeated texts before starting any threads
+    std::vector<const TokenCountJob*> pending;
+    for (const auto& job : jobs) {
+        auto it = Counts.find(CacheKey(job.SourceHash));
+        if (it != Counts.end()) {
+            if (it->second.LastUsed != ScanTime) {
+                it->second.LastUsed = ScanTime;
+                ++CacheHits;
+            }
+            continue;
+        }
+
+        // Placeholder so duplicates in this call are only counted once
+        Counts[CacheKey(job.SourceHash)].LastUsed = ScanTime;
+        pending.push_back(&job);
+        ++CacheMisses;
+    }
+
+    if (pending.empty()) {
+        return;
+    }
+
+    // Jobs vary a lot in size, so threads pull them one at a time
+    std::vector<uint32_t> counts(pending.size());
+    std::atomic<size_t> next_job(0);
+
+    auto worker = [&]() {
+        for (;;) {
+            const size_t i = next_job++;
+            if (i >= pending.size()) {
+                break;
+            }
+            counts[i] = CountText(pending[i]->Text);
+        }
+    };
+
+    const int thread_count = std::min(ThreadCount, static_cast<int>( pending.size() ));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < pending.size(); ++i) {
+        Counts[CacheKey(pending[i]->SourceHash)].Count = counts[i];
+    }
+}
+
+bool TokenCounter::FindCount(uint64_t source_hash, uint32_t& count)
+{
+    auto it = Counts.find(CacheKey(source_hash));
+    if (it == Counts.end()) {
+        return false;
+    }
+
+    it->second.LastUsed = ScanTime;
+    count = it->second.Count;
+    return true;
+}
+
+
+} // namespace analysis
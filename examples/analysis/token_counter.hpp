@@ -0,0 +1,96 @@
+#ifndef TOKEN_COUNTER_HPP
+#define TOKEN_COUNTER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// ggml headers
+#include "llama.h"
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Token Counter
+
+// One piece of text to count, identified by the hash of its source
+struct TokenCountJob
+{
+    uint64_t SourceHash = 0;
+    std::string Text;
+};
+
+/*
+    Counts tokens with a vocab-only llama context, which loads in a fraction
+    of a second and needs no model weights, so every function can be measured
+    before the model is loaded.
+
+    Tokenizing only reads the vocabulary, so a pool of threads shares the one
+    context.  Counts are cached by source hash, and the cache is keyed by the
+    vocabulary so switching to a model with a different tokenizer misses.
+    Like the extraction cache, the cache file may be shared by worker
+    processes, which merge their counts when they save it.
+*/
+class TokenCounter
+{
+public:
+    ~TokenCounter()
+    {
+        Shutdown();
+    }
+
+    bool Initialize(const std::string& model_path, int thread_count);
+    void Shutdown();
+
+    // Returns false if the file exists but could not be read.
+    // A missing file is an empty cache.
+    bool LoadCache(const std::string& cache_file_path);
+
+    // Atomically replaces the cache file with this cache merged with the
+    // counts saved by other processes
+    bool SaveCache();
+
+    // Counts all jobs that are not cached yet, in parallel
+    void CountTokens(const std::vector<TokenCountJob>& jobs);
+
+    // Returns true and fills `count` if the text with this hash was counted
+    bool FindCount(uint64_t source_hash, uint32_t& count);
+
+    // Counts a single text on the calling thread, without caching.
+    // The BOS token is not included.
+    uint32_t CountText(const std::string& text) const;
+
+    int CacheHits = 0;
+    int CacheMisses = 0;
+
+protected:
+    llama_context* Context = nullptr;
+    int ThreadCount = 1;
+
+    // Hash of every token string, so counts from another vocabulary miss
+    uint64_t VocabHash = 0;
+
+    std::string CacheFilePath;
+
+    struct Entry
+    {
+        uint32_t Count = 0;
+
+        // unix_time_now() of the last scan that used the entry
+        int64_t LastUsed = 0;
+    };
+
+    std::unordered_map<uint64_t, Entry> Counts;
+
+    // Start of this scan, the LastUsed of every entry it uses
+    int64_t ScanTime = 0;
+
+    uint64_t CacheKey(uint64_t source_hash) const;
+};
+
+
+} // namespace analysis
+
+#endif // TOKEN_COUNTER_HPP
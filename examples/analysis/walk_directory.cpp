@@ -18,6 +18,62 @@ namespace analysis {
 //------------------------------------------------------------------------------
 // Directory Walker
 
+static const SupportedFileType* find_file_type(
+    const std::vector<SupportedFileType>& supported_file_types,
+    const std::filesystem::path& file_path)
+{
+    // Get the file extension
+    std::string ext = file_path.extension().string();
+    if (ext.empty()) {
+        return nullptr;  // File has no extension
+    }
+    ext = ext.substr(1);  // Remove the dot from the extension
+    ext = boost::algorithm::to_lower_copy(ext); // Normalize case to lower
+
+    // Check if the file type is supported
+    auto it = std::find_if(supported_file_types.begin(), supported_file_types.end(),
+        [&ext](const SupportedFileType& fileType) {
+            return fileType.Extension == ext;
+        });
+
+    if (it == supported_file_types.end()) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+static void handle_file(
+    const SupportedFileType& file_type,
+    const std::string& file_path,
+    int subdirectory_depth)
+{
+#ifdef ENABLE_MMAP
+    // Get the file size
+    std::size_t size_bytes = std::filesystem::file_size(file_path);
+
+    // Map the file to memory
+    boost::interprocess::file_mapping mapping(file_path.c_str(),
+                                               boost::interprocess::read_only);
+    boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+
+    // Call the handler with the file contents
+    file_type.Handler(
+        file_path,
+        static_cast<const char*>(region.get_address()),
+        size_bytes,
+        subdirectory_depth
+    );
+#else
+    // Call the handler with the file contents
+    file_type.Handler(
+        file_path,
+        nullptr,
+        0,
+        subdirectory_depth
+    );
+#endif
+}
+
 void walk_directory(
     const std::vector<SupportedFileType>& supported_file_types,
     const std::string& path,
@@ -25,51 +81,14 @@ void walk_directory(
 {
     for (const auto& entry : std::filesystem::directory_iterator(path)) {
         if (entry.is_regular_file()) {
-            // Get the file extension
-            std::string ext = entry.path().extension().string();
-            if (ext.empty()) {
-                continue;  // File has no extension
-            }
-            ext = ext.substr(1);  // Remove the dot from the extension
-            ext = boost::algorithm::to_lower_copy(ext); // Normalize case to lower
-
-            // Check if the file type is supported
-            auto it = std::find_if(supported_file_types.begin(), supported_file_types.end(),
-                [&ext](const SupportedFileType& fileType) {
-                    return fileType.Extension == ext;
-                });
-
-            if (it == supported_file_types.end()) {
+            const SupportedFileType* file_type = find_file_type(supported_file_types, entry.path());
+            if (!file_type) {
                 // File type is not supported
                 BOOST_LOG_TRIVIAL(debug) << "Skipping unsupported file: " << entry.path().string();
                 continue;
             }
 
-#ifdef ENABLE_MMAP
-            // Get the file size
-            std::size_t size_bytes = std::filesystem::file_size(entry.path());
-
-            // Map the file to memory
-            boost::interprocess::file_mapping mapping(entry.path().string().c_str(),
-                                                       boost::interprocess::read_only);
-            boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
-
-            // Call the handler with the file contents
-            it->Handler(
-                entry.path().string(),
-                static_cast<const char*>(region.get_address()),
-                size_bytes,
-                subdirectory_depth
-            );
-#else
-            // Call the handler with the file contents
-            it->Handler(
-                entry.path().string(),
-                nullptr,
-                0,
-                subdirectory_depth
-            );
-#endif
+            handle_file(*file_type, entry.path().string(), subdirectory_depth);
         } else if (entry.is_directory()) {
             walk_directory(
                 supported_file_types,
@@ -80,5 +99,42 @@ void walk_directory(
     }
 }
 
+void list_supported_files(
+    const std::vector<SupportedFileType>& supported_file_types,
+    const std::string& path,
+    std::vector<std::string>& out_file_paths)
+{
+    out_file_paths.clear();
+
+    if (std::filesystem::is_regular_file(path)) {
+        if (find_file_type(supported_file_types, path)) {
+            out_file_paths.push_back(path);
+        }
+        return;
+    }
+
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(path)) {
+        if (entry.is_regular_file() && find_file_type(supported_file_types, entry.path())) {
+            out_file_paths.push_back(entry.path().string());
+        }
+    }
+
+    // Directory iteration order is unspecified, and every worker must agree
+    std::sort(out_file_paths.begin(), out_file_paths.end());
+}
+
+bool visit_file(
+    const std::vector<SupportedFileType>& supported_file_types,
+    const std::string& file_path)
+{
+    const SupportedFileType* file_type = find_file_type(supported_file_types, file_path);
+    if (!file_type) {
+        return false;
+    }
+
+    handle_file(*file_type, file_path, 0);
+    return true;
+}
+
 
 } // namespace analysis
@@ -29,6 +29,19 @@ void walk_directory(
     const std::string& path,
     int subdirectory_depth = 0);
 
+// Lists every supported file under `path` (or `path` itself if it is a file).
+// Sorted, so processes scanning the same tree get the same list.
+void list_supported_files(
+    const std::vector<SupportedFileType>& supported_file_types,
+    const std::string& path,
+    std::vector<std::string>& out_file_paths);
+
+// Calls the matching handler for one file.
+// Returns false if the file type is not supported.
+bool visit_file(
+    const std::vector<SupportedFileType>& supported_file_types,
+    const std::string& file_path);
+
 
 } // namespace analysis
 
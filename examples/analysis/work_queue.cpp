@@ -0,0 +1,278 @@
+#include "work_queue.hpp"
+#include "shared_file.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Lease Work Queue
+
+static const char* kManifestHeader = "analysis-queue 1";
+
+static std::string batch_name(int batch)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "batch-%06d", batch);
+    return name;
+}
+
+bool LeaseWorkQueue::Initialize(
+    const std::string& queue_dir,
+    const std::vector<std::string>& file_paths,
+    int batch_size,
+    int lease_seconds)
+{
+    QueueDir = queue_dir;
+    Worker = current_worker_id();
+    LeaseSeconds = lease_seconds;
+    ClaimedBatch = -1;
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(QueueDir) / "leases", ec);
+    std::filesystem::create_directories(std::filesystem::path(QueueDir) / "results", ec);
+    if (ec) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to create queue directory " << QueueDir << ": " << ec.message();
+        return false;
+    }
+
+    if (!PublishManifest(file_paths, batch_size) || !Open(queue_dir)) {
+        return false;
+    }
+
+    BOOST_LOG_TRIVIAL(info) << "Worker " << Worker << " joined queue " << QueueDir << " with " << Files.size() << " files in " << BatchCount() << " batches";
+    return true;
+}
+
+bool LeaseWorkQueue::PublishManifest(const std::vector<std::string>& file_paths, int batch_size)
+{
+    const std::filesystem::path manifest_path = std::filesystem::path(QueueDir) / "manifest";
+    if (std::filesystem::exists(manifest_path)) {
+        return true;
+    }
+
+    const std::string temp_path = temp_path_for(manifest_path.string());
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        out << kManifestHeader << "\n" << batch_size << "\n";
+        for (const auto& file_path : file_paths) {
+            out << file_path << "\n";
+        }
+        if (!out) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to write queue manifest: " << temp_path;
+            return false;
+        }
+    }
+
+    // A hard link fails if another worker published first, unlike rename
+    std::error_code ec;
+    std::filesystem::create_hard_link(temp_path, manifest_path, ec);
+    if (ec && !std::filesystem::exists(manifest_path)) {
+        // The filesystem may not support hard links
+        std::filesystem::rename(temp_path, manifest_path, ec);
+        if (ec) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to publish queue manifest: " << ec.message();
+            return false;
+        }
+    }
+    std::filesystem::remove(temp_path, ec);
+    return true;
+}
+
+bool LeaseWorkQueue::Open(const std::string& queue_dir)
+{
+    QueueDir = queue_dir;
+    if (Worker.empty()) {
+        Worker = current_worker_id();
+    }
+
+    const std::string manifest_path = (std::filesystem::path(QueueDir) / "manifest").string();
+
+    std::ifstream in(manifest_path);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != kManifestHeader || !std::getline(in, line)) {
+        BOOST_LOG_TRIVIAL(error) << "Not a queue manifest: " << manifest_path;
+        return false;
+    }
+
+    BatchSize = std::atoi(line.c_str());
+    if (BatchSize <= 0) {
+        BOOST_LOG_TRIVIAL(error) << "Bad batch size in queue manifest: " << manifest_path;
+        return false;
+    }
+
+    Files.clear();
+    while (std::getline(in, line)) {
+        if (!line.empty()) {
+            Files.push_back(line);
+        }
+    }
+    return true;
+}
+
+int LeaseWorkQueue::BatchCount() const
+{
+    return static_cast<int>( (Files.size() + BatchSize - 1) / BatchSize );
+}
+
+std::string LeaseWorkQueue::LeasePath(int batch) const
+{
+    return (std::filesystem::path(QueueDir) / "leases" / batch_name(batch)).string();
+}
+
+std::string LeaseWorkQueue::ResultsPath(int batch) const
+{
+    return (std::filesystem::path(QueueDir) / "results" / batch_name(batch)).string();
+}
+
+bool LeaseWorkQueue::TryAcquire(int batch)
+{
+    const std::string lease_path = LeasePath(batch);
+    if (create_exclusive(lease_path, Worker)) {
+        return true;
+    }
+
+    std::error_code ec;
+    if (!std::filesystem::exists(lease_path, ec)) {
+        // Released since we looked
+        return create_exclusive(lease_path, Worker);
+    }
+
+    std::string stale_worker;
+    if (!remove_stale_file(lease_path, LeaseSeconds, stale_worker)) {
+        return false;
+    }
+
+    BOOST_LOG_TRIVIAL(warning) << "Taking over expired lease on " << batch_name(batch) << " from " << stale_worker;
+    return create_exclusive(lease_path, Worker);
+}
+
+bool LeaseWorkQueue::ClaimBatch(int& batch, std::vector<std::string>& file_paths)
+{
+    // Poll often enough to notice expired leases soon after they expire
+    const auto poll_interval = std::chrono::seconds(std::max(1, std::min(LeaseSeconds / 4, 10)));
+
+    for (;;) {
+        bool pending = false;
+
+        for (int i = 0; i < BatchCount(); ++i) {
+            if (std::filesystem::exists(ResultsPath(i))) {
+                continue;
+            }
+            pending = true;
+
+            if (!TryAcquire(i)) {
+                continue;
+            }
+
+            // Another worker may have finished it just before we took the lease
+            if (std::filesystem::exists(ResultsPath(i))) {
+                std::error_code ec;
+                std::filesystem::remove(LeasePath(i), ec);
+                continue;
+            }
+
+            ClaimedBatch = i;
+            LastRenewal = std::chrono::steady_clock::now();
+
+            const size_t begin = static_cast<size_t>(i) * BatchSize;
+            const size_t end = std::min(Files.size(), begin + BatchSize);
+            file_paths.assign(Files.begin() + begin, Files.begin() + end);
+            batch = i;
+
+            BOOST_LOG_TRIVIAL(debug) << "Worker " << Worker << " claimed " << batch_name(i);
+            return true;
+        }
+
+        if (!pending) {
+            return false;
+        }
+
+        BOOST_LOG_TRIVIAL(debug) << "All remaining batches are leased, waiting";
+        std::this_thread::sleep_for(poll_interval);
+    }
+}
+
+bool LeaseWorkQueue::RenewLease()
+{
+    if (ClaimedBatch < 0) {
+        return false;
+    }
+
+    // Touching the file is cheap, but there is no need to do it constantly
+    const auto now = std::chrono::steady_clock::now();
+    if (now - LastRenewal < std::chrono::seconds(LeaseSeconds) / 4) {
+        return true;
+    }
+    LastRenewal = now;
+
+    const std::string lease_path = LeasePath(ClaimedBatch);
+    if (read_file(lease_path) != Worker) {
+        BOOST_LOG_TRIVIAL(warning) << "Lost the lease on " << batch_name(ClaimedBatch) << " to another worker";
+        return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::last_write_time(lease_path, std::filesystem::file_time_type::clock::now(), ec);
+    return !ec;
+}
+
+bool LeaseWorkQueue::CompleteBatch(const ScanResults& results)
+{
+    if (ClaimedBatch < 0) {
+        return false;
+    }
+
+    const bool written = results.Write(ResultsPath(ClaimedBatch));
+
+    // Leave the lease to expire if it now belongs to someone else
+    const std::string lease_path = LeasePath(ClaimedBatch);
+    if (read_file(lease_path) == Worker) {
+        std::error_code ec;
+        std::filesystem::remove(lease_path, ec);
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "Worker " << Worker << " finished " << batch_name(ClaimedBatch);
+    ClaimedBatch = -1;
+    return written;
+}
+
+bool merge_queue_results(
+    const std::string& queue_dir,
+    ScanResults& merged,
+    int& missing_batches)
+{
+    merged = ScanResults();
+    missing_batches = 0;
+
+    LeaseWorkQueue queue;
+    if (!queue.Open(queue_dir)) {
+        return false;
+    }
+
+    for (int i = 0; i < queue.BatchCount(); ++i) {
+        const std::string results_path = (std::filesystem::path(queue_dir) / "results" / batch_name(i)).string();
+        if (!std::filesystem::exists(results_path)) {
+            ++missing_batches;
+            continue;
+        }
+
+        ScanResults results;
+        if (!results.Read(results_path)) {
+            return false;
+        }
+        merged.Merge(results);
+    }
+
+    return true;
+}
+
+
+} // namespace analysis
@@ -0,0 +1,88 @@
+#ifndef WORK_QUEUE_HPP
+#define WORK_QUEUE_HPP
+
+#include "scan_results.hpp"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace analysis {
+
+
+//------------------------------------------------------------------------------
+// Lease Work Queue
+
+/*
+    Splits a scan across worker processes that share a queue directory, which
+    may be on a network filesystem so workers can run on several machines.
+
+        <queue-dir>/manifest           Batch size and the sorted file list
+        <queue-dir>/leases/batch-N     Worker currently processing batch N
+        <queue-dir>/results/batch-N    ScanResults for batch N, once finished
+
+    The first worker publishes the manifest and every later worker uses it,
+    so all workers agree on the batches.  A batch is claimed by creating its
+    lease file exclusively.  Workers touch their lease while they work, and a
+    lease that has not been touched for the lease duration is assumed to
+    belong to a dead worker and is taken over.  If a slow worker loses its
+    lease both workers produce the same results, so the race only wastes time.
+*/
+class LeaseWorkQueue
+{
+public:
+    // Creates or joins the queue.  `file_paths` is only used if this worker
+    // is the one to publish the manifest.
+    bool Initialize(
+        const std::string& queue_dir,
+        const std::vector<std::string>& file_paths,
+        int batch_size,
+        int lease_seconds);
+
+    // Reads the manifest of an existing queue without joining it as a worker
+    bool Open(const std::string& queue_dir);
+
+    // Claims a batch that has no results yet.  Waits while all remaining
+    // batches are leased by live workers.  Returns false once every batch
+    // has results.
+    bool ClaimBatch(int& batch, std::vector<std::string>& file_paths);
+
+    // Extends the lease on the claimed batch.  Cheap to call often.
+    // Returns false if another worker took the lease over.
+    bool RenewLease();
+
+    // Publishes results for the claimed batch and releases its lease
+    bool CompleteBatch(const ScanResults& results);
+
+    int BatchCount() const;
+
+    const std::string& WorkerId() const { return Worker; }
+
+protected:
+    std::string QueueDir;
+    std::string Worker;
+    int BatchSize = 0;
+    int LeaseSeconds = 0;
+    std::vector<std::string> Files;
+
+    int ClaimedBatch = -1;
+    std::chrono::steady_clock::time_point LastRenewal;
+
+    std::string LeasePath(int batch) const;
+    std::string ResultsPath(int batch) const;
+
+    bool PublishManifest(const std::vector<std::string>& file_paths, int batch_size);
+    bool TryAcquire(int batch);
+};
+
+// Combines the results of every batch in a queue directory.
+// `missing_batches` receives the number of batches without results.
+bool merge_queue_results(
+    const std::string& queue_dir,
+    ScanResults& merged,
+    int& missing_batches);
+
+
+} // namespace analysis
+
+#endif // WORK_QUEUE_HPP
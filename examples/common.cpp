@@ -82,6 +82,12 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             if (params.prompt.back() == '\n') {
                 params.prompt.pop_back();
             }
+        } else if (arg == "--prompt-cache") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.path_prompt_cache = argv[i];
         } else if (arg == "-n" || arg == "--n_predict") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -102,6 +108,44 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.n_ctx = std::stoi(argv[i]);
         } else if (arg == "--memory_f32") {
             params.memory_f16 = false;
+        } else if (arg == "--kv-type") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string type = argv[i];
+            if (type == "f32") {
+                params.kv_type = LLAMA_KV_TYPE_F32;
+            } else if (type == "f16") {
+                params.kv_type = LLAMA_KV_TYPE_F16;
+            } else if (type == "q8_0") {
+                params.kv_type = LLAMA_KV_TYPE_Q8_0;
+            } else if (type == "q4_0") {
+                params.kv_type = LLAMA_KV_TYPE_Q4_0;
+            } else {
+                fprintf(stderr, "error: unknown kv type '%s'\n", argv[i]);
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "--pooling") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string type = argv[i];
+            if (type == "last") {
+                params.pooling_type = LLAMA_POOLING_TYPE_LAST;
+            } else if (type == "mean") {
+                params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+            } else if (type == "none") {
+                params.pooling_type = LLAMA_POOLING_TYPE_NONE;
+            } else {
+                fprintf(stderr, "error: unknown pooling type '%s'\n", argv[i]);
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "--split-lines") {
+            params.embd_split_lines = true;
         } else if (arg == "--top_p") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -159,6 +203,10 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.use_color = true;
         } else if (arg == "--mlock") {
             params.use_mlock = true;
+        } else if (arg == "--pin-threads") {
+            params.pin_threads = true;
+        } else if (arg == "--fuse-weights") {
+            params.fuse_weights = true;
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
         } else if (arg == "--mtest") {
@@ -227,6 +275,8 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --in-prefix STRING    string to prefix user inputs with (default: empty)\n");
     fprintf(stderr, "  -f FNAME, --file FNAME\n");
     fprintf(stderr, "                        prompt file to start generation.\n");
+    fprintf(stderr, "  --prompt-cache FNAME  file to cache the evaluated prompt in, the longest matching prefix\n");
+    fprintf(stderr, "                        of a cached prompt is loaded instead of evaluated (default: none)\n");
     fprintf(stderr, "  -n N, --n_predict N   number of tokens to predict (default: %d, -1 = infinity)\n", params.n_predict);
     fprintf(stderr, "  --top_k N             top-k sampling (default: %d)\n", params.top_k);
     fprintf(stderr, "  --top_p N             top-p sampling (default: %.1f)\n", (double)params.top_p);
@@ -235,6 +285,9 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  -c N, --ctx_size N    size of the prompt context (default: %d)\n", params.n_ctx);
     fprintf(stderr, "  --ignore-eos          ignore end of stream token and continue generating\n");
     fprintf(stderr, "  --memory_f32          use f32 instead of f16 for memory key+value\n");
+    fprintf(stderr, "  --kv-type TYPE        memory key+value type: f32, f16, q8_0 or q4_0 (overrides --memory_f32)\n");
+    fprintf(stderr, "  --pooling TYPE        embedding of each input: last, mean or none (every token) (default: last)\n");
+    fprintf(stderr, "  --split-lines         embed every line of the prompt as a separate input\n");
     fprintf(stderr, "  --temp N              temperature (default: %.1f)\n", (double)params.temp);
     fprintf(stderr, "  --n_parts N           number of model parts (default: -1 = determine from dimensions)\n");
     fprintf(stderr, "  -b N, --batch_size N  batch size for prompt processing (default: %d)\n", params.n_batch);
@@ -243,6 +296,8 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     if (llama_mlock_supported()) {
         fprintf(stderr, "  --mlock               force system to keep model in RAM rather than swapping or compressing\n");
     }
+    fprintf(stderr, "  --pin-threads         pin each compute thread to a core\n");
+    fprintf(stderr, "  --fuse-weights        fuse the wq/wk/wv and w1/w3 weights of each layer (loads the model without mmap)\n");
     if (llama_mmap_supported()) {
         fprintf(stderr, "  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
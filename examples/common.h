@@ -32,16 +32,20 @@ struct gpt_params {
     std::string model  = "models/lamma-7B/ggml-model.bin"; // model path
     std::string prompt = "";
     std::string input_prefix = ""; // string to prefix user inputs with
+    std::string path_prompt_cache = ""; // file to save the evaluated prompt to and load it from
 
 
     std::vector<std::string> antiprompt; // string upon seeing which more user input is prompted
 
     bool memory_f16        = true;  // use f16 instead of f32 for memory kv
+    llama_kv_type kv_type  = LLAMA_KV_TYPE_DEFAULT; // memory kv type, overrides memory_f16
     bool random_prompt     = false; // do not randomize prompt if none provided
     bool use_color         = false; // use color to distinguish generations and inputs
     bool interactive       = false; // interactive mode
 
     bool embedding         = false; // get only sentence embedding
+    llama_pooling_type pooling_type = LLAMA_POOLING_TYPE_LAST; // how the embedding tool combines the hidden states
+    bool embd_split_lines  = false; // embedding tool: one embedding per prompt line instead of per prompt
     bool interactive_start = false; // wait for user input immediately
 
     bool instruct          = false; // instruction mode (used for Alpaca models)
@@ -49,6 +53,8 @@ struct gpt_params {
     bool perplexity        = false; // compute perplexity over the prompt
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool pin_threads       = false; // pin each compute thread to a core
+    bool fuse_weights      = false; // load the projections of each layer as fused matrices
     bool mem_test          = false; // compute maximum memory usage
     bool verbose_prompt    = false; // print prompt tokens before generation
 };
@@ -1,6 +1,8 @@
 #include "common.h"
 #include "llama.h"
 
+#include <sstream>
+
 int main(int argc, char ** argv) {
     gpt_params params;
     params.model = "models/llama-7B/ggml-model.bin";
@@ -37,10 +39,14 @@ int main(int argc, char ** argv) {
         lparams.n_parts    = params.n_parts;
         lparams.seed       = params.seed;
         lparams.f16_kv     = params.memory_f16;
+        lparams.kv_type    = params.kv_type;
         lparams.logits_all = params.perplexity;
         lparams.use_mmap   = params.use_mmap;
         lparams.use_mlock  = params.use_mlock;
-        lparams.embedding  = params.embedding;
+        lparams.pin_threads = params.pin_threads;
+        lparams.fuse_weights = params.fuse_weights;
+        lparams.embedding  = true; // the embeddings are the only output, llama_decode() keeps none without it
+        lparams.pooling_type = params.pooling_type;
 
         ctx = llama_init_from_file(params.model.c_str(), lparams);
 
@@ -57,42 +63,104 @@ int main(int argc, char ** argv) {
                 params.n_threads, std::thread::hardware_concurrency(), llama_print_system_info());
     }
 
-    int n_past = 0;
-
-    // Add a space in front of the first character to match OG llama tokenizer behavior
-    params.prompt.insert(0, 1, ' ');
-
-    // tokenize the prompt
-    auto embd_inp = ::llama_tokenize(ctx, params.prompt, true);
+    // the prompt is one input, or with --split-lines every line of it is a separate input with its own sequence
+    std::vector<std::string> lines;
+    if (params.embd_split_lines) {
+        std::istringstream prompt(params.prompt);
+        std::string line;
+        while (std::getline(prompt, line)) {
+            if (!line.empty()) {
+                lines.push_back(line);
+            }
+        }
+    } else {
+        lines.push_back(params.prompt);
+    }
 
-    // determine newline token
-    auto llama_token_newline = ::llama_tokenize(ctx, "\n", false);
+    std::vector<std::vector<llama_token>> inputs;
+    for (std::string & line : lines) {
+        // Add a space in front of the first character to match OG llama tokenizer behavior
+        line.insert(0, 1, ' ');
+        inputs.push_back(::llama_tokenize(ctx, line, true));
+    }
 
     if (params.verbose_prompt) {
         fprintf(stderr, "\n");
         fprintf(stderr, "%s: prompt: '%s'\n", __func__, params.prompt.c_str());
-        fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
-        for (int i = 0; i < (int) embd_inp.size(); i++) {
-            fprintf(stderr, "%6d -> '%s'\n", embd_inp[i], llama_token_to_str(ctx, embd_inp[i]));
+        for (const auto & inp : inputs) {
+            fprintf(stderr, "%s: number of tokens in input = %zu\n", __func__, inp.size());
+            for (int i = 0; i < (int) inp.size(); i++) {
+                fprintf(stderr, "%6d -> '%s'\n", inp[i], llama_token_to_str(ctx, inp[i]));
+            }
         }
         fprintf(stderr, "\n");
     }
 
-    if (params.embedding){
-        if (embd_inp.size() > 0) {
-            if (llama_eval(ctx, embd_inp.data(), embd_inp.size(), n_past, params.n_threads)) {
-                fprintf(stderr, "%s : failed to eval\n", __func__);
-                return 1;
+    const int n_ctx  = llama_n_ctx(ctx);
+    const int n_embd = llama_n_embd(ctx);
+
+    // inputs are packed into batches that fill the context, without computing any logits
+    std::vector<llama_token>  batch_token;
+    std::vector<llama_pos>    batch_pos;
+    std::vector<llama_seq_id> batch_seq_id;
+
+    size_t i_next = 0;
+    while (i_next < inputs.size()) {
+        const size_t i_first = i_next;
+
+        batch_token.clear();
+        batch_pos.clear();
+        batch_seq_id.clear();
+
+        while (i_next < inputs.size() && batch_token.size() + inputs[i_next].size() <= (size_t) n_ctx) {
+            for (int j = 0; j < (int) inputs[i_next].size(); j++) {
+                batch_token.push_back(inputs[i_next][j]);
+                batch_pos.push_back(j);
+                batch_seq_id.push_back((llama_seq_id) (i_next - i_first));
             }
+            i_next++;
         }
 
-        const int n_embd = llama_n_embd(ctx);
-        const auto embeddings = llama_get_embeddings(ctx);
+        if (i_next == i_first) {
+            fprintf(stderr, "%s: input %zu is longer than the context (%zu tokens)\n", __func__, i_first, inputs[i_first].size());
+            return 1;
+        }
 
-        for (int i = 0; i < n_embd; i++) {
-            printf("%f ", embeddings[i]);
+        llama_batch batch = {
+            /*.n_tokens =*/ (int) batch_token.size(),
+            /*.token    =*/ batch_token.data(),
+            /*.pos      =*/ batch_pos.data(),
+            /*.seq_id   =*/ batch_seq_id.data(),
+            /*.logits   =*/ nullptr,
+        };
+
+        if (llama_decode(ctx, batch, params.n_threads) != 0) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            return 1;
         }
-        printf("\n");
+
+        for (int t = 0; t < batch.n_tokens; t++) {
+            const float * embeddings = nullptr;
+            if (params.pooling_type == LLAMA_POOLING_TYPE_NONE) {
+                embeddings = llama_get_embeddings_ith(ctx, t);
+            } else if (t == batch.n_tokens - 1 || batch_seq_id[t + 1] != batch_seq_id[t]) {
+                embeddings = llama_get_embeddings_seq(ctx, batch_seq_id[t]);
+            } else {
+                continue;
+            }
+
+            if (embeddings == nullptr) {
+                fprintf(stderr, "%s : no embeddings for token %d of input %zu\n", __func__, t, i_first + batch_seq_id[t]);
+                return 1;
+            }
+
+            for (int j = 0; j < n_embd; j++) {
+                printf("%f ", embeddings[j]);
+            }
+            printf("\n");
+        }
+
+        llama_kv_cache_clear(ctx);
     }
 
     llama_print_timings(ctx);
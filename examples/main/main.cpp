@@ -6,6 +6,7 @@
 #include "common.h"
 #include "llama.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 #include <cmath>
@@ -102,8 +103,11 @@ int main(int argc, char ** argv) {
         lparams.n_parts    = params.n_parts;
         lparams.seed       = params.seed;
         lparams.f16_kv     = params.memory_f16;
+        lparams.kv_type    = params.kv_type;
         lparams.use_mmap   = params.use_mmap;
         lparams.use_mlock  = params.use_mlock;
+        lparams.pin_threads = params.pin_threads;
+        lparams.fuse_weights = params.fuse_weights;
 
         ctx = llama_init_from_file(params.model.c_str(), lparams);
 
@@ -152,6 +156,39 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // reuse the longest prefix of the prompt that is in the prompt cache
+    std::vector<llama_token> session_tokens;
+    int n_session_reuse = 0;
+
+    if (!params.path_prompt_cache.empty()) {
+        FILE * fp = std::fopen(params.path_prompt_cache.c_str(), "rb");
+        if (fp != NULL) {
+            std::fclose(fp);
+
+            session_tokens.resize(n_ctx);
+            size_t n_token_count = 0;
+            if (llama_load_session_file(ctx, params.path_prompt_cache.c_str(), session_tokens.data(), session_tokens.size(), &n_token_count)) {
+                session_tokens.resize(n_token_count);
+            } else {
+                session_tokens.clear();
+            }
+        }
+
+        // the last prompt token is always evaluated to get its logits
+        while (n_session_reuse < (int) session_tokens.size() && n_session_reuse + 1 < (int) embd_inp.size() &&
+               session_tokens[n_session_reuse] == embd_inp[n_session_reuse]) {
+            n_session_reuse++;
+        }
+
+        // drop the cached tokens after the common prefix
+        llama_kv_cache_seq_rm(ctx, -1, n_session_reuse, -1);
+
+        fprintf(stderr, "%s: prompt cache '%s': reusing %d of %zu prompt tokens\n", __func__,
+                params.path_prompt_cache.c_str(), n_session_reuse, embd_inp.size());
+    }
+
+    bool need_to_save_prompt_cache = !params.path_prompt_cache.empty() && session_tokens != embd_inp;
+
     // number of tokens to keep when resetting context
     if (params.n_keep < 0 || params.n_keep > (int)embd_inp.size() || params.instruct) {
         params.n_keep = (int)embd_inp.size();
@@ -244,30 +281,35 @@ int main(int argc, char ** argv) {
     // the first thing we will do is to output the prompt, so set color accordingly
     set_console_color(con_st, CONSOLE_COLOR_PROMPT);
 
+    // the reused part of the prompt is already in the KV cache
+    for (; n_consumed < n_session_reuse; ++n_consumed) {
+        last_n_tokens.erase(last_n_tokens.begin());
+        last_n_tokens.push_back(embd_inp[n_consumed]);
+        printf("%s", llama_token_to_str(ctx, embd_inp[n_consumed]));
+        n_past++;
+    }
+
     std::vector<llama_token> embd;
 
     while (n_remain != 0 || params.interactive) {
         // predict
         if (embd.size() > 0) {
-            // infinite text generation via context swapping
+            // infinite text generation via context shifting
             // if we run out of context:
-            // - take the n_keep first tokens from the original prompt (via n_past)
-            // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in a batch
+            // - keep the n_keep first tokens from the original prompt
+            // - drop half of the remaining tokens from the KV cache
+            // - shift the positions of the rest down so they follow the kept ones, without re-evaluating them
             if (n_past + (int) embd.size() > n_ctx) {
-                const int n_left = n_past - params.n_keep;
+                const int n_left    = n_past - params.n_keep;
+                const int n_discard = std::max(n_left/2, n_past + (int) embd.size() - n_ctx);
 
-                n_past = params.n_keep;
-
-                // insert n_left/2 tokens at the start of embd from last_n_tokens
-                embd.insert(embd.begin(), last_n_tokens.begin() + n_ctx - n_left/2 - embd.size(), last_n_tokens.end() - embd.size());
+                llama_kv_cache_seq_rm(ctx, 0, params.n_keep, params.n_keep + n_discard);
+                if (!llama_kv_cache_seq_shift(ctx, 0, params.n_keep + n_discard, n_past, -n_discard)) {
+                    fprintf(stderr, "%s : failed to shift the context\n", __func__);
+                    return 1;
+                }
 
-                //printf("\n---\n");
-                //printf("resetting: '");
-                //for (int i = 0; i < (int) embd.size(); i++) {
-                //    printf("%s", llama_token_to_str(ctx, embd[i]));
-                //}
-                //printf("'\n");
-                //printf("\n---\n");
+                n_past -= n_discard;
             }
 
             if (llama_eval(ctx, embd.data(), embd.size(), n_past, params.n_threads)) {
@@ -279,6 +321,12 @@ int main(int argc, char ** argv) {
         n_past += embd.size();
         embd.clear();
 
+        // save the prompt as soon as all of it has been evaluated
+        if (need_to_save_prompt_cache && (int) embd_inp.size() <= n_consumed) {
+            need_to_save_prompt_cache = false;
+            llama_save_session_file(ctx, params.path_prompt_cache.c_str(), embd_inp.data(), n_past);
+        }
+
         if ((int) embd_inp.size() <= n_consumed && !is_interacting) {
             // out of user input, sample next token
             const int32_t top_k          = params.top_k;
@@ -114,9 +114,12 @@ int main(int argc, char ** argv) {
         lparams.n_parts    = params.n_parts;
         lparams.seed       = params.seed;
         lparams.f16_kv     = params.memory_f16;
+        lparams.kv_type    = params.kv_type;
         lparams.logits_all = params.perplexity;
         lparams.use_mmap   = params.use_mmap;
         lparams.use_mlock  = params.use_mlock;
+        lparams.pin_threads = params.pin_threads;
+        lparams.fuse_weights = params.fuse_weights;
         lparams.embedding  = params.embedding;
 
         ctx = llama_init_from_file(params.model.c_str(), lparams);
@@ -70,6 +70,45 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef CRITICAL_SECTION   pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -77,6 +116,11 @@ static int sched_yield (void) {
 typedef void* thread_ret_t;
 #endif
 
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#endif
+
 // __FMA__ and __F16C__ are not defined in MSVC, however they are implied with AVX2/AVX512
 #if defined(_MSC_VER) && (defined(__AVX2__) || defined(__AVX512F__))
 #ifndef __FMA__
@@ -502,6 +546,15 @@ typedef struct {
 } block_q4_1;
 static_assert(sizeof(block_q4_1) == sizeof(float) * 2 + QK / 2, "wrong q4_1 block size/padding");
 
+// blocks of QK elements
+// represented with a single float (delta) and QK 8-bit signed integer factors
+// used for the KV cache, where 4 bits lose too much of the attention
+typedef struct {
+    float  d;      // delta
+    int8_t qs[QK]; // quants
+} block_q8_0;
+static_assert(sizeof(block_q8_0) == sizeof(float) + QK, "wrong q8_0 block size/padding");
+
 // reference implementation for deterministic creation of model files
 static void quantize_row_q4_0_reference(const float * restrict x, block_q4_0 * restrict y, int k) {
     assert(k % QK == 0);
@@ -1178,6 +1231,48 @@ static void dequantize_row_q4_1(const void * restrict vx, float * restrict y, in
 #endif
 }
 
+static void quantize_row_q8_0_reference(const float * restrict x, block_q8_0 * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+
+        for (int l = 0; l < QK; l++) {
+            const float v = x[i*QK + l];
+            amax = MAX(amax, fabsf(v));
+        }
+
+        const float d = amax / ((1 << 7) - 1);
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = d;
+
+        for (int l = 0; l < QK; ++l) {
+            y[i].qs[l] = (int8_t) roundf(x[i*QK + l]*id);
+        }
+    }
+}
+
+static void quantize_row_q8_0(const float * restrict x, void * restrict vy, int k) {
+    quantize_row_q8_0_reference(x, vy, k);
+}
+
+static void dequantize_row_q8_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    const block_q8_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = x[i].d;
+
+        for (int l = 0; l < QK; ++l) {
+            y[i*QK + l] = x[i].qs[l]*d;
+        }
+    }
+}
+
 //
 // simd mappings
 //
@@ -1742,6 +1837,71 @@ inline static void ggml_vec_dot_f32(const int n, float * restrict s, const float
     *s = sumf;
 }
 
+#if __AVX2__ && QK == 32
+static inline __m256 dot_q4_0_oneblock_avx2(
+    __m256 acc,
+    const block_q4_0 * restrict x,
+    const block_q4_0 * restrict y,
+    int i
+) {
+    /* Prepare the constants we will need during execution */
+    const __m256i lowMask = _mm256_set1_epi8( 0xF );
+    const __m256i offset_8 = _mm256_set1_epi16( 8 );
+
+    /* Compute combined scale for the block */
+    const __m256 scale = _mm256_mul_ps(
+            _mm256_broadcast_ss( &x[i].d ),
+            _mm256_broadcast_ss( &y[i].d ) );
+
+    /* get input from x
+       Input: 32 Nibbles (16 bytes) at *x[i]
+       Output: 2 vectors with 16 values of type int16_t (x_high_q, x_low_q) */
+
+    /* Load 16 bytes from memory */
+    const __m128i tmp_x = _mm_loadu_si128( ( const __m128i* ) x[i].qs);
+    /* Expand bytes into uint16_t values */
+    const __m256i bytes_x = _mm256_cvtepu8_epi16(tmp_x);
+    /* Unpack values into individual bytes */
+    __m256i x_low_q = _mm256_and_si256( lowMask, bytes_x );
+    const __m256i pre_shift_x_high_q = _mm256_andnot_si256( lowMask, bytes_x );
+    __m256i x_high_q = _mm256_srli_epi16( pre_shift_x_high_q, 4 );
+    /* Now we have two vectors with bytes in [ 0 .. 15 ] interval.  Offset them into [ -8 .. +7 ] interval.  */
+    x_high_q = _mm256_sub_epi16( x_high_q, offset_8 );
+    x_low_q = _mm256_sub_epi16( x_low_q, offset_8 );
+
+    /* get input from y
+       Input: 32 Nibbles (16 bytes) at *y[i]
+       Output: 2 vectors with 16 values of type int16_t (y_high_q, y_low_q) */
+
+    /* Load 16 bytes from memory */
+    const __m128i tmp_y = _mm_loadu_si128( (const __m128i* ) y[i].qs);
+    /* Expand bytes into uint16_t values */
+    const __m256i bytes_y = _mm256_cvtepu8_epi16(tmp_y);
+    /* Unpack values into individual bytes */
+    const __m256i pre_shift_y_high_q = _mm256_andnot_si256( lowMask, bytes_y );
+    __m256i y_high_q = _mm256_srli_epi16( pre_shift_y_high_q, 4 );
+    __m256i y_low_q = _mm256_and_si256( lowMask, bytes_y );
+    /* Now we have two vectors with bytes in [ 0 .. 15 ] interval.  Offset them into [ -8 .. +7 ] interval.  */
+    y_high_q = _mm256_sub_epi16( y_high_q, offset_8 );
+    y_low_q = _mm256_sub_epi16( y_low_q, offset_8 );
+
+    /* Compute products of int16_t integers, add pairwise, store as int32_t */
+    __m256i xy_high_q = _mm256_madd_epi16( x_high_q, y_high_q );
+    __m256i xy_low_q = _mm256_madd_epi16( x_low_q, y_low_q );
+
+    /* Accumulate the products of int32_t integers -> we now have a vector of 8 int_32t */
+    __m256i xy_q = _mm256_add_epi32( xy_high_q, xy_low_q );
+
+    /* Convert to vectore of 8 int32_t to 8 floats */
+    __m256 q = _mm256_cvtepi32_ps( xy_q );
+
+    /* Multiply q with scale and accumulate */
+    acc = _mm256_fmadd_ps( scale, q, acc );
+
+    return acc;
+}
+#endif
+
 #if __AVX512F__ && QK == 32
 static inline __m512 dot_q4_0_oneblock_avx512(
     __m512 acc,
@@ -1946,70 +2106,22 @@ static void ggml_vec_dot_q4_0(const int n, float * restrict s, const void * rest
     // Initialize accumulator with zeros
     __m256 acc = _mm256_setzero_ps();
 
-    /* Prepare the constants we will need during execution */
-    const __m256i lowMask = _mm256_set1_epi8( 0xF );
-    const __m256i offset_8 = _mm256_set1_epi16( 8 );
-
 #define UNROLL_COUNT 8
-    // make sure we only unroll multiples of the block count
-    assert(nb % UNROLL_COUNT == 0);
+    // unroll whole groups of blocks, the remaining blocks are done one at a time
+    const int nb_unrolled = nb - nb % UNROLL_COUNT;
 
     // Main loop
-    for (int i = 0; i < nb; i+=UNROLL_COUNT) {
+    for (int i = 0; i < nb_unrolled; i+=UNROLL_COUNT) {
         // This loop will be unrolled by the compiler
         for (int u=0;u<UNROLL_COUNT;u++)  {
-            /* Compute combined scale for the block */
-            const __m256 scale = _mm256_mul_ps(
-                    _mm256_broadcast_ss( &x[i+u].d ),
-                    _mm256_broadcast_ss( &y[i+u].d ) );
-
-            /* get input from x
-               Input: 32 Nibbles (16 bytes) at *x[i+u]
-               Output: 2 vectors with 16 values of type int16_t (x_high_q, x_low_q) */
-
-            /* Load 16 bytes from memory */
-            const __m128i tmp_x = _mm_loadu_si128( ( const __m128i* ) x[i+u].qs);
-            /* Expand bytes into uint16_t values */
-            const __m256i bytes_x = _mm256_cvtepu8_epi16(tmp_x);
-            /* Unpack values into individual bytes */
-            __m256i x_low_q = _mm256_and_si256( lowMask, bytes_x );
-            const __m256i pre_shift_x_high_q = _mm256_andnot_si256( lowMask, bytes_x );
-            __m256i x_high_q = _mm256_srli_epi16( pre_shift_x_high_q, 4 );
-            /* Now we have two vectors with bytes in [ 0 .. 15 ] interval.  Offset them into [ -8 .. +7 ] interval.  */
-            x_high_q = _mm256_sub_epi16( x_high_q, offset_8 );
-            x_low_q = _mm256_sub_epi16( x_low_q, offset_8 );
-
-            /* get input from y
-               Input: 32 Nibbles (16 bytes) at *y[i+u]
-               Output: 2 vectors with 16 values of type int16_t (y_high_q, y_low_q) */
-
-            /* Load 16 bytes from memory */
-            const __m128i tmp_y = _mm_loadu_si128( (const __m128i* ) y[i+u].qs);
-            /* Expand bytes into uint16_t values */
-            const __m256i bytes_y = _mm256_cvtepu8_epi16(tmp_y);
-            /* Unpack values into individual bytes */
-            const __m256i pre_shift_y_high_q = _mm256_andnot_si256( lowMask, bytes_y );
-            __m256i y_high_q = _mm256_srli_epi16( pre_shift_y_high_q, 4 );
-            __m256i y_low_q = _mm256_and_si256( lowMask, bytes_y );
-            /* Now we have two vectors with bytes in [ 0 .. 15 ] interval.  Offset them into [ -8 .. +7 ] interval.  */
-            y_high_q = _mm256_sub_epi16( y_high_q, offset_8 );
-            y_low_q = _mm256_sub_epi16( y_low_q, offset_8 );
-
-            /* Compute products of int16_t integers, add pairwise, store as int32_t */
-            __m256i xy_high_q = _mm256_madd_epi16( x_high_q, y_high_q );
-            __m256i xy_low_q = _mm256_madd_epi16( x_low_q, y_low_q );
-
-            /* Accumulate the products of int32_t integers -> we now have a vector of 8 int_32t */
-            __m256i xy_q = _mm256_add_epi32( xy_high_q, xy_low_q );
-
-            /* Convert to vectore of 8 int32_t to 8 floats */
-            __m256 q = _mm256_cvtepi32_ps( xy_q );
-
-            /* Multiply q with scale and accumulate */
-            acc = _mm256_fmadd_ps( scale, q, acc );
+            acc = dot_q4_0_oneblock_avx2( acc, x, y, i+u );
         }
     }
 
+    for (int i = nb_unrolled; i < nb; ++i) {
+        acc = dot_q4_0_oneblock_avx2( acc, x, y, i );
+    }
+
     // Return horizontal sum of the acc vector
     __m128 res = _mm256_extractf128_ps( acc, 1 );
     res = _mm_add_ps( res, _mm256_castps256_ps128( acc ) );
@@ -2318,6 +2430,214 @@ static void ggml_vec_dot_q4_1(const int n, float * restrict s, const void * rest
     *s = sumf;
 }
 
+static void ggml_vec_dot_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    float sumf = 0.0;
+
+#if defined(__AVX2__)
+    // Initialize accumulator with zeros
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        // Compute combined scale for the block
+        const __m256 d = _mm256_mul_ps( _mm256_broadcast_ss( &x[i].d ), _mm256_broadcast_ss( &y[i].d ) );
+
+        const __m256i bx = _mm256_loadu_si256( (const __m256i *) x[i].qs );
+        const __m256i by = _mm256_loadu_si256( (const __m256i *) y[i].qs );
+
+        // Get absolute values of x vectors
+        const __m256i ax = _mm256_sign_epi8( bx, bx );
+
+        // Sign the values of the y vectors
+        const __m256i sy = _mm256_sign_epi8( by, bx );
+
+        // Perform multiplication and create 16-bit values, the quants are in [-127, 127] so this cannot saturate
+        const __m256i dot = _mm256_maddubs_epi16( ax, sy );
+
+        const __m256i ones = _mm256_set1_epi16( 1 );
+        const __m256i i32 = _mm256_madd_epi16( ones, dot );
+
+        // Convert int32_t to float, apply the scale and accumulate
+        acc = _mm256_fmadd_ps( d, _mm256_cvtepi32_ps( i32 ), acc );
+    }
+
+    // Return horizontal sum of the acc vector
+    __m128 res = _mm256_extractf128_ps( acc, 1 );
+    res = _mm_add_ps( res, _mm256_castps256_ps128( acc ) );
+    res = _mm_add_ps( res, _mm_movehl_ps( res, res ) );
+    res = _mm_add_ss( res, _mm_movehdup_ps( res ) );
+
+    sumf = _mm_cvtss_f32( res );
+#elif defined(__ARM_NEON)
+    for (int i = 0; i < nb; i++) {
+        const int8x16_t x0 = vld1q_s8(x[i].qs);
+        const int8x16_t x1 = vld1q_s8(x[i].qs + 16);
+        const int8x16_t y0 = vld1q_s8(y[i].qs);
+        const int8x16_t y1 = vld1q_s8(y[i].qs + 16);
+
+        const int16x8_t p0 = vmull_s8(vget_low_s8 (x0), vget_low_s8 (y0));
+        const int16x8_t p1 = vmull_s8(vget_high_s8(x0), vget_high_s8(y0));
+        const int16x8_t p2 = vmull_s8(vget_low_s8 (x1), vget_low_s8 (y1));
+        const int16x8_t p3 = vmull_s8(vget_high_s8(x1), vget_high_s8(y1));
+
+        const int32x4_t p = vaddq_s32(
+                vaddq_s32(vpaddlq_s16(p0), vpaddlq_s16(p1)),
+                vaddq_s32(vpaddlq_s16(p2), vpaddlq_s16(p3)));
+
+        sumf += x[i].d*y[i].d*vaddvq_s32(p);
+    }
+#else
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        const int8_t * restrict p0 = x[i].qs;
+        const int8_t * restrict p1 = y[i].qs;
+
+        int sumi = 0;
+        for (int j = 0; j < QK; j++) {
+            sumi += p0[j]*p1[j];
+        }
+
+        sumf += x[i].d*y[i].d*sumi;
+    }
+#endif
+
+    *s = sumf;
+}
+
+// dot products of a quantized row x with an F32 row y, dequantizing x on the fly
+// used where y is an activation that would lose too much if it was quantized, e.g. in the attention
+
+#if defined(__AVX2__)
+// horizontal sum of the 8 floats of x
+static inline float hsum_float_8(const __m256 x) {
+    __m128 res = _mm256_extractf128_ps(x, 1);
+    res = _mm_add_ps(res, _mm256_castps256_ps128(x));
+    res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+    res = _mm_add_ss(res, _mm_movehdup_ps(res));
+    return _mm_cvtss_f32(res);
+}
+
+// sum of the products of 32 signed 8-bit ints with 32 floats
+static inline __m256 mul_sum_i8_f32(const __m256i x8, const float * restrict y) {
+    const __m256i x16_lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(x8));
+    const __m256i x16_hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(x8, 1));
+
+    __m256 p = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(x16_lo))), _mm256_loadu_ps(y +  0));
+    p = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(x16_lo, 1))), _mm256_loadu_ps(y +  8), p);
+    p = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(x16_hi))),      _mm256_loadu_ps(y + 16), p);
+    p = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(x16_hi, 1))), _mm256_loadu_ps(y + 24), p);
+
+    return p;
+}
+#endif
+
+static void ggml_vec_dot_q4_0_f32(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const float      * restrict y = vy;
+
+    float sumf = 0.0;
+
+#if defined(__AVX2__) && QK == 32
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; i++) {
+        const __m256i x8 = _mm256_sub_epi8(bytesFromNibbles(x[i].qs), _mm256_set1_epi8(8));
+
+        acc = _mm256_fmadd_ps(_mm256_broadcast_ss(&x[i].d), mul_sum_i8_f32(x8, y + i*QK), acc);
+    }
+
+    sumf = hsum_float_8(acc);
+#else
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        const uint8_t * restrict pp = x[i].qs;
+
+        float sumi = 0.0f;
+        for (int l = 0; l < QK; l += 2) {
+            sumi += ((pp[l/2] & 0xf) - 8)*y[i*QK + l + 0];
+            sumi += ((pp[l/2] >>  4) - 8)*y[i*QK + l + 1];
+        }
+
+        sumf += x[i].d*sumi;
+    }
+#endif
+
+    *s = sumf;
+}
+
+static void ggml_vec_dot_q4_1_f32(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+
+    const block_q4_1 * restrict x = vx;
+    const float      * restrict y = vy;
+
+    float sumf = 0.0;
+
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        const uint8_t * restrict pp = x[i].qs;
+
+        float sumi = 0.0f;
+        float sumy = 0.0f;
+        for (int l = 0; l < QK; l += 2) {
+            sumi += (pp[l/2] & 0xf)*y[i*QK + l + 0];
+            sumi += (pp[l/2] >>  4)*y[i*QK + l + 1];
+            sumy += y[i*QK + l + 0] + y[i*QK + l + 1];
+        }
+
+        sumf += x[i].d*sumi + x[i].m*sumy;
+    }
+
+    *s = sumf;
+}
+
+static void ggml_vec_dot_q8_0_f32(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK;
+
+    assert(n % QK == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const float      * restrict y = vy;
+
+    float sumf = 0.0;
+
+#if defined(__AVX2__) && QK == 32
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; i++) {
+        const __m256i x8 = _mm256_loadu_si256((const __m256i *) x[i].qs);
+
+        acc = _mm256_fmadd_ps(_mm256_broadcast_ss(&x[i].d), mul_sum_i8_f32(x8, y + i*QK), acc);
+    }
+
+    sumf = hsum_float_8(acc);
+#else
+    // scalar
+    for (int i = 0; i < nb; i++) {
+        float sumi = 0.0f;
+        for (int l = 0; l < QK; l++) {
+            sumi += x[i].qs[l]*y[i*QK + l];
+        }
+
+        sumf += x[i].d*sumi;
+    }
+#endif
+
+    *s = sumf;
+}
+
 // compute GGML_VEC_DOT_UNROLL dot products at once
 // xs - x row stride in bytes
 inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
@@ -2502,6 +2822,91 @@ inline static void ggml_vec_silu_f32(const int n, float * y, const float * x) {
 }
 #endif
 
+// exp(x) for 8 or 4 values at a time: x = n*ln(2) + r with |r| <= ln(2)/2, exp(r) is a
+// polynomial (Cephes) and 2^n is built in the exponent bits. the result is 0 below -88
+#if defined(__AVX2__) && defined(__FMA__)
+inline static __m256 ggml_v_expf(__m256 x) {
+    x = _mm256_min_ps(x, _mm256_set1_ps( 88.0f));
+    x = _mm256_max_ps(x, _mm256_set1_ps(-88.0f));
+
+    const __m256 fx = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(0.5f)));
+
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps( 0.693359375f),    x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+inline static float32x4_t ggml_v_expf(float32x4_t x) {
+    x = vminq_f32(x, vdupq_n_f32( 88.0f));
+    x = vmaxq_f32(x, vdupq_n_f32(-88.0f));
+
+    const float32x4_t fx = vrndmq_f32(vfmaq_f32(vdupq_n_f32(0.5f), x, vdupq_n_f32(1.44269504088896341f)));
+
+    x = vfmsq_f32(x, fx, vdupq_n_f32( 0.693359375f));
+    x = vfmsq_f32(x, fx, vdupq_n_f32(-2.12194440e-4f));
+
+    float32x4_t y = vdupq_n_f32(1.9875691500e-4f);
+    y = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), y, x);
+    y = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), y, x);
+    y = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), y, x);
+    y = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), y, x);
+    y = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), y, x);
+    y = vfmaq_f32(vaddq_f32(x, vdupq_n_f32(1.0f)), y, vmulq_f32(x, x));
+
+    const int32x4_t e = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(fx), vdupq_n_s32(127)), 23);
+
+    return vmulq_f32(y, vreinterpretq_f32_s32(e));
+}
+#endif
+
+// y = exp(x - max), returns the sum of y
+inline static ggml_float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max) {
+    int i = 0;
+    ggml_float sum = 0.0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 7 < n; i += 8) {
+        const __m256 val = ggml_v_expf(_mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_set1_ps(max)));
+        _mm256_storeu_ps(y + i, val);
+        acc = _mm256_add_ps(acc, val);
+    }
+
+    float tmp[8];
+    _mm256_storeu_ps(tmp, acc);
+    for (int k = 0; k < 8; ++k) {
+        sum += (ggml_float)tmp[k];
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 3 < n; i += 4) {
+        const float32x4_t val = ggml_v_expf(vsubq_f32(vld1q_f32(x + i), vdupq_n_f32(max)));
+        vst1q_f32(y + i, val);
+        acc = vaddq_f32(acc, val);
+    }
+    sum += (ggml_float)vaddvq_f32(acc);
+#endif
+
+    for (; i < n; ++i) {
+        const float val = expf(x[i] - max);
+        sum += (ggml_float)val;
+        y[i] = val;
+    }
+
+    return sum;
+}
+
 inline static void ggml_vec_sum_f32(const int n, float * s, const float * x) {
 #ifndef GGML_USE_ACCELERATE
     ggml_float sum = 0.0;
@@ -2567,8 +2972,9 @@ static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
     [GGML_TYPE_I8]   = 1,
     [GGML_TYPE_I16]  = 1,
     [GGML_TYPE_I32]  = 1,
+    [GGML_TYPE_Q8_0] = QK,
 };
-static_assert(GGML_TYPE_COUNT == 7, "GGML_BLCK_SIZE is outdated");
+static_assert(GGML_TYPE_COUNT == 8, "GGML_BLCK_SIZE is outdated");
 
 static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     [GGML_TYPE_F32]  = sizeof(float),
@@ -2578,8 +2984,9 @@ static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     [GGML_TYPE_I8]   = sizeof(int8_t),
     [GGML_TYPE_I16]  = sizeof(int16_t),
     [GGML_TYPE_I32]  = sizeof(int32_t),
+    [GGML_TYPE_Q8_0] = sizeof(block_q8_0),
 };
-static_assert(GGML_TYPE_COUNT == 7, "GGML_TYPE_SIZE is outdated");
+static_assert(GGML_TYPE_COUNT == 8, "GGML_TYPE_SIZE is outdated");
 
 static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "NONE",
@@ -2608,6 +3015,7 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
 
     "SCALE",
     "CPY",
+    "SET_COLS",
     "CONT",
     "RESHAPE",
     "VIEW",
@@ -2622,9 +3030,10 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
 
     "FLASH_ATTN",
     "FLASH_FF",
+    "ATTN_DECODE",
 };
 
-static_assert(GGML_OP_COUNT == 36, "GGML_OP_COUNT != 36");
+static_assert(GGML_OP_COUNT == 38, "GGML_OP_COUNT != 38");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -2653,6 +3062,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
 
     "x*v",
     "x-\\>y",
+    "set_cols(x)",
     "cont(x)",
     "reshape(x)",
     "view(x)",
@@ -2667,9 +3077,10 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
 
     "flash_attn(x)",
     "flash_ff(x)",
+    "attn_decode(x)",
 };
 
-static_assert(GGML_OP_COUNT == 36, "GGML_OP_COUNT != 36");
+static_assert(GGML_OP_COUNT == 38, "GGML_OP_COUNT != 38");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -2691,6 +3102,7 @@ struct ggml_context {
 
     struct ggml_scratch scratch;
     struct ggml_scratch scratch_save;
+    bool   scratch_saved; // between ggml_scratch_save and ggml_scratch_load
 };
 
 struct ggml_context_container {
@@ -2874,6 +3286,17 @@ static inline bool ggml_can_repeat(const struct ggml_tensor * t0, const struct g
         (t1->ne[3]%t0->ne[3] == 0);
 }
 
+// check if t0 can be repeated to the shape of t1 (dims 1, 2 and 3 are broadcast)
+static inline bool ggml_can_broadcast(const struct ggml_tensor * t0, const struct ggml_tensor * t1) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return
+        (t0->ne[0] == t1->ne[0]) &&
+        (t0->ne[1] == t1->ne[1] || t0->ne[1] == 1) &&
+        (t0->ne[2] == t1->ne[2] || t0->ne[2] == 1) &&
+        (t0->ne[3] == t1->ne[3] || t0->ne[3] == 1);
+}
+
 static inline int ggml_up32(int n) {
     return (n + 31) & ~31;
 }
@@ -2974,6 +3397,7 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         /*.objects_end        =*/ NULL,
         /*.scratch            =*/ { 0, 0, NULL, },
         /*.scratch_save       =*/ { 0, 0, NULL, },
+        /*.scratch_saved      =*/ false,
     };
 
     GGML_ASSERT(ctx->mem_buffer != NULL); // check for allocation failure
@@ -3196,13 +3620,33 @@ struct ggml_tensor * ggml_new_tensor_4d(
     return ggml_new_tensor(ctx, type, 4, ne);
 }
 
+// tensors whose data is set when the graph is built are kept out of the scratch buffer,
+// where an op that is computed earlier could overwrite them
+// scratch buffers are reused from one layer to the next, so a parameter there shares its
+// bytes with results that are computed before the op reads it
+// calls do not nest, and ggml_new_i32/f32 call them themselves
+static void ggml_scratch_save(struct ggml_context * ctx) {
+    // a nested save would overwrite the saved buffer with the disabled one
+    GGML_ASSERT(!ctx->scratch_saved);
+
+    ctx->scratch_save  = ctx->scratch;
+    ctx->scratch_saved = true;
+    ctx->scratch.data  = NULL;
+}
+
+static void ggml_scratch_load(struct ggml_context * ctx) {
+    GGML_ASSERT(ctx->scratch_saved);
+
+    ctx->scratch       = ctx->scratch_save;
+    ctx->scratch_saved = false;
+}
+
 struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
-    ctx->scratch_save = ctx->scratch;
-    ctx->scratch.data = NULL;
+    ggml_scratch_save(ctx);
 
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
 
-    ctx->scratch = ctx->scratch_save;
+    ggml_scratch_load(ctx);
 
     ggml_set_i32(result, value);
 
@@ -3210,12 +3654,11 @@ struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
 }
 
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
-    ctx->scratch_save = ctx->scratch;
-    ctx->scratch.data = NULL;
+    ggml_scratch_save(ctx);
 
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
 
-    ctx->scratch = ctx->scratch_save;
+    ggml_scratch_load(ctx);
 
     ggml_set_f32(result, value);
 
@@ -3244,6 +3687,7 @@ struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3304,6 +3748,7 @@ struct ggml_tensor * ggml_set_f32(struct ggml_tensor * tensor, float value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3358,6 +3803,7 @@ int32_t ggml_get_i32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3402,6 +3848,7 @@ void ggml_set_i32_1d(const struct ggml_tensor * tensor, int i, int32_t value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3444,6 +3891,7 @@ float ggml_get_f32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3488,6 +3936,7 @@ void ggml_set_f32_1d(const struct ggml_tensor * tensor, int i, float value) {
                 GGML_ASSERT(false);
             } break;
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 GGML_ASSERT(false);
             } break;
@@ -3588,11 +4037,13 @@ struct ggml_tensor * ggml_add_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    GGML_ASSERT(ggml_are_same_shape(a, b));
+    GGML_ASSERT(ggml_can_broadcast(b, a));
 
     bool is_node = false;
 
     if (!inplace && (a->grad || b->grad)) {
+        // TODO: implement backward for broadcasting
+        GGML_ASSERT(ggml_are_same_shape(a, b));
         is_node = true;
     }
 
@@ -3666,11 +4117,13 @@ struct ggml_tensor * ggml_mul_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    GGML_ASSERT(ggml_are_same_shape(a, b));
+    GGML_ASSERT(ggml_can_broadcast(b, a));
 
     bool is_node = false;
 
     if (!inplace && (a->grad || b->grad)) {
+        // TODO: implement backward for broadcasting
+        GGML_ASSERT(ggml_are_same_shape(a, b));
         is_node = true;
     }
 
@@ -4192,25 +4645,46 @@ struct ggml_tensor * ggml_rms_norm_inplace(
     return ggml_rms_norm_impl(ctx, a, true);
 }
 
-// ggml_mul_mat
-
-struct ggml_tensor * ggml_mul_mat(
+struct ggml_tensor * ggml_rms_norm_mul(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b) {
-    GGML_ASSERT(ggml_can_mul_mat(a, b));
-    GGML_ASSERT(!ggml_is_transposed(a));
-
-    bool is_node = false;
+    GGML_ASSERT(b->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_can_broadcast(b, a));
 
     if (a->grad || b->grad) {
-        is_node = true;
+        GGML_ASSERT(false); // TODO: implement backward
     }
 
-    const int64_t ne[4] = { a->ne[1], b->ne[1], a->ne[2], b->ne[3] };
-    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, MIN(a->n_dims, b->n_dims), ne);
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
 
-    result->op   = GGML_OP_MUL_MAT;
+    result->op   = GGML_OP_RMS_NORM;
+    result->grad = NULL;
+    result->src0 = a;
+    result->src1 = b;
+
+    return result;
+}
+
+// ggml_mul_mat
+
+struct ggml_tensor * ggml_mul_mat(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_can_mul_mat(a, b));
+    GGML_ASSERT(!ggml_is_transposed(a));
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        is_node = true;
+    }
+
+    const int64_t ne[4] = { a->ne[1], b->ne[1], a->ne[2], b->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, MIN(a->n_dims, b->n_dims), ne);
+
+    result->op   = GGML_OP_MUL_MAT;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
     result->src1 = b;
@@ -4218,6 +4692,18 @@ struct ggml_tensor * ggml_mul_mat(
     return result;
 }
 
+struct ggml_tensor * ggml_mul_mat_dequant(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    struct ggml_tensor * result = ggml_mul_mat(ctx, a, b);
+
+    // the type that B is multiplied with
+    result->opt[0] = ggml_new_i32(ctx, GGML_TYPE_F32);
+
+    return result;
+}
+
 // ggml_scale
 
 struct ggml_tensor * ggml_scale_impl(
@@ -4302,6 +4788,43 @@ struct ggml_tensor * ggml_cpy_inplace(
     return ggml_cpy_impl(ctx, a, b, true);
 }
 
+// ggml_set_cols
+
+struct ggml_tensor * ggml_set_cols(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   offs0) {
+    GGML_ASSERT(a->type == GGML_TYPE_F32);
+    GGML_ASSERT(a->ne[1] == b->ne[1] && a->ne[2] == b->ne[2] && a->ne[3] == b->ne[3]);
+    GGML_ASSERT(offs0 >= 0 && offs0 + a->ne[0] <= b->ne[0]);
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    // make a view of the destination
+    struct ggml_tensor * result = ggml_view_tensor(ctx, b);
+
+    ggml_scratch_save(ctx);
+
+    struct ggml_tensor * c = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+    ((int32_t *) c->data)[0] = offs0;
+
+    ggml_scratch_load(ctx);
+
+    result->op     = GGML_OP_SET_COLS;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = a;
+    result->src1   = b;
+    result->opt[0] = c;
+
+    return result;
+}
+
 // ggml_cont
 
 struct ggml_tensor * ggml_cont_impl(
@@ -4664,6 +5187,32 @@ struct ggml_tensor * ggml_soft_max(
     return result;
 }
 
+// ggml_soft_max_ext
+
+struct ggml_tensor * ggml_soft_max_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * mask,
+        float                 scale) {
+    GGML_ASSERT(mask == NULL || (mask->type == GGML_TYPE_F32 && ggml_can_broadcast(mask, a)));
+
+    if (a->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    struct ggml_tensor * s = ggml_new_f32(ctx, scale);
+
+    result->op     = GGML_OP_SOFT_MAX;
+    result->grad   = NULL;
+    result->src0   = a;
+    result->src1   = mask;
+    result->opt[0] = s;
+
+    return result;
+}
+
 // ggml_rope
 
 struct ggml_tensor * ggml_rope(
@@ -4684,11 +5233,15 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
+    ggml_scratch_save(ctx);
+
     struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
     ((int32_t *) b->data)[0] = n_past;
     ((int32_t *) b->data)[1] = n_dims;
     ((int32_t *) b->data)[2] = mode;
 
+    ggml_scratch_load(ctx);
+
     result->op   = GGML_OP_ROPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
@@ -4697,6 +5250,44 @@ struct ggml_tensor * ggml_rope(
     return result;
 }
 
+// ggml_rope_pos
+
+struct ggml_tensor * ggml_rope_pos(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode) {
+    GGML_ASSERT(b->type == GGML_TYPE_I32);
+    GGML_ASSERT(ggml_is_vector(b) && b->ne[0] == a->ne[2]);
+    GGML_ASSERT(mode == 0);
+    bool is_node = false;
+
+    if (a->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    ggml_scratch_save(ctx);
+
+    struct ggml_tensor * c = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+    ((int32_t *) c->data)[0] = 0;
+    ((int32_t *) c->data)[1] = n_dims;
+    ((int32_t *) c->data)[2] = mode;
+
+    ggml_scratch_load(ctx);
+
+    result->op     = GGML_OP_ROPE;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = a;
+    result->src1   = c;
+    result->opt[0] = b;
+
+    return result;
+}
+
 // ggml_conv_1d_1s
 
 struct ggml_tensor * ggml_conv_1d_1s(
@@ -4815,6 +5406,39 @@ struct ggml_tensor * ggml_flash_ff(
     return result;
 }
 
+// ggml_attn_decode
+
+struct ggml_tensor * ggml_attn_decode(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        float                 scale) {
+    GGML_ASSERT(q->type == GGML_TYPE_F32 && q->nb[0] == sizeof(float) && q->ne[2] == 1 && q->ne[3] == 1);
+    GGML_ASSERT(k->ne[0] == q->ne[0] && k->ne[1] == q->ne[1]);
+    GGML_ASSERT(v->ne[0] == k->ne[2] && v->ne[1] == q->ne[0] && v->ne[2] == q->ne[1]);
+    GGML_ASSERT(mask == NULL || (mask->type == GGML_TYPE_F32 && mask->ne[0] == k->ne[2]));
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, q->ne[0], q->ne[1], 1);
+
+    struct ggml_tensor * s = ggml_new_f32(ctx, scale);
+
+    result->op     = GGML_OP_ATTN_DECODE;
+    result->grad   = NULL;
+    result->src0   = q;
+    result->src1   = k;
+    result->opt[0] = v;
+    result->opt[1] = mask;
+    result->opt[2] = s;
+
+    return result;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_set_param(
@@ -4826,6 +5450,36 @@ void ggml_set_param(
     tensor->grad = ggml_dup_tensor(ctx, tensor);
 }
 
+static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_Q4_0] = {
+        .dequantize_row_q         = dequantize_row_q4_0,
+        .quantize_row_q           = quantize_row_q4_0,
+        .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q4_0_reference,
+        .vec_dot_q                = ggml_vec_dot_q4_0,
+        .vec_dot_q_f32            = ggml_vec_dot_q4_0_f32,
+    },
+    [GGML_TYPE_Q4_1] = {
+        .dequantize_row_q         = dequantize_row_q4_1,
+        .quantize_row_q           = quantize_row_q4_1,
+        .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q4_1_reference,
+        .vec_dot_q                = ggml_vec_dot_q4_1,
+        .vec_dot_q_f32            = ggml_vec_dot_q4_1_f32,
+    },
+    [GGML_TYPE_Q8_0] = {
+        .dequantize_row_q         = dequantize_row_q8_0,
+        .quantize_row_q           = quantize_row_q8_0,
+        .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q8_0_reference,
+        .vec_dot_q                = ggml_vec_dot_q8_0,
+        .vec_dot_q_f32            = ggml_vec_dot_q8_0_f32,
+    },
+};
+
+// For internal test use
+quantize_fns_t ggml_internal_get_quantize_fn(size_t i) {
+    GGML_ASSERT(i < GGML_TYPE_COUNT);
+    return quantize_fns[i];
+}
+
 // ggml_compute_forward_dup
 
 static void ggml_compute_forward_dup_f16(
@@ -5105,6 +5759,27 @@ static void ggml_compute_forward_dup_f32(
                         }
                     }
                 }
+            } else if (quantize_fns[dst->type].quantize_row_q) {
+                // quantize each row in place, the rows must be a whole number of blocks
+                GGML_ASSERT(ne00 % GGML_BLCK_SIZE[dst->type] == 0);
+
+                quantize_row_q_t const quantize_row_q = quantize_fns[dst->type].quantize_row_q;
+
+                size_t id = 0;
+                const size_t rs = (ne00/GGML_BLCK_SIZE[dst->type])*GGML_TYPE_SIZE[dst->type];
+
+                for (int i03 = 0; i03 < ne03; i03++) {
+                    for (int i02 = 0; i02 < ne02; i02++) {
+                        for (int i01 = 0; i01 < ne01; i01++) {
+                            const float * src0_ptr = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                            char * dst_ptr = (char *) dst->data + id*rs;
+
+                            quantize_row_q(src0_ptr, dst_ptr, ne00);
+
+                            id++;
+                        }
+                    }
+                }
             } else {
                 GGML_ASSERT(false); // TODO: implement
             }
@@ -5229,6 +5904,7 @@ static void ggml_compute_forward_dup(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5246,7 +5922,7 @@ static void ggml_compute_forward_add_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_broadcast(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -5258,11 +5934,20 @@ static void ggml_compute_forward_add_f32(
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+
+    const int64_t ne11 = src1->ne[1];
+    const int64_t ne12 = src1->ne[2];
+    const int64_t ne13 = src1->ne[3];
+
     const size_t nb00 = src0->nb[0];
     const size_t nb01 = src0->nb[1];
 
     const size_t nb10 = src1->nb[0];
     const size_t nb11 = src1->nb[1];
+    const size_t nb12 = src1->nb[2];
+    const size_t nb13 = src1->nb[3];
 
     const size_t nb0 = dst->nb[0];
     const size_t nb1 = dst->nb[1];
@@ -5272,25 +5957,36 @@ static void ggml_compute_forward_add_f32(
 
     if (nb10 == sizeof(float)) {
         for (int j = ith; j < n; j += nth) {
+            // src1 row, repeating src1 along dims 1, 2 and 3 if needed
+            const int64_t i1 = j%ne01;
+            const int64_t i2 = (j/ne01)%ne02;
+            const int64_t i3 = j/(ne01*ne02);
+            const size_t offs1 = (i1%ne11)*nb11 + (i2%ne12)*nb12 + (i3%ne13)*nb13;
+
 #ifdef GGML_USE_ACCELERATE
             vDSP_vadd(
                     (float *) ((char *) src0->data + j*nb01), 1,
-                    (float *) ((char *) src1->data + j*nb11), 1,
+                    (float *) ((char *) src1->data + offs1), 1,
                     (float *) ((char *) dst->data  + j*nb1),  1, nc);
 #else
             ggml_vec_add_f32(nc,
                     (float *) ((char *) dst->data  + j*nb1),
                     (float *) ((char *) src0->data + j*nb01),
-                    (float *) ((char *) src1->data + j*nb11));
+                    (float *) ((char *) src1->data + offs1));
 #endif
         }
     } else {
         // src1 is not contiguous
         for (int j = ith; j < n; j += nth) {
+            const int64_t i1 = j%ne01;
+            const int64_t i2 = (j/ne01)%ne02;
+            const int64_t i3 = j/(ne01*ne02);
+            const size_t offs1 = (i1%ne11)*nb11 + (i2%ne12)*nb12 + (i3%ne13)*nb13;
+
             float * dst_ptr  = (float *) ((char *) dst->data  + j*nb1);
             float * src0_ptr = (float *) ((char *) src0->data + j*nb01);
             for (int i = 0; i < nc; i++) {
-                float * src1_ptr = (float *) ((char *) src1->data + j*nb11 + i*nb10);
+                float * src1_ptr = (float *) ((char *) src1->data + offs1 + i*nb10);
 
                 dst_ptr[i] = src0_ptr[i] + *src1_ptr;
             }
@@ -5310,6 +6006,7 @@ static void ggml_compute_forward_add(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5362,6 +6059,7 @@ static void ggml_compute_forward_sub(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5380,25 +6078,44 @@ static void ggml_compute_forward_mul_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-    assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_broadcast(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+
+    const int64_t ne11 = src1->ne[1];
+    const int64_t ne12 = src1->ne[2];
+    const int64_t ne13 = src1->ne[3];
+
+    const size_t nb11 = src1->nb[1];
+    const size_t nb12 = src1->nb[2];
+    const size_t nb13 = src1->nb[3];
+
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
     assert(src1->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int j = ith; j < n; j += nth) {
+        // src1 row, repeating src1 along dims 1, 2 and 3 if needed
+        const int64_t i1 = j%ne01;
+        const int64_t i2 = (j/ne01)%ne02;
+        const int64_t i3 = j/(ne01*ne02);
+        const size_t offs1 = (i1%ne11)*nb11 + (i2%ne12)*nb12 + (i3%ne13)*nb13;
+
         ggml_vec_mul_f32(nc,
-                (float *) ((char *) dst->data  + i*( dst->nb[1])),
-                (float *) ((char *) src0->data + i*(src0->nb[1])),
-                (float *) ((char *) src1->data + i*(src1->nb[1])));
+                (float *) ((char *) dst->data  + j*( dst->nb[1])),
+                (float *) ((char *) src0->data + j*(src0->nb[1])),
+                (float *) ((char *) src1->data + offs1));
     }
 }
 
@@ -5414,6 +6131,7 @@ static void ggml_compute_forward_mul(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5466,6 +6184,7 @@ static void ggml_compute_forward_div(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5514,6 +6233,7 @@ static void ggml_compute_forward_sqr(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5562,6 +6282,7 @@ static void ggml_compute_forward_sqrt(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5620,6 +6341,7 @@ static void ggml_compute_forward_sum(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5697,6 +6419,7 @@ static void ggml_compute_forward_mean(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5761,6 +6484,7 @@ static void ggml_compute_forward_repeat(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5809,6 +6533,7 @@ static void ggml_compute_forward_abs(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5857,6 +6582,7 @@ static void ggml_compute_forward_sgn(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5905,6 +6631,7 @@ static void ggml_compute_forward_neg(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5953,6 +6680,7 @@ static void ggml_compute_forward_step(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6001,6 +6729,7 @@ static void ggml_compute_forward_relu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6066,6 +6795,7 @@ static void ggml_compute_forward_gelu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6085,7 +6815,8 @@ static void ggml_compute_forward_silu_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_is_contiguous(src0));
+    // the rows of src0 may be strided, e.g. a view of a fused matmul result
+    GGML_ASSERT(src0->nb[0] == sizeof(float) && (ggml_is_contiguous(src0) || ggml_nrows(src0) == src0->ne[1]));
     GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_are_same_shape(src0, dst));
 
@@ -6133,6 +6864,7 @@ static void ggml_compute_forward_silu(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6219,6 +6951,7 @@ static void ggml_compute_forward_norm(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6233,8 +6966,10 @@ static void ggml_compute_forward_norm(
 static void ggml_compute_forward_rms_norm_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
     GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(src1 == NULL || ggml_can_broadcast(src1, src0));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -6258,6 +6993,11 @@ static void ggml_compute_forward_rms_norm_f32(
     const size_t nb2 = dst->nb[2];
     const size_t nb3 = dst->nb[3];
 
+    // optional scale, multiplied into the normalized rows (ggml_rms_norm_mul)
+    const int64_t ne11 = src1 ? src1->ne[1] : 1;
+    const int64_t ne12 = src1 ? src1->ne[2] : 1;
+    const int64_t ne13 = src1 ? src1->ne[3] : 1;
+
     const float eps = 1e-6f; // TODO: make this a parameter
 
     // TODO: optimize
@@ -6283,6 +7023,12 @@ static void ggml_compute_forward_rms_norm_f32(
                 const float scale = 1.0f/sqrtf(mean + eps);
 
                 ggml_vec_scale_f32(ne00, y, scale);
+
+                if (src1) {
+                    const float * w = (float *) ((char *) src1->data + (i01%ne11)*src1->nb[1] + (i02%ne12)*src1->nb[2] + (i03%ne13)*src1->nb[3]);
+
+                    ggml_vec_mul_f32(ne00, y, y, w);
+                }
             }
         }
     }
@@ -6291,14 +7037,16 @@ static void ggml_compute_forward_rms_norm_f32(
 static void ggml_compute_forward_rms_norm(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
     switch (src0->type) {
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_rms_norm_f32(params, src0, dst);
+                ggml_compute_forward_rms_norm_f32(params, src0, src1, dst);
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -6459,10 +7207,10 @@ static void ggml_compute_forward_mul_mat_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
+    // rows per task, there are a few tasks per thread
     const int dr = (nr + nth - 1)/nth;
 
-    // row range for this thread
+    // row range for this task
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
@@ -6619,21 +7367,27 @@ static void ggml_compute_forward_mul_mat_f16_f32(
 #endif
 
     if (params->type == GGML_TASK_INIT) {
-        ggml_fp16_t * const wdata = params->wdata;
-
-        size_t id = 0;
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
-            for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                    for (int64_t i10 = 0; i10 < ne10; ++i10) {
-                        wdata[id++] = GGML_FP32_TO_FP16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
-                    }
-                }
+        // the rows of src1 are converted in parallel, nth is the number of INIT tasks
+        const int64_t nr1 = ne11*ne12*ne13;
+        const int64_t dr1 = (nr1 + nth - 1)/nth;
+
+        const int64_t ir10 = dr1*ith;
+        const int64_t ir11 = MIN(ir10 + dr1, nr1);
+
+        GGML_ASSERT(ir11*ne10*sizeof(ggml_fp16_t) <= params->wsize);
+
+        for (int64_t ir = ir10; ir < ir11; ++ir) {
+            const int64_t i13 = ir/(ne12*ne11);
+            const int64_t i12 = (ir - i13*ne12*ne11)/ne11;
+            const int64_t i11 = (ir - i13*ne12*ne11 - i12*ne11);
+
+            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + ir*ne10;
+
+            for (int64_t i10 = 0; i10 < ne10; ++i10) {
+                wdata[i10] = GGML_FP32_TO_FP16(*(float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + i10*nb10));
             }
         }
 
-        GGML_ASSERT(id*sizeof(ggml_fp16_t) <= params->wsize);
-
         return;
     }
 
@@ -6650,10 +7404,10 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
+    // rows per task, there are a few tasks per thread
     const int dr = (nr + nth - 1)/nth;
 
-    // row range for this thread
+    // row range for this task
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
@@ -6695,27 +7449,6 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     //}
 }
 
-static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
-    [GGML_TYPE_Q4_0] = {
-        .dequantize_row_q         = dequantize_row_q4_0,
-        .quantize_row_q           = quantize_row_q4_0,
-        .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q4_0_reference,
-        .vec_dot_q                = ggml_vec_dot_q4_0,
-    },
-    [GGML_TYPE_Q4_1] = {
-        .dequantize_row_q         = dequantize_row_q4_1,
-        .quantize_row_q           = quantize_row_q4_1,
-        .quantize_row_q_reference = (quantize_row_q_t) quantize_row_q4_1_reference,
-        .vec_dot_q                = ggml_vec_dot_q4_1,
-    },
-};
-
-// For internal test use
-quantize_fns_t ggml_internal_get_quantize_fn(size_t i) {
-    GGML_ASSERT(i < GGML_TYPE_COUNT);
-    return quantize_fns[i];
-}
-
 static void ggml_compute_forward_mul_mat_q_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -6766,6 +7499,9 @@ static void ggml_compute_forward_mul_mat_q_f32(
     quantize_row_q_t const quantize_row_q = quantize_fns[type].quantize_row_q;
     vec_dot_q_t      const vec_dot_q      = quantize_fns[type].vec_dot_q;
 
+    // ggml_mul_mat_dequant: src1 stays F32 and src0 is dequantized in the dot products
+    const bool dequant = dst->opt[0] != NULL;
+
     // we don't support permuted src0 or src1
     GGML_ASSERT(nb00 == (int) GGML_TYPE_SIZE[type]);
     GGML_ASSERT(nb10 == sizeof(float));
@@ -6832,16 +7568,25 @@ static void ggml_compute_forward_mul_mat_q_f32(
 #endif
 
     if (params->type == GGML_TASK_INIT) {
-        char * wdata = params->wdata;
+        if (dequant) {
+            return;
+        }
+
         const size_t row_size = ne10*GGML_TYPE_SIZE[type]/GGML_BLCK_SIZE[type];
 
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
-            for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                    quantize_row_q((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
-                    wdata += row_size;
-                }
-            }
+        // the rows of src1 are quantized in parallel, nth is the number of INIT tasks
+        const int64_t nr1 = ne11*ne12*ne13;
+        const int64_t dr1 = (nr1 + nth - 1)/nth;
+
+        const int64_t ir10 = dr1*ith;
+        const int64_t ir11 = MIN(ir10 + dr1, nr1);
+
+        for (int64_t ir = ir10; ir < ir11; ++ir) {
+            const int64_t i13 = ir/(ne12*ne11);
+            const int64_t i12 = (ir - i13*ne12*ne11)/ne11;
+            const int64_t i11 = (ir - i13*ne12*ne11 - i12*ne11);
+
+            quantize_row_q((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (char *) params->wdata + ir*row_size, ne10);
         }
 
         return;
@@ -6856,10 +7601,10 @@ static void ggml_compute_forward_mul_mat_q_f32(
     // total rows in src0
     const int nr = ne01*ne02*ne03;
 
-    // rows per thread
+    // rows per task, there are a few tasks per thread
     const int dr = (nr + nth - 1)/nth;
 
-    // row range for this thread
+    // row range for this task
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
@@ -6886,6 +7631,14 @@ static void ggml_compute_forward_mul_mat_q_f32(
 
         assert(ne00 % 32 == 0);
 
+        if (dequant) {
+            for (int64_t ic = 0; ic < ne11; ++ic) {
+                const char * src1_row = (char *) src1->data + (ic*nb11 + i12*nb12 + i13*nb13);
+                quantize_fns[type].vec_dot_q_f32(ne00, &dst_col[ic*ne0], src0_row, src1_row);
+            }
+            continue;
+        }
+
         for (int64_t ic = 0; ic < ne11; ++ic) {
             vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
         }
@@ -6912,6 +7665,7 @@ static void ggml_compute_forward_mul_mat(
     switch (src0->type) {
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 ggml_compute_forward_mul_mat_q_f32(params, src0, src1, dst);
             } break;
@@ -7010,6 +7764,7 @@ static void ggml_compute_forward_scale(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7030,31 +7785,127 @@ static void ggml_compute_forward_cpy(
     ggml_compute_forward_dup(params, src0, dst);
 }
 
-// ggml_compute_forward_cont
+// ggml_compute_forward_set_cols
 
-static void ggml_compute_forward_cont(
+static void ggml_compute_forward_set_cols(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * opt0,
         struct ggml_tensor * dst) {
-    ggml_compute_forward_dup(params, src0, dst);
-}
-
-// ggml_compute_forward_reshape
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
 
-static void ggml_compute_forward_reshape(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        struct ggml_tensor * dst) {
-    // NOP
-    UNUSED(params);
-    UNUSED(src0);
-    UNUSED(dst);
-}
+    const int offs0 = ((int32_t *) opt0->data)[0];
 
-// ggml_compute_forward_view
+    const int64_t n   = src0->ne[0];
+    const int64_t ne0 = dst->ne[0];
+    const int64_t ne1 = dst->ne[1];
+    const int64_t ne2 = dst->ne[2];
 
-static void ggml_compute_forward_view(
-        const struct ggml_compute_params * params,
+    const size_t nb00 = src0->nb[0];
+    const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
+
+    const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
+
+    const enum ggml_type type = dst->type;
+
+    GGML_ASSERT(src0->type == GGML_TYPE_F32);
+    GGML_ASSERT(dst->nb[0] == GGML_TYPE_SIZE[type]);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // total rows
+    const int64_t nr = ggml_nrows(dst);
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    // blocks touched in each row of a quantized dst
+    const int64_t qk = GGML_BLCK_SIZE[type];
+    const int64_t i0 = (offs0/qk)*qk;
+    const int64_t i1 = MIN(((offs0 + n + qk - 1)/qk)*qk, ne0);
+
+    float * wdata = (float *) params->wdata + ith*(ne0 + CACHE_LINE_SIZE_F32);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne2*ne1);
+        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
+        const int64_t i1r = (ir - i3*ne2*ne1 - i2*ne1);
+
+        const char * src0_ptr = (char *) src0->data + i1r*nb01 + i2*nb02 + i3*nb03;
+        char * dst_ptr = (char *) dst->data + i1r*nb1 + i2*nb2 + i3*nb3;
+
+        switch (type) {
+            case GGML_TYPE_F32:
+                {
+                    float * d = (float *) dst_ptr + offs0;
+                    for (int64_t k = 0; k < n; ++k) {
+                        d[k] = *(const float *) (src0_ptr + k*nb00);
+                    }
+                } break;
+            case GGML_TYPE_F16:
+                {
+                    ggml_fp16_t * d = (ggml_fp16_t *) dst_ptr + offs0;
+                    for (int64_t k = 0; k < n; ++k) {
+                        d[k] = GGML_FP32_TO_FP16(*(const float *) (src0_ptr + k*nb00));
+                    }
+                } break;
+            default:
+                {
+                    GGML_ASSERT(quantize_fns[type].quantize_row_q);
+
+                    char * blk = dst_ptr + (i0/qk)*GGML_TYPE_SIZE[type];
+
+                    // keep the values around a partially covered block
+                    if (i0 < offs0 || offs0 + n < i1) {
+                        quantize_fns[type].dequantize_row_q(blk, wdata, i1 - i0);
+                    }
+
+                    for (int64_t k = 0; k < n; ++k) {
+                        wdata[offs0 - i0 + k] = *(const float *) (src0_ptr + k*nb00);
+                    }
+
+                    quantize_fns[type].quantize_row_q(wdata, blk, i1 - i0);
+                } break;
+        }
+    }
+}
+
+// ggml_compute_forward_cont
+
+static void ggml_compute_forward_cont(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    ggml_compute_forward_dup(params, src0, dst);
+}
+
+// ggml_compute_forward_reshape
+
+static void ggml_compute_forward_reshape(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    // NOP
+    UNUSED(params);
+    UNUSED(src0);
+    UNUSED(dst);
+}
+
+// ggml_compute_forward_view
+
+static void ggml_compute_forward_view(
+        const struct ggml_compute_params * params,
         const struct ggml_tensor * src0) {
     // NOP
     UNUSED(params);
@@ -7175,6 +8026,7 @@ static void ggml_compute_forward_get_rows(
     switch (src0->type) {
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
             {
                 ggml_compute_forward_get_rows_q(params, src0, src1, dst);
             } break;
@@ -7264,6 +8116,7 @@ static void ggml_compute_forward_diag_mask_inf(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7280,10 +8133,13 @@ static void ggml_compute_forward_diag_mask_inf(
 static void ggml_compute_forward_soft_max_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
         struct ggml_tensor * dst) {
     GGML_ASSERT(ggml_is_contiguous(src0));
     GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(src1 == NULL || (src1->nb[0] == sizeof(float) && ggml_can_broadcast(src1, src0)));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -7297,6 +8153,12 @@ static void ggml_compute_forward_soft_max_f32(
     const int nc = src0->ne[0];
     const int nr = ggml_nrows(src0);
 
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+
+    // optional scale and mask (ggml_soft_max_ext)
+    const float scale = opt0 ? *(float *) opt0->data : 1.0f;
+
     // rows per thread
     const int dr = (nr + nth - 1)/nth;
 
@@ -7305,43 +8167,62 @@ static void ggml_compute_forward_soft_max_f32(
     const int ir1 = MIN(ir0 + dr, nr);
 
     for (int i1 = ir0; i1 < ir1; i1++) {
-        float *p = (float *)((char *) dst->data + i1*dst->nb[1]);
+        float * sp = (float *)((char *) src0->data + i1*src0->nb[1]);
+        float * dp = (float *)((char *)  dst->data + i1*dst->nb[1]);
+
+        // the mask row, repeated along dims 1, 2 and 3 if needed
+        const float * mp = NULL;
+        if (src1) {
+            const int64_t i01 = i1%ne01;
+            const int64_t i02 = (i1/ne01)%ne02;
+            const int64_t i03 = i1/(ne01*ne02);
+
+            mp = (float *)((char *) src1->data +
+                    (i01%src1->ne[1])*src1->nb[1] + (i02%src1->ne[2])*src1->nb[2] + (i03%src1->ne[3])*src1->nb[3]);
+        }
+
+        // the masked tail of the row is 0 without being computed, e.g. the cells after the last one a token sees
+        int n = nc;
+        while (mp && n > 0 && mp[n - 1] == -INFINITY) {
+            n--;
+        }
+
+        if (dp != sp) {
+            memcpy(dp, sp, n*sizeof(float));
+        }
+        if (scale != 1.0f) {
+            ggml_vec_scale_f32(n, dp, scale);
+        }
+        if (mp) {
+            ggml_vec_add_f32(n, dp, dp, mp);
+        }
 
 #ifndef NDEBUG
-        for (int i = 0; i < nc; ++i) {
-            //printf("p[%d] = %f\n", i, p[i]);
-            assert(!isnan(p[i]));
+        for (int i = 0; i < n; ++i) {
+            //printf("p[%d] = %f\n", i, dp[i]);
+            assert(!isnan(dp[i]));
         }
 #endif
 
         float max = -INFINITY;
-        ggml_vec_max_f32(nc, &max, p);
-
-        ggml_float sum = 0.0;
+        ggml_vec_max_f32(n, &max, dp);
 
-        uint16_t scvt;
-        for (int i = 0; i < nc; i++) {
-            if (p[i] == -INFINITY) {
-                p[i] = 0.0f;
-            } else {
-                //const float val = (p[i] == -INFINITY) ? 0.0 : exp(p[i] - max);
-                ggml_fp16_t s = GGML_FP32_TO_FP16(p[i] - max);
-                memcpy(&scvt, &s, sizeof(scvt));
-                const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
-                sum += (ggml_float)val;
-                p[i] = val;
-            }
-        }
+        // the masked elements inside the row are -INF and become 0
+        ggml_float sum = ggml_vec_soft_max_f32(n, dp, dp, max);
 
         assert(sum > 0.0);
 
         sum = 1.0/sum;
-        ggml_vec_scale_f32(nc, p, sum);
+        ggml_vec_scale_f32(n, dp, sum);
+
+        for (int i = n; i < nc; ++i) {
+            dp[i] = 0.0f;
+        }
 
 #ifndef NDEBUG
         for (int i = 0; i < nc; ++i) {
-            assert(!isnan(p[i]));
-            assert(!isinf(p[i]));
+            assert(!isnan(dp[i]));
+            assert(!isinf(dp[i]));
         }
 #endif
     }
@@ -7350,14 +8231,17 @@ static void ggml_compute_forward_soft_max_f32(
 static void ggml_compute_forward_soft_max(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
         struct ggml_tensor * dst) {
     switch (src0->type) {
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_soft_max_f32(params, src0, dst);
+                ggml_compute_forward_soft_max_f32(params, src0, src1, opt0, dst);
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7375,6 +8259,7 @@ static void ggml_compute_forward_rope_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
+        const struct ggml_tensor * pos,
         struct ggml_tensor * dst) {
     assert(src1->type == GGML_TYPE_I32);
     assert(ggml_nelements(src1) == 3);
@@ -7417,9 +8302,12 @@ static void ggml_compute_forward_rope_f32(
     // row index used to determine which thread to use
     int ir = 0;
 
+    // explicit positions, one per row of dim 2
+    const int32_t * pos_data = pos ? (const int32_t *) pos->data : NULL;
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = (mode == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int p = (mode == 0 ? n_past + i2 : i2);
+            const int p = pos_data ? pos_data[i2] : (mode == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -7448,6 +8336,7 @@ static void ggml_compute_forward_rope_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
+        const struct ggml_tensor * pos,
         struct ggml_tensor * dst) {
     assert(src1->type == GGML_TYPE_I32);
     assert(ggml_nelements(src1) == 3);
@@ -7490,9 +8379,12 @@ static void ggml_compute_forward_rope_f16(
     // row index used to determine which thread to use
     int ir = 0;
 
+    // explicit positions, one per row of dim 2
+    const int32_t * pos_data = pos ? (const int32_t *) pos->data : NULL;
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = (mode == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int p = (mode == 0 ? n_past + i2 : i2);
+            const int p = pos_data ? pos_data[i2] : (mode == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -7521,18 +8413,20 @@ static void ggml_compute_forward_rope(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
+        const struct ggml_tensor * pos,
         struct ggml_tensor * dst) {
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
-                ggml_compute_forward_rope_f16(params, src0, src1, dst);
+                ggml_compute_forward_rope_f16(params, src0, src1, pos, dst);
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_rope_f32(params, src0, src1, dst);
+                ggml_compute_forward_rope_f32(params, src0, src1, pos, dst);
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -7801,6 +8695,7 @@ static void ggml_compute_forward_conv_1d_1s(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -8069,6 +8964,7 @@ static void ggml_compute_forward_conv_1d_2s(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -8554,6 +9450,7 @@ static void ggml_compute_forward_flash_attn(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -8765,6 +9662,246 @@ static void ggml_compute_forward_flash_ff(
             } break;
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_I8:
+        case GGML_TYPE_I16:
+        case GGML_TYPE_I32:
+        case GGML_TYPE_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_attn_decode
+
+// bytes of q converted for the dot products with a row of K of the given type: F16 rows are
+// multiplied with F16 values, quantized rows with values quantized to the same type and F32
+// rows with the F32 values themselves
+static size_t ggml_attn_decode_row_size(enum ggml_type type, int64_t n) {
+    return type == GGML_TYPE_F32 ? 0 : GGML_TYPE_SIZE[type]*n/GGML_BLCK_SIZE[type];
+}
+
+// the weights of V stay F32 and the rows of V are dequantized a whole block at a time, the cells
+// of V are taken in spans of a block
+static int64_t ggml_attn_decode_span(enum ggml_type type) {
+    return GGML_BLCK_SIZE[type];
+}
+
+// cells of each chunk of a head, a multiple of 64 so that the chunks start on a span of V
+static int64_t ggml_attn_decode_chunk_size(int64_t n_kv, int n_chunks) {
+    return ((n_kv + n_chunks - 1)/n_chunks + 63)/64*64;
+}
+
+// the work data is q converted for each head, then for each task the scores of its cells,
+// its output, the max and the sum of its scores and a row of V converted to F32 if V is F16
+static void ggml_attn_decode_work(const struct ggml_tensor * node, int n_chunks, size_t * q_size, size_t * task_size) {
+    const struct ggml_tensor * q = node->src0;
+    const struct ggml_tensor * k = node->src1;
+    const struct ggml_tensor * v = node->opt[0];
+
+    const int64_t cs = ggml_attn_decode_chunk_size(k->ne[2], n_chunks);
+
+    *q_size    = q->ne[1]*ggml_attn_decode_row_size(k->type, q->ne[0]);
+    *task_size = sizeof(float)*(cs + q->ne[0] + 2 + (v->type == GGML_TYPE_F16 ? cs : 0));
+
+    *q_size    = (*q_size    + CACHE_LINE_SIZE - 1)/CACHE_LINE_SIZE*CACHE_LINE_SIZE;
+    *task_size = (*task_size + CACHE_LINE_SIZE - 1)/CACHE_LINE_SIZE*CACHE_LINE_SIZE;
+}
+
+// a task per chunk of cells of each head computes the scores of its cells, their softmax
+// without the normalization and the sum of the V rows weighted with it. the FINALIZE pass
+// rescales the chunks of each head to the max of the head and adds them up
+static void ggml_compute_forward_attn_decode_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        const struct ggml_tensor * scale,
+        struct ggml_tensor * dst) {
+    const int64_t D      = q->ne[0];
+    const int64_t n_head = q->ne[1];
+    const int64_t n_kv   = k->ne[2];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_ASSERT(k->nb[0] == GGML_TYPE_SIZE[k->type] && v->nb[0] == GGML_TYPE_SIZE[v->type]);
+    GGML_ASSERT(k->type == GGML_TYPE_F32 || k->type == GGML_TYPE_F16 || quantize_fns[k->type].vec_dot_q);
+    GGML_ASSERT(v->type == GGML_TYPE_F32 || v->type == GGML_TYPE_F16 || quantize_fns[v->type].vec_dot_q_f32);
+    GGML_ASSERT(D % GGML_BLCK_SIZE[k->type] == 0);
+    GGML_ASSERT(n_kv % ggml_attn_decode_span(v->type) == 0);
+
+    // nth is the number of INIT tasks in the INIT pass and n_head*n_chunks in the others
+    const int n_chunks = (int) (params->type == GGML_TASK_INIT ? 1 : nth/n_head);
+
+    size_t q_size;
+    size_t task_size;
+    ggml_attn_decode_work(dst, n_chunks, &q_size, &task_size);
+
+    const size_t q_row = ggml_attn_decode_row_size(k->type, D);
+
+    if (params->type == GGML_TASK_INIT) {
+        // q of each head is converted once for all the chunks of the head
+        for (int64_t h = ith; h < n_head && k->type != GGML_TYPE_F32; h += nth) {
+            const float * qh = (float *) ((char *) q->data + h*q->nb[1]);
+            char        * wq = (char *) params->wdata + h*q_row;
+
+            if (k->type == GGML_TYPE_F16) {
+                for (int64_t i = 0; i < D; i++) {
+                    ((ggml_fp16_t *) wq)[i] = GGML_FP32_TO_FP16(qh[i]);
+                }
+            } else {
+                quantize_fns[k->type].quantize_row_q(qh, wq, D);
+            }
+        }
+
+        return;
+    }
+
+    const int64_t cs = ggml_attn_decode_chunk_size(n_kv, n_chunks);
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        for (int64_t h = 0; h < n_head; h++) {
+            float max = -INFINITY;
+            for (int c = 0; c < n_chunks; c++) {
+                const float * o = (float *) ((char *) params->wdata + q_size + (h*n_chunks + c)*task_size + cs*sizeof(float));
+                max = MAX(max, o[D]);
+            }
+
+            float * y = (float *) ((char *) dst->data + h*dst->nb[1]);
+
+            ggml_float sum = 0.0;
+            for (int64_t i = 0; i < D; i++) {
+                y[i] = 0.0f;
+            }
+
+            for (int c = 0; c < n_chunks; c++) {
+                const float * o = (float *) ((char *) params->wdata + q_size + (h*n_chunks + c)*task_size + cs*sizeof(float));
+                if (o[D + 1] == 0.0f) {
+                    continue;
+                }
+
+                const float f = expf(o[D] - max);
+                sum += (ggml_float) (f*o[D + 1]);
+                ggml_vec_mad_f32(D, y, o, f);
+            }
+
+            assert(sum > 0.0);
+
+            sum = 1.0/sum;
+            ggml_vec_scale_f32(D, y, sum);
+        }
+
+        return;
+    }
+
+    const int64_t h  = ith/n_chunks;
+    const int64_t j0 = MIN(n_kv, (ith%n_chunks)*cs);
+    const int64_t j1 = MIN(n_kv, j0 + cs);
+
+    float * s  = (float *) ((char *) params->wdata + q_size + ith*task_size);
+    float * o  = s + cs;
+    float * fv = o + D + 2;
+
+    const float * mp = mask ? (float *) mask->data : NULL;
+
+    // the masked cells at the end of the chunk are left out
+    int64_t je = j1;
+    while (mp && je > j0 && mp[je - 1] == -INFINITY) {
+        je--;
+    }
+
+    for (int64_t i = 0; i < D; i++) {
+        o[i] = 0.0f;
+    }
+    o[D]     = -INFINITY; // max
+    o[D + 1] = 0.0f;      // sum
+
+    if (je == j0) {
+        return;
+    }
+
+    const int64_t n = je - j0;
+
+    // scores
+    {
+        void * qh = k->type == GGML_TYPE_F32 ? (char *) q->data + h*q->nb[1] : (char *) params->wdata + h*q_row;
+
+        for (int64_t j = j0; j < je; j++) {
+            void * kj = (char *) k->data + h*k->nb[1] + j*k->nb[2];
+
+            if (k->type == GGML_TYPE_F32) {
+                ggml_vec_dot_f32(D, s + (j - j0), kj, (float *) qh);
+            } else if (k->type == GGML_TYPE_F16) {
+                ggml_vec_dot_f16(D, s + (j - j0), kj, (ggml_fp16_t *) qh);
+            } else {
+                quantize_fns[k->type].vec_dot_q(D, s + (j - j0), kj, qh);
+            }
+        }
+
+        ggml_vec_scale_f32(n, s, *(float *) scale->data);
+        if (mp) {
+            ggml_vec_add_f32(n, s, s, mp + j0);
+        }
+    }
+
+    float max = -INFINITY;
+    ggml_vec_max_f32(n, &max, s);
+
+    // every cell of the chunk is masked, e.g. they belong to other sequences
+    if (max == -INFINITY) {
+        return;
+    }
+
+    o[D]     = max;
+    o[D + 1] = ggml_vec_soft_max_f32(n, s, s, max);
+
+    // V rows weighted with the F32 scores, over whole spans of V. an F16 row is converted to
+    // F32 and a quantized row is dequantized in the dot product
+    {
+        const int64_t span = ggml_attn_decode_span(v->type);
+        const int64_t nv   = MIN(j1 - j0, (n + span - 1)/span*span);
+
+        for (int64_t j = n; j < nv; j++) {
+            s[j] = 0.0f;
+        }
+
+        for (int64_t i = 0; i < D; i++) {
+            void * vi = (char *) v->data + i*v->nb[1] + h*v->nb[2] + (j0/GGML_BLCK_SIZE[v->type])*v->nb[0];
+
+            if (v->type == GGML_TYPE_F32) {
+                ggml_vec_dot_f32(nv, o + i, vi, s);
+            } else if (v->type == GGML_TYPE_F16) {
+                for (int64_t j = 0; j < nv; j++) {
+                    fv[j] = GGML_FP16_TO_FP32(((ggml_fp16_t *) vi)[j]);
+                }
+                ggml_vec_dot_f32(nv, o + i, fv, s);
+            } else {
+                quantize_fns[v->type].vec_dot_q_f32(nv, o + i, vi, s);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_attn_decode(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        const struct ggml_tensor * scale,
+        struct ggml_tensor * dst) {
+    switch (q->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_attn_decode_f32(params, q, k, v, mask, scale, dst);
+            } break;
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -8855,7 +9992,7 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_RMS_NORM:
             {
-                ggml_compute_forward_rms_norm(params, tensor->src0, tensor);
+                ggml_compute_forward_rms_norm(params, tensor->src0, tensor->src1, tensor);
             } break;
         case GGML_OP_MUL_MAT:
             {
@@ -8869,6 +10006,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_cpy(params, tensor->src0, tensor);
             } break;
+        case GGML_OP_SET_COLS:
+            {
+                ggml_compute_forward_set_cols(params, tensor->src0, tensor->opt[0], tensor);
+            } break;
         case GGML_OP_CONT:
             {
                 ggml_compute_forward_cont(params, tensor->src0, tensor);
@@ -8899,11 +10040,11 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_SOFT_MAX:
             {
-                ggml_compute_forward_soft_max(params, tensor->src0, tensor);
+                ggml_compute_forward_soft_max(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
             } break;
         case GGML_OP_ROPE:
             {
-                ggml_compute_forward_rope(params, tensor->src0, tensor->src1, tensor);
+                ggml_compute_forward_rope(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
             } break;
         case GGML_OP_CONV_1D_1S:
             {
@@ -8924,6 +10065,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_flash_ff(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
             } break;
+        case GGML_OP_ATTN_DECODE:
+            {
+                ggml_compute_forward_attn_decode(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
+            } break;
         case GGML_OP_NONE:
             {
                 // nop
@@ -8935,28 +10080,182 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
     }
 }
 
-////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////
 
-static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor * tensor, bool inplace) {
-    struct ggml_tensor * src0 = tensor->src0;
-    struct ggml_tensor * src1 = tensor->src1;
+// elementwise nodes that follow the node computing their src0 can be fused into it: they run
+// in its tasks, on the rows that the task has just computed (see ggml_graph_schedule_groups)
 
-    switch (tensor->op) {
-        case GGML_OP_DUP:
+static bool ggml_is_elementwise(const struct ggml_tensor * node) {
+    const struct ggml_tensor * src0 = node->src0;
+    const struct ggml_tensor * src1 = node->src1;
+
+    if (src0 == NULL || node->type != GGML_TYPE_F32 || src0->type != GGML_TYPE_F32 ||
+        !ggml_are_same_shape(src0, node) || node->nb[0] != sizeof(float) || src0->nb[0] != sizeof(float)) {
+        return false;
+    }
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+            return src1->type == GGML_TYPE_F32 && src1->nb[0] == sizeof(float) && ggml_can_broadcast(src1, src0);
+        case GGML_OP_SCALE:
+            return src1->type == GGML_TYPE_F32 && ggml_is_scalar(src1);
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_ABS:
+        case GGML_OP_SGN:
+        case GGML_OP_NEG:
+        case GGML_OP_STEP:
+        case GGML_OP_RELU:
+        case GGML_OP_GELU:
+        case GGML_OP_SILU:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// elements [i0, i1) of row ir of an elementwise node
+static void ggml_compute_forward_elementwise_row(const struct ggml_tensor * node, int64_t ir, int64_t i0, int64_t i1) {
+    const struct ggml_tensor * src0 = node->src0;
+    const struct ggml_tensor * src1 = node->src1;
+
+    const int64_t r1 = ir%node->ne[1];
+    const int64_t r2 = (ir/node->ne[1])%node->ne[2];
+    const int64_t r3 = ir/(node->ne[1]*node->ne[2]);
+
+    const int n = (int) (i1 - i0);
+
+    float * y = (float *) ((char *) node->data + r1*node->nb[1] + r2*node->nb[2] + r3*node->nb[3]) + i0;
+    float * x = (float *) ((char *) src0->data + r1*src0->nb[1] + r2*src0->nb[2] + r3*src0->nb[3]) + i0;
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
             {
-                if (src0->grad) {
-                    src0->grad = ggml_add_impl(ctx, src0->grad, tensor->grad, inplace);
+                // src1 row, repeating src1 along dims 1, 2 and 3 if needed
+                float * z = (float *) ((char *) src1->data +
+                        (r1%src1->ne[1])*src1->nb[1] + (r2%src1->ne[2])*src1->nb[2] + (r3%src1->ne[3])*src1->nb[3]) + i0;
+
+                switch (node->op) {
+                    case GGML_OP_ADD: ggml_vec_add_f32(n, y, x, z); break;
+                    case GGML_OP_SUB: ggml_vec_sub_f32(n, y, x, z); break;
+                    case GGML_OP_MUL: ggml_vec_mul_f32(n, y, x, z); break;
+                    default:          ggml_vec_div_f32(n, y, x, z); break;
                 }
             } break;
-        case GGML_OP_ADD:
+        case GGML_OP_SCALE:
             {
-                if (src0->grad) {
-                    src0->grad = ggml_add_impl(ctx, src0->grad, tensor->grad, inplace);
+                if (y != x) {
+                    memcpy(y, x, n*sizeof(float));
                 }
-                if (src1->grad) {
-                    src1->grad = ggml_add_impl(ctx, src1->grad, tensor->grad, inplace);
-                }
-            } break;
+                ggml_vec_scale_f32(n, y, *(float *) src1->data);
+            } break;
+        case GGML_OP_SQR:  ggml_vec_sqr_f32 (n, y, x); break;
+        case GGML_OP_SQRT: ggml_vec_sqrt_f32(n, y, x); break;
+        case GGML_OP_ABS:  ggml_vec_abs_f32 (n, y, x); break;
+        case GGML_OP_SGN:  ggml_vec_sgn_f32 (n, y, x); break;
+        case GGML_OP_NEG:  ggml_vec_neg_f32 (n, y, x); break;
+        case GGML_OP_STEP: ggml_vec_step_f32(n, y, x); break;
+        case GGML_OP_RELU: ggml_vec_relu_f32(n, y, x); break;
+        case GGML_OP_GELU: ggml_vec_gelu_f32(n, y, x); break;
+        case GGML_OP_SILU: ggml_vec_silu_f32(n, y, x); break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// computes a task of node and then the same rows of the nodes fused into it, in order
+static void ggml_compute_forward_fused(
+        struct ggml_compute_params * params,
+        struct ggml_tensor * node,
+        struct ggml_tensor ** fused,
+        int n_fused) {
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    if (node->op == GGML_OP_MUL_MAT) {
+        ggml_compute_forward(params, node);
+
+        if (params->type != GGML_TASK_COMPUTE) {
+            return;
+        }
+
+        // the src0 rows of this task, split as in ggml_compute_forward_mul_mat
+        // each of them is one element of the dst rows with the same i2 and i3
+        const int64_t ne01 = node->src0->ne[1];
+        const int64_t ne02 = node->src0->ne[2];
+
+        const int64_t nr = ne01*ne02*node->src0->ne[3];
+        const int64_t dr = (nr + nth - 1)/nth;
+
+        const int64_t ir0 = dr*ith;
+        const int64_t ir1 = MIN(ir0 + dr, nr);
+
+        for (int64_t ir = ir0; ir < ir1; ) {
+            const int64_t i23 = ir/ne01;
+            const int64_t i01 = ir%ne01;
+            const int64_t n01 = MIN(ne01 - i01, ir1 - ir);
+
+            for (int64_t i1 = 0; i1 < node->ne[1]; i1++) {
+                for (int k = 0; k < n_fused; k++) {
+                    ggml_compute_forward_elementwise_row(fused[k], i23*node->ne[1] + i1, i01, i01 + n01);
+                }
+            }
+
+            ir += n01;
+        }
+
+        return;
+    }
+
+    if (params->type != GGML_TASK_COMPUTE) {
+        return;
+    }
+
+    // an elementwise node and those fused into it, row by row
+    const int64_t nr = ggml_nrows(node);
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ir++) {
+        ggml_compute_forward_elementwise_row(node, ir, 0, node->ne[0]);
+        for (int k = 0; k < n_fused; k++) {
+            ggml_compute_forward_elementwise_row(fused[k], ir, 0, node->ne[0]);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor * tensor, bool inplace) {
+    struct ggml_tensor * src0 = tensor->src0;
+    struct ggml_tensor * src1 = tensor->src1;
+
+    switch (tensor->op) {
+        case GGML_OP_DUP:
+            {
+                if (src0->grad) {
+                    src0->grad = ggml_add_impl(ctx, src0->grad, tensor->grad, inplace);
+                }
+            } break;
+        case GGML_OP_ADD:
+            {
+                if (src0->grad) {
+                    src0->grad = ggml_add_impl(ctx, src0->grad, tensor->grad, inplace);
+                }
+                if (src1->grad) {
+                    src1->grad = ggml_add_impl(ctx, src1->grad, tensor->grad, inplace);
+                }
+            } break;
         case GGML_OP_SUB:
             {
                 if (src0->grad) {
@@ -9131,6 +10430,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_SET_COLS:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_CONT:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -9183,6 +10486,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // not supported
             } break;
+        case GGML_OP_ATTN_DECODE:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
         case GGML_OP_NONE:
             {
                 // nop
@@ -9194,6 +10501,26 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
     }
 }
 
+static size_t ggml_hash(const void * p) {
+    return (size_t)(uintptr_t) p % GGML_GRAPH_HASHTABLE_SIZE;
+}
+
+// adds the tensor to the visited set, returns false if it was already there
+static bool ggml_hash_insert(struct ggml_tensor * hash_table[], struct ggml_tensor * p) {
+    size_t h = ggml_hash(p);
+
+    // linear probing, the table is never full as it is larger than the nodes and leafs together
+    while (hash_table[h] != NULL) {
+        if (hash_table[h] == p) {
+            return false;
+        }
+        h = (h + 1) % GGML_GRAPH_HASHTABLE_SIZE;
+    }
+
+    hash_table[h] = p;
+    return true;
+}
+
 static void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor * node) {
     if (node->grad == NULL) {
         // this usually happens when we generate intermediate nodes from constants in the backward pass
@@ -9204,16 +10531,8 @@ static void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor *
     }
 
     // check if already visited
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        if (cgraph->nodes[i] == node) {
-            return;
-        }
-    }
-
-    for (int i = 0; i < cgraph->n_leafs; i++) {
-        if (cgraph->leafs[i] == node) {
-            return;
-        }
+    if (!ggml_hash_insert(cgraph->visited_hash_table, node)) {
+        return;
     }
 
     if (node->src0) {
@@ -9249,6 +10568,7 @@ static void ggml_build_forward_impl(struct ggml_cgraph * cgraph, struct ggml_ten
     if (!expand) {
         cgraph->n_nodes = 0;
         cgraph->n_leafs = 0;
+        memset(cgraph->visited_hash_table, 0, sizeof(cgraph->visited_hash_table));
     }
 
     const int n0 = cgraph->n_nodes;
@@ -9274,11 +10594,13 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_nodes      =*/ 0,
         /*.n_leafs      =*/ 0,
         /*.n_threads    =*/ 0,
+        /*.threadpool   =*/ NULL,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
         /*.nodes        =*/ { NULL },
         /*.grads        =*/ { NULL },
         /*.leafs        =*/ { NULL },
+        /*.visited_hash_table =*/ { NULL },
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
@@ -9328,189 +10650,680 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 }
 
 //
-// thread data
-//
-// synchronization is done via busy loops
-// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
-//
-
-#ifdef __APPLE__
-
-//#include <os/lock.h>
+// thread pool
 //
-//typedef os_unfair_lock ggml_lock_t;
+// the workers of a pool wait for the next graph by spinning for a while and then
+// sleeping on a condition variable. within a graph, the threads synchronize with
+// spinning barriers, only around the groups of nodes that more than one thread works on
 //
-//#define ggml_lock_init(x)    UNUSED(x)
-//#define ggml_lock_destroy(x) UNUSED(x)
-//#define ggml_lock_lock       os_unfair_lock_lock
-//#define ggml_lock_unlock     os_unfair_lock_unlock
+// consecutive nodes that do not touch each other's data form a group. the threads pull
+// the tasks of all the nodes in a group from a shared counter, so independent nodes run
+// at the same time and a thread that is done with its task takes the next one left
 //
-//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
-
-typedef int ggml_lock_t;
-
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
-
-#define GGML_LOCK_INITIALIZER 0
 
 typedef pthread_t ggml_thread_t;
 
 #define ggml_thread_create pthread_create
 #define ggml_thread_join   pthread_join
 
-#else
+// iterations a worker spins for the next graph before it goes to sleep
+// doubled after a graph that came while spinning, halved after one that did not
+#define GGML_THREADPOOL_SPIN_MIN (1 << 10)
+#define GGML_THREADPOOL_SPIN_MAX (1 << 18)
+
+// iterations a thread spins in a barrier before it yields its core
+#define GGML_BARRIER_SPIN (1 << 10)
+
+// max number of nodes computed together between two barriers
+#define GGML_MAX_CONCURRENT_NODES 16
+
+// max number of elementwise nodes fused into the node before them
+#define GGML_MAX_FUSED_NODES 8
+
+// the rows of a matrix multiplication are split into more tasks than threads, so a thread
+// that is slowed down leaves its remaining chunks to the others
+// more chunks balance better and cost more claims of the shared chunk counter, the best
+// values depend on the machine, so they can be set when building:
+//   cmake -DLLAMA_CHUNKS_PER_THREAD=8 -DLLAMA_CHUNK_MIN_ROWS=32
+//   make LLAMA_CHUNKS_PER_THREAD=8 LLAMA_CHUNK_MIN_ROWS=32
+// 1 chunk per thread gives the static split of one range of rows per thread
+#ifndef GGML_CHUNKS_PER_THREAD
+#define GGML_CHUNKS_PER_THREAD 4
+#endif
+#ifndef GGML_CHUNK_MIN_ROWS
+#define GGML_CHUNK_MIN_ROWS    16
+#endif
 
-//typedef pthread_spinlock_t ggml_lock_t;
+// min cells of the KV cache in a chunk of a head of the single token attention
+#ifndef GGML_ATTN_CHUNK_MIN_CELLS
+#define GGML_ATTN_CHUNK_MIN_CELLS 128
+#endif
+
+static inline void ggml_cpu_relax(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+    __asm__ volatile("yield" ::: "memory");
+#endif
+}
 
-//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
-//#define ggml_lock_destroy pthread_spin_destroy
-//#define ggml_lock_lock    pthread_spin_lock
-//#define ggml_lock_unlock  pthread_spin_unlock
+struct ggml_compute_state {
+    ggml_thread_t thrd;
 
-typedef int ggml_lock_t;
+    int ith;
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+    struct ggml_threadpool * pool;
+};
 
-#define GGML_LOCK_INITIALIZER 0
+// nodes [i0, i1) of the graph, none of them reads or writes the data that another writes
+struct ggml_graph_group {
+    int i0;
+    int i1;
 
-typedef pthread_t ggml_thread_t;
+    int n_tasks;    // compute tasks of the nodes in the group
+    int n_op_tasks; // compute tasks of the nodes that are not views
+    int n_init;     // INIT tasks of the nodes in the group
+    int n_work;     // nodes with work data, the only ones with a FINALIZE pass
 
-#define ggml_thread_create pthread_create
-#define ggml_thread_join   pthread_join
+    atomic_int next[3]; // next task of each pass (INIT, COMPUTE, FINALIZE)
+};
 
-#endif
+struct ggml_graph_schedule {
+    int n_groups;
 
-struct ggml_compute_state_shared {
-    ggml_lock_t spin;
+    struct ggml_graph_group * groups; // [n_nodes]
 
-    int n_threads;
+    // work data of each node, the nodes of a group only share theirs to use the same INIT
+    size_t * work_offs;  // [n_nodes]
+    size_t * work_size;  // [n_nodes]
+    int    * init_tasks; // [n_nodes], 0 for the nodes that use the INIT of another
 
-    // synchronization primitives
-    atomic_int  n_ready;
-    atomic_bool has_work;
-    atomic_bool stop; // stop all threads
+    // next node computed in the tasks of each node, -1 if none
+    // the fused nodes have no tasks of their own
+    int * fused_next; // [n_nodes]
 };
 
-struct ggml_compute_state {
-    ggml_thread_t thrd;
+struct ggml_threadpool {
+    // written by every thread, so each has a cache line of its own
+    atomic_int n_graph; // number of graphs posted to the pool
+    char pad0[CACHE_LINE_SIZE - sizeof(atomic_int)];
+
+    atomic_int n_barrier;
+    char pad1[CACHE_LINE_SIZE - sizeof(atomic_int)];
+
+    atomic_int n_barrier_passed;
+    char pad2[CACHE_LINE_SIZE - sizeof(atomic_int)];
+
+    atomic_bool stop;
+
+    // the sleeping workers wait for a new graph or stop
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    // graph being computed and the number of threads that compute it
+    struct ggml_cgraph          * cgraph;
+    struct ggml_graph_schedule  * sched;
+    int                           n_active;
 
-    struct ggml_compute_params params;
-    struct ggml_tensor * node;
+    int  n_threads;
+    bool pin;
 
-    struct ggml_compute_state_shared * shared;
+    struct ggml_compute_state * workers; // [n_threads - 1]
 };
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+static void ggml_thread_pin(int i) {
+#if defined(__linux__)
+    const int n_cpu = (int) sysconf(_SC_NPROCESSORS_ONLN);
 
-    const int n_threads = state->shared->n_threads;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(i % (n_cpu > 0 ? n_cpu : 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << (i % (8*sizeof(DWORD_PTR))));
+#else
+    UNUSED(i);
+#endif
+}
 
-    while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
+static void ggml_barrier(struct ggml_threadpool * pool, int n_threads) {
+    if (n_threads == 1) {
+        return;
+    }
+
+    const int n_passed = atomic_load(&pool->n_barrier_passed);
+
+    if (atomic_fetch_add(&pool->n_barrier, 1) == n_threads - 1) {
+        // last thread in: reset the counter and let the others through
+        atomic_store(&pool->n_barrier, 0);
+        atomic_fetch_add(&pool->n_barrier_passed, 1);
+        return;
+    }
+
+    for (int spin = 0; atomic_load(&pool->n_barrier_passed) == n_passed; spin++) {
+        if (spin < GGML_BARRIER_SPIN) {
+            ggml_cpu_relax();
         } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
+            sched_yield();
+        }
+    }
+}
+
+static bool ggml_op_is_view(enum ggml_op op) {
+    return op == GGML_OP_NONE || op == GGML_OP_RESHAPE || op == GGML_OP_VIEW ||
+           op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
+
+// runs the tasks of one pass over a group until none is left
+static void ggml_graph_compute_pass(
+        struct ggml_cgraph * cgraph,
+        struct ggml_graph_schedule * sched,
+        struct ggml_graph_group * group,
+        enum ggml_task_type type) {
+    const int n =
+        type == GGML_TASK_INIT    ? group->n_init  :
+        type == GGML_TASK_COMPUTE ? group->n_tasks : group->n_work;
+
+    for (int t = atomic_fetch_add(&group->next[type], 1); t < n; t = atomic_fetch_add(&group->next[type], 1)) {
+        // find the node of the task, the FINALIZE pass has one per node with work data
+        int i   = group->i0;
+        int ith = t;
+        int nth = 0;
+
+        for (;; i++) {
+            nth =
+                type == GGML_TASK_INIT    ? sched->init_tasks[i]     :
+                type == GGML_TASK_COMPUTE ? cgraph->nodes[i]->n_tasks : (sched->work_size[i] > 0);
+            if (ith < nth) {
+                break;
             }
+            ith -= nth;
         }
 
-        atomic_fetch_sub(&state->shared->n_ready, 1);
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        struct ggml_compute_params params = {
+            /*.type  =*/ type,
+            /*.ith   =*/ ith,
+            /*.nth   =*/ type == GGML_TASK_INIT ? nth : node->n_tasks,
+            /*.wsize =*/ sched->work_size[i],
+            /*.wdata =*/ sched->work_size[i] > 0 ? (char *) cgraph->work->data + sched->work_offs[i] : NULL,
+        };
 
-        // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
+        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
+        const int64_t perf_node_start_time_us = ggml_perf_time_us();
+
+        if (sched->fused_next[i] >= 0) {
+            struct ggml_tensor * fused[GGML_MAX_FUSED_NODES];
+            int n_fused = 0;
+
+            for (int k = sched->fused_next[i]; k >= 0; k = sched->fused_next[k]) {
+                fused[n_fused++] = cgraph->nodes[k];
             }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
+
+            ggml_compute_forward_fused(&params, node, fused, n_fused);
+        } else {
+            ggml_compute_forward(&params, node);
         }
 
-        // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
-            break;
+        // performance stats (node), from the first task of each
+        // the time of the fused nodes is counted in the node they are fused into
+        if (type == GGML_TASK_COMPUTE && ith == 0) {
+            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
+            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
+
+            node->perf_runs++;
+            node->perf_cycles  += perf_cycles_cur;
+            node->perf_time_us += perf_time_us_cur;
+
+            for (int k = sched->fused_next[i]; k >= 0; k = sched->fused_next[k]) {
+                cgraph->nodes[k]->perf_runs++;
+            }
+        }
+    }
+}
+
+// computes the nodes of the graph as thread ith of n_threads
+static void ggml_graph_compute_nodes(
+        struct ggml_threadpool * pool,
+        struct ggml_cgraph * cgraph,
+        struct ggml_graph_schedule * sched,
+        int ith,
+        int n_threads) {
+    // thread 0 computes the groups with a single task alone, the others catch up
+    // before the next group that they work on
+    bool synced = true;
+
+    // the schedule is freed once the threads are through the last barrier, so nothing
+    // is read from it after a barrier that may be the last one
+    const int n_groups = sched->n_groups;
+
+    for (int g = 0; g < n_groups; g++) {
+        struct ggml_graph_group * group = &sched->groups[g];
+
+        GGML_PRINT_DEBUG_5("%s: %d-%d/%d\n", __func__, group->i0, group->i1, cgraph->n_nodes);
+
+        const bool parallel = group->n_op_tasks > 1 || group->n_init > 1;
+        const bool has_init = group->n_init > 0;
+        const bool has_work = group->n_work > 0;
+
+        if (parallel) {
+            if (!synced) {
+                ggml_barrier(pool, n_threads);
+            }
+        } else if (ith != 0) {
+            synced = false;
+            continue;
         }
 
-        if (state->node) {
-            if (state->params.ith < state->params.nth) {
-                ggml_compute_forward(&state->params, state->node);
+        if (has_init) {
+            ggml_graph_compute_pass(cgraph, sched, group, GGML_TASK_INIT);
+            if (parallel) {
+                ggml_barrier(pool, n_threads);
             }
+        }
 
-            state->node = NULL;
-        } else {
+        ggml_graph_compute_pass(cgraph, sched, group, GGML_TASK_COMPUTE);
+        if (parallel) {
+            ggml_barrier(pool, n_threads);
+        }
+
+        if (has_work) {
+            ggml_graph_compute_pass(cgraph, sched, group, GGML_TASK_FINALIZE);
+            if (parallel) {
+                ggml_barrier(pool, n_threads);
+            }
+        }
+
+        synced = parallel;
+    }
+
+    // the graph is done when every thread is
+    if (!synced) {
+        ggml_barrier(pool, n_threads);
+    }
+}
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * pool  = state->pool;
+
+    if (pool->pin) {
+        ggml_thread_pin(state->ith);
+    }
+
+    int n_graph = 0;
+    int n_spin  = GGML_THREADPOOL_SPIN_MIN;
+
+    while (true) {
+        bool slept = false;
+
+        // wait for a new graph
+        for (int spin = 0; atomic_load(&pool->n_graph) == n_graph && !atomic_load(&pool->stop); spin++) {
+            if (spin < n_spin) {
+                ggml_cpu_relax();
+                continue;
+            }
+
+            pthread_mutex_lock(&pool->mutex);
+            while (atomic_load(&pool->n_graph) == n_graph && !atomic_load(&pool->stop)) {
+                pthread_cond_wait(&pool->cond, &pool->mutex);
+            }
+            pthread_mutex_unlock(&pool->mutex);
+
+            slept = true;
+        }
+
+        n_spin = slept ? MAX(n_spin/2, GGML_THREADPOOL_SPIN_MIN) : MIN(n_spin*2, GGML_THREADPOOL_SPIN_MAX);
+
+        if (atomic_load(&pool->stop)) {
             break;
         }
+
+        n_graph = atomic_load(&pool->n_graph);
+
+        if (state->ith < pool->n_active) {
+            ggml_graph_compute_nodes(pool, pool->cgraph, pool->sched, state->ith, pool->n_active);
+        }
     }
 
     return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    const int n_threads = cgraph->n_threads;
-
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+struct ggml_threadpool * ggml_threadpool_new(int n_threads, bool pin) {
+    GGML_ASSERT(n_threads >= 1);
 
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
-
-        atomic_store(&state_shared.has_work, true);
-
-        for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
-            };
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+
+    atomic_store(&pool->n_graph,          0);
+    atomic_store(&pool->n_barrier,        0);
+    atomic_store(&pool->n_barrier_passed, 0);
+    atomic_store(&pool->stop,             false);
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init (&pool->cond,  NULL);
+
+    pool->cgraph    = NULL;
+    pool->sched     = NULL;
+    pool->n_active  = 0;
+    pool->n_threads = n_threads;
+    pool->pin       = pin;
+    pool->workers   = n_threads > 1 ? malloc(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+
+    for (int j = 0; j < n_threads - 1; j++) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd = 0,
+            .ith  = j + 1,
+            .pool = pool,
+        };
+
+        int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_graph_compute_thread, &pool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return pool;
+}
 
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->stop, true);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    pthread_cond_destroy (&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
+static int ggml_n_chunks(int n_threads, int64_t n_rows) {
+    if (n_threads == 1) {
+        return 1;
+    }
+
+    return (int) MAX(n_threads, MIN(n_threads*GGML_CHUNKS_PER_THREAD, n_rows/GGML_CHUNK_MIN_ROWS));
+}
+
+// bytes from the first to the last element of a tensor, for views with any strides
+static size_t ggml_nbytes_span(const struct ggml_tensor * tensor) {
+    if (ggml_nelements(tensor) == 0) {
+        return 0;
+    }
+
+    size_t span = (tensor->ne[0]/GGML_BLCK_SIZE[tensor->type])*tensor->nb[0];
+    for (int i = 1; i < GGML_MAX_DIMS; i++) {
+        span += (tensor->ne[i] - 1)*tensor->nb[i];
+    }
+
+    return span;
+}
+
+static bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    const char * a0 = a->data;
+    const char * b0 = b->data;
+
+    return a0 < b0 + ggml_nbytes_span(b) && b0 < a0 + ggml_nbytes_span(a);
+}
+
+// true if node b has to wait for node a: b reads what a writes, or writes what a reads or writes
+// views do not compute anything, the nodes that use them read the data of their source
+static bool ggml_node_depends(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_op_is_view(a->op) || ggml_op_is_view(b->op)) {
+        return false;
+    }
+
+    const struct ggml_tensor * srcs_a[2 + GGML_MAX_OPT] = { a->src0, a->src1 };
+    const struct ggml_tensor * srcs_b[2 + GGML_MAX_OPT] = { b->src0, b->src1 };
+    for (int i = 0; i < GGML_MAX_OPT; i++) {
+        srcs_a[2 + i] = a->opt[i];
+        srcs_b[2 + i] = b->opt[i];
+    }
+
+    if (ggml_tensors_overlap(a, b)) {
+        return true;
+    }
+
+    for (int i = 0; i < 2 + GGML_MAX_OPT; i++) {
+        if ((srcs_b[i] && ggml_tensors_overlap(a, srcs_b[i])) ||
+            (srcs_a[i] && ggml_tensors_overlap(srcs_a[i], b))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the INIT pass of a matrix multiplication only converts src1 to the type that src0 is
+// multiplied with, so the result can be used by all those with the same src1 and src0 type
+static bool ggml_mul_mat_share_init(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a->op != GGML_OP_MUL_MAT || b->op != GGML_OP_MUL_MAT || a->opt[0] || b->opt[0] ||
+        a->src1 != b->src1 || a->src0->type != b->src0->type || a->src0->type == GGML_TYPE_F32) {
+        return false;
+    }
+
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    if (ggml_compute_forward_mul_mat_use_blas(a->src0, a->src1, a) ||
+        ggml_compute_forward_mul_mat_use_blas(b->src0, b->src1, b)) {
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+// a node can have elementwise nodes fused into it if it computes whole rows, or whole columns
+// of its rows for a matrix multiplication, in each task
+static bool ggml_node_can_fuse_into(const struct ggml_tensor * node) {
+    if (node->op == GGML_OP_MUL_MAT) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+        if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+            return false;
+        }
+#endif
+        return node->type == GGML_TYPE_F32 && node->ne[2] == node->src0->ne[2];
+    }
+
+    return ggml_is_elementwise(node);
+}
+
+// true if node i can be computed in the tasks of the chain of fused nodes that starts with node
+// head of the group and ends with node tail: it is elementwise on the result of tail, nothing else
+// in the chain writes what it reads, and it has no dependency on the other nodes of the group
+static bool ggml_node_can_fuse(const struct ggml_cgraph * cgraph, const struct ggml_graph_group * group, int head, int tail, int i) {
+    const struct ggml_tensor * node = cgraph->nodes[i];
+
+    if (!ggml_is_elementwise(node) || node->src0 != cgraph->nodes[tail] || !ggml_are_same_shape(node, cgraph->nodes[head])) {
+        return false;
+    }
+
+    for (int j = group->i0; j < i; j++) {
+        const struct ggml_tensor * other = cgraph->nodes[j];
+
+        if (ggml_op_is_view(other->op)) {
+            continue;
+        }
+
+        if (j < head) {
+            if (ggml_node_depends(other, node)) {
+                return false;
+            }
+            continue;
+        }
+
+        // the nodes of the chain have only computed the rows of the task when this one runs
+        if (node->src1 && ggml_tensors_overlap(other, node->src1)) {
+            return false;
+        }
+
+        // and this one must not overwrite what they still read for the other rows
+        const struct ggml_tensor * srcs[2 + GGML_MAX_OPT] = { j == head ? other->src0 : NULL, other->src1 };
+        for (int k = 0; k < GGML_MAX_OPT; k++) {
+            srcs[2 + k] = other->opt[k];
+        }
+
+        for (int k = 0; k < 2 + GGML_MAX_OPT; k++) {
+            if (srcs[k] && ggml_tensors_overlap(node, srcs[k])) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// splits the nodes into groups that can be computed together and places the work data
+// of the nodes of each group one after the other. returns the size of the work buffer
+static size_t ggml_graph_schedule_groups(struct ggml_cgraph * cgraph, struct ggml_graph_schedule * sched, size_t work_max) {
+    size_t work_size = 0;
+
+    struct ggml_graph_group * group = NULL;
+    size_t group_work = 0;
+
+    // chain of fused nodes that the next node may join, -1 if none
+    int head    = -1;
+    int tail    = -1;
+    int n_fused = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        sched->fused_next[i] = -1;
+
+        if (head >= 0 && n_fused < GGML_MAX_FUSED_NODES && ggml_node_can_fuse(cgraph, group, head, tail, i)) {
+            GGML_ASSERT(sched->work_size[i] == 0);
+
+            sched->fused_next[tail] = i;
+            sched->work_offs[i]     = 0;
+            node->n_tasks           = 0;
+
+            tail = i;
+            n_fused++;
+
+            group->i1++;
+            continue;
+        }
+
+        // the work data of each node starts on a cache line of its own
+        const size_t node_offs = (group_work + CACHE_LINE_SIZE - 1)/CACHE_LINE_SIZE*CACHE_LINE_SIZE;
+
+        bool join = group != NULL &&
+            group->i1 - group->i0 < GGML_MAX_CONCURRENT_NODES &&
+            (sched->work_size[i] == 0 || node_offs + sched->work_size[i] <= work_max);
+
+        for (int j = group ? group->i0 : i; join && j < i; j++) {
+            join = !ggml_node_depends(cgraph->nodes[j], node);
+        }
+
+        if (!join) {
+            group = &sched->groups[sched->n_groups++];
+
+            group->i0         = i;
+            group->i1         = i;
+            group->n_tasks    = 0;
+            group->n_op_tasks = 0;
+            group->n_init     = 0;
+            group->n_work     = 0;
+
+            for (int k = 0; k < 3; k++) {
+                atomic_store(&group->next[k], 0);
+            }
+
+            group_work = 0;
+        }
+
+        sched->work_offs[i] = 0;
+
+        // reuse the converted src1 of a matrix multiplication in the group if there is one
+        for (int j = group->i0; j < i && sched->work_size[i] > 0; j++) {
+            if (sched->init_tasks[j] > 0 && ggml_mul_mat_share_init(cgraph->nodes[j], node)) {
+                sched->work_offs[i]  = sched->work_offs[j];
+                sched->init_tasks[i] = 0;
+                break;
+            }
+        }
+
+        if (sched->work_size[i] > 0 && sched->init_tasks[i] > 0) {
+            sched->work_offs[i] = join ? node_offs : 0;
+            group_work = sched->work_offs[i] + sched->work_size[i];
+        }
+
+        group->i1++;
+        group->n_tasks    += node->n_tasks;
+        group->n_op_tasks += ggml_op_is_view(node->op) ? 0 : node->n_tasks;
+        group->n_init     += sched->init_tasks[i];
+        group->n_work     += sched->work_size[i] > 0;
+
+        work_size = MAX(work_size, group_work);
+
+        // views of the chain do not end it, they do not compute anything
+        if (!ggml_op_is_view(node->op) || head < 0 || !join) {
+            const bool start = ggml_node_can_fuse_into(node);
+
+            head    = start ? i : -1;
+            tail    = start ? i : -1;
+            n_fused = 0;
         }
     }
 
+    return work_size;
+}
+
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    struct ggml_threadpool * pool = cgraph->threadpool;
+
+    // without a pool, the threads only live for this computation
+    const bool own_pool = pool == NULL && cgraph->n_threads > 1;
+    if (own_pool) {
+        pool = ggml_threadpool_new(cgraph->n_threads, false);
+    }
+
+    const int n_threads = pool ? MIN(cgraph->n_threads, pool->n_threads) : 1;
+
+    struct ggml_graph_schedule sched = {
+        /*.n_groups   =*/ 0,
+        /*.groups     =*/ malloc(sizeof(struct ggml_graph_group)*MAX(cgraph->n_nodes, 1)),
+        /*.work_offs  =*/ malloc(sizeof(size_t)*MAX(cgraph->n_nodes, 1)),
+        /*.work_size  =*/ malloc(sizeof(size_t)*MAX(cgraph->n_nodes, 1)),
+        /*.init_tasks =*/ malloc(sizeof(int)*MAX(cgraph->n_nodes, 1)),
+        /*.fused_next =*/ malloc(sizeof(int)*MAX(cgraph->n_nodes, 1)),
+    };
+
     // initialize tasks + work buffer
     {
-        size_t work_size = 0;
-
         // thread scheduling for the different operations
         for (int i = 0; i < cgraph->n_nodes; i++) {
             struct ggml_tensor * node = cgraph->nodes[i];
 
+            sched.work_size[i]  = 0;
+            sched.init_tasks[i] = 0;
+
             switch (node->op) {
                 case GGML_OP_DUP:
                     {
                         node->n_tasks = 1;
                     } break;
                 case GGML_OP_ADD:
+                case GGML_OP_MUL:
                     {
                         node->n_tasks = n_threads;
                     } break;
                 case GGML_OP_SUB:
-                case GGML_OP_MUL:
                 case GGML_OP_DIV:
                 case GGML_OP_SQR:
                 case GGML_OP_SQRT:
@@ -9540,7 +11353,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                     } break;
                 case GGML_OP_MUL_MAT:
                     {
-                        node->n_tasks = n_threads;
+                        node->n_tasks = ggml_n_chunks(n_threads, ggml_nrows(node->src0));
 
                         // TODO: use different scheduling for different matrix sizes
                         //const int nr0 = ggml_nrows(node->src0);
@@ -9562,9 +11375,11 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                                 //printf("cur = %zu\n", cur);
                             } else {
                                 cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+                                sched.init_tasks[i] = MIN(n_threads, ggml_nrows(node->src1));
                             }
 #else
                             cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+                            sched.init_tasks[i] = MIN(n_threads, ggml_nrows(node->src1));
 #endif
                         } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
                             cur = 0;
@@ -9575,19 +11390,35 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                                 cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
                             } else
 #endif
-                            {
+                            if (node->opt[0]) {
+                                cur = 0; // ggml_mul_mat_dequant reads src1 as it is
+                            } else {
                                 cur = GGML_TYPE_SIZE[node->src0->type]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[node->src0->type];
+                                sched.init_tasks[i] = MIN(n_threads, ggml_nrows(node->src1));
                             }
                         } else {
                             GGML_ASSERT(false);
                         }
 
-                        work_size = MAX(work_size, cur);
+                        sched.work_size[i] = cur;
                     } break;
                 case GGML_OP_SCALE:
                     {
                         node->n_tasks = n_threads;
                     } break;
+                case GGML_OP_SET_COLS:
+                    {
+                        node->n_tasks = n_threads;
+
+                        // one dst row per thread to patch partially covered blocks
+                        size_t cur = 0;
+
+                        if (quantize_fns[node->type].quantize_row_q) {
+                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->ne[0] + CACHE_LINE_SIZE_F32)*n_threads;
+                        }
+
+                        sched.work_size[i] = cur;
+                    } break;
                 case GGML_OP_CPY:
                 case GGML_OP_CONT:
                 case GGML_OP_RESHAPE:
@@ -9635,7 +11466,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                             GGML_ASSERT(false);
                         }
 
-                        work_size = MAX(work_size, cur);
+                        sched.work_size[i] = cur;
                     } break;
                 case GGML_OP_FLASH_ATTN:
                     {
@@ -9655,7 +11486,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                             cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
                         }
 
-                        work_size = MAX(work_size, cur);
+                        sched.work_size[i] = cur;
                     } break;
                 case GGML_OP_FLASH_FF:
                     {
@@ -9673,7 +11504,26 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                             cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
                         }
 
-                        work_size = MAX(work_size, cur);
+                        sched.work_size[i] = cur;
+                    } break;
+                case GGML_OP_ATTN_DECODE:
+                    {
+                        const int64_t n_head = node->src0->ne[1];
+                        const int64_t n_kv   = node->src1->ne[2];
+
+                        // split the cells of each head into chunks when there are not enough heads
+                        // to keep the threads busy
+                        const int n_chunks = n_threads == 1 ? 1 :
+                            (int) MAX(1, MIN((n_threads*GGML_CHUNKS_PER_THREAD + n_head - 1)/n_head, n_kv/GGML_ATTN_CHUNK_MIN_CELLS));
+
+                        node->n_tasks = (int) n_head*n_chunks;
+
+                        size_t q_size;
+                        size_t task_size;
+                        ggml_attn_decode_work(node, n_chunks, &q_size, &task_size);
+
+                        sched.work_size[i]  = q_size + node->n_tasks*task_size;
+                        sched.init_tasks[i] = node->src1->type == GGML_TYPE_F32 ? 1 : (int) MIN(n_threads, n_head);
                     } break;
                 case GGML_OP_NONE:
                     {
@@ -9684,8 +11534,16 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                         GGML_ASSERT(false);
                     } break;
             }
+
+            // the other ops with work data initialize it in a single task
+            if (sched.work_size[i] > 0 && sched.init_tasks[i] == 0) {
+                sched.init_tasks[i] = 1;
+            }
         }
 
+        // a work buffer that is already there bounds the groups
+        const size_t work_size = ggml_graph_schedule_groups(cgraph, &sched, cgraph->work ? cgraph->work_size : SIZE_MAX);
+
         if (cgraph->work != NULL && work_size > cgraph->work_size) {
             GGML_ASSERT(false); // TODO: better handling
         }
@@ -9701,165 +11559,29 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
-
-        struct ggml_tensor * node = cgraph->nodes[i];
-
-        // TODO: this could be used to avoid unnecessary computations, but it needs to be improved
-        //if (node->grad == NULL && node->perf_runs > 0) {
-        //    continue;
-        //}
-
-        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
-        const int64_t perf_node_start_time_us = ggml_perf_time_us();
-
-        // INIT
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_INIT,
-            /*.ith   =*/ 0,
-            /*.nth   =*/ node->n_tasks,
-            /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-            /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
-        };
-
-        ggml_compute_forward(&params, node);
-
-        // COMPUTE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_store(&state_shared.has_work, true);
-        }
-
-        params.type = GGML_TASK_COMPUTE;
-        ggml_compute_forward(&params, node);
-
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-        }
-
-        // FINALIZE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_FINALIZE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_store(&state_shared.has_work, true);
-        }
-
-        params.type = GGML_TASK_FINALIZE;
-        ggml_compute_forward(&params, node);
-
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-        }
-
-        // performance stats (node)
-        {
-            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
-            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
+    if (n_threads > 1) {
+        pool->cgraph   = cgraph;
+        pool->sched    = &sched;
+        pool->n_active = n_threads;
 
-            node->perf_runs++;
-            node->perf_cycles  += perf_cycles_cur;
-            node->perf_time_us += perf_time_us_cur;
-        }
+        pthread_mutex_lock(&pool->mutex);
+        atomic_fetch_add(&pool->n_graph, 1);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
     }
 
-    // join thread pool
-    if (n_threads > 1) {
-        atomic_store(&state_shared.stop, true);
-        atomic_store(&state_shared.has_work, true);
-
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
-        }
+    ggml_graph_compute_nodes(pool, cgraph, &sched, 0, n_threads);
 
-        ggml_lock_destroy(&state_shared.spin);
+    if (own_pool) {
+        ggml_threadpool_free(pool);
     }
 
+    free(sched.groups);
+    free(sched.work_offs);
+    free(sched.work_size);
+    free(sched.init_tasks);
+    free(sched.fused_next);
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
@@ -179,6 +179,7 @@ extern "C" {
 
 #define GGML_MAX_DIMS     4
 #define GGML_MAX_NODES    4096
+#define GGML_GRAPH_HASHTABLE_SIZE 8273 // prime, more than twice GGML_MAX_NODES
 #define GGML_MAX_PARAMS   16
 #define GGML_MAX_CONTEXTS 64
 #define GGML_MAX_OPT      4
@@ -206,6 +207,7 @@ enum ggml_type {
     GGML_TYPE_I8,
     GGML_TYPE_I16,
     GGML_TYPE_I32,
+    GGML_TYPE_Q8_0,
     GGML_TYPE_COUNT,
 };
 
@@ -237,6 +239,7 @@ enum ggml_op {
 
     GGML_OP_SCALE,
     GGML_OP_CPY,
+    GGML_OP_SET_COLS,
     GGML_OP_CONT,
     GGML_OP_RESHAPE,
     GGML_OP_VIEW,
@@ -251,6 +254,7 @@ enum ggml_op {
 
     GGML_OP_FLASH_ATTN,
     GGML_OP_FLASH_FF,
+    GGML_OP_ATTN_DECODE,
 
     GGML_OP_COUNT,
 };
@@ -301,12 +305,16 @@ struct ggml_tensor {
     char padding[8];
 };
 
+struct ggml_threadpool;
+
 // computation graph
 struct ggml_cgraph {
     int n_nodes;
     int n_leafs;
     int n_threads;
 
+    struct ggml_threadpool * threadpool; // NULL to start the threads for each computation
+
     size_t work_size;
     struct ggml_tensor * work;
 
@@ -314,6 +322,9 @@ struct ggml_cgraph {
     struct ggml_tensor * grads[GGML_MAX_NODES];
     struct ggml_tensor * leafs[GGML_MAX_NODES];
 
+    // nodes and leafs of the graph, open addressing with linear probing
+    struct ggml_tensor * visited_hash_table[GGML_GRAPH_HASHTABLE_SIZE];
+
     // performance
     int     perf_runs;
     int64_t perf_cycles;
@@ -418,6 +429,8 @@ struct ggml_tensor * ggml_dup(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// b is broadcast to the shape of a: each of its dims 1, 2 and 3 is either the same as in a or 1,
+// e.g. a bias row added to every row of a or an attention mask shared by all heads
 struct ggml_tensor * ggml_add(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -428,6 +441,7 @@ struct ggml_tensor * ggml_sub(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// b is broadcast to the shape of a in the same way as for ggml_add
 struct ggml_tensor * ggml_mul(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -503,6 +517,12 @@ struct ggml_tensor * ggml_rms_norm(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// ggml_mul(ggml_rms_norm(a), b) in a single pass, b is broadcast as for ggml_mul
+struct ggml_tensor * ggml_rms_norm_mul(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b);
+
 // A: m rows, n columns
 // B: p rows, n columns (i.e. we transpose it internally)
 // result is m columns, p rows
@@ -511,6 +531,14 @@ struct ggml_tensor * ggml_mul_mat(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// ggml_mul_mat, but a quantized A is dequantized inside the dot products instead of
+// quantizing B to the type of A, so B keeps its full precision
+// for products of two activations, e.g. the attention with a quantized KV cache
+struct ggml_tensor * ggml_mul_mat_dequant(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b);
+
 //
 // operations on tensors without backpropagation
 //
@@ -527,6 +555,15 @@ struct ggml_tensor * ggml_cpy(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// a -> b[offs0:offs0 + a->ne[0]] for every row of b, return view(b)
+// a is F32 with the same number of rows as b and may have any strides
+// if b is quantized, the blocks that are only partially covered by a are requantized
+struct ggml_tensor * ggml_set_cols(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   offs0);
+
 // make contiguous
 struct ggml_tensor * ggml_cont(
         struct ggml_context * ctx,
@@ -611,6 +648,15 @@ struct ggml_tensor * ggml_soft_max(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// soft_max(a*scale + mask) in a single pass, mask can be NULL and is broadcast as for ggml_add
+// the elements masked with -INF at the end of a row are not computed
+// in-place, returns view(a)
+struct ggml_tensor * ggml_soft_max_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * mask,
+        float                 scale);
+
 // rotary position embedding
 // in-place, returns view(a)
 // if mode == 1, skip n_past elements
@@ -622,6 +668,16 @@ struct ggml_tensor * ggml_rope(
         int                   n_dims,
         int                   mode);
 
+// rotary position embedding with an explicit position for each a->ne[2] row
+// b is an I32 vector with a->ne[2] elements, only mode 0 is supported
+// in-place, returns view(a)
+struct ggml_tensor * ggml_rope_pos(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode);
+
 // padding = 1
 // TODO: we don't support extra parameters for now
 //       that's why we are hard-coding the stride, padding, and dilation
@@ -651,6 +707,21 @@ struct ggml_tensor * ggml_flash_ff(
         struct ggml_tensor  * c0,
         struct ggml_tensor  * c1);
 
+// attention of a single token to the cells of a KV cache, for each head:
+//   soft_max(k*q*scale + mask)*v
+// q:    [head_dim, n_head, 1] F32
+// k:    [head_dim, n_head, n_kv], a cell after the other
+// v:    [n_kv, head_dim, n_head], transposed
+// mask: [n_kv, 1] F32 or NULL
+// k and v are read in place and can be F32, F16 or quantized, returns [head_dim, n_head, 1] F32
+struct ggml_tensor * ggml_attn_decode(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        float                 scale);
+
 //
 // automatic differentiation
 //
@@ -667,6 +738,14 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
 void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+// threads for ggml_graph_compute() that are kept between computations
+// the calling thread is the first of the n_threads, the others wait for the next graph
+// by spinning for a while and then sleeping. with pin, worker i runs on core i only
+struct ggml_threadpool * ggml_threadpool_new (int n_threads, bool pin);
+void                     ggml_threadpool_free(struct ggml_threadpool * pool);
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
+
 // print info and performance information for the graph
 void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
@@ -816,6 +895,7 @@ typedef struct {
     quantize_row_q_t   quantize_row_q;
     quantize_row_q_t   quantize_row_q_reference;
     vec_dot_q_t        vec_dot_q;
+    vec_dot_q_t        vec_dot_q_f32; // y is F32
 } quantize_fns_t;
 
 quantize_fns_t ggml_internal_get_quantize_fn(size_t i);
@@ -12,13 +12,16 @@
 #include <array>
 #include <cinttypes>
 #include <fstream>
+#include <sstream>
 #include <random>
 #include <map>
+#include <set>
 #include <unordered_map>
 #include <queue>
 #include <cassert>
 #include <cstring>
 #include <climits>
+#include <limits>
 #include <memory>
 #include <algorithm>
 #include <initializer_list>
@@ -26,6 +29,16 @@
 #define LLAMA_USE_SCRATCH
 #define LLAMA_MAX_SCRATCH_BUFFERS 16
 
+// the KV cache grows and shrinks in blocks of this many cells
+#define LLAMA_KV_BLOCK_SIZE 256
+
+// the KV cache shrinks after this many evaluations in a row that used at most a quarter of it
+#define LLAMA_KV_SHRINK_EVALS 16
+
+// a batch attends to a multiple of this many cells, so that the compute graph
+// can be reused while that many tokens are generated
+#define LLAMA_KV_GRAPH_PAD 32
+
 
 // available llama models
 enum e_model {
@@ -106,6 +119,21 @@ struct llama_layer {
     struct ggml_tensor * w1;
     struct ggml_tensor * w2;
     struct ggml_tensor * w3;
+
+    // wq/wk/wv and w1/w3 loaded as one matrix, NULL unless the weights are fused
+    struct ggml_tensor * wqkv;
+    struct ggml_tensor * w13;
+};
+
+struct llama_kv_cell {
+    llama_pos pos   = -1; // -1 if the cell is free
+    llama_pos delta =  0; // position change that the K of the cell has not been rotated by yet
+
+    std::set<llama_seq_id> seq_id;
+
+    bool has_seq_id(const llama_seq_id & id) const {
+        return seq_id.find(id) != seq_id.end();
+    }
 };
 
 struct llama_kv_cache {
@@ -116,7 +144,19 @@ struct llama_kv_cache {
 
     llama_buffer buf;
 
-    int n; // number of tokens currently in the cache
+    int n = 0; // number of used cells, over all sequences
+
+    uint32_t head = 0; // where to start looking for free cells
+    uint32_t size = 0; // number of allocated cells, a multiple of LLAMA_KV_BLOCK_SIZE or n_ctx
+
+    std::vector<llama_kv_cell> cells;
+
+    // some cells have a delta, applied before the next evaluation
+    // when this is false the delta of every cell is 0
+    bool has_shift = false;
+
+    // evaluations in a row after which at most a quarter of the cells were used
+    uint32_t n_evals_underused = 0;
 
     ~llama_kv_cache() {
         if (ctx) {
@@ -177,6 +217,126 @@ struct llama_vocab {
     std::vector<token_score> id_to_token;
 };
 
+// a run of tokens in the prefix cache, following the tokens of its parent
+struct llama_prefix_node {
+    std::vector<llama_token> tokens;
+
+    llama_pos    pos    = 0;  // position of tokens[0]
+    llama_seq_id seq_id = -1; // the KV cells of the tokens belong to this sequence, -1 for the root
+
+    int64_t t_used = 0; // for LRU eviction, never older than any child
+
+    llama_prefix_node * parent = nullptr;
+    std::map<llama_token, std::unique_ptr<llama_prefix_node>> children; // by first token
+};
+
+struct llama_prefix_cache {
+    llama_prefix_node root;
+
+    size_t n_max    = 0; // tokens, 0 if the cache is disabled
+    size_t n_tokens = 0; // over all nodes
+
+    int64_t clock = 0;
+
+    // sequence ids of dropped nodes are reused
+    llama_seq_id next_seq_id = LLAMA_PREFIX_CACHE_SEQ_ID;
+    std::set<llama_seq_id> free_seq_ids;
+
+    llama_prefix_cache_stats stats = {};
+};
+
+// K/V of a sequence that was swapped out of the KV cache
+struct llama_kv_swap_seq {
+    uint32_t n_cells  = 0;
+    uint32_t n_blocks = 0; // V blocks that hold the cells
+    size_t   size     = 0; // bytes
+
+    std::vector<uint8_t> data; // empty while the sequence is on disk
+    std::string          path; // set while the sequence is on disk
+};
+
+struct llama_kv_swap {
+    size_t      size_max = 0; // bytes in memory, the least recently used sequences beyond it go to files in dir
+    std::string dir;          // empty to keep all swapped out sequences in memory
+
+    bool automatic = false; // llama_decode() swaps out sequences when it needs their cells
+
+    size_t size_memory = 0;
+    size_t size_disk   = 0;
+
+    std::map<llama_seq_id, llama_kv_swap_seq> seqs;
+
+    // last llama_decode() call with tokens of each sequence
+    std::map<llama_seq_id, int64_t> t_used;
+    int64_t clock = 0;
+
+    llama_kv_swap_stats stats = {};
+
+    ~llama_kv_swap() {
+        for (const auto & it : seqs) {
+            if (!it.second.path.empty()) {
+                std::remove(it.second.path.c_str());
+            }
+        }
+    }
+};
+
+// a view of the KV cache whose offset depends on the first cell of the batch
+struct llama_graph_kv_view {
+    struct ggml_tensor * tensor;
+    struct ggml_tensor * cache;     // kv_self.k or kv_self.v
+    size_t               offs;      // offset for cell 0
+    size_t               cell_size; // bytes between cells
+};
+
+// compute graph of the last evaluation, kept in buf_compute and reused by the
+// following evaluations with the same shape: only the inputs and the views of the
+// cells that the batch writes to are updated
+struct llama_graph {
+    struct ggml_context * ctx = NULL;
+    struct ggml_cgraph    gf;
+
+    // shape the graph was built for
+    int  n_tokens       = 0;
+    int  n_kv           = 0;
+    int  n_outputs      = 0;
+    int  n_output_vocab = 0;
+    bool gather_vocab   = false;
+    int  n_threads      = 0;
+
+    // the KV cache the views were made of
+    const struct ggml_tensor * k = NULL;
+    const struct ggml_tensor * v = NULL;
+    const void * k_data  = NULL;
+    const void * v_data  = NULL;
+    int          kv_size = 0;
+
+    // inputs
+    struct ggml_tensor * embd         = NULL;
+    struct ggml_tensor * KQ_pos       = NULL;
+    struct ggml_tensor * KQ_mask      = NULL;
+    struct ggml_tensor * output_rows  = NULL;
+    struct ggml_tensor * output_vocab = NULL;
+
+    std::vector<llama_graph_kv_view>  kv_views;
+    std::vector<struct ggml_tensor *> kv_heads; // the first cell of the batch, for ggml_set_cols
+
+    // outputs
+    struct ggml_tensor * embeddings = NULL;
+    struct ggml_tensor * logits     = NULL;
+
+    void reset() {
+        if (ctx) {
+            ggml_free(ctx);
+            ctx = NULL;
+        }
+    }
+
+    ~llama_graph() {
+        reset();
+    }
+};
+
 struct llama_context {
     std::mt19937 rng;
 
@@ -195,18 +355,38 @@ struct llama_context {
     llama_model model;
     llama_vocab vocab;
 
+    llama_prefix_cache prefix_cache;
+    llama_kv_swap      kv_swap;
+
     size_t mem_per_token = 0;
 
-    // decode output (2-dimensional array: [n_tokens][n_vocab])
+    // decode output (2-dimensional array: [n_outputs][n_vocab])
     std::vector<float> logits;
     bool logits_all = false;
 
-    // input embedding (1-dimensional array: [n_embd])
+    // row of each token of the last batch in logits, -1 if it has no logits
+    std::vector<int32_t> output_ids;
+
+    // tokens that logits are computed for, empty for the whole vocabulary
+    std::vector<llama_token> output_vocab;
+
+    // embeddings of the last evaluation (2-dimensional array: [n_rows][n_embd])
+    // one row per token with LLAMA_POOLING_TYPE_NONE, otherwise one per sequence in embedding_seq
     std::vector<float> embedding;
+    std::vector<llama_seq_id> embedding_seq;
+    bool embedding_mode = false;
+    llama_pooling_type pooling_type = LLAMA_POOLING_TYPE_LAST;
 
     // memory buffers used to evaluate the model
     // TODO: move in llama_state
     llama_buffer buf_compute;
+
+    // graph of the last evaluation, lives in buf_compute
+    llama_graph graph;
+
+    // threads that compute the graphs, kept between evaluations
+    struct ggml_threadpool * threadpool = NULL;
+    bool pin_threads = false;
     llama_buffer buf_scratch[LLAMA_MAX_SCRATCH_BUFFERS];
 
     int    buf_last = 0;
@@ -242,6 +422,10 @@ struct llama_context {
         return 0;
 #endif
     }
+
+    ~llama_context() {
+        ggml_threadpool_free(threadpool);
+    }
 };
 
 template <typename T>
@@ -276,6 +460,7 @@ static const char * llama_format_type(enum ggml_type type) {
         case GGML_TYPE_F16: return "f16";
         case GGML_TYPE_Q4_0: return "q4_0";
         case GGML_TYPE_Q4_1: return "q4_1";
+        case GGML_TYPE_Q8_0: return "q8_0";
         default: LLAMA_ASSERT(false);
     }
 }
@@ -630,6 +815,41 @@ struct llama_model_loader {
         return get_tensor_for(lt);
     }
 
+    // loads tensors of the same type and shape as the rows of one matrix, each of them
+    // is a view of its rows. returns NULL if they cannot be fused
+    struct ggml_tensor * get_tensor_fused(const std::vector<std::string> & names, std::vector<uint32_t> ne,
+                                          std::vector<struct ggml_tensor *> & parts) {
+        std::vector<llama_load_tensor *> lts;
+        for (const std::string & name : names) {
+            auto it = tensors_map.name_to_idx.find(name);
+            if (it == tensors_map.name_to_idx.end()) {
+                throw format("llama.cpp: tensor '%s' is missing from model", name.c_str());
+            }
+            llama_load_tensor & lt = tensors_map.tensors.at(it->second);
+            if (lt.ne != ne) {
+                throw format("llama.cpp: tensor '%s' has wrong shape; expected %s, got %s",
+                             name.c_str(), llama_format_tensor_shape(ne).c_str(), llama_format_tensor_shape(lt.ne).c_str());
+            }
+            if (use_mmap || (!lts.empty() && lt.type != lts.front()->type)) {
+                return NULL;
+            }
+            lts.push_back(&lt);
+        }
+
+        LLAMA_ASSERT(ne.size() == 2);
+        struct ggml_tensor * fused = ggml_new_tensor_2d(ggml_ctx, lts.front()->type, ne.at(0), ne.at(1)*lts.size());
+
+        parts.clear();
+        for (size_t i = 0; i < lts.size(); i++) {
+            LLAMA_ASSERT(lts[i]->ggml_tensor == NULL);
+            lts[i]->ggml_tensor = ggml_view_2d(ggml_ctx, fused, ne.at(0), ne.at(1), fused->nb[1], i*ne.at(1)*fused->nb[1]);
+            parts.push_back(lts[i]->ggml_tensor);
+            num_ggml_tensors_created++;
+        }
+
+        return fused;
+    }
+
     struct ggml_tensor * get_tensor_for(llama_load_tensor & lt) {
         struct ggml_tensor * tensor;
         if (lt.ne.size() == 2) {
@@ -751,1048 +971,3192 @@ struct llama_model_loader {
 // kv cache
 //
 
-static bool kv_cache_init(
+// the number of cells is a multiple of this
+// quantized V rows are quantized in blocks along the cells and the 4-bit dot product takes pairs of blocks
+static uint32_t kv_cache_cell_pad(ggml_type wtype) {
+    return ggml_blck_size(wtype) > 1 ? 2*ggml_blck_size(wtype) : 1;
+}
+
+// number of cells to allocate for n_used cells: whole blocks, at most n_ctx
+static uint32_t kv_cache_blocks_size(uint32_t n_used, uint32_t n_ctx, ggml_type wtype) {
+    const uint32_t n_blocks = std::max(1u, (n_used + LLAMA_KV_BLOCK_SIZE - 1)/LLAMA_KV_BLOCK_SIZE);
+    const uint32_t pad      = kv_cache_cell_pad(wtype);
+    return (std::min(n_blocks*LLAMA_KV_BLOCK_SIZE, n_ctx) + pad - 1)/pad*pad;
+}
+
+static size_t kv_cache_buf_size(const struct llama_hparams & hparams, ggml_type wtype, uint32_t n_cells) {
+    const int64_t n_elements = (int64_t)hparams.n_embd*hparams.n_layer*n_cells;
+
+    return 2u*n_elements*ggml_type_size(wtype)/ggml_blck_size(wtype) + 2u*MB;
+}
+
+// reallocates the cache with room for n_cells cells
+// the used cells are moved to the front in order, so the cache is also compacted
+static bool kv_cache_resize(
         const struct llama_hparams & hparams,
              struct llama_kv_cache & cache,
                          ggml_type   wtype,
-                               int   n_ctx) {
+                          uint32_t   n_cells) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
 
-    const int64_t n_mem      = (int64_t)n_layer*n_ctx;
-    const int64_t n_elements = n_embd*n_mem;
+    LLAMA_ASSERT(n_cells >= (uint32_t) cache.n);
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*MB);
+    const int64_t n_elements = (int64_t)n_embd*n_layer*n_cells;
+
+    llama_buffer buf;
+    buf.resize(kv_cache_buf_size(hparams, wtype, n_cells));
 
     struct ggml_init_params params;
-    params.mem_size   = cache.buf.size;
-    params.mem_buffer = cache.buf.addr;
+    params.mem_size   = buf.size;
+    params.mem_buffer = buf.addr;
     params.no_alloc   = false;
 
-    cache.ctx = ggml_init(params);
+    struct ggml_context * ctx = ggml_init(params);
 
-    if (!cache.ctx) {
+    if (!ctx) {
         fprintf(stderr, "%s: failed to allocate memory for kv cache\n", __func__);
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    struct ggml_tensor * k = ggml_new_tensor_1d(ctx, wtype, n_elements);
+    struct ggml_tensor * v = ggml_new_tensor_1d(ctx, wtype, n_elements);
 
-    return true;
-}
+    // unused cells are masked out, but 0 * garbage can still be NaN
+    memset(k->data, 0, ggml_nbytes(k));
+    memset(v->data, 0, ggml_nbytes(v));
 
-struct llama_context_params llama_context_default_params() {
-    struct llama_context_params result = {
-        /*.n_ctx                       =*/ 512,
-        /*.n_parts                     =*/ -1,
-        /*.seed                        =*/ 0,
-        /*.f16_kv                      =*/ false,
-        /*.logits_all                  =*/ false,
-        /*.vocab_only                  =*/ false,
-        /*.use_mmap                    =*/ true,
-        /*.use_mlock                   =*/ false,
-        /*.embedding                   =*/ false,
-        /*.progress_callback           =*/ nullptr,
-        /*.progress_callback_user_data =*/ nullptr,
-    };
+    std::vector<llama_kv_cell> cells(n_cells);
 
-    return result;
-}
+    // find the runs of used cells: {first cell, number of cells}
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
 
-bool llama_mmap_supported() {
-    return llama_mmap::SUPPORTED;
-}
+    uint32_t n_moved = 0;
+    for (uint32_t i0 = 0; i0 < cache.size; ) {
+        if (cache.cells[i0].pos < 0) {
+            i0++;
+            continue;
+        }
 
-bool llama_mlock_supported() {
-    return llama_mlock::SUPPORTED;
-}
+        uint32_t i1 = i0;
+        while (i1 < cache.size && cache.cells[i1].pos >= 0) {
+            cells[n_moved + i1 - i0] = cache.cells[i1];
+            i1++;
+        }
 
-//
-// model loading
-//
+        runs.emplace_back(i0, i1 - i0);
 
-static const char *llama_file_version_name(llama_file_version version) {
-    switch (version) {
-        case LLAMA_FILE_VERSION_GGML: return "'ggml' (old version with low tokenizer quality and no mmap support)";
-        case LLAMA_FILE_VERSION_GGMF_V1: return "ggmf v1 (old version with no mmap support)";
-        case LLAMA_FILE_VERSION_GGJT_V1: return "ggjt v1 (latest)";
-        default: LLAMA_ASSERT(false);
+        n_moved += i1 - i0;
+        i0 = i1;
     }
-}
 
-static const char *llama_ftype_name(enum llama_ftype ftype) {
-    switch (ftype) {
-        case LLAMA_FTYPE_ALL_F32:     return "all F32";
-        case LLAMA_FTYPE_MOSTLY_F16:  return "mostly F16";
-        case LLAMA_FTYPE_MOSTLY_Q4_0: return "mostly Q4_0";
-        case LLAMA_FTYPE_MOSTLY_Q4_1: return "mostly Q4_1";
-        case LLAMA_FTYPE_MOSTLY_Q4_1_SOME_F16:
-                                      return "mostly Q4_1, some F16";
-        default:                      return "unknown, may not work";
+    LLAMA_ASSERT(n_moved == (uint32_t) cache.n);
+
+    // copy each run with one memcpy per layer for K and per row for V
+    // a K cell is a whole number of blocks, but quantized V rows have to be requantized
+    const bool   quantized = ggml_blck_size(wtype) > 1;
+    const size_t esize     = ggml_type_size(wtype);
+    const size_t k_row     = esize*n_embd/ggml_blck_size(wtype);
+
+    std::vector<float> v_src;
+    std::vector<float> v_dst;
+    quantize_fns_t qfns = {};
+    if (quantized && !runs.empty()) {
+        v_src.resize(cache.size);
+        v_dst.resize(n_cells);
+        qfns = ggml_internal_get_quantize_fn(wtype);
     }
-}
 
-static const char *llama_model_type_name(e_model type) {
-    switch (type) {
-        case MODEL_7B: return "7B";
-        case MODEL_13B: return "13B";
-        case MODEL_30B: return "30B";
-        case MODEL_65B: return "65B";
-        default: LLAMA_ASSERT(false);
-    }
-}
+    for (int il = 0; il < n_layer && !runs.empty(); ++il) {
+        uint32_t dst = 0;
+        for (const auto & run : runs) {
+            memcpy((char *) k->data       + ((int64_t)il*n_cells    + dst)*k_row,
+                   (char *) cache.k->data + ((int64_t)il*cache.size + run.first)*k_row,
+                   (size_t)run.second*k_row);
+            dst += run.second;
+        }
 
-static void llama_model_load_internal(
-        const std::string & fname,
-        llama_context & lctx,
-        int n_ctx,
-        ggml_type memory_type,
-        bool use_mmap,
-        bool use_mlock,
-        bool vocab_only,
-        llama_progress_callback progress_callback,
-        void * progress_callback_user_data) {
+        // V is transposed: one row of cells per embedding dimension
+        for (int ie = 0; ie < n_embd; ++ie) {
+            const int64_t row = (int64_t)il*n_embd + ie;
 
-    lctx.t_start_us = ggml_time_us();
+            if (quantized) {
+                const size_t v_row_src = esize*cache.size/ggml_blck_size(wtype);
+                const size_t v_row_dst = esize*n_cells/ggml_blck_size(wtype);
 
-    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap, vocab_only));
+                qfns.dequantize_row_q((char *) cache.v->data + row*v_row_src, v_src.data(), cache.size);
 
-    lctx.vocab = std::move(ml->file_loaders.at(0)->vocab);
-    auto & model = lctx.model;
-    model.hparams = ml->file_loaders.at(0)->hparams;
-    llama_file_version file_version = ml->file_loaders.at(0)->file_version;
-    auto & hparams = model.hparams;
-    uint32_t n_ff = ((2*(4*hparams.n_embd)/3 + hparams.n_mult - 1)/hparams.n_mult)*hparams.n_mult;
+                dst = 0;
+                for (const auto & run : runs) {
+                    std::copy(v_src.begin() + run.first, v_src.begin() + run.first + run.second, v_dst.begin() + dst);
+                    dst += run.second;
+                }
+                std::fill(v_dst.begin() + dst, v_dst.end(), 0.0f);
 
-    {
-        switch (hparams.n_layer) {
-            case 32: model.type = e_model::MODEL_7B; break;
-            case 40: model.type = e_model::MODEL_13B; break;
-            case 60: model.type = e_model::MODEL_30B; break;
-            case 80: model.type = e_model::MODEL_65B; break;
+                qfns.quantize_row_q(v_dst.data(), (char *) v->data + row*v_row_dst, n_cells);
+            } else {
+                dst = 0;
+                for (const auto & run : runs) {
+                    memcpy((char *) v->data       + (row*n_cells    + dst)*esize,
+                           (char *) cache.v->data + (row*cache.size + run.first)*esize,
+                           (size_t)run.second*esize);
+                    dst += run.second;
+                }
+            }
         }
-
-        hparams.n_ctx = n_ctx;
     }
 
-    {
-        fprintf(stderr, "%s: format     = %s\n",  __func__, llama_file_version_name(file_version));
-        fprintf(stderr, "%s: n_vocab    = %u\n",  __func__, hparams.n_vocab);
-        fprintf(stderr, "%s: n_ctx      = %u\n",  __func__, hparams.n_ctx);
-        fprintf(stderr, "%s: n_embd     = %u\n",  __func__, hparams.n_embd);
-        fprintf(stderr, "%s: n_mult     = %u\n",  __func__, hparams.n_mult);
-        fprintf(stderr, "%s: n_head     = %u\n",  __func__, hparams.n_head);
-        fprintf(stderr, "%s: n_layer    = %u\n",  __func__, hparams.n_layer);
-        fprintf(stderr, "%s: n_rot      = %u\n",  __func__, hparams.n_rot);
-        fprintf(stderr, "%s: ftype      = %u (%s)\n", __func__, hparams.ftype, llama_ftype_name(hparams.ftype));
-        fprintf(stderr, "%s: n_ff       = %u\n",  __func__, n_ff);
-        fprintf(stderr, "%s: n_parts    = %zu\n", __func__, ml->file_loaders.size());
-        fprintf(stderr, "%s: model size = %s\n",  __func__, llama_model_type_name(model.type));
+    if (cache.ctx) {
+        ggml_free(cache.ctx);
     }
 
-    if (vocab_only) {
-        return;
-    }
+    std::swap(cache.buf.addr, buf.addr);
+    std::swap(cache.buf.size, buf.size);
 
-    auto & ctx = model.ctx;
+    cache.ctx   = ctx;
+    cache.k     = k;
+    cache.v     = v;
+    cache.head  = n_moved;
+    cache.size  = n_cells;
+    cache.cells = std::move(cells);
 
-    size_t ctx_size, mmapped_size;
-    ml->calc_sizes(&ctx_size, &mmapped_size);
-    fprintf(stderr, "%s: ggml ctx size = %6.2f KB\n", __func__, ctx_size/1024.0);
+    return true;
+}
 
-    // print memory requirements
-    {
-        const size_t scale = memory_type == GGML_TYPE_F32 ? 2 : 1;
+// the cache starts with a single block and grows as cells are used, up to n_ctx
+static bool kv_cache_init(
+        const struct llama_hparams & hparams,
+             struct llama_kv_cache & cache,
+                         ggml_type   wtype,
+                               int   n_ctx) {
+    cache.n    = 0;
+    cache.head = 0;
+    cache.size = 0;
+    cache.cells.clear();
 
-        // this is the total memory required to run the inference
-        const size_t mem_required =
-            ctx_size +
-            mmapped_size +
-            MEM_REQ_SCRATCH0.at(model.type) +
-            MEM_REQ_SCRATCH1.at(model.type) +
-            MEM_REQ_EVAL.at    (model.type);
+    return kv_cache_resize(hparams, cache, wtype, kv_cache_blocks_size(0, n_ctx, wtype));
+}
 
-        // this is the memory required by one llama_state
-        const size_t mem_required_state =
-            scale*MEM_REQ_KV_SELF.at(model.type);
+// grows the cache if there is not enough room for n_tokens more cells
+static bool kv_cache_reserve(
+        const struct llama_hparams & hparams,
+             struct llama_kv_cache & cache,
+                          uint32_t   n_tokens) {
+    const uint32_t n_needed = cache.n + n_tokens;
 
-        fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per state)\n", __func__,
-                mem_required / 1024.0 / 1024.0, mem_required_state / 1024.0 / 1024.0);
+    if (n_needed <= cache.size || n_needed > hparams.n_ctx) {
+        return n_needed <= hparams.n_ctx;
     }
 
-    // create the ggml context
-    {
-        lctx.model.buf.resize(ctx_size);
-        if (use_mlock) {
-            lctx.model.mlock_buf.init(lctx.model.buf.addr);
-            lctx.model.mlock_buf.grow_to(lctx.model.buf.size);
-        }
+    return kv_cache_resize(hparams, cache, cache.k->type, kv_cache_blocks_size(n_needed, hparams.n_ctx, cache.k->type));
+}
 
-        struct ggml_init_params params = {
-            /*.mem_size   =*/ lctx.model.buf.size,
-            /*.mem_buffer =*/ lctx.model.buf.addr,
-            /*.no_alloc   =*/ ml->use_mmap,
-        };
+// releases blocks that are no longer needed, keeping one spare block
+// so that removing and re-adding a few tokens does not reallocate every time
+static bool kv_cache_shrink(
+        const struct llama_hparams & hparams,
+             struct llama_kv_cache & cache) {
+    const uint32_t n_cells = kv_cache_blocks_size(cache.n + LLAMA_KV_BLOCK_SIZE, hparams.n_ctx, cache.k->type);
 
-        model.ctx = ggml_init(params);
-        if (!model.ctx) {
-            throw format("ggml_init() failed");
-        }
+    if (n_cells >= cache.size) {
+        return true;
     }
 
-    // prepare memory for the weights
-    {
-        const auto & hparams = model.hparams;
-
-        const uint32_t n_embd  = hparams.n_embd;
-        const uint32_t n_layer = hparams.n_layer;
-        const uint32_t n_vocab = hparams.n_vocab;
+    return kv_cache_resize(hparams, cache, cache.k->type, n_cells);
+}
 
-        ml->ggml_ctx = ctx;
+// copies the V of cells, for every layer and embedding dimension: cell moves[i].first of
+// the rows in src to cell moves[i].second of the rows in dst, sorted by the dst cell
+// src and dst hold rows of src_cells and dst_cells cells and may be the same rows
+// a quantized block of dst is copied as it is when the moves fill it from one block of src
+// in order, the other blocks they touch are dequantized and quantized again, so the values
+// they already hold are rounded again if the copied values raise the block's scale
+static void kv_cache_copy_v(
+        const struct llama_hparams & hparams,
+                         ggml_type   wtype,
+                        const void * src,
+                          uint32_t   src_cells,
+                              void * dst,
+                          uint32_t   dst_cells,
+        const std::vector<std::pair<uint32_t, uint32_t>> & moves) {
+    const int    blck  = ggml_blck_size(wtype);
+    const size_t bsize = ggml_type_size(wtype);
+
+    const size_t src_row = bsize*src_cells/blck;
+    const size_t dst_row = bsize*dst_cells/blck;
+
+    std::vector<float> src_vals;
+    std::vector<float> dst_vals;
+    quantize_fns_t qfns = {};
+    if (blck > 1) {
+        src_vals.resize(blck);
+        dst_vals.resize(blck);
+        qfns = ggml_internal_get_quantize_fn(wtype);
+    }
 
-        model.tok_embeddings = ml->get_tensor("tok_embeddings.weight", {n_embd, n_vocab});
-        model.norm   = ml->get_tensor("norm.weight", {n_embd});
-        model.output = ml->get_tensor("output.weight", {n_embd, n_vocab});
+    for (int64_t row = 0; row < (int64_t) hparams.n_layer*hparams.n_embd; ++row) {
+        const char * s = (const char *) src + row*src_row;
+        char       * d = (char *)       dst + row*dst_row;
 
-        model.layers.resize(n_layer);
-        for (uint32_t i = 0; i < n_layer; ++i) {
-            auto & layer = model.layers[i];
+        for (size_t i0 = 0; i0 < moves.size(); ) {
+            // the moves to one block of dst
+            const uint32_t b = moves[i0].second/blck;
 
-            std::string layers_i = "layers." + std::to_string(i);
+            size_t i1 = i0;
+            bool whole = moves[i0].first % blck == 0;
+            while (i1 < moves.size() && moves[i1].second/blck == b) {
+                whole = whole && moves[i1].first == moves[i0].first + (i1 - i0) && moves[i1].second == b*blck + (i1 - i0);
+                i1++;
+            }
+            whole = whole && i1 - i0 == (size_t) blck;
 
-            layer.attention_norm = ml->get_tensor(layers_i + ".attention_norm.weight", {n_embd});
+            if (whole) {
+                memcpy(d + b*bsize, s + moves[i0].first/blck*bsize, bsize);
+            } else {
+                qfns.dequantize_row_q(d + b*bsize, dst_vals.data(), blck);
+
+                int64_t sb = -1;
+                for (size_t i = i0; i < i1; ++i) {
+                    if (moves[i].first/blck != sb) {
+                        sb = moves[i].first/blck;
+                        qfns.dequantize_row_q(s + sb*bsize, src_vals.data(), blck);
+                    }
+                    dst_vals[moves[i].second % blck] = src_vals[moves[i].first % blck];
+                }
 
-            layer.wq = ml->get_tensor(layers_i + ".attention.wq.weight", {n_embd, n_embd});
-            layer.wk = ml->get_tensor(layers_i + ".attention.wk.weight", {n_embd, n_embd});
-            layer.wv = ml->get_tensor(layers_i + ".attention.wv.weight", {n_embd, n_embd});
-            layer.wo = ml->get_tensor(layers_i + ".attention.wo.weight", {n_embd, n_embd});
+                qfns.quantize_row_q(dst_vals.data(), d + b*bsize, blck);
+            }
 
-            layer.ffn_norm = ml->get_tensor(layers_i + ".ffn_norm.weight", {n_embd});
-
-            layer.w1 = ml->get_tensor(layers_i + ".feed_forward.w1.weight", {n_embd,   n_ff});
-            layer.w2 = ml->get_tensor(layers_i + ".feed_forward.w2.weight", {  n_ff,   n_embd});
-            layer.w3 = ml->get_tensor(layers_i + ".feed_forward.w3.weight", {n_embd,   n_ff});
+            i0 = i1;
         }
     }
+}
 
-    ml->done_getting_tensors();
+// find a run of batch.n_tokens free cells and assign the batch to them
+// the K/V of the batch are written to the cells starting at cache.head
+static bool llama_kv_cache_find_slot(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    const uint32_t n_ctx    = cache.size;
+    const uint32_t n_tokens = batch.n_tokens;
 
-    // populate `tensors_by_name`
-    for (llama_load_tensor & lt : ml->tensors_map.tensors) {
-        model.tensors_by_name.emplace_back(lt.name, lt.ggml_tensor);
+    if (n_tokens > n_ctx) {
+        fprintf(stderr, "%s: n_tokens = %d > n_ctx = %d\n", __func__, n_tokens, n_ctx);
+        return false;
     }
 
-    ml->load_all_data(progress_callback, progress_callback_user_data, use_mlock ? &lctx.model.mlock_mmap : NULL);
+    uint32_t n_tested = 0;
 
-    model.mapping = std::move(ml->mapping);
+    while (true) {
+        if (cache.head + n_tokens > n_ctx) {
+            n_tested += n_ctx - cache.head;
+            cache.head = 0;
+            if (n_tested >= n_ctx) {
+                return false;
+            }
+            continue;
+        }
 
-    // loading time will be recalculate after the first eval, so
-    // we take page faults deferred by mmap() into consideration
-    lctx.t_load_us = ggml_time_us() - lctx.t_start_us;
-}
+        bool found = true;
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            if (cache.cells[cache.head + i].pos >= 0) {
+                found = false;
+                cache.head += i + 1;
+                n_tested   += i + 1;
+                break;
+            }
+        }
 
-static bool llama_model_load(
-        const std::string & fname,
-        llama_context & lctx,
-        int n_ctx,
-        ggml_type memory_type,
-        bool use_mmap,
-        bool use_mlock,
-        bool vocab_only,
-        llama_progress_callback progress_callback,
-        void *progress_callback_user_data) {
-    try {
-        llama_model_load_internal(fname, lctx, n_ctx, memory_type, use_mmap, use_mlock,
-                                  vocab_only, progress_callback, progress_callback_user_data);
-        return true;
-    } catch (const std::string & err) {
-        fprintf(stderr, "error loading model: %s\n", err.c_str());
-        return false;
+        if (found) {
+            break;
+        }
+
+        if (n_tested >= n_ctx) {
+            return false;
+        }
     }
-}
 
-// evaluate the transformer
-//
-//   - lctx:      llama context
-//   - tokens:    new batch of tokens to process
-//   - n_past:    the context size so far
-//   - n_threads: number of threads to use
-//
-static bool llama_eval_internal(
-        llama_context & lctx,
-    const llama_token * tokens,
-            const int   n_tokens,
-            const int   n_past,
-            const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        cache.cells[cache.head + i].pos = batch.pos[i];
+        cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i]);
+    }
 
-    const int N = n_tokens;
+    cache.n += n_tokens;
 
-    const auto & model   = lctx.model;
-    const auto & hparams = model.hparams;
+    return true;
+}
 
-    auto & kv_self = model.kv_self;
+// frees the cells that llama_kv_cache_find_slot assigned to a batch that could not be evaluated
+static void llama_kv_cache_release_slot(
+           struct llama_kv_cache & cache,
+                        uint32_t   n_tokens) {
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        cache.cells[cache.head + i].pos = -1;
+        cache.cells[cache.head + i].seq_id.clear();
+    }
 
-    LLAMA_ASSERT(!!kv_self.ctx);
+    cache.n -= n_tokens;
+}
 
-    const int n_embd  = hparams.n_embd;
-    const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
-    const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
-    const int n_rot   = hparams.n_embd/hparams.n_head;
+// number of cells that attention has to look at: up to the last used cell
+static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
+    for (uint32_t i = cache.size; i > 0; --i) {
+        if (cache.cells[i - 1].pos >= 0) {
+            return i;
+        }
+    }
 
-    auto & mem_per_token = lctx.mem_per_token;
-    auto & buf_compute   = lctx.buf_compute;
+    return 0;
+}
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ buf_compute.size,
-        /*.mem_buffer =*/ buf_compute.addr,
-        /*.no_alloc   =*/ false,
-    };
+static void llama_kv_cache_seq_rm(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   p0,
+                    llama_pos   p1) {
+    uint32_t new_head = cache.size;
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
-    // for big prompts, if BLAS is enabled, it is better to use only one thread
-    // otherwise, the threads are spin-lock waiting for the BLAS calls and are degrading the performance
-    ggml_cgraph gf = {};
-    gf.n_threads = N >= 32 && ggml_cpu_has_blas() ? 1 : n_threads;
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        auto & cell = cache.cells[i];
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+        if (cell.pos < 0 || cell.pos < p0 || cell.pos >= p1) {
+            continue;
+        }
 
-    struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
+        if (seq_id < 0) {
+            cell.seq_id.clear();
+        } else if (cell.has_seq_id(seq_id)) {
+            cell.seq_id.erase(seq_id);
+        } else {
+            continue;
+        }
 
-    for (int il = 0; il < n_layer; ++il) {
-        struct ggml_tensor * inpSA = inpL;
+        if (cell.seq_id.empty()) {
+            cell.pos = -1;
+            cache.n--;
+            if (new_head == cache.size) {
+                new_head = i;
+            }
+        }
+    }
 
-        struct ggml_tensor * cur;
+    // start looking for free cells at the first one we freed
+    if (new_head != cache.size && new_head < cache.head) {
+        cache.head = new_head;
+    }
+}
 
-        lctx.use_buf(ctx0, 0);
+static void llama_kv_cache_seq_cp(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id_src,
+                 llama_seq_id   seq_id_dst,
+                    llama_pos   p0,
+                    llama_pos   p1) {
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
-        // norm
-        {
-            cur = ggml_rms_norm(ctx0, inpL);
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        auto & cell = cache.cells[i];
 
-            // cur = attention_norm*cur
-            cur = ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.layers[il].attention_norm, cur),
-                        cur);
+        if (cell.has_seq_id(seq_id_src) && cell.pos >= p0 && cell.pos < p1) {
+            cell.seq_id.insert(seq_id_dst);
         }
+    }
+}
 
-        // self-attention
-        {
-            // compute Q and K and RoPE them
-            struct ggml_tensor * Qcur = ggml_rope(ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wq, cur), n_embd/n_head, n_head, N), n_past, n_rot, 0);
-            struct ggml_tensor * Kcur = ggml_rope(ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wk, cur), n_embd/n_head, n_head, N), n_past, n_rot, 0);
+// number of cells in [p0, p1) that seq_id shares with other sequences and still holds after shifting them by delta
+static uint32_t llama_kv_cache_seq_count_shared(
+        const struct llama_kv_cache & cache,
+                       llama_seq_id   seq_id,
+                          llama_pos   p0,
+                          llama_pos   p1,
+                          llama_pos   delta) {
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    uint32_t n = 0;
+    for (const auto & cell : cache.cells) {
+        if (cell.pos >= p0 && cell.pos < p1 && cell.pos + delta >= 0 && cell.seq_id.size() > 1 && cell.has_seq_id(seq_id)) {
+            n++;
+        }
+    }
+    return n;
+}
 
-            // store key and value to memory
-            {
-                // compute the transposed [N, n_embd] V matrix
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_mul_mat(ctx0, model.layers[il].wv, cur), n_embd, N));
+// gives seq_id cells of its own for the cells in [p0, p1) that it shares with other sequences,
+// so that shifting it by delta leaves the other sequences where they are
+// the cache must have a free cell for each cell that llama_kv_cache_seq_count_shared() counts
+static void llama_kv_cache_seq_unshare(
+        const struct llama_hparams & hparams,
+             struct llama_kv_cache & cache,
+                      llama_seq_id   seq_id,
+                         llama_pos   p0,
+                         llama_pos   p1,
+                         llama_pos   delta) {
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    // {shared cell, free cell}
+    std::vector<std::pair<uint32_t, uint32_t>> moves;
+
+    uint32_t j = 0;
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        auto & cell = cache.cells[i];
+        if (cell.pos < p0 || cell.pos >= p1 || cell.seq_id.size() < 2 || !cell.has_seq_id(seq_id)) {
+            continue;
+        }
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, (ggml_element_size(kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd + n_past*ggml_element_size(kv_self.v));
+        // the shift would drop the cell from the sequence anyway
+        if (cell.pos + delta < 0) {
+            cell.seq_id.erase(seq_id);
+            continue;
+        }
 
-                // important: storing RoPE-ed version of K in the KV cache!
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
-            }
+        while (cache.cells[j].pos >= 0) {
+            j++;
+            LLAMA_ASSERT(j < cache.size);
+        }
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        Qcur,
-                        0, 2, 1, 3);
+        cache.cells[j].pos   = cell.pos;
+        cache.cells[j].delta = cell.delta;
+        cache.cells[j].seq_id.insert(seq_id);
+        cell.seq_id.erase(seq_id);
+        cache.n++;
 
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(kv_self.k)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
+        moves.emplace_back(i, j);
+    }
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+    if (moves.empty()) {
+        return;
+    }
 
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0,
-                        KQ,
-                        ggml_new_f32(ctx0, 1.0f/sqrtf(float(n_embd)/n_head)));
+    const ggml_type wtype = cache.k->type;
+    const size_t    k_row = ggml_type_size(wtype)*hparams.n_embd/ggml_blck_size(wtype);
 
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+    for (int il = 0; il < (int) hparams.n_layer; ++il) {
+        for (const auto & move : moves) {
+            memcpy((char *) cache.k->data + ((size_t) il*cache.size + move.second)*k_row,
+                   (char *) cache.k->data + ((size_t) il*cache.size + move.first)*k_row, k_row);
+        }
+    }
 
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+    std::sort(moves.begin(), moves.end(), [](const std::pair<uint32_t, uint32_t> & a, const std::pair<uint32_t, uint32_t> & b) {
+        return a.second < b.second;
+    });
 
-            // split cached V into n_head heads
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_embd/n_head, n_head,
-                        n_ctx*ggml_element_size(kv_self.v),
-                        n_ctx*ggml_element_size(kv_self.v)*n_embd/n_head,
-                        il*n_ctx*ggml_element_size(kv_self.v)*n_embd);
+    kv_cache_copy_v(hparams, wtype, cache.v->data, cache.size, cache.v->data, cache.size, moves);
+}
 
-#if 1
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-#else
-            // make V contiguous in memory to speed up the matmul, however we waste time on the copy
-            // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
-            // is there a better way?
-            struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_past + N, n_embd/n_head, n_head));
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
-#endif
+// cells of seq_id that other sequences share have to be unshared first
+static void llama_kv_cache_seq_shift(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   p0,
+                    llama_pos   p1,
+                    llama_pos   delta) {
+    uint32_t new_head = cache.size;
 
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        auto & cell = cache.cells[i];
 
-            // projection (no bias)
-            cur = ggml_mul_mat(ctx0,
-                    model.layers[il].wo,
-                    cur);
+        if (cell.pos < 0 || cell.pos < p0 || cell.pos >= p1 || (seq_id >= 0 && !cell.has_seq_id(seq_id))) {
+            continue;
         }
 
-        lctx.use_buf(ctx0, 1);
-
-        struct ggml_tensor * inpFF = ggml_add(ctx0, cur, inpSA);
+        LLAMA_ASSERT(seq_id < 0 || cell.seq_id.size() == 1);
 
-        // feed-forward network
-        {
-            // norm
-            {
-                cur = ggml_rms_norm(ctx0, inpFF);
+        cell.pos   += delta;
+        cell.delta += delta;
+        cache.has_shift = true;
 
-                // cur = ffn_norm*cur
-                cur = ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.layers[il].ffn_norm, cur),
-                        cur);
+        // shifted to before the start of the sequence
+        if (cell.pos < 0) {
+            cell.pos = -1;
+            cell.seq_id.clear();
+            cache.n--;
+            if (new_head == cache.size) {
+                new_head = i;
             }
+        }
+    }
 
-            struct ggml_tensor * tmp = ggml_mul_mat(ctx0,
-                    model.layers[il].w3,
-                    cur);
-
-            cur = ggml_mul_mat(ctx0,
-                    model.layers[il].w1,
-                    cur);
+    if (new_head != cache.size && new_head < cache.head) {
+        cache.head = new_head;
+    }
+}
 
-            // SILU activation
-            cur = ggml_silu(ctx0, cur);
+//
+// prefix cache
+//
 
-            cur = ggml_mul(ctx0, cur, tmp);
+// size of the K and V of one token over all layers
+static size_t kv_cache_token_size(const struct llama_hparams & hparams, ggml_type wtype) {
+    return 2u*hparams.n_embd*hparams.n_layer*ggml_type_size(wtype)/ggml_blck_size(wtype);
+}
 
-            cur = ggml_mul_mat(ctx0,
-                    model.layers[il].w2,
-                    cur);
-        }
+static llama_seq_id llama_prefix_cache_new_seq_id(struct llama_prefix_cache & cache) {
+    if (!cache.free_seq_ids.empty()) {
+        const llama_seq_id seq_id = *cache.free_seq_ids.begin();
+        cache.free_seq_ids.erase(cache.free_seq_ids.begin());
+        return seq_id;
+    }
+    return cache.next_seq_id++;
+}
 
-        cur = ggml_add(ctx0, cur, inpFF);
+// frees the cells of a node and of all of its descendants, without unlinking it
+static void llama_prefix_cache_release(struct llama_context & lctx, struct llama_prefix_node * node) {
+    auto & cache = lctx.prefix_cache;
 
-        // input for next layer
-        inpL = cur;
+    for (auto & it : node->children) {
+        llama_prefix_cache_release(lctx, it.second.get());
     }
 
-    lctx.use_buf(ctx0, 0);
+    llama_kv_cache_seq_rm(lctx.model.kv_self, node->seq_id, -1, -1);
 
-    // used at the end to optionally extract the embeddings
-    struct ggml_tensor * embeddings = NULL;
+    cache.n_tokens -= node->tokens.size();
+    cache.free_seq_ids.insert(node->seq_id);
+}
 
-    // norm
-    {
+static void llama_prefix_cache_drop(struct llama_context & lctx, struct llama_prefix_node * node) {
+    llama_prefix_cache_release(lctx, node);
+    node->parent->children.erase(node->tokens[0]);
+}
 
-        inpL = ggml_rms_norm(ctx0, inpL);
+// drops the least recently used leaf
+// returns false if the cache is empty
+static bool llama_prefix_cache_evict(struct llama_context & lctx) {
+    llama_prefix_node * lru = nullptr;
 
-        // inpL = norm*inpL
-        inpL = ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.norm, inpL),
-                    inpL);
+    std::vector<llama_prefix_node *> stack = { &lctx.prefix_cache.root };
+    while (!stack.empty()) {
+        llama_prefix_node * node = stack.back();
+        stack.pop_back();
 
-        embeddings = inpL;
+        if (node->children.empty()) {
+            if (node->parent && (!lru || node->t_used < lru->t_used)) {
+                lru = node;
+            }
+            continue;
+        }
+
+        for (auto & it : node->children) {
+            stack.push_back(it.second.get());
+        }
     }
 
-    // lm_head
-    inpL = ggml_mul_mat(ctx0, model.output, inpL);
+    if (!lru) {
+        return false;
+    }
 
-    lctx.use_buf(ctx0, -1);
+    llama_prefix_cache_drop(lctx, lru);
+    lctx.prefix_cache.stats.n_evictions++;
 
-    // logits -> probs
-    //inpL = ggml_soft_max(ctx0, inpL);
+    return true;
+}
 
-    // run the computation
-    ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute       (ctx0, &gf);
+// splits a node after its first n tokens, the rest goes to a new child
+static void llama_prefix_cache_split(struct llama_context & lctx, struct llama_prefix_node * node, size_t n) {
+    auto & kv_self = lctx.model.kv_self;
+
+    std::unique_ptr<llama_prefix_node> tail(new llama_prefix_node);
+    tail->tokens.assign(node->tokens.begin() + n, node->tokens.end());
+    tail->pos      = node->pos + n;
+    tail->seq_id   = llama_prefix_cache_new_seq_id(lctx.prefix_cache);
+    tail->t_used   = node->t_used;
+    tail->parent   = node;
+    tail->children = std::move(node->children);
+    for (auto & it : tail->children) {
+        it.second->parent = tail.get();
+    }
 
-    // print timing information per ggml operation (for debugging purposes)
-    // requires GGML_PERF to be defined
-    //ggml_graph_print(&gf);
+    // the cells move to the new sequence, the cells of both sequences stay in use throughout
+    llama_kv_cache_seq_cp(kv_self, node->seq_id, tail->seq_id, tail->pos, -1);
+    llama_kv_cache_seq_rm(kv_self, node->seq_id, tail->pos, -1);
 
-    // plot the computation graph in dot format (for debugging purposes)
-    //if (n_past%100 == 0) {
-    //    ggml_graph_dump_dot(&gf, NULL, "llama.dot");
-    //}
+    node->tokens.resize(n);
+    node->children.clear();
+    node->children[tail->tokens[0]] = std::move(tail);
+}
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+// drops every node whose cells were removed or moved by changes to the KV cache
+// that did not go through the prefix cache, and frees cells of unknown prefix sequences
+static void llama_prefix_cache_sync(struct llama_context & lctx) {
+    auto & cache   = lctx.prefix_cache;
+    auto & kv_self = lctx.model.kv_self;
 
-    // extract logits
-    {
-        auto & logits_out = lctx.logits;
+    struct seq_range {
+        uint32_t  n     = 0;
+        llama_pos p_min = std::numeric_limits<llama_pos>::max();
+        llama_pos p_max = -1;
+    };
 
-        if (lctx.logits_all) {
-            logits_out.resize(n_vocab * N);
-            memcpy(logits_out.data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*N);
-        } else {
-            // return result for just the last token
-            logits_out.resize(n_vocab);
-            memcpy(logits_out.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    std::map<llama_seq_id, seq_range> ranges;
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        const auto & cell = kv_self.cells[i];
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            if (seq_id >= LLAMA_PREFIX_CACHE_SEQ_ID) {
+                auto & r = ranges[seq_id];
+                r.n++;
+                r.p_min = std::min(r.p_min, cell.pos);
+                r.p_max = std::max(r.p_max, cell.pos);
+            }
         }
     }
 
-    // extract embeddings
-    if (lctx.embedding.size()) {
-        auto & embedding_out = lctx.embedding;
-
-        embedding_out.resize(n_embd);
-        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(N - 1)), sizeof(float)*n_embd);
+    if (ranges.empty() && cache.root.children.empty()) {
+        return;
     }
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
-    }
+    std::vector<llama_prefix_node *> stack = { &cache.root };
+    while (!stack.empty()) {
+        llama_prefix_node * node = stack.back();
+        stack.pop_back();
 
-#if 0
-    printf("\n%s: used_mem = %.3f MB, scratch -- %.3f MB %.3f MB\n", __func__,
-            ggml_used_mem(ctx0)/1024.0/1024.0,
-            lctx.get_buf_max_mem(0)/1024.0/1024.0,
-            lctx.get_buf_max_mem(1)/1024.0/1024.0);
-#endif
+        for (auto it = node->children.begin(); it != node->children.end(); ) {
+            llama_prefix_node * child = it->second.get();
+            ++it;
 
-    ggml_free(ctx0);
+            const auto r = ranges.find(child->seq_id);
+            const llama_pos p_end = child->pos + (llama_pos) child->tokens.size();
+            if (r == ranges.end() || r->second.n != child->tokens.size() ||
+                r->second.p_min != child->pos || r->second.p_max != p_end - 1) {
+                llama_prefix_cache_drop(lctx, child);
+                continue;
+            }
 
-    // measure the performance only for the single-token evals
-    if (N == 1) {
-        lctx.t_eval_us += ggml_time_us() - t_start_us;
-        lctx.n_eval++;
+            ranges.erase(r);
+            stack.push_back(child);
+        }
     }
-    else if (N > 1) {
-        lctx.t_p_eval_us += ggml_time_us() - t_start_us;
-        lctx.n_p_eval += N;
+
+    // cells of sequences that no node owns
+    for (const auto & it : ranges) {
+        llama_kv_cache_seq_rm(kv_self, it.first, -1, -1);
     }
+}
 
-    return true;
+static void llama_prefix_cache_reset(struct llama_context & lctx) {
+    auto & root = lctx.prefix_cache.root;
+
+    while (!root.children.empty()) {
+        llama_prefix_cache_drop(lctx, root.children.begin()->second.get());
+    }
+}
+
+// counts the cells of a sequence with positions in [p0, p1)
+static uint32_t llama_kv_cache_seq_count(const struct llama_kv_cache & cache, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        const auto & cell = cache.cells[i];
+        if (cell.pos >= p0 && cell.pos < p1 && cell.has_seq_id(seq_id)) {
+            n++;
+        }
+    }
+    return n;
 }
 
 //
-// tokenizer
+// kv swap
 //
 
-static size_t utf8_len(char src) {
-    const size_t lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4 };
-    uint8_t highbits = static_cast<uint8_t>(src) >> 4;
-    return lookup[highbits];
+// A swapped out sequence of n cells in nb V blocks is stored as:
+//
+//   n x (pos, delta, slot)
+//   K: n_layer x n cells
+//   V: n_layer x n_embd rows of the nb blocks that hold its cells
+//
+// The V blocks are kept as they are, including the values of other sequences that
+// share them, so swapping out does not round anything. slot is the index of the
+// cell in the nb blocks. For F32 and F16 a block is one cell and nb is n.
+
+static int64_t llama_kv_swap_t_used(const struct llama_kv_swap & swap, llama_seq_id seq_id) {
+    const auto it = swap.t_used.find(seq_id);
+    return it == swap.t_used.end() ? 0 : it->second;
 }
 
-struct llama_sp_symbol {
-    using index = int;
-    index prev;
-    index next;
-    const char * text;
-    size_t n;
-};
+// forgets swapped out sequences, seq_id < 0 for all of them
+static void llama_kv_swap_drop(struct llama_context & lctx, llama_seq_id seq_id) {
+    auto & swap = lctx.kv_swap;
 
-struct llama_sp_bigram {
-    struct comparator {
-        bool operator()(llama_sp_bigram & l, llama_sp_bigram & r) {
-            return (l.score < r.score) || (l.score == r.score && l.left > r.left);
+    if (seq_id < 0) {
+        swap.t_used.clear();
+    } else {
+        swap.t_used.erase(seq_id);
+    }
+
+    for (auto it = swap.seqs.begin(); it != swap.seqs.end(); ) {
+        if (seq_id >= 0 && it->first != seq_id) {
+            ++it;
+            continue;
         }
-    };
-    using queue_storage = std::vector<llama_sp_bigram>;
-    using queue = std::priority_queue<llama_sp_bigram, queue_storage, comparator>;
-    llama_sp_symbol::index left;
-    llama_sp_symbol::index right;
-    float score;
-    size_t size;
-};
 
-// original implementation:
-// https://github.com/ggerganov/llama.cpp/commit/074bea2eb1f1349a0118239c4152914aecaa1be4
-struct llama_tokenizer {
-    llama_tokenizer(const llama_vocab & vocab): vocab_(vocab) {}
+        if (it->second.path.empty()) {
+            swap.size_memory -= it->second.size;
+        } else {
+            std::remove(it->second.path.c_str());
+            swap.size_disk -= it->second.size;
+        }
 
-    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        // split string into utf8 chars
-        int index = 0;
-        size_t offs = 0;
-        while (offs < text.size()) {
-            llama_sp_symbol sym;
-            size_t char_len = std::min(text.size() - offs, utf8_len(text[offs]));
-            sym.text = text.c_str() + offs;
-            sym.n = char_len;
-            offs += char_len;
-            sym.prev = index - 1;
-            sym.next = offs == text.size() ? -1 : index + 1;
-            index++;
-            symbols_.emplace_back(std::move(sym));
+        it = swap.seqs.erase(it);
+    }
+}
+
+// writes the least recently used sequences in memory to files until the rest fits in size_max
+static void llama_kv_swap_spill(struct llama_context & lctx) {
+    auto & swap = lctx.kv_swap;
+
+    while (swap.size_memory > swap.size_max && !swap.dir.empty()) {
+        llama_seq_id lru = -1;
+        for (const auto & it : swap.seqs) {
+            if (it.second.path.empty() && (lru < 0 || llama_kv_swap_t_used(swap, it.first) < llama_kv_swap_t_used(swap, lru))) {
+                lru = it.first;
+            }
         }
 
-        // seed the work queue with all possible 2-character tokens.
-        for (size_t i = 1; i < symbols_.size(); ++i) {
-            try_add_bigram(i - 1, i);
+        if (lru < 0) {
+            break;
         }
 
-        // keep substituting the highest frequency pairs for as long as we can.
-        while (!work_queue_.empty()) {
-            auto bigram = work_queue_.top();
-            work_queue_.pop();
+        auto & entry = swap.seqs[lru];
 
-            auto & left_sym = symbols_[bigram.left];
-            auto & right_sym = symbols_[bigram.right];
+        const std::string path = format("%s/llama-kv-%p-%d.bin", swap.dir.c_str(), (void *) &lctx, lru);
+        try {
+            llama_file file(path.c_str(), "wb");
+            file.write_raw(entry.data.data(), entry.size);
+        } catch (const std::string & err) {
+            fprintf(stderr, "%s: failed to write %s: %s\n", __func__, path.c_str(), err.c_str());
+            std::remove(path.c_str());
+            break;
+        }
 
-            // if one of the symbols already got merged, skip it.
-            if (left_sym.n == 0 || right_sym.n == 0 ||
-                left_sym.n + right_sym.n != bigram.size) {
-                continue;
-            }
+        std::vector<uint8_t>().swap(entry.data);
+        entry.path = path;
 
-            // merge the right sym into the left one
-            left_sym.n += right_sym.n;
-            right_sym.n = 0;
+        swap.size_memory -= entry.size;
+        swap.size_disk   += entry.size;
+        swap.stats.n_disk_writes++;
+    }
+}
 
-            //printf("left = '%*s' size = %zu\n", (int) left_sym.n, left_sym.text, bigram.size);
+// moves the cells of a sequence out of the KV cache
+// returns false if the sequence has no cells
+static bool llama_kv_swap_out(struct llama_context & lctx, llama_seq_id seq_id) {
+    const auto & hparams = lctx.model.hparams;
+    auto & kv_self = lctx.model.kv_self;
+    auto & swap    = lctx.kv_swap;
+
+    std::vector<uint32_t> ids;
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        if (kv_self.cells[i].pos >= 0 && kv_self.cells[i].has_seq_id(seq_id)) {
+            ids.push_back(i);
+        }
+    }
 
-            // remove the right sym from the chain
-            left_sym.next = right_sym.next;
-            if (right_sym.next >= 0) {
-                symbols_[right_sym.next].prev = bigram.left;
-            }
+    if (ids.empty()) {
+        return false;
+    }
 
-            // find more substitutions
-            try_add_bigram(left_sym.prev, bigram.left);
-            try_add_bigram(bigram.left, left_sym.next);
-        }
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
 
-        for (int i = 0; i != -1; i = symbols_[i].next) {
-            auto & symbol = symbols_[i];
-            auto token = vocab_.token_to_id.find(std::string(symbol.text, symbol.n));
+    const ggml_type wtype = kv_self.k->type;
+    const int    blck  = ggml_blck_size(wtype);
+    const size_t esize = ggml_type_size(wtype);
 
-            if (token == vocab_.token_to_id.end()) {
-                // output any symbols that did not form tokens as bytes.
-                for (int j = 0; j < (int) symbol.n; ++j) {
-                    llama_vocab::id token_id = static_cast<uint8_t>(symbol.text[j]) + 3;
-                    output.push_back(token_id);
-                }
-            } else {
-                output.push_back((*token).second);
-            }
+    // the V blocks that hold the cells
+    std::vector<uint32_t> blocks;
+    for (const uint32_t id : ids) {
+        if (blocks.empty() || blocks.back() != id/blck) {
+            blocks.push_back(id/blck);
         }
     }
 
-private:
-    void try_add_bigram(int left, int right) {
-        if (left == -1 || right == -1) {
-            return;
+    const uint32_t n  = ids.size();
+    const uint32_t nb = blocks.size();
+
+    const size_t k_row = esize*n_embd/blck;
+    const size_t v_row = esize*nb;
+
+    llama_kv_swap_seq entry;
+    entry.n_cells  = n;
+    entry.n_blocks = nb;
+    entry.size     = n*(2*sizeof(llama_pos) + sizeof(uint32_t)) + (size_t) n_layer*n*k_row + (size_t) n_layer*n_embd*v_row;
+    entry.data.resize(entry.size);
+
+    uint8_t * ptr = entry.data.data();
+
+    for (uint32_t j = 0, ib = 0; j < n; ++j) {
+        const uint32_t id = ids[j];
+        while (blocks[ib] != id/blck) {
+            ib++;
         }
+        const uint32_t slot = ib*blck + id % blck;
 
-        const std::string text = std::string(symbols_[left].text, symbols_[left].n + symbols_[right].n);
-        auto token = vocab_.token_to_id.find(text);
+        memcpy(ptr, &kv_self.cells[id].pos,   sizeof(llama_pos)); ptr += sizeof(llama_pos);
+        memcpy(ptr, &kv_self.cells[id].delta, sizeof(llama_pos)); ptr += sizeof(llama_pos);
+        memcpy(ptr, &slot,                    sizeof(uint32_t));  ptr += sizeof(uint32_t);
+    }
 
-        if (token == vocab_.token_to_id.end()) {
-            return;
+    for (int il = 0; il < n_layer; ++il) {
+        for (const uint32_t id : ids) {
+            memcpy(ptr, (const char *) kv_self.k->data + ((size_t) il*kv_self.size + id)*k_row, k_row);
+            ptr += k_row;
         }
+    }
 
-        if (static_cast<size_t>((*token).second) >= vocab_.id_to_token.size()) {
-            return;
+    for (int64_t row = 0; row < (int64_t) n_layer*n_embd; ++row) {
+        const char * v_src = (const char *) kv_self.v->data + row*esize*kv_self.size/blck;
+        for (uint32_t ib = 0; ib < nb; ++ib) {
+            memcpy(ptr + ib*esize, v_src + blocks[ib]*esize, esize);
         }
+        ptr += v_row;
+    }
 
-        const auto &tok_score = vocab_.id_to_token[(*token).second];
+    LLAMA_ASSERT(ptr == entry.data.data() + entry.size);
 
-        llama_sp_bigram bigram;
-        bigram.left = left;
-        bigram.right = right;
-        bigram.score = tok_score.score;
-        bigram.size = text.size();
-        work_queue_.push(bigram);
-    }
+    llama_kv_cache_seq_rm(kv_self, seq_id, -1, -1);
 
-    const llama_vocab & vocab_;
-    std::vector<llama_sp_symbol> symbols_;
-    llama_sp_bigram::queue work_queue_;
-};
+    swap.size_memory += entry.size;
+    swap.seqs[seq_id] = std::move(entry);
+    swap.stats.n_swap_out++;
 
-static std::vector<llama_vocab::id> llama_tokenize(const llama_vocab & vocab, const std::string & text, bool bos) {
-    llama_tokenizer tokenizer(vocab);
-    std::vector<llama_vocab::id> output;
+    llama_kv_swap_spill(lctx);
 
-    if (text.size() == 0) {
-        return output;
+    return true;
+}
+
+// moves the cells of a swapped out sequence back into free cells of the KV cache
+// the V blocks go to free blocks as they are when the cache has enough of them, otherwise
+// the cells are spread over free cells and the blocks they land in are quantized again
+// returns false if the cache has no room for them, throws if they could not be read
+static bool llama_kv_swap_in(struct llama_context & lctx, llama_seq_id seq_id) {
+    const auto & hparams = lctx.model.hparams;
+    auto & kv_self = lctx.model.kv_self;
+    auto & swap    = lctx.kv_swap;
+
+    const auto it = swap.seqs.find(seq_id);
+    if (it == swap.seqs.end()) {
+        return true;
     }
 
-    if (bos) {
-        output.push_back(1);
+    auto & entry = it->second;
+    const uint32_t n = entry.n_cells;
+
+    if (!kv_cache_reserve(hparams, kv_self, n)) {
+        return false;
     }
 
-    tokenizer.tokenize(text, output);
-    return output;
-}
+    if (!entry.path.empty()) {
+        entry.data.resize(entry.size);
+        {
+            llama_file file(entry.path.c_str(), "rb");
+            file.read_raw(entry.data.data(), entry.size);
+        }
+        std::remove(entry.path.c_str());
+        entry.path.clear();
 
-//
-// sampling
-//
+        swap.size_disk   -= entry.size;
+        swap.size_memory += entry.size;
+        swap.stats.n_disk_reads++;
+    }
 
-static void sample_top_k(std::vector<std::pair<float, llama_vocab::id>> & logits_id, int top_k) {
-    // find the top k tokens
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + top_k, logits_id.end(),
-            [](const std::pair<float, llama_vocab::id> & a, const std::pair<float, llama_vocab::id> & b) {
-        return a.first > b.first;
-    });
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
 
-    logits_id.resize(top_k);
-}
+    const ggml_type wtype = kv_self.k->type;
+    const int    blck  = ggml_blck_size(wtype);
+    const size_t esize = ggml_type_size(wtype);
 
-static llama_vocab::id llama_sample_top_p_top_k(
-        llama_context & lctx,
-        const std::vector<llama_vocab::id> & last_n_tokens,
-        int top_k,
-        float top_p,
-        float temp,
-        float repeat_penalty) {
-    auto & rng = lctx.rng;
+    const uint32_t nb = entry.n_blocks;
 
-    const int n_logits = lctx.model.hparams.n_vocab;
+    const size_t k_row = esize*n_embd/blck;
+    const size_t v_row = esize*nb;
 
-    const auto & logits = lctx.logits;
-    const auto * plogits = logits.data() + logits.size() - n_logits;
+    const uint8_t * ptr = entry.data.data();
 
-    if (temp <= 0) {
-        // select the token with the highest logit directly
-        float max_logit = plogits[0];
-        llama_vocab::id max_id = 0;
+    std::vector<uint32_t> slots(n);
+    for (uint32_t j = 0; j < n; ++j) {
+        memcpy(&slots[j], ptr + j*(2*sizeof(llama_pos) + sizeof(uint32_t)) + 2*sizeof(llama_pos), sizeof(uint32_t));
+    }
 
-        for (int i = 1; i < n_logits; ++i) {
-            if (plogits[i] > max_logit) {
-                max_logit = plogits[i];
-                max_id = i;
-            }
+    // free blocks for the V blocks, in order
+    std::vector<uint32_t> blocks;
+    for (uint32_t b = 0; b < kv_self.size/blck && blocks.size() < nb; ++b) {
+        bool is_free = true;
+        for (int i = 0; i < blck && is_free; ++i) {
+            is_free = kv_self.cells[b*blck + i].pos < 0;
+        }
+        if (is_free) {
+            blocks.push_back(b);
         }
-        return max_id;
     }
 
-    std::vector<std::pair<float, llama_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
+    const bool whole_blocks = blocks.size() == nb;
 
-    {
-        const float scale = 1.0f/temp;
-        for (int i = 0; i < n_logits; ++i) {
-            // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
-            // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
-            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
-                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
-                if (plogits[i] < 0.0f) {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale*repeat_penalty, i));
-                } else {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale/repeat_penalty, i));
-                }
-            } else {
-                logits_id.push_back(std::make_pair(plogits[i]*scale, i));
+    std::vector<uint32_t> ids;
+    if (whole_blocks) {
+        for (const uint32_t slot : slots) {
+            ids.push_back(blocks[slot/blck]*blck + slot % blck);
+        }
+    } else {
+        for (uint32_t i = 0; i < kv_self.size && ids.size() < n; ++i) {
+            if (kv_self.cells[i].pos < 0) {
+                ids.push_back(i);
             }
         }
     }
 
-    sample_top_k(logits_id, top_k > 0 ? std::min(top_k, n_logits) : n_logits);
+    LLAMA_ASSERT(ids.size() == n);
 
-    // compute probs for the top k tokens
-    std::vector<float> probs;
-    probs.reserve(logits_id.size());
+    for (const uint32_t id : ids) {
+        auto & cell = kv_self.cells[id];
+        memcpy(&cell.pos,   ptr, sizeof(llama_pos)); ptr += sizeof(llama_pos);
+        memcpy(&cell.delta, ptr, sizeof(llama_pos)); ptr += sizeof(llama_pos);
+        ptr += sizeof(uint32_t);
+        cell.seq_id.insert(seq_id);
 
-    float maxl = logits_id[0].first;
-    double sum = 0.0;
-    for (const auto & kv : logits_id) {
-        const float p = expf(kv.first - maxl);
-        probs.push_back(p);
-        sum += p;
+        kv_self.has_shift |= cell.delta != 0;
     }
+    kv_self.n += n;
 
-    // normalize the probs
-    for (auto & p : probs) {
-        p /= sum;
+    for (int il = 0; il < n_layer; ++il) {
+        for (const uint32_t id : ids) {
+            memcpy((char *) kv_self.k->data + ((size_t) il*kv_self.size + id)*k_row, ptr, k_row);
+            ptr += k_row;
+        }
     }
 
-    if (top_p < 1.0) {
-        double cumsum = 0.0;
-        for (int i = 0; i < (int) probs.size(); i++) {
-            cumsum += probs[i];
-            if (cumsum >= top_p) {
-                probs.resize(i + 1);
-                logits_id.resize(i + 1);
-                break;
+    if (whole_blocks) {
+        for (int64_t row = 0; row < (int64_t) n_layer*n_embd; ++row) {
+            char * v_dst = (char *) kv_self.v->data + row*esize*kv_self.size/blck;
+            for (uint32_t ib = 0; ib < nb; ++ib) {
+                memcpy(v_dst + blocks[ib]*esize, ptr + ib*esize, esize);
             }
+            ptr += v_row;
         }
+    } else {
+        // the cells are in ascending order, and so are their slots
+        std::vector<std::pair<uint32_t, uint32_t>> moves;
+        for (uint32_t j = 0; j < n; ++j) {
+            moves.emplace_back(slots[j], ids[j]);
+        }
+        kv_cache_copy_v(hparams, wtype, ptr, nb*blck, kv_self.v->data, kv_self.size, moves);
+        ptr += (size_t) n_layer*n_embd*v_row;
     }
 
-    //printf("\n");
-    //for (int i = 0; i < (int) 10; i++) {
-    //    printf("%d: '%s' %f\n", i, lctx.vocab.id_to_token.at(logits_id[i].second).tok.c_str(), probs[i]);
-    //}
-    //printf("\n\n");
-    //exit(0);
+    LLAMA_ASSERT(ptr == entry.data.data() + entry.size);
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+    swap.size_memory -= entry.size;
+    swap.seqs.erase(it);
+    swap.stats.n_swap_in++;
 
-    return logits_id[idx].second;
+    return true;
 }
 
-//
-// quantization
-//
+// brings a swapped out sequence back before an operation on its cells, seq_id < 0 for all of them
+static void llama_kv_swap_touch(struct llama_context & lctx, llama_seq_id seq_id) {
+    std::vector<llama_seq_id> seq_ids;
+    for (const auto & it : lctx.kv_swap.seqs) {
+        if (seq_id < 0 || it.first == seq_id) {
+            seq_ids.push_back(it.first);
+        }
+    }
 
-static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, enum llama_ftype ftype) {
-    ggml_type quantized_type;
-    switch (ftype) {
-        case LLAMA_FTYPE_MOSTLY_Q4_0: quantized_type = GGML_TYPE_Q4_0; break;
-        case LLAMA_FTYPE_MOSTLY_Q4_1: quantized_type = GGML_TYPE_Q4_1; break;
-        default: throw format("invalid output file type %d\n", ftype);
-    };
+    for (const llama_seq_id id : seq_ids) {
+        try {
+            if (!llama_kv_swap_in(lctx, id)) {
+                fprintf(stderr, "%s: no room in the KV cache to swap in sequence %d\n", __func__, id);
+            }
+        } catch (const std::string & err) {
+            fprintf(stderr, "%s: failed to swap in sequence %d: %s\n", __func__, id, err.c_str());
+        }
+    }
+}
 
-    std::unique_ptr<llama_model_loader> model_loader(new llama_model_loader(fname_inp.c_str(), /*use_mmap*/ false,
-                                                                            /*vocab_only*/ false));
-    llama_file_saver file_saver(fname_out.c_str(), model_loader->file_loaders.at(0).get(), ftype);
+// frees cells for a batch: drops a cached prefix if there is one, otherwise
+// swaps out the least recently used sequence that has no tokens in the batch
+// returns false if nothing could be freed
+static bool llama_kv_cache_make_room(struct llama_context & lctx, const struct llama_batch & batch) {
+    if (llama_prefix_cache_evict(lctx)) {
+        return true;
+    }
 
-    size_t total_size_org = 0;
-    size_t total_size_new = 0;
-    std::vector<int64_t> hist_all(1 << 4, 0);
+    auto & swap = lctx.kv_swap;
+    if (!swap.automatic) {
+        return false;
+    }
 
-    size_t idx = 0;
-    for (llama_load_tensor & tensor : model_loader->tensors_map.tensors) {
-        llama_buffer read_data;
-        read_data.resize(tensor.size);
-        tensor.data = read_data.addr;
-        model_loader->load_data_for(tensor);
+    const std::set<llama_seq_id> in_batch(batch.seq_id, batch.seq_id + batch.n_tokens);
 
-        printf("[%zu/%zu] %36s - %s, type = %6s, ",
-               ++idx, model_loader->tensors_map.tensors.size(),
-               tensor.name.c_str(), llama_format_tensor_shape(tensor.ne).c_str(),
-               llama_format_type(tensor.type));
+    llama_seq_id lru = -1;
+    for (const auto & cell : lctx.model.kv_self.cells) {
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            if (seq_id == lru || seq_id >= LLAMA_PREFIX_CACHE_SEQ_ID || in_batch.count(seq_id)) {
+                continue;
+            }
+            if (lru < 0 || llama_kv_swap_t_used(swap, seq_id) < llama_kv_swap_t_used(swap, lru)) {
+                lru = seq_id;
+            }
+        }
+    }
 
-        // This used to be a regex, but <regex> has an extreme cost to compile times.
-        bool quantize = tensor.name.rfind("weight") == tensor.name.size() - 6; // ends with 'weight'?
+    return lru >= 0 && llama_kv_swap_out(lctx, lru);
+}
 
-        // quantize only 2D tensors
+struct llama_context_params llama_context_default_params() {
+    struct llama_context_params result = {
+        /*.n_ctx                       =*/ 512,
+        /*.n_parts                     =*/ -1,
+        /*.seed                        =*/ 0,
+        /*.f16_kv                      =*/ false,
+        /*.kv_type                     =*/ LLAMA_KV_TYPE_DEFAULT,
+        /*.prefix_cache_tokens         =*/ 0,
+        /*.kv_swap_size                =*/ 0,
+        /*.kv_swap_dir                 =*/ nullptr,
+        /*.logits_all                  =*/ false,
+        /*.vocab_only                  =*/ false,
+        /*.use_mmap                    =*/ true,
+        /*.use_mlock                   =*/ false,
+        /*.fuse_weights                =*/ false,
+        /*.pin_threads                 =*/ false,
+        /*.embedding                   =*/ false,
+        /*.pooling_type                =*/ LLAMA_POOLING_TYPE_LAST,
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
+    };
+
+    return result;
+}
+
+bool llama_mmap_supported() {
+    return llama_mmap::SUPPORTED;
+}
+
+bool llama_mlock_supported() {
+    return llama_mlock::SUPPORTED;
+}
+
+//
+// model loading
+//
+
+static const char *llama_file_version_name(llama_file_version version) {
+    switch (version) {
+        case LLAMA_FILE_VERSION_GGML: return "'ggml' (old version with low tokenizer quality and no mmap support)";
+        case LLAMA_FILE_VERSION_GGMF_V1: return "ggmf v1 (old version with no mmap support)";
+        case LLAMA_FILE_VERSION_GGJT_V1: return "ggjt v1 (latest)";
+        default: LLAMA_ASSERT(false);
+    }
+}
+
+static const char *llama_ftype_name(enum llama_ftype ftype) {
+    switch (ftype) {
+        case LLAMA_FTYPE_ALL_F32:     return "all F32";
+        case LLAMA_FTYPE_MOSTLY_F16:  return "mostly F16";
+        case LLAMA_FTYPE_MOSTLY_Q4_0: return "mostly Q4_0";
+        case LLAMA_FTYPE_MOSTLY_Q4_1: return "mostly Q4_1";
+        case LLAMA_FTYPE_MOSTLY_Q4_1_SOME_F16:
+                                      return "mostly Q4_1, some F16";
+        default:                      return "unknown, may not work";
+    }
+}
+
+static const char *llama_model_type_name(e_model type) {
+    switch (type) {
+        case MODEL_7B: return "7B";
+        case MODEL_13B: return "13B";
+        case MODEL_30B: return "30B";
+        case MODEL_65B: return "65B";
+        default: LLAMA_ASSERT(false);
+    }
+}
+
+static void llama_model_load_internal(
+        const std::string & fname,
+        llama_context & lctx,
+        int n_ctx,
+        ggml_type memory_type,
+        bool use_mmap,
+        bool use_mlock,
+        bool fuse_weights,
+        bool vocab_only,
+        llama_progress_callback progress_callback,
+        void * progress_callback_user_data) {
+
+    lctx.t_start_us = ggml_time_us();
+
+    if (fuse_weights && use_mmap) {
+        fprintf(stderr, "llama.cpp: not using mmap because the weights are fused in memory\n");
+        use_mmap = false;
+    }
+
+    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap, vocab_only));
+
+    lctx.vocab = std::move(ml->file_loaders.at(0)->vocab);
+    auto & model = lctx.model;
+    model.hparams = ml->file_loaders.at(0)->hparams;
+    llama_file_version file_version = ml->file_loaders.at(0)->file_version;
+    auto & hparams = model.hparams;
+    uint32_t n_ff = ((2*(4*hparams.n_embd)/3 + hparams.n_mult - 1)/hparams.n_mult)*hparams.n_mult;
+
+    {
+        switch (hparams.n_layer) {
+            case 32: model.type = e_model::MODEL_7B; break;
+            case 40: model.type = e_model::MODEL_13B; break;
+            case 60: model.type = e_model::MODEL_30B; break;
+            case 80: model.type = e_model::MODEL_65B; break;
+        }
+
+        hparams.n_ctx = n_ctx;
+    }
+
+    {
+        fprintf(stderr, "%s: format     = %s\n",  __func__, llama_file_version_name(file_version));
+        fprintf(stderr, "%s: n_vocab    = %u\n",  __func__, hparams.n_vocab);
+        fprintf(stderr, "%s: n_ctx      = %u\n",  __func__, hparams.n_ctx);
+        fprintf(stderr, "%s: n_embd     = %u\n",  __func__, hparams.n_embd);
+        fprintf(stderr, "%s: n_mult     = %u\n",  __func__, hparams.n_mult);
+        fprintf(stderr, "%s: n_head     = %u\n",  __func__, hparams.n_head);
+        fprintf(stderr, "%s: n_layer    = %u\n",  __func__, hparams.n_layer);
+        fprintf(stderr, "%s: n_rot      = %u\n",  __func__, hparams.n_rot);
+        fprintf(stderr, "%s: ftype      = %u (%s)\n", __func__, hparams.ftype, llama_ftype_name(hparams.ftype));
+        fprintf(stderr, "%s: n_ff       = %u\n",  __func__, n_ff);
+        fprintf(stderr, "%s: n_parts    = %zu\n", __func__, ml->file_loaders.size());
+        fprintf(stderr, "%s: model size = %s\n",  __func__, llama_model_type_name(model.type));
+    }
+
+    if (vocab_only) {
+        return;
+    }
+
+    auto & ctx = model.ctx;
+
+    size_t ctx_size, mmapped_size;
+    ml->calc_sizes(&ctx_size, &mmapped_size);
+    if (fuse_weights) {
+        // the fused matrices hold the data, their parts are views
+        ctx_size += 2*hparams.n_layer*(sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE);
+    }
+    fprintf(stderr, "%s: ggml ctx size = %6.2f KB\n", __func__, ctx_size/1024.0);
+
+    // print memory requirements
+    {
+        const size_t scale = memory_type == GGML_TYPE_F32 ? 2 : 1;
+
+        // this is the total memory required to run the inference
+        const size_t mem_required =
+            ctx_size +
+            mmapped_size +
+            MEM_REQ_SCRATCH0.at(model.type) +
+            MEM_REQ_SCRATCH1.at(model.type) +
+            MEM_REQ_EVAL.at    (model.type);
+
+        // this is the memory required by one llama_state
+        const size_t mem_required_state =
+            scale*MEM_REQ_KV_SELF.at(model.type);
+
+        fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per state)\n", __func__,
+                mem_required / 1024.0 / 1024.0, mem_required_state / 1024.0 / 1024.0);
+    }
+
+    // create the ggml context
+    {
+        lctx.model.buf.resize(ctx_size);
+        if (use_mlock) {
+            lctx.model.mlock_buf.init(lctx.model.buf.addr);
+            lctx.model.mlock_buf.grow_to(lctx.model.buf.size);
+        }
+
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ lctx.model.buf.size,
+            /*.mem_buffer =*/ lctx.model.buf.addr,
+            /*.no_alloc   =*/ ml->use_mmap,
+        };
+
+        model.ctx = ggml_init(params);
+        if (!model.ctx) {
+            throw format("ggml_init() failed");
+        }
+    }
+
+    // prepare memory for the weights
+    {
+        const auto & hparams = model.hparams;
+
+        const uint32_t n_embd  = hparams.n_embd;
+        const uint32_t n_layer = hparams.n_layer;
+        const uint32_t n_vocab = hparams.n_vocab;
+
+        ml->ggml_ctx = ctx;
+
+        model.tok_embeddings = ml->get_tensor("tok_embeddings.weight", {n_embd, n_vocab});
+        model.norm   = ml->get_tensor("norm.weight", {n_embd});
+        model.output = ml->get_tensor("output.weight", {n_embd, n_vocab});
+
+        model.layers.resize(n_layer);
+        for (uint32_t i = 0; i < n_layer; ++i) {
+            auto & layer = model.layers[i];
+
+            std::string layers_i = "layers." + std::to_string(i);
+
+            layer.attention_norm = ml->get_tensor(layers_i + ".attention_norm.weight", {n_embd});
+
+            std::vector<struct ggml_tensor *> parts;
+
+            layer.wqkv = NULL;
+            if (fuse_weights) {
+                layer.wqkv = ml->get_tensor_fused({ layers_i + ".attention.wq.weight",
+                                                    layers_i + ".attention.wk.weight",
+                                                    layers_i + ".attention.wv.weight" }, {n_embd, n_embd}, parts);
+            }
+            if (layer.wqkv) {
+                layer.wq = parts[0];
+                layer.wk = parts[1];
+                layer.wv = parts[2];
+            } else {
+                layer.wq = ml->get_tensor(layers_i + ".attention.wq.weight", {n_embd, n_embd});
+                layer.wk = ml->get_tensor(layers_i + ".attention.wk.weight", {n_embd, n_embd});
+                layer.wv = ml->get_tensor(layers_i + ".attention.wv.weight", {n_embd, n_embd});
+            }
+            layer.wo = ml->get_tensor(layers_i + ".attention.wo.weight", {n_embd, n_embd});
+
+            layer.ffn_norm = ml->get_tensor(layers_i + ".ffn_norm.weight", {n_embd});
+
+            layer.w13 = NULL;
+            if (fuse_weights) {
+                layer.w13 = ml->get_tensor_fused({ layers_i + ".feed_forward.w1.weight",
+                                                   layers_i + ".feed_forward.w3.weight" }, {n_embd, n_ff}, parts);
+            }
+            if (layer.w13) {
+                layer.w1 = parts[0];
+                layer.w3 = parts[1];
+            } else {
+                layer.w1 = ml->get_tensor(layers_i + ".feed_forward.w1.weight", {n_embd,   n_ff});
+                layer.w3 = ml->get_tensor(layers_i + ".feed_forward.w3.weight", {n_embd,   n_ff});
+            }
+            layer.w2 = ml->get_tensor(layers_i + ".feed_forward.w2.weight", {  n_ff,   n_embd});
+        }
+    }
+
+    ml->done_getting_tensors();
+
+    // populate `tensors_by_name`
+    for (llama_load_tensor & lt : ml->tensors_map.tensors) {
+        model.tensors_by_name.emplace_back(lt.name, lt.ggml_tensor);
+    }
+
+    ml->load_all_data(progress_callback, progress_callback_user_data, use_mlock ? &lctx.model.mlock_mmap : NULL);
+
+    model.mapping = std::move(ml->mapping);
+
+    // loading time will be recalculate after the first eval, so
+    // we take page faults deferred by mmap() into consideration
+    lctx.t_load_us = ggml_time_us() - lctx.t_start_us;
+}
+
+static bool llama_model_load(
+        const std::string & fname,
+        llama_context & lctx,
+        int n_ctx,
+        ggml_type memory_type,
+        bool use_mmap,
+        bool use_mlock,
+        bool fuse_weights,
+        bool vocab_only,
+        llama_progress_callback progress_callback,
+        void *progress_callback_user_data) {
+    try {
+        llama_model_load_internal(fname, lctx, n_ctx, memory_type, use_mmap, use_mlock,
+                                  fuse_weights, vocab_only, progress_callback, progress_callback_user_data);
+        return true;
+    } catch (const std::string & err) {
+        fprintf(stderr, "error loading model: %s\n", err.c_str());
+        return false;
+    }
+}
+
+// the thread pool for n_threads threads, started on first use
+static struct ggml_threadpool * llama_get_threadpool(llama_context & lctx, int n_threads) {
+    if (n_threads <= 1) {
+        return NULL;
+    }
+
+    if (lctx.threadpool && ggml_threadpool_n_threads(lctx.threadpool) != n_threads) {
+        ggml_threadpool_free(lctx.threadpool);
+        lctx.threadpool = NULL;
+    }
+
+    if (!lctx.threadpool) {
+        lctx.threadpool = ggml_threadpool_new(n_threads, lctx.pin_threads);
+    }
+
+    return lctx.threadpool;
+}
+
+// rotates the K of every cell by the delta of the cell, in place
+// RoPE rotations compose, so this gives the same K as computing it at the new position
+static bool llama_kv_cache_apply_shift(
+        llama_context & lctx,
+            const int   n_threads) {
+    const auto & hparams = lctx.model.hparams;
+    auto & kv_self = lctx.model.kv_self;
+    auto & buf_compute = lctx.buf_compute;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_head  = hparams.n_head;
+    const int n_rot   = hparams.n_embd/hparams.n_head;
+
+    const int n_cells = llama_kv_cache_cell_max(kv_self);
+
+    const bool   quantized = ggml_blck_size(kv_self.k->type) > 1;
+    const size_t k_row     = ggml_type_size(kv_self.k->type)*n_embd/ggml_blck_size(kv_self.k->type);
+
+    // the compute buffer is reused for the shift
+    lctx.graph.reset();
+
+    // one graph per layer, so that a dequantized layer of K fits in the compute buffer
+    for (int il = 0; il < n_layer && n_cells > 0; ++il) {
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ buf_compute.size,
+            /*.mem_buffer =*/ buf_compute.addr,
+            /*.no_alloc   =*/ false,
+        };
+
+        struct ggml_context * ctx0 = ggml_init(params);
+        if (!ctx0) {
+            return false;
+        }
+
+        ggml_cgraph gf = {};
+        gf.n_threads  = n_threads;
+        gf.threadpool = llama_get_threadpool(lctx, n_threads);
+
+        struct ggml_tensor * K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_cells);
+        for (int i = 0; i < n_cells; ++i) {
+            ((int32_t *) K_shift->data)[i] = kv_self.cells[i].delta;
+        }
+
+        if (quantized) {
+            // there is no quantized RoPE: dequantize, rotate and quantize again
+            struct ggml_tensor * rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_cells);
+            for (int i = 0; i < n_cells; ++i) {
+                ((int32_t *) rows->data)[i] = i;
+            }
+
+            struct ggml_tensor * k = ggml_view_2d(ctx0, kv_self.k, n_embd, n_cells, k_row, il*kv_self.size*k_row);
+            struct ggml_tensor * k_f32 = ggml_reshape_3d(ctx0, ggml_get_rows(ctx0, k, rows), n_embd/n_head, n_head, n_cells);
+
+            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_rope_pos(ctx0, k_f32, K_shift, n_rot, 0), k));
+        } else {
+            struct ggml_tensor * k = ggml_view_3d(ctx0, kv_self.k, n_embd/n_head, n_head, n_cells,
+                    ggml_element_size(kv_self.k)*(n_embd/n_head), k_row, il*kv_self.size*k_row);
+
+            ggml_build_forward_expand(&gf, ggml_rope_pos(ctx0, k, K_shift, n_rot, 0));
+        }
+
+        ggml_graph_compute(ctx0, &gf);
+        ggml_free(ctx0);
+    }
+
+    for (auto & cell : kv_self.cells) {
+        cell.delta = 0;
+    }
+    kv_self.has_shift = false;
+
+    return true;
+}
+
+// builds the graph for a batch of n_tokens tokens that attends to the cells [0, n_kv)
+// the views of the cells that the batch writes to are made for cell 0 and moved to
+// the first cell of the batch before each evaluation
+static void llama_build_graph(
+        llama_context & lctx,
+            const int   n_tokens,
+            const int   n_kv,
+            const int   n_outputs,
+            const bool  gather_vocab,
+            const int   n_threads) {
+    const int N = n_tokens;
+
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+
+    const auto & kv_self = model.kv_self;
+
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_head  = hparams.n_head;
+    const int n_vocab = hparams.n_vocab;
+    const int n_rot   = hparams.n_embd/hparams.n_head;
+
+    const int kv_size = kv_self.size;
+
+    // bytes per cell of a K layer and per row of a V layer
+    const bool   kv_quantized = ggml_blck_size(kv_self.k->type) > 1;
+    const size_t k_row = ggml_type_size(kv_self.k->type)*n_embd /ggml_blck_size(kv_self.k->type);
+    const size_t v_row = ggml_type_size(kv_self.v->type)*kv_size/ggml_blck_size(kv_self.v->type);
+
+    const int n_output_vocab = lctx.output_vocab.empty() ? n_vocab : (int) lctx.output_vocab.size();
+
+    auto & buf_compute = lctx.buf_compute;
+    auto & graph       = lctx.graph;
+    auto & gf          = graph.gf;
+
+    graph.reset();
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ buf_compute.size,
+        /*.mem_buffer =*/ buf_compute.addr,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    graph.ctx            = ctx0;
+    graph.n_tokens       = N;
+    graph.n_kv           = n_kv;
+    graph.n_outputs      = n_outputs;
+    graph.n_output_vocab = n_output_vocab;
+    graph.gather_vocab   = gather_vocab;
+    graph.n_threads      = n_threads;
+    graph.k              = kv_self.k;
+    graph.v              = kv_self.v;
+    graph.k_data         = kv_self.k->data;
+    graph.v_data         = kv_self.v->data;
+    graph.kv_size        = kv_size;
+    graph.kv_views.clear();
+    graph.kv_heads.clear();
+
+    gf = {};
+    gf.n_threads = n_threads;
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+
+    struct ggml_tensor * output_rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, std::max(n_outputs, 1));
+
+    struct ggml_tensor * output_vocab = NULL;
+    if (!lctx.output_vocab.empty()) {
+        output_vocab = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_output_vocab);
+    }
+
+    struct ggml_tensor * KQ_pos  = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, N);
+
+    struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
+
+    for (int il = 0; il < n_layer; ++il) {
+        struct ggml_tensor * inpSA = inpL;
+
+        struct ggml_tensor * cur;
+
+        lctx.use_buf(ctx0, 0);
+
+        // norm
+        {
+            // cur = attention_norm*rms_norm(inpL)
+            cur = ggml_rms_norm_mul(ctx0, inpL, model.layers[il].attention_norm);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * tmpq;
+            struct ggml_tensor * tmpk;
+            struct ggml_tensor * tmpv;
+
+            if (model.layers[il].wqkv) {
+                // one matmul for the three projections, each of them is a view of its rows of the result
+                struct ggml_tensor * qkv = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                ggml_build_forward_expand(&gf, qkv);
+
+                tmpq = ggml_view_3d(ctx0, qkv, n_embd/n_head, n_head, N, (n_embd/n_head)*sizeof(float), qkv->nb[1], 0*n_embd*sizeof(float));
+                tmpk = ggml_view_3d(ctx0, qkv, n_embd/n_head, n_head, N, (n_embd/n_head)*sizeof(float), qkv->nb[1], 1*n_embd*sizeof(float));
+                tmpv = ggml_view_2d(ctx0, qkv, n_embd, N, qkv->nb[1], 2*n_embd*sizeof(float));
+            } else {
+                // the projections only depend on cur, adding them first lets them run together
+                struct ggml_tensor * q = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * k = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+                struct ggml_tensor * v = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                ggml_build_forward_expand(&gf, q);
+                ggml_build_forward_expand(&gf, k);
+                ggml_build_forward_expand(&gf, v);
+
+                tmpq = ggml_reshape_3d(ctx0, q, n_embd/n_head, n_head, N);
+                tmpk = ggml_reshape_3d(ctx0, k, n_embd/n_head, n_head, N);
+                tmpv = ggml_reshape_2d(ctx0, v, n_embd, N);
+            }
+
+            // compute Q and K and RoPE them
+            struct ggml_tensor * Qcur = ggml_rope_pos(ctx0, tmpq, KQ_pos, n_rot, 0);
+            struct ggml_tensor * Kcur = ggml_rope_pos(ctx0, tmpk, KQ_pos, n_rot, 0);
+
+            // store key and value to memory
+            {
+                // compute the transposed [N, n_embd] V matrix
+                struct ggml_tensor * Vcur = ggml_transpose(ctx0, tmpv);
+
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, k_row*il*kv_size);
+
+                // important: storing RoPE-ed version of K in the KV cache!
+                struct ggml_tensor * k_cpy = ggml_cpy(ctx0, Kcur, k);
+                ggml_build_forward_expand(&gf, k_cpy);
+
+                graph.kv_views.push_back({ k,     kv_self.k, k_row*il*kv_size, k_row });
+                graph.kv_views.push_back({ k_cpy, kv_self.k, k_row*il*kv_size, k_row });
+
+                if (kv_quantized) {
+                    // the new cells share V blocks with their neighbours, so the partially filled block
+                    // at either end is dequantized and quantized again with each batch; its old values
+                    // keep their quants unless the new ones raise the block's scale, then they are rounded again
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, kv_size, n_embd, v_row, il*n_embd*v_row);
+                    struct ggml_tensor * v_set = ggml_set_cols(ctx0, Vcur, v, 0);
+                    ggml_build_forward_expand(&gf, v_set);
+
+                    graph.kv_heads.push_back(v_set->opt[0]);
+                } else {
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd, v_row, il*n_embd*v_row);
+                    struct ggml_tensor * v_cpy = ggml_cpy(ctx0, Vcur, v);
+                    ggml_build_forward_expand(&gf, v_cpy);
+
+                    graph.kv_views.push_back({ v,     kv_self.v, il*n_embd*v_row, ggml_element_size(kv_self.v) });
+                    graph.kv_views.push_back({ v_cpy, kv_self.v, il*n_embd*v_row, ggml_element_size(kv_self.v) });
+                }
+            }
+
+            // cached K as [n_embd/n_head, n_head, n_kv]
+            struct ggml_tensor * K_cache =
+                ggml_reshape_3d(ctx0,
+                        ggml_view_1d(ctx0, kv_self.k, n_kv*n_embd, il*kv_size*k_row),
+                        n_embd/n_head, n_head, n_kv);
+
+            // split cached V into n_head heads
+            struct ggml_tensor * V =
+                ggml_view_3d(ctx0, kv_self.v,
+                        n_kv, n_embd/n_head, n_head,
+                        v_row,
+                        v_row*(n_embd/n_head),
+                        il*n_embd*v_row);
+
+            if (N == 1) {
+                // a single token attends to the cache in one node that reads K and V where they are
+                cur = ggml_reshape_2d(ctx0,
+                        ggml_attn_decode(ctx0, Qcur, K_cache, V, KQ_mask, 1.0f/sqrtf(float(n_embd)/n_head)),
+                        n_embd, N);
+            } else {
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            Qcur,
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K = ggml_permute(ctx0, K_cache, 0, 2, 1, 3);
+
+                // K * Q, a quantized K is dequantized in the dot products so that Q stays F32
+                struct ggml_tensor * KQ = ggml_mul_mat_dequant(ctx0, K, Q);
+
+                // KQ = soft_max(KQ/sqrt(n_embd/n_head) + KQ_mask), the same mask for every head
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, 1.0f/sqrtf(float(n_embd)/n_head));
+
+#if 1
+                struct ggml_tensor * KQV = ggml_mul_mat_dequant(ctx0, V, KQ_soft_max);
+#else
+                // make V contiguous in memory to speed up the matmul, however we waste time on the copy
+                // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
+                // is there a better way?
+                struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_kv, n_embd/n_head, n_head));
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
+#endif
+
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                // cur = KQV_merged.contiguous().view(n_embd, N)
+                cur = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+            }
+
+            // projection (no bias)
+            cur = ggml_mul_mat(ctx0,
+                    model.layers[il].wo,
+                    cur);
+        }
+
+        lctx.use_buf(ctx0, 1);
+
+        struct ggml_tensor * inpFF = ggml_add(ctx0, cur, inpSA);
+
+        // feed-forward network
+        {
+            // norm
+            {
+                // cur = ffn_norm*rms_norm(inpFF)
+                cur = ggml_rms_norm_mul(ctx0, inpFF, model.layers[il].ffn_norm);
+            }
+
+            struct ggml_tensor * tmp;
+
+            if (model.layers[il].w13) {
+                // one matmul for w1 and w3, each of them is a view of its rows of the result
+                struct ggml_tensor * w13 = ggml_mul_mat(ctx0, model.layers[il].w13, cur);
+                const int n_ff = w13->ne[0]/2;
+
+                tmp = ggml_view_2d(ctx0, w13, n_ff, N, w13->nb[1], n_ff*sizeof(float));
+                cur = ggml_view_2d(ctx0, w13, n_ff, N, w13->nb[1], 0);
+            } else {
+                tmp = ggml_mul_mat(ctx0,
+                        model.layers[il].w3,
+                        cur);
+
+                cur = ggml_mul_mat(ctx0,
+                        model.layers[il].w1,
+                        cur);
+
+                ggml_build_forward_expand(&gf, tmp);
+                ggml_build_forward_expand(&gf, cur);
+            }
+
+            // SILU activation
+            cur = ggml_silu(ctx0, cur);
+
+            cur = ggml_mul(ctx0, cur, tmp);
+
+            cur = ggml_mul_mat(ctx0,
+                    model.layers[il].w2,
+                    cur);
+        }
+
+        cur = ggml_add(ctx0, cur, inpFF);
+
+        // input for next layer
+        inpL = cur;
+    }
+
+    lctx.use_buf(ctx0, 0);
+
+    // used at the end to optionally extract the embeddings
+    struct ggml_tensor * embeddings = NULL;
+
+    // norm
+    {
+        // inpL = norm*rms_norm(inpL)
+        inpL = ggml_rms_norm_mul(ctx0, inpL, model.norm);
+
+        embeddings = inpL;
+    }
+
+    // only the rows that logits were requested for go through the output projection
+    if (n_outputs > 0 && n_outputs < N) {
+        inpL = ggml_get_rows(ctx0, inpL, output_rows);
+    }
+
+    // lm_head
+    if (n_outputs > 0) {
+        if (gather_vocab) {
+            // the gathered rows go to the scratch buffer, so they must be computed after the
+            // layers: add everything up to the hidden states to the graph first
+            ggml_build_forward_expand(&gf, inpL);
+
+            // only the rows of the output matrix for the requested tokens
+            inpL = ggml_mul_mat(ctx0, ggml_get_rows(ctx0, model.output, output_vocab), inpL);
+        } else {
+            inpL = ggml_mul_mat(ctx0, model.output, inpL);
+        }
+    }
+
+    lctx.use_buf(ctx0, -1);
+
+    // logits -> probs
+    //inpL = ggml_soft_max(ctx0, inpL);
+
+    ggml_build_forward_expand(&gf, inpL);
+
+    graph.embd         = embd;
+    graph.KQ_pos       = KQ_pos;
+    graph.KQ_mask      = KQ_mask;
+    graph.output_rows  = output_rows;
+    graph.output_vocab = output_vocab;
+    graph.embeddings   = embeddings;
+    graph.logits       = inpL;
+}
+
+// evaluate the transformer
+//
+//   - lctx:      llama context
+//   - batch:     new batch of tokens to process, already assigned to the
+//                KV cells starting at kv_self.head
+//   - n_threads: number of threads to use
+//
+static bool llama_eval_internal(
+        llama_context & lctx,
+   const llama_batch & batch,
+            const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const int N = batch.n_tokens;
+
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+
+    const auto & kv_self = model.kv_self;
+
+    LLAMA_ASSERT(!!kv_self.ctx);
+
+    const int n_embd  = hparams.n_embd;
+    const int n_vocab = hparams.n_vocab;
+
+    auto & mem_per_token = lctx.mem_per_token;
+
+    // cells [0, n_kv) contain every token that the batch can attend to
+    const int kv_size = kv_self.size;
+    const int kv_head = kv_self.head;
+    const int kv_pad  = std::max<int>(kv_cache_cell_pad(kv_self.k->type), LLAMA_KV_GRAPH_PAD);
+    const int n_kv    = std::min(kv_size, ((int) llama_kv_cache_cell_max(kv_self) + kv_pad - 1)/kv_pad*kv_pad);
+
+    // the tokens that logits were requested for, in output order
+    auto & output_ids = lctx.output_ids;
+
+    output_ids.assign(N, -1);
+
+    int n_outputs = 0;
+    for (int i = 0; i < N; ++i) {
+        // embedding mode only computes logits that are asked for
+        const bool output = lctx.logits_all || (batch.logits ? batch.logits[i] : i == N - 1 && !lctx.embedding_mode);
+        if (output) {
+            output_ids[i] = n_outputs++;
+        }
+    }
+
+    const int n_output_vocab = lctx.output_vocab.empty() ? n_vocab : (int) lctx.output_vocab.size();
+
+    // a large subset is cheaper to pick from the full logits than to gather from the output matrix
+    const bool gather_vocab = !lctx.output_vocab.empty() && n_output_vocab <= n_vocab/8;
+
+    // for big prompts, if BLAS is enabled, it is better to use only one thread
+    // otherwise, the threads are spin-lock waiting for the BLAS calls and are degrading the performance
+    const int n_graph_threads = N >= 32 && ggml_cpu_has_blas() ? 1 : n_threads;
+
+    auto & graph = lctx.graph;
+    auto & gf    = graph.gf;
+
+    // the graph of the previous evaluation is reused if it has the same shape
+    const bool reuse_graph = graph.ctx &&
+        graph.n_tokens       == N               &&
+        graph.n_kv           == n_kv            &&
+        graph.n_outputs      == n_outputs       &&
+        graph.n_output_vocab == n_output_vocab  &&
+        graph.gather_vocab   == gather_vocab    &&
+        (graph.output_vocab != NULL) == !lctx.output_vocab.empty() &&
+        graph.n_threads      == n_graph_threads &&
+        graph.k              == kv_self.k       &&
+        graph.v              == kv_self.v       &&
+        graph.k_data         == kv_self.k->data &&
+        graph.v_data         == kv_self.v->data &&
+        graph.kv_size        == kv_size;
+
+    if (!reuse_graph) {
+        llama_build_graph(lctx, N, n_kv, n_outputs, gather_vocab, n_graph_threads);
+    }
+
+    memcpy(graph.embd->data,   batch.token, N*ggml_element_size(graph.embd));
+    memcpy(graph.KQ_pos->data, batch.pos,   N*ggml_element_size(graph.KQ_pos));
+
+    for (int i = 0; i < N; ++i) {
+        if (output_ids[i] >= 0) {
+            ((int32_t *) graph.output_rows->data)[output_ids[i]] = i;
+        }
+    }
+
+    if (graph.output_vocab) {
+        memcpy(graph.output_vocab->data, lctx.output_vocab.data(), n_output_vocab*ggml_element_size(graph.output_vocab));
+    }
+
+    // a token sees the cached tokens of its own sequence up to its own position
+    {
+        float * data = (float *) graph.KQ_mask->data;
+        for (int j = 0; j < N; ++j) {
+            const llama_pos    pos    = batch.pos[j];
+            const llama_seq_id seq_id = batch.seq_id[j];
+
+            for (int i = 0; i < n_kv; ++i) {
+                const auto & cell = kv_self.cells[i];
+                const bool visible = cell.pos >= 0 && cell.pos <= pos && cell.has_seq_id(seq_id);
+                data[j*n_kv + i] = visible ? 0.0f : -INFINITY;
+            }
+        }
+    }
+
+    // the batch writes its K and V to the cells starting at kv_head
+    for (const auto & view : graph.kv_views) {
+        view.tensor->data = (char *) view.cache->data + view.offs + view.cell_size*kv_head;
+    }
+    for (auto * head : graph.kv_heads) {
+        ((int32_t *) head->data)[0] = kv_head;
+    }
+
+    // run the computation
+    gf.threadpool = llama_get_threadpool(lctx, n_threads);
+    ggml_graph_compute(graph.ctx, &gf);
+
+    // print timing information per ggml operation (for debugging purposes)
+    // requires GGML_PERF to be defined
+    //ggml_graph_print(&gf);
+
+    // plot the computation graph in dot format (for debugging purposes)
+    //if (n_past%100 == 0) {
+    //    ggml_graph_dump_dot(&gf, NULL, "llama.dot");
+    //}
+
+    //embd_w.resize(n_vocab*N);
+    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+
+    // extract logits, the rows are already in output order
+    {
+        auto & logits_out = lctx.logits;
+
+        if (graph.output_vocab) {
+            const float * data = (float *) ggml_get_data(graph.logits);
+
+            logits_out.assign(n_vocab * n_outputs, -INFINITY);
+            for (int i = 0; i < n_outputs; ++i) {
+                for (int j = 0; j < n_output_vocab; ++j) {
+                    const llama_token id = lctx.output_vocab[j];
+                    logits_out[(size_t) n_vocab*i + id] = gather_vocab ? data[(size_t) n_output_vocab*i + j] : data[(size_t) n_vocab*i + id];
+                }
+            }
+        } else {
+            logits_out.resize(n_vocab * n_outputs);
+            if (n_outputs > 0) {
+                memcpy(logits_out.data(), (float *) ggml_get_data(graph.logits), sizeof(float)*n_vocab*n_outputs);
+            }
+        }
+    }
+
+    // extract embeddings
+    if (lctx.embedding_mode) {
+        auto & embedding_out = lctx.embedding;
+        auto & embedding_seq = lctx.embedding_seq;
+
+        const float * data = (float *) ggml_get_data(graph.embeddings);
+
+        embedding_seq.clear();
+
+        if (lctx.pooling_type == LLAMA_POOLING_TYPE_NONE) {
+            embedding_out.assign(data, data + (size_t) n_embd*N);
+        } else {
+            // one row per sequence, in the order the sequences first appear in the batch
+            std::map<llama_seq_id, int> seq_row;
+            std::vector<int>       row_n_tokens;
+            std::vector<llama_pos> row_pos;
+
+            embedding_out.clear();
+            for (int i = 0; i < N; ++i) {
+                const llama_seq_id seq_id = batch.seq_id[i];
+
+                auto it = seq_row.find(seq_id);
+                if (it == seq_row.end()) {
+                    it = seq_row.emplace(seq_id, (int) embedding_seq.size()).first;
+                    embedding_seq.push_back(seq_id);
+                    embedding_out.resize(embedding_out.size() + n_embd, 0.0f);
+                    row_n_tokens.push_back(0);
+                    row_pos.push_back(-1);
+                }
+
+                const int row = it->second;
+                float * dst = embedding_out.data() + (size_t) n_embd*row;
+                const float * src = data + (size_t) n_embd*i;
+
+                if (lctx.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
+                    for (int j = 0; j < n_embd; ++j) {
+                        dst[j] += src[j];
+                    }
+                    row_n_tokens[row]++;
+                } else if (batch.pos[i] >= row_pos[row]) {
+                    memcpy(dst, src, sizeof(float)*n_embd);
+                    row_pos[row] = batch.pos[i];
+                }
+            }
+
+            if (lctx.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
+                for (size_t row = 0; row < embedding_seq.size(); ++row) {
+                    const float scale = 1.0f/row_n_tokens[row];
+                    for (int j = 0; j < n_embd; ++j) {
+                        embedding_out[n_embd*row + j] *= scale;
+                    }
+                }
+            }
+        }
+    }
+
+    if (mem_per_token == 0) {
+        mem_per_token = ggml_used_mem(graph.ctx)/N;
+    }
+
+#if 0
+    printf("\n%s: used_mem = %.3f MB, scratch -- %.3f MB %.3f MB\n", __func__,
+            ggml_used_mem(graph.ctx)/1024.0/1024.0,
+            lctx.get_buf_max_mem(0)/1024.0/1024.0,
+            lctx.get_buf_max_mem(1)/1024.0/1024.0);
+#endif
+
+    // measure the performance only for the single-token evals
+    if (N == 1) {
+        lctx.t_eval_us += ggml_time_us() - t_start_us;
+        lctx.n_eval++;
+    }
+    else if (N > 1) {
+        lctx.t_p_eval_us += ggml_time_us() - t_start_us;
+        lctx.n_p_eval += N;
+    }
+
+    return true;
+}
+
+//
+// tokenizer
+//
+
+static size_t utf8_len(char src) {
+    const size_t lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4 };
+    uint8_t highbits = static_cast<uint8_t>(src) >> 4;
+    return lookup[highbits];
+}
+
+struct llama_sp_symbol {
+    using index = int;
+    index prev;
+    index next;
+    const char * text;
+    size_t n;
+};
+
+struct llama_sp_bigram {
+    struct comparator {
+        bool operator()(llama_sp_bigram & l, llama_sp_bigram & r) {
+            return (l.score < r.score) || (l.score == r.score && l.left > r.left);
+        }
+    };
+    using queue_storage = std::vector<llama_sp_bigram>;
+    using queue = std::priority_queue<llama_sp_bigram, queue_storage, comparator>;
+    llama_sp_symbol::index left;
+    llama_sp_symbol::index right;
+    float score;
+    size_t size;
+};
+
+// original implementation:
+// https://github.com/ggerganov/llama.cpp/commit/074bea2eb1f1349a0118239c4152914aecaa1be4
+struct llama_tokenizer {
+    llama_tokenizer(const llama_vocab & vocab): vocab_(vocab) {}
+
+    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
+        // split string into utf8 chars
+        int index = 0;
+        size_t offs = 0;
+        while (offs < text.size()) {
+            llama_sp_symbol sym;
+            size_t char_len = std::min(text.size() - offs, utf8_len(text[offs]));
+            sym.text = text.c_str() + offs;
+            sym.n = char_len;
+            offs += char_len;
+            sym.prev = index - 1;
+            sym.next = offs == text.size() ? -1 : index + 1;
+            index++;
+            symbols_.emplace_back(std::move(sym));
+        }
+
+        // seed the work queue with all possible 2-character tokens.
+        for (size_t i = 1; i < symbols_.size(); ++i) {
+            try_add_bigram(i - 1, i);
+        }
+
+        // keep substituting the highest frequency pairs for as long as we can.
+        while (!work_queue_.empty()) {
+            auto bigram = work_queue_.top();
+            work_queue_.pop();
+
+            auto & left_sym = symbols_[bigram.left];
+            auto & right_sym = symbols_[bigram.right];
+
+            // if one of the symbols already got merged, skip it.
+            if (left_sym.n == 0 || right_sym.n == 0 ||
+                left_sym.n + right_sym.n != bigram.size) {
+                continue;
+            }
+
+            // merge the right sym into the left one
+            left_sym.n += right_sym.n;
+            right_sym.n = 0;
+
+            //printf("left = '%*s' size = %zu\n", (int) left_sym.n, left_sym.text, bigram.size);
+
+            // remove the right sym from the chain
+            left_sym.next = right_sym.next;
+            if (right_sym.next >= 0) {
+                symbols_[right_sym.next].prev = bigram.left;
+            }
+
+            // find more substitutions
+            try_add_bigram(left_sym.prev, bigram.left);
+            try_add_bigram(bigram.left, left_sym.next);
+        }
+
+        for (int i = 0; i != -1; i = symbols_[i].next) {
+            auto & symbol = symbols_[i];
+            auto token = vocab_.token_to_id.find(std::string(symbol.text, symbol.n));
+
+            if (token == vocab_.token_to_id.end()) {
+                // output any symbols that did not form tokens as bytes.
+                for (int j = 0; j < (int) symbol.n; ++j) {
+                    llama_vocab::id token_id = static_cast<uint8_t>(symbol.text[j]) + 3;
+                    output.push_back(token_id);
+                }
+            } else {
+                output.push_back((*token).second);
+            }
+        }
+    }
+
+private:
+    void try_add_bigram(int left, int right) {
+        if (left == -1 || right == -1) {
+            return;
+        }
+
+        const std::string text = std::string(symbols_[left].text, symbols_[left].n + symbols_[right].n);
+        auto token = vocab_.token_to_id.find(text);
+
+        if (token == vocab_.token_to_id.end()) {
+            return;
+        }
+
+        if (static_cast<size_t>((*token).second) >= vocab_.id_to_token.size()) {
+            return;
+        }
+
+        const auto &tok_score = vocab_.id_to_token[(*token).second];
+
+        llama_sp_bigram bigram;
+        bigram.left = left;
+        bigram.right = right;
+        bigram.score = tok_score.score;
+        bigram.size = text.size();
+        work_queue_.push(bigram);
+    }
+
+    const llama_vocab & vocab_;
+    std::vector<llama_sp_symbol> symbols_;
+    llama_sp_bigram::queue work_queue_;
+};
+
+static std::vector<llama_vocab::id> llama_tokenize(const llama_vocab & vocab, const std::string & text, bool bos) {
+    llama_tokenizer tokenizer(vocab);
+    std::vector<llama_vocab::id> output;
+
+    if (text.size() == 0) {
+        return output;
+    }
+
+    if (bos) {
+        output.push_back(1);
+    }
+
+    tokenizer.tokenize(text, output);
+    return output;
+}
+
+//
+// sampling
+//
+
+static void sample_top_k(std::vector<std::pair<float, llama_vocab::id>> & logits_id, int top_k) {
+    // find the top k tokens
+    std::partial_sort(
+            logits_id.begin(),
+            logits_id.begin() + top_k, logits_id.end(),
+            [](const std::pair<float, llama_vocab::id> & a, const std::pair<float, llama_vocab::id> & b) {
+        return a.first > b.first;
+    });
+
+    logits_id.resize(top_k);
+}
+
+static llama_vocab::id llama_sample_top_p_top_k(
+        llama_context & lctx,
+        const std::vector<llama_vocab::id> & last_n_tokens,
+        int top_k,
+        float top_p,
+        float temp,
+        float repeat_penalty) {
+    auto & rng = lctx.rng;
+
+    const int n_logits = lctx.model.hparams.n_vocab;
+
+    const auto & logits = lctx.logits;
+    const auto * plogits = logits.data() + logits.size() - n_logits;
+
+    if (temp <= 0) {
+        // select the token with the highest logit directly
+        float max_logit = plogits[0];
+        llama_vocab::id max_id = 0;
+
+        for (int i = 1; i < n_logits; ++i) {
+            if (plogits[i] > max_logit) {
+                max_logit = plogits[i];
+                max_id = i;
+            }
+        }
+        return max_id;
+    }
+
+    std::vector<std::pair<float, llama_vocab::id>> logits_id;
+    logits_id.reserve(n_logits);
+
+    {
+        const float scale = 1.0f/temp;
+        for (int i = 0; i < n_logits; ++i) {
+            // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
+            // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
+            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
+                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+                if (plogits[i] < 0.0f) {
+                    logits_id.push_back(std::make_pair(plogits[i]*scale*repeat_penalty, i));
+                } else {
+                    logits_id.push_back(std::make_pair(plogits[i]*scale/repeat_penalty, i));
+                }
+            } else {
+                logits_id.push_back(std::make_pair(plogits[i]*scale, i));
+            }
+        }
+    }
+
+    sample_top_k(logits_id, top_k > 0 ? std::min(top_k, n_logits) : n_logits);
+
+    // compute probs for the top k tokens
+    std::vector<float> probs;
+    probs.reserve(logits_id.size());
+
+    float maxl = logits_id[0].first;
+    double sum = 0.0;
+    for (const auto & kv : logits_id) {
+        const float p = expf(kv.first - maxl);
+        probs.push_back(p);
+        sum += p;
+    }
+
+    // normalize the probs
+    for (auto & p : probs) {
+        p /= sum;
+    }
+
+    if (top_p < 1.0) {
+        double cumsum = 0.0;
+        for (int i = 0; i < (int) probs.size(); i++) {
+            cumsum += probs[i];
+            if (cumsum >= top_p) {
+                probs.resize(i + 1);
+                logits_id.resize(i + 1);
+                break;
+            }
+        }
+    }
+
+    //printf("\n");
+    //for (int i = 0; i < (int) 10; i++) {
+    //    printf("%d: '%s' %f\n", i, lctx.vocab.id_to_token.at(logits_id[i].second).tok.c_str(), probs[i]);
+    //}
+    //printf("\n\n");
+    //exit(0);
+
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    int idx = dist(rng);
+
+    return logits_id[idx].second;
+}
+
+//
+// quantization
+//
+
+static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, enum llama_ftype ftype) {
+    ggml_type quantized_type;
+    switch (ftype) {
+        case LLAMA_FTYPE_MOSTLY_Q4_0: quantized_type = GGML_TYPE_Q4_0; break;
+        case LLAMA_FTYPE_MOSTLY_Q4_1: quantized_type = GGML_TYPE_Q4_1; break;
+        default: throw format("invalid output file type %d\n", ftype);
+    };
+
+    std::unique_ptr<llama_model_loader> model_loader(new llama_model_loader(fname_inp.c_str(), /*use_mmap*/ false,
+                                                                            /*vocab_only*/ false));
+    llama_file_saver file_saver(fname_out.c_str(), model_loader->file_loaders.at(0).get(), ftype);
+
+    size_t total_size_org = 0;
+    size_t total_size_new = 0;
+    std::vector<int64_t> hist_all(1 << 4, 0);
+
+    size_t idx = 0;
+    for (llama_load_tensor & tensor : model_loader->tensors_map.tensors) {
+        llama_buffer read_data;
+        read_data.resize(tensor.size);
+        tensor.data = read_data.addr;
+        model_loader->load_data_for(tensor);
+
+        printf("[%zu/%zu] %36s - %s, type = %6s, ",
+               ++idx, model_loader->tensors_map.tensors.size(),
+               tensor.name.c_str(), llama_format_tensor_shape(tensor.ne).c_str(),
+               llama_format_type(tensor.type));
+
+        // This used to be a regex, but <regex> has an extreme cost to compile times.
+        bool quantize = tensor.name.rfind("weight") == tensor.name.size() - 6; // ends with 'weight'?
+
+        // quantize only 2D tensors
         quantize &= (tensor.ne.size() == 2);
 
-        enum ggml_type new_type;
-        void * new_data;
-        size_t new_size;
-        llama_buffer work;
+        enum ggml_type new_type;
+        void * new_data;
+        size_t new_size;
+        llama_buffer work;
+
+        if (!quantize) {
+            new_type = tensor.type;
+            new_data = tensor.data;
+            new_size = tensor.size;
+            printf("size = %8.3f MB\n", tensor.size/1024.0/1024.0);
+        } else {
+            new_type = quantized_type;
+            float * f32_data;
+            size_t nelements = tensor.ne.at(0) * tensor.ne.at(1);
+            llama_buffer f32_conv_buf;
+            if (tensor.type == GGML_TYPE_F32) {
+                f32_data = (float *) tensor.data;
+            } else if (tensor.type == GGML_TYPE_F16) {
+                f32_conv_buf.resize(nelements * sizeof(float));
+                f32_data = (float *) f32_conv_buf.addr;
+                auto f16_data = (const ggml_fp16_t *) tensor.data;
+                for (size_t i = 0; i < nelements; i++) {
+                    f32_data[i] = ggml_fp16_to_fp32(f16_data[i]);
+                }
+            } else {
+                throw format("type %s unsupported for integer quantization", llama_format_type(tensor.type));
+            }
+
+            printf("quantizing .. ");
+            fflush(stdout);
+
+            work.resize(nelements * 4); // upper bound on size
+            new_data = work.addr;
+            std::vector<int64_t> hist_cur(1 << 4, 0);
+
+            switch (new_type) {
+                case GGML_TYPE_Q4_0:
+                    {
+                        new_size = ggml_quantize_q4_0(f32_data, new_data, nelements, (int) tensor.ne.at(0), hist_cur.data());
+                    } break;
+                case GGML_TYPE_Q4_1:
+                    {
+                        new_size = ggml_quantize_q4_1(f32_data, new_data, nelements, (int) tensor.ne.at(0), hist_cur.data());
+                    } break;
+                default:
+                    LLAMA_ASSERT(false);
+            }
+
+            printf("size = %8.2f MB -> %8.2f MB | hist: ", tensor.size/1024.0/1024.0, new_size/1024.0/1024.0);
+            for (size_t i = 0; i < hist_cur.size(); i++) {
+                hist_all[i] += hist_cur[i];
+            }
+
+            for (size_t i = 0; i < hist_cur.size(); i++) {
+                printf("%5.3f ", hist_cur[i] / float(nelements));
+            }
+            printf("\n");
+        }
+        total_size_org += tensor.size;
+        total_size_new += new_size;
+        file_saver.write_tensor(tensor, new_type, new_data, new_size);
+    }
+
+    printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+    printf("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
+
+    {
+        int64_t sum_all = 0;
+        for (size_t i = 0; i < hist_all.size(); i++) {
+            sum_all += hist_all[i];
+        }
+
+        printf("%s: hist: ", __func__);
+        for (size_t i = 0; i < hist_all.size(); i++) {
+            printf("%5.3f ", hist_all[i] / float(sum_all));
+        }
+        printf("\n");
+    }
+}
+
+//
+// interface implementation
+//
+
+struct llama_context * llama_init_from_file(
+                             const char * path_model,
+            struct llama_context_params   params) {
+    ggml_time_init();
+
+    llama_context * ctx = new llama_context;
+
+    if (params.seed <= 0) {
+        params.seed = time(NULL);
+    }
+
+    unsigned cur_percentage = 0;
+    if (params.progress_callback == NULL) {
+        params.progress_callback_user_data = &cur_percentage;
+        params.progress_callback = [](float progress, void * ctx) {
+            unsigned * cur_percentage_p = (unsigned *) ctx;
+            unsigned percentage = (unsigned) (100 * progress);
+            while (percentage > *cur_percentage_p) {
+                ++*cur_percentage_p;
+                fprintf(stderr, ".");
+                fflush(stderr);
+                if (percentage >= 100) {
+                    fprintf(stderr, "\n");
+                }
+            }
+        };
+    }
+
+    ctx->rng = std::mt19937(params.seed);
+    ctx->logits_all = params.logits_all;
+    ctx->pin_threads    = params.pin_threads;
+    ctx->embedding_mode = params.embedding;
+    ctx->pooling_type   = params.pooling_type;
+    ctx->prefix_cache.n_max    = std::max(params.prefix_cache_tokens, 0);
 
-        if (!quantize) {
-            new_type = tensor.type;
-            new_data = tensor.data;
-            new_size = tensor.size;
-            printf("size = %8.3f MB\n", tensor.size/1024.0/1024.0);
+    ctx->kv_swap.size_max  = params.kv_swap_size;
+    ctx->kv_swap.dir       = params.kv_swap_dir ? params.kv_swap_dir : "";
+    ctx->kv_swap.automatic = params.kv_swap_size > 0 || params.kv_swap_dir;
+
+    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    switch (params.kv_type) {
+        case LLAMA_KV_TYPE_DEFAULT: break;
+        case LLAMA_KV_TYPE_F32:  memory_type = GGML_TYPE_F32;  break;
+        case LLAMA_KV_TYPE_F16:  memory_type = GGML_TYPE_F16;  break;
+        case LLAMA_KV_TYPE_Q8_0: memory_type = GGML_TYPE_Q8_0; break;
+        case LLAMA_KV_TYPE_Q4_0: memory_type = GGML_TYPE_Q4_0; break;
+        default:
+            fprintf(stderr, "%s: invalid kv_type %d\n", __func__, (int) params.kv_type);
+            llama_free(ctx);
+            return nullptr;
+    }
+
+    if (!llama_model_load(path_model, *ctx, params.n_ctx, memory_type,
+                          params.use_mmap, params.use_mlock, params.fuse_weights, params.vocab_only,
+                          params.progress_callback, params.progress_callback_user_data)) {
+        fprintf(stderr, "%s: failed to load model\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+
+    // reserve memory for context buffers
+    if (!params.vocab_only) {
+        // every head of a quantized K cell has to be a whole number of block pairs
+        const auto & hp = ctx->model.hparams;
+        if ((hp.n_embd/hp.n_head) % kv_cache_cell_pad(memory_type) != 0) {
+            fprintf(stderr, "%s: kv type %s needs a head size that is a multiple of %d\n", __func__,
+                    llama_format_type(memory_type), (int) kv_cache_cell_pad(memory_type));
+            llama_free(ctx);
+            return nullptr;
+        }
+
+        if (!kv_cache_init(ctx->model.hparams, ctx->model.kv_self, memory_type, ctx->model.hparams.n_ctx)) {
+            fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
+            llama_free(ctx);
+            return nullptr;
+        }
+
+        {
+            const size_t memory_size = ggml_nbytes(ctx->model.kv_self.k) + ggml_nbytes(ctx->model.kv_self.v);
+            const size_t memory_max  = kv_cache_buf_size(ctx->model.hparams, memory_type, ctx->model.hparams.n_ctx) - 2u*MB;
+            fprintf(stderr, "%s: kv self size  = %7.2f MB (grows up to %7.2f MB)\n", __func__,
+                    memory_size / 1024.0 / 1024.0, memory_max / 1024.0 / 1024.0);
+        }
+
+        const auto & hparams = ctx->model.hparams;
+
+        // resized during inference
+        if (params.logits_all) {
+            ctx->logits.reserve(hparams.n_ctx*hparams.n_vocab);
         } else {
-            new_type = quantized_type;
-            float * f32_data;
-            size_t nelements = tensor.ne.at(0) * tensor.ne.at(1);
-            llama_buffer f32_conv_buf;
-            if (tensor.type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor.data;
-            } else if (tensor.type == GGML_TYPE_F16) {
-                f32_conv_buf.resize(nelements * sizeof(float));
-                f32_data = (float *) f32_conv_buf.addr;
-                auto f16_data = (const ggml_fp16_t *) tensor.data;
-                for (size_t i = 0; i < nelements; i++) {
-                    f32_data[i] = ggml_fp16_to_fp32(f16_data[i]);
-                }
-            } else {
-                throw format("type %s unsupported for integer quantization", llama_format_type(tensor.type));
+            ctx->logits.reserve(hparams.n_ctx);
+        }
+
+        if (params.embedding){
+            ctx->embedding.resize(hparams.n_embd);
+        }
+
+        ctx->buf_compute.resize(MEM_REQ_EVAL.at(ctx->model.type));
+
+        ctx->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
+        ctx->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
+    }
+
+    return ctx;
+}
+
+void llama_free(struct llama_context * ctx) {
+    delete ctx;
+}
+
+int llama_model_quantize(
+        const char * fname_inp,
+        const char * fname_out,
+  enum llama_ftype   ftype) {
+    try {
+        llama_model_quantize_internal(fname_inp, fname_out, ftype);
+        return 0;
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to quantize: %s\n", __func__, err.c_str());
+        return 1;
+    }
+}
+
+// Returns the KV cache that will contain the context for the
+// ongoing prediction with the model.
+const uint8_t * llama_get_kv_cache(struct llama_context * ctx) {
+    return ctx->model.kv_self.buf.addr;
+}
+
+// Returns the size of the KV cache
+size_t llama_get_kv_cache_size(struct llama_context * ctx) {
+    return ctx->model.kv_self.buf.size;
+}
+
+int llama_get_kv_cache_token_count(struct llama_context * ctx) {
+    return ctx->model.kv_self.n;
+}
+
+void llama_kv_cache_clear(struct llama_context * ctx) {
+    llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+}
+
+bool llama_kv_cache_shrink(struct llama_context * ctx) {
+    ctx->model.kv_self.n_evals_underused = 0;
+
+    return kv_cache_shrink(ctx->model.hparams, ctx->model.kv_self);
+}
+
+void llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    if (p0 <= 0 && p1 < 0) {
+        // swapped out sequences that are removed entirely do not have to come back
+        llama_kv_swap_drop(*ctx, seq_id);
+    } else {
+        llama_kv_swap_touch(*ctx, seq_id);
+    }
+
+    llama_kv_cache_seq_rm(ctx->model.kv_self, seq_id, p0, p1);
+
+    if (seq_id < 0 || seq_id >= LLAMA_PREFIX_CACHE_SEQ_ID) {
+        llama_prefix_cache_sync(*ctx);
+    }
+}
+
+void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    if (seq_id_src == seq_id_dst) {
+        return;
+    }
+    llama_kv_swap_touch(*ctx, seq_id_src);
+    llama_kv_swap_touch(*ctx, seq_id_dst);
+    llama_kv_cache_seq_cp(ctx->model.kv_self, seq_id_src, seq_id_dst, p0, p1);
+}
+
+bool llama_kv_cache_seq_shift(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    const auto & hparams = ctx->model.hparams;
+    auto & kv_self = ctx->model.kv_self;
+
+    llama_kv_swap_touch(*ctx, seq_id);
+
+    if (seq_id >= 0) {
+        // the cells shared with other sequences are copied, cached prefixes make room for the copies first
+        uint32_t n_shared;
+        while ((n_shared = llama_kv_cache_seq_count_shared(kv_self, seq_id, p0, p1, delta)) > 0 &&
+               !kv_cache_reserve(hparams, kv_self, n_shared)) {
+            if (!llama_prefix_cache_evict(*ctx)) {
+                fprintf(stderr, "%s: no room in the KV cache to copy the %u cells that sequence %d shares\n", __func__, n_shared, seq_id);
+                return false;
+            }
+        }
+
+        llama_kv_cache_seq_unshare(hparams, kv_self, seq_id, p0, p1, delta);
+    }
+
+    llama_kv_cache_seq_shift(kv_self, seq_id, p0, p1, delta);
+
+    // shifting all sequences moves the cached prefixes as well
+    llama_prefix_cache_sync(*ctx);
+
+    return true;
+}
+
+int llama_prefix_cache_lookup(struct llama_context * ctx, llama_seq_id seq_id, const llama_token * tokens, int n_tokens) {
+    auto & cache   = ctx->prefix_cache;
+    auto & kv_self = ctx->model.kv_self;
+
+    // removing the tokens of a negative seq_id would remove every token, the cached ones too
+    if (seq_id < 0 || seq_id >= LLAMA_PREFIX_CACHE_SEQ_ID) {
+        fprintf(stderr, "%s: invalid seq_id %d\n", __func__, seq_id);
+        return 0;
+    }
+
+    llama_kv_swap_drop(*ctx, seq_id);
+    llama_kv_cache_seq_rm(kv_self, seq_id, -1, -1);
+
+    cache.stats.n_lookups++;
+    cache.clock++;
+
+    int n_match = 0;
+
+    llama_prefix_node * node = &cache.root;
+    while (n_match < n_tokens) {
+        const auto it = node->children.find(tokens[n_match]);
+        if (it == node->children.end()) {
+            break;
+        }
+
+        llama_prefix_node * child = it->second.get();
+
+        size_t n = 0;
+        while (n < child->tokens.size() && n_match + (int) n < n_tokens && child->tokens[n] == tokens[n_match + n]) {
+            n++;
+        }
+
+        llama_kv_cache_seq_cp(kv_self, child->seq_id, seq_id, child->pos, child->pos + n);
+        child->t_used = cache.clock;
+        n_match += n;
+
+        if (n < child->tokens.size()) {
+            break;
+        }
+        node = child;
+    }
+
+    if (n_match > 0) {
+        cache.stats.n_hits++;
+        cache.stats.n_tokens_reused += n_match;
+        cache.stats.size_reused     += n_match*kv_cache_token_size(ctx->model.hparams, kv_self.k->type);
+    }
+
+    return n_match;
+}
+
+bool llama_prefix_cache_store(struct llama_context * ctx, llama_seq_id seq_id, const llama_token * tokens, int n_tokens) {
+    auto & cache   = ctx->prefix_cache;
+    auto & kv_self = ctx->model.kv_self;
+
+    if (cache.n_max == 0 || seq_id < 0 || seq_id >= LLAMA_PREFIX_CACHE_SEQ_ID) {
+        return false;
+    }
+
+    // the tokens of a prompt are stored with all of the ones before them, so the tokens beyond
+    // the budget could only be stored by evicting the new leaf itself
+    n_tokens = std::min(n_tokens, (int) cache.n_max);
+
+    cache.clock++;
+
+    int n_match = 0;
+
+    llama_prefix_node * node = &cache.root;
+    while (n_match < n_tokens) {
+        const auto it = node->children.find(tokens[n_match]);
+        if (it == node->children.end()) {
+            break;
+        }
+
+        llama_prefix_node * child = it->second.get();
+
+        size_t n = 0;
+        while (n < child->tokens.size() && n_match + (int) n < n_tokens && child->tokens[n] == tokens[n_match + n]) {
+            n++;
+        }
+
+        child->t_used = cache.clock;
+        n_match += n;
+
+        if (n < child->tokens.size()) {
+            // the tokens end inside the node, they are all cached already
+            if (n_match == n_tokens) {
+                return true;
             }
+            llama_prefix_cache_split(*ctx, child, n);
+        }
+        node = child;
+    }
+
+    if (n_match == n_tokens) {
+        return true;
+    }
+
+    if (llama_kv_cache_seq_count(kv_self, seq_id, n_match, n_tokens) != (uint32_t) (n_tokens - n_match)) {
+        return false;
+    }
+
+    std::unique_ptr<llama_prefix_node> leaf(new llama_prefix_node);
+    leaf->tokens.assign(tokens + n_match, tokens + n_tokens);
+    leaf->pos    = n_match;
+    leaf->seq_id = llama_prefix_cache_new_seq_id(cache);
+    leaf->t_used = cache.clock;
+    leaf->parent = node;
+
+    llama_kv_cache_seq_cp(kv_self, seq_id, leaf->seq_id, n_match, n_tokens);
+    cache.n_tokens += leaf->tokens.size();
+
+    node->children[tokens[n_match]] = std::move(leaf);
+
+    // the new leaf is the most recently used one, the path to it fits and is evicted last
+    while (cache.n_tokens > cache.n_max && llama_prefix_cache_evict(*ctx)) {
+    }
+
+    return true;
+}
+
+void llama_prefix_cache_clear(struct llama_context * ctx) {
+    llama_prefix_cache_reset(*ctx);
+
+    if (!kv_cache_shrink(ctx->model.hparams, ctx->model.kv_self)) {
+        fprintf(stderr, "%s: failed to shrink the KV cache\n", __func__);
+    }
+}
+
+struct llama_prefix_cache_stats llama_prefix_cache_get_stats(struct llama_context * ctx) {
+    auto stats = ctx->prefix_cache.stats;
+    stats.size = ctx->prefix_cache.n_tokens*kv_cache_token_size(ctx->model.hparams, ctx->model.kv_self.k->type);
+    return stats;
+}
+
+bool llama_kv_cache_seq_swap_out(struct llama_context * ctx, llama_seq_id seq_id) {
+    if (seq_id < 0 || seq_id >= LLAMA_PREFIX_CACHE_SEQ_ID || !llama_kv_swap_out(*ctx, seq_id)) {
+        return false;
+    }
+
+    if (!kv_cache_shrink(ctx->model.hparams, ctx->model.kv_self)) {
+        fprintf(stderr, "%s: failed to shrink the KV cache\n", __func__);
+    }
+
+    return true;
+}
+
+bool llama_kv_cache_seq_swap_in(struct llama_context * ctx, llama_seq_id seq_id) {
+    try {
+        return llama_kv_swap_in(*ctx, seq_id);
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to swap in sequence %d: %s\n", __func__, seq_id, err.c_str());
+        return false;
+    }
+}
+
+enum llama_kv_location llama_kv_cache_seq_location(struct llama_context * ctx, llama_seq_id seq_id) {
+    const auto it = ctx->kv_swap.seqs.find(seq_id);
+    if (it == ctx->kv_swap.seqs.end()) {
+        return LLAMA_KV_LOCATION_CACHE;
+    }
+    return it->second.path.empty() ? LLAMA_KV_LOCATION_MEMORY : LLAMA_KV_LOCATION_DISK;
+}
+
+struct llama_kv_swap_stats llama_kv_swap_get_stats(struct llama_context * ctx) {
+    auto stats = ctx->kv_swap.stats;
+    stats.size_memory = ctx->kv_swap.size_memory;
+    stats.size_disk   = ctx->kv_swap.size_disk;
+    return stats;
+}
+
+// Sets the KV cache containing the current context for the model
+void llama_set_kv_cache(
+        struct llama_context * ctx,
+               const uint8_t * kv_cache,
+                      size_t   n_size,
+                         int   n_token_count) {
+    // Make sure we have the same kv cache setup
+    const auto & hparams = ctx->model.hparams;
+    auto & kv_self = ctx->model.kv_self;
+
+    // the raw cache may come from a cache with another number of cells
+    const size_t cell_size = kv_cache_buf_size(hparams, kv_self.k->type, 1) - 2u*MB;
+    const size_t n_cells   = (n_size - 2u*MB)/cell_size;
+    LLAMA_ASSERT(n_size == kv_cache_buf_size(hparams, kv_self.k->type, n_cells));
+
+    llama_prefix_cache_reset(*ctx);
+    llama_kv_swap_drop(*ctx, -1);
+
+    if (n_cells != kv_self.size) {
+        llama_kv_cache_seq_rm(kv_self, -1, -1, -1);
+        if (!kv_cache_resize(hparams, kv_self, kv_self.k->type, n_cells)) {
+            fprintf(stderr, "%s: failed to resize the KV cache\n", __func__);
+            return;
+        }
+    }
+
+    LLAMA_ASSERT(kv_self.buf.size == n_size);
+
+    // copy only the tensor data, the tensor headers point into the buffer they were saved from
+    const size_t offs_k = (const uint8_t *) kv_self.k->data - kv_self.buf.addr;
+    const size_t offs_v = (const uint8_t *) kv_self.v->data - kv_self.buf.addr;
+    memcpy(kv_self.k->data, kv_cache + offs_k, ggml_nbytes(kv_self.k));
+    memcpy(kv_self.v->data, kv_cache + offs_v, ggml_nbytes(kv_self.v));
+
+    // the raw cache holds a single sequence, in order
+    LLAMA_ASSERT(n_token_count >= 0 && (uint32_t) n_token_count <= kv_self.size);
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        kv_self.cells[i] = llama_kv_cell();
+        kv_self.cells[i].pos = (int) i < n_token_count ? (llama_pos) i : -1;
+        if ((int) i < n_token_count) {
+            kv_self.cells[i].seq_id.insert(0);
+        }
+    }
+    kv_self.n         = n_token_count;
+    kv_self.head      = n_token_count;
+    kv_self.has_shift = false;
+}
+
+//
+// state
+//
+
+// The state is everything needed to continue where the context left off:
+//
+//   u32 rng size, rng state as text
+//   u32 n_logits, logits, u32 n_outputs, output_ids of the last batch
+//   u32 n_embedding, embedding
+//   u32 n_embd, u32 n_layer, u32 kv type, u32 n_used, u32 n_cells
+//   for each of the n_used cells: i32 pos, i32 delta, u32 n_seq, n_seq x i32 seq_id
+//   for each layer: K of cells [0, n_cells)
+//   for each layer and embedding dimension: V of cells [0, n_cells)
+//
+// Only the used cells are saved, so the cache is compacted first. n_cells is
+// n_used rounded up to whole blocks of a quantized V row.
+
+// writes the state to a buffer, to a file, or nowhere to measure its size
+struct llama_state_writer {
+    uint8_t    * buf  = nullptr;
+    llama_file * file = nullptr;
+    size_t       size = 0;
+
+    void write(const void * src, size_t n) {
+        if (buf && n > 0) {
+            memcpy(buf + size, src, n);
+        }
+        if (file) {
+            file->write_raw(src, n);
+        }
+        size += n;
+    }
+
+    void write_u32(uint32_t val) {
+        write(&val, sizeof(val));
+    }
+};
+
+struct llama_state_reader {
+    const uint8_t * buf;
+    size_t          size;
+    size_t          pos = 0;
+
+    llama_state_reader(const uint8_t * buf, size_t size) : buf(buf), size(size) {}
+
+    const uint8_t * read(size_t n) {
+        if (n > size - pos) {
+            throw std::string("state data is truncated");
+        }
+        const uint8_t * ptr = buf + pos;
+        pos += n;
+        return ptr;
+    }
+
+    void read(void * dst, size_t n) {
+        const uint8_t * src = read(n);
+        if (n > 0) {
+            memcpy(dst, src, n);
+        }
+    }
 
-            printf("quantizing .. ");
-            fflush(stdout);
+    uint32_t read_u32() {
+        uint32_t val;
+        read(&val, sizeof(val));
+        return val;
+    }
+};
 
-            work.resize(nelements * 4); // upper bound on size
-            new_data = work.addr;
-            std::vector<int64_t> hist_cur(1 << 4, 0);
+static uint32_t llama_state_kv_cells(const struct llama_kv_cache & kv_self) {
+    const uint32_t pad = kv_cache_cell_pad(kv_self.k->type);
+    return std::min(kv_self.size, ((uint32_t) kv_self.n + pad - 1)/pad*pad);
+}
 
-            switch (new_type) {
-                case GGML_TYPE_Q4_0:
-                    {
-                        new_size = ggml_quantize_q4_0(f32_data, new_data, nelements, (int) tensor.ne.at(0), hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q4_1:
-                    {
-                        new_size = ggml_quantize_q4_1(f32_data, new_data, nelements, (int) tensor.ne.at(0), hist_cur.data());
-                    } break;
-                default:
-                    LLAMA_ASSERT(false);
-            }
+static void llama_write_state(struct llama_context * ctx, llama_state_writer & out) {
+    const auto & hparams = ctx->model.hparams;
+    auto & kv_self = ctx->model.kv_self;
 
-            printf("size = %8.2f MB -> %8.2f MB | hist: ", tensor.size/1024.0/1024.0, new_size/1024.0/1024.0);
-            for (size_t i = 0; i < hist_cur.size(); i++) {
-                hist_all[i] += hist_cur[i];
-            }
+    {
+        std::ostringstream rng_ss;
+        rng_ss << ctx->rng;
+        const std::string rng = rng_ss.str();
 
-            for (size_t i = 0; i < hist_cur.size(); i++) {
-                printf("%5.3f ", hist_cur[i] / float(nelements));
+        out.write_u32(rng.size());
+        out.write(rng.data(), rng.size());
+    }
+
+    out.write_u32(ctx->logits.size());
+    out.write(ctx->logits.data(), ctx->logits.size()*sizeof(float));
+    out.write_u32(ctx->output_ids.size());
+    out.write(ctx->output_ids.data(), ctx->output_ids.size()*sizeof(int32_t));
+
+    out.write_u32(ctx->embedding.size());
+    out.write(ctx->embedding.data(), ctx->embedding.size()*sizeof(float));
+
+    // the used cells must be [0, n) to be written as one range
+    if (out.buf || out.file) {
+        if (llama_kv_cache_cell_max(kv_self) != (uint32_t) kv_self.n) {
+            if (!kv_cache_resize(hparams, kv_self, kv_self.k->type, kv_self.size)) {
+                throw std::string("failed to compact the KV cache");
             }
-            printf("\n");
         }
-        total_size_org += tensor.size;
-        total_size_new += new_size;
-        file_saver.write_tensor(tensor, new_type, new_data, new_size);
     }
 
-    printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
-    printf("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
 
-    {
-        int64_t sum_all = 0;
-        for (size_t i = 0; i < hist_all.size(); i++) {
-            sum_all += hist_all[i];
+    const uint32_t n_used  = kv_self.n;
+    const uint32_t n_cells = llama_state_kv_cells(kv_self);
+
+    out.write_u32(n_embd);
+    out.write_u32(n_layer);
+    out.write_u32(kv_self.k->type);
+    out.write_u32(n_used);
+    out.write_u32(n_cells);
+
+    // the used cells in the order compaction keeps them, so that measuring the size
+    // without compacting counts the same seq ids as writing
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        const auto & cell = kv_self.cells[i];
+        if (cell.pos < 0) {
+            continue;
         }
 
-        printf("%s: hist: ", __func__);
-        for (size_t i = 0; i < hist_all.size(); i++) {
-            printf("%5.3f ", hist_all[i] / float(sum_all));
+        out.write(&cell.pos, sizeof(cell.pos));
+        out.write(&cell.delta, sizeof(cell.delta));
+        out.write_u32(cell.seq_id.size());
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            out.write(&seq_id, sizeof(seq_id));
         }
-        printf("\n");
+    }
+
+    const size_t esize = ggml_type_size(kv_self.k->type);
+    const int    blck  = ggml_blck_size(kv_self.k->type);
+    const size_t k_row = esize*n_embd/blck;
+
+    for (int il = 0; il < n_layer; ++il) {
+        out.write((const char *) kv_self.k->data + (size_t) il*kv_self.size*k_row, n_cells*k_row);
+    }
+
+    for (int64_t row = 0; row < (int64_t) n_layer*n_embd; ++row) {
+        out.write((const char *) kv_self.v->data + row*esize*kv_self.size/blck, esize*n_cells/blck);
     }
 }
 
-//
-// interface implementation
-//
+size_t llama_get_state_size(struct llama_context * ctx) {
+    llama_state_writer out;
+    llama_write_state(ctx, out);
 
-struct llama_context * llama_init_from_file(
-                             const char * path_model,
-            struct llama_context_params   params) {
-    ggml_time_init();
+    return out.size;
+}
 
-    llama_context * ctx = new llama_context;
+size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
+    llama_state_writer out;
+    out.buf = dst;
 
-    if (params.seed <= 0) {
-        params.seed = time(NULL);
+    try {
+        llama_write_state(ctx, out);
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: %s\n", __func__, err.c_str());
+        return 0;
     }
 
-    unsigned cur_percentage = 0;
-    if (params.progress_callback == NULL) {
-        params.progress_callback_user_data = &cur_percentage;
-        params.progress_callback = [](float progress, void * ctx) {
-            unsigned * cur_percentage_p = (unsigned *) ctx;
-            unsigned percentage = (unsigned) (100 * progress);
-            while (percentage > *cur_percentage_p) {
-                ++*cur_percentage_p;
-                fprintf(stderr, ".");
-                fflush(stderr);
-                if (percentage >= 100) {
-                    fprintf(stderr, "\n");
-                }
-            }
-        };
+    return out.size;
+}
+
+// everything is validated before the context is changed
+static void llama_read_state(struct llama_context * ctx, llama_state_reader & in) {
+    const auto & hparams = ctx->model.hparams;
+    auto & kv_self = ctx->model.kv_self;
+
+    std::mt19937 rng;
+    {
+        const uint32_t n = in.read_u32();
+        const uint8_t * data = in.read(n);
+
+        std::istringstream rng_ss(std::string((const char *) data, n));
+        rng_ss >> rng;
+        if (rng_ss.fail()) {
+            throw std::string("invalid rng state");
+        }
     }
 
-    ctx->rng = std::mt19937(params.seed);
-    ctx->logits_all = params.logits_all;
+    const uint32_t n_logits  = in.read_u32();
+    const uint8_t * logits   = in.read(n_logits*sizeof(float));
+    const uint32_t n_outputs = in.read_u32();
+    const uint8_t * outputs  = in.read(n_outputs*sizeof(int32_t));
 
-    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    const uint32_t n_embedding = in.read_u32();
+    const uint8_t * embedding  = in.read(n_embedding*sizeof(float));
 
-    if (!llama_model_load(path_model, *ctx, params.n_ctx, memory_type,
-                          params.use_mmap, params.use_mlock, params.vocab_only,
-                          params.progress_callback, params.progress_callback_user_data)) {
-        fprintf(stderr, "%s: failed to load model\n", __func__);
-        llama_free(ctx);
-        return nullptr;
+    const uint32_t n_embd  = in.read_u32();
+    const uint32_t n_layer = in.read_u32();
+    const uint32_t type    = in.read_u32();
+    const uint32_t n_used  = in.read_u32();
+    const uint32_t n_cells = in.read_u32();
+
+    if (n_embd != hparams.n_embd || n_layer != hparams.n_layer || type != (uint32_t) kv_self.k->type) {
+        throw format("state was saved with n_embd = %u, n_layer = %u, kv type %d, expected %u, %u, %d",
+                     n_embd, n_layer, (int) type, hparams.n_embd, hparams.n_layer, (int) kv_self.k->type);
     }
 
-    // reserve memory for context buffers
-    if (!params.vocab_only) {
-        if (!kv_cache_init(ctx->model.hparams, ctx->model.kv_self, memory_type, ctx->model.hparams.n_ctx)) {
-            fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
-            llama_free(ctx);
-            return nullptr;
-        }
+    if (n_logits % hparams.n_vocab != 0 || n_embedding % hparams.n_embd != 0) {
+        throw std::string("state has outputs of the wrong size");
+    }
 
-        {
-            const size_t memory_size = ggml_nbytes(ctx->model.kv_self.k) + ggml_nbytes(ctx->model.kv_self.v);
-            fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+    const uint32_t n_alloc = kv_cache_blocks_size(n_used, hparams.n_ctx, kv_self.k->type);
+    if (n_used > hparams.n_ctx || n_cells < n_used || n_cells > n_alloc || n_cells % ggml_blck_size(kv_self.k->type) != 0) {
+        throw format("state has %u cells, the context only has room for %u", n_cells, hparams.n_ctx);
+    }
+
+    std::vector<llama_kv_cell> cells(n_used);
+    for (auto & cell : cells) {
+        in.read(&cell.pos, sizeof(cell.pos));
+        in.read(&cell.delta, sizeof(cell.delta));
+        const uint32_t n_seq = in.read_u32();
+        for (uint32_t s = 0; s < n_seq; ++s) {
+            llama_seq_id seq_id;
+            in.read(&seq_id, sizeof(seq_id));
+            cell.seq_id.insert(seq_id);
         }
+    }
 
-        const auto & hparams = ctx->model.hparams;
+    const size_t esize = ggml_type_size(kv_self.k->type);
+    const int    blck  = ggml_blck_size(kv_self.k->type);
+    const size_t k_row = esize*n_embd/blck;
 
-        // resized during inference
-        if (params.logits_all) {
-            ctx->logits.reserve(hparams.n_ctx*hparams.n_vocab);
-        } else {
-            ctx->logits.reserve(hparams.n_ctx);
-        }
+    const uint8_t * k_data = in.read((size_t) n_layer*n_cells*k_row);
+    const uint8_t * v_data = in.read((size_t) n_layer*n_embd*esize*n_cells/blck);
 
-        if (params.embedding){
-            ctx->embedding.resize(hparams.n_embd);
+    // replace the cache, sized for the restored cells
+    llama_prefix_cache_reset(*ctx);
+    llama_kv_swap_drop(*ctx, -1);
+    llama_kv_cache_seq_rm(kv_self, -1, -1, -1);
+    if (n_alloc != kv_self.size) {
+        if (!kv_cache_resize(hparams, kv_self, kv_self.k->type, n_alloc)) {
+            throw std::string("failed to resize the KV cache");
         }
+    }
 
-        ctx->buf_compute.resize(MEM_REQ_EVAL.at(ctx->model.type));
+    for (uint32_t il = 0; il < n_layer; ++il) {
+        memcpy((char *) kv_self.k->data + (size_t) il*kv_self.size*k_row, k_data + (size_t) il*n_cells*k_row, n_cells*k_row);
+    }
 
-        ctx->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
-        ctx->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
+    for (int64_t row = 0; row < (int64_t) n_layer*n_embd; ++row) {
+        memcpy((char *) kv_self.v->data + row*esize*kv_self.size/blck, v_data + row*esize*n_cells/blck, esize*n_cells/blck);
     }
 
-    return ctx;
-}
+    std::fill(kv_self.cells.begin(), kv_self.cells.end(), llama_kv_cell());
+    std::copy(cells.begin(), cells.end(), kv_self.cells.begin());
+    kv_self.n    = n_used;
+    kv_self.head = n_used;
 
-void llama_free(struct llama_context * ctx) {
-    delete ctx;
+    kv_self.has_shift = false;
+    for (const auto & cell : cells) {
+        kv_self.has_shift |= cell.delta != 0;
+    }
+
+    // the state may hold cells of prefixes cached by the context that saved it
+    llama_prefix_cache_sync(*ctx);
+
+    ctx->rng = rng;
+
+    ctx->logits.resize(n_logits);
+    memcpy(ctx->logits.data(), logits, n_logits*sizeof(float));
+    ctx->output_ids.resize(n_outputs);
+    memcpy(ctx->output_ids.data(), outputs, n_outputs*sizeof(int32_t));
+
+    ctx->embedding.resize(n_embedding);
+    memcpy(ctx->embedding.data(), embedding, n_embedding*sizeof(float));
+    ctx->embedding_seq.clear();
 }
 
-int llama_model_quantize(
-        const char * fname_inp,
-        const char * fname_out,
-  enum llama_ftype   ftype) {
+size_t llama_set_state_data(struct llama_context * ctx, const uint8_t * src, size_t n_size) {
+    llama_state_reader in(src, n_size);
+
     try {
-        llama_model_quantize_internal(fname_inp, fname_out, ftype);
-        return 0;
+        llama_read_state(ctx, in);
     } catch (const std::string & err) {
-        fprintf(stderr, "%s: failed to quantize: %s\n", __func__, err.c_str());
-        return 1;
+        fprintf(stderr, "%s: %s\n", __func__, err.c_str());
+        return 0;
     }
-}
 
-// Returns the KV cache that will contain the context for the
-// ongoing prediction with the model.
-const uint8_t * llama_get_kv_cache(struct llama_context * ctx) {
-    return ctx->model.kv_self.buf.addr;
+    return in.pos;
 }
 
-// Returns the size of the KV cache
-size_t llama_get_kv_cache_size(struct llama_context * ctx) {
-    return ctx->model.kv_self.buf.size;
+bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    try {
+        llama_file file(path_session, "wb");
+
+        file.write_u32(LLAMA_SESSION_MAGIC);
+        file.write_u32(LLAMA_SESSION_VERSION);
+        file.write_u32((uint32_t) n_token_count);
+        file.write_raw(tokens, sizeof(llama_token)*n_token_count);
+
+        // the KV cache is large, write it straight to the file
+        llama_state_writer out;
+        out.file = &file;
+        llama_write_state(ctx, out);
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to save session %s: %s\n", __func__, path_session, err.c_str());
+        return false;
+    }
+
+    return true;
 }
 
-int llama_get_kv_cache_token_count(struct llama_context * ctx) {
-    return ctx->model.kv_self.n;
+bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    try {
+        llama_file file(path_session, "rb");
+
+        // with mmap the KV data is copied to the cache straight from the page cache
+        std::unique_ptr<llama_mmap> mapping;
+        std::vector<uint8_t> data;
+        const uint8_t * addr;
+        if (llama_mmap::SUPPORTED && file.size > 0) {
+            mapping.reset(new llama_mmap(&file));
+            addr = (const uint8_t *) mapping->addr;
+        } else {
+            data.resize(file.size);
+            file.read_raw(data.data(), file.size);
+            addr = data.data();
+        }
+
+        llama_state_reader in(addr, file.size);
+
+        const uint32_t magic   = in.read_u32();
+        const uint32_t version = in.read_u32();
+        if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
+            throw format("unknown magic %#x or version %u", magic, version);
+        }
+
+        const uint32_t n_token_count = in.read_u32();
+        if (n_token_count > n_token_capacity) {
+            throw format("token count %u exceeds the capacity %zu", n_token_count, n_token_capacity);
+        }
+        in.read(tokens_out, sizeof(llama_token)*n_token_count);
+
+        llama_read_state(ctx, in);
+
+        if (in.pos != in.size) {
+            throw std::string("unexpected data after the state");
+        }
+
+        *n_token_count_out = n_token_count;
+    } catch (const std::string & err) {
+        fprintf(stderr, "%s: failed to load session %s: %s\n", __func__, path_session, err.c_str());
+        return false;
+    }
+
+    return true;
 }
 
-// Sets the KV cache containing the current context for the model
-void llama_set_kv_cache(
+int llama_decode(
         struct llama_context * ctx,
-               const uint8_t * kv_cache,
-                      size_t   n_size,
-                         int   n_token_count) {
-    // Make sure we have the same kv cache setup
-    LLAMA_ASSERT(ctx->model.kv_self.buf.size == n_size);
-    memcpy(ctx->model.kv_self.buf.addr, kv_cache, n_size);
-    ctx->model.kv_self.n = n_token_count;
+          struct llama_batch   batch,
+                         int   n_threads) {
+    if (batch.n_tokens <= 0) {
+        fprintf(stderr, "%s: empty batch\n", __func__);
+        return -1;
+    }
+
+    auto & kv_self = ctx->model.kv_self;
+    auto & swap    = ctx->kv_swap;
+
+    // sequences of the batch that were swapped out come back first
+    if (!swap.seqs.empty()) {
+        try {
+            for (int i = 0; i < batch.n_tokens; ++i) {
+                while (!llama_kv_swap_in(*ctx, batch.seq_id[i])) {
+                    if (!llama_kv_cache_make_room(*ctx, batch)) {
+                        return 1;
+                    }
+                }
+            }
+        } catch (const std::string & err) {
+            fprintf(stderr, "%s: failed to swap in: %s\n", __func__, err.c_str());
+            return -1;
+        }
+    }
+
+    swap.clock++;
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        swap.t_used[batch.seq_id[i]] = swap.clock;
+    }
+
+    if (kv_self.has_shift && !llama_kv_cache_apply_shift(*ctx, n_threads)) {
+        fprintf(stderr, "%s: failed to apply the KV cache shift\n", __func__);
+        return -1;
+    }
+
+    while (true) {
+        if (kv_cache_reserve(ctx->model.hparams, kv_self, batch.n_tokens)) {
+            if (llama_kv_cache_find_slot(kv_self, batch)) {
+                break;
+            }
+
+            // no run of free cells is long enough: compact the cache and retry
+            if (kv_cache_resize(ctx->model.hparams, kv_self, kv_self.k->type, kv_self.size) &&
+                llama_kv_cache_find_slot(kv_self, batch)) {
+                break;
+            }
+        }
+
+        // cached prefixes and idle sequences give up their cells to the batch
+        if (!llama_kv_cache_make_room(*ctx, batch)) {
+            return 1;
+        }
+    }
+
+    if (!llama_eval_internal(*ctx, batch, n_threads)) {
+        // the cells of the batch have positions but no K/V
+        llama_kv_cache_release_slot(kv_self, batch.n_tokens);
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    kv_self.head += batch.n_tokens;
+
+    // a rewind or a new perplexity chunk empties the cache and refills it right away, so
+    // blocks are only released once the cache has stayed mostly unused for a while
+    if ((uint32_t) kv_self.n*4 <= kv_self.size) {
+        if (++kv_self.n_evals_underused >= LLAMA_KV_SHRINK_EVALS) {
+            kv_self.n_evals_underused = 0;
+            if (!kv_cache_shrink(ctx->model.hparams, kv_self)) {
+                fprintf(stderr, "%s: failed to shrink the KV cache\n", __func__);
+            }
+        }
+    } else {
+        kv_self.n_evals_underused = 0;
+    }
+
+    // get a more accurate load time, upon first eval
+    if (!ctx->has_evaluated_once) {
+        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
+        ctx->has_evaluated_once = true;
+    }
+    return 0;
 }
 
 int llama_eval(
@@ -1801,18 +4165,51 @@ int llama_eval(
                          int   n_tokens,
                          int   n_past,
                          int   n_threads) {
-    if (!llama_eval_internal(*ctx, tokens, n_tokens, n_past, n_threads)) {
+    // everything from n_past on is replaced by the new tokens
+    // only sequence 0 is touched, so prompts in the prefix cache stay cached
+    llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+
+    std::vector<llama_pos>    pos(n_tokens);
+    std::vector<llama_seq_id> seq_id(n_tokens, 0);
+    for (int i = 0; i < n_tokens; ++i) {
+        pos[i] = n_past + i;
+    }
+
+    // the last token always gets logits, also in embedding mode
+    std::unique_ptr<bool[]> logits(new bool[n_tokens]());
+    if (n_tokens > 0) {
+        logits[n_tokens - 1] = true;
+    }
+
+    llama_batch batch = {
+        /*.n_tokens =*/ n_tokens,
+        /*.token    =*/ tokens,
+        /*.pos      =*/ pos.data(),
+        /*.seq_id   =*/ seq_id.data(),
+        /*.logits   =*/ logits.get(),
+    };
+
+    if (llama_decode(ctx, batch, n_threads) != 0) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return 1;
     }
-    // get a more accurate load time, upon first eval
-    if (!ctx->has_evaluated_once) {
-        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
-        ctx->has_evaluated_once = true;
-    }
     return 0;
 }
 
+bool llama_set_output_vocab(struct llama_context * ctx, const llama_token * tokens, int n_tokens) {
+    const int n_vocab = ctx->vocab.id_to_token.size();
+
+    for (int i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            fprintf(stderr, "%s: invalid token %d\n", __func__, tokens[i]);
+            return false;
+        }
+    }
+
+    ctx->output_vocab.assign(tokens, tokens + std::max(n_tokens, 0));
+    return true;
+}
+
 int llama_tokenize(
         struct llama_context * ctx,
                   const char * text,
@@ -1849,10 +4246,39 @@ float * llama_get_logits(struct llama_context * ctx) {
     return ctx->logits.data();
 }
 
+float * llama_get_logits_ith(struct llama_context * ctx, int i) {
+    if (i < 0 || i >= (int) ctx->output_ids.size() || ctx->output_ids[i] < 0) {
+        return nullptr;
+    }
+
+    return ctx->logits.data() + (size_t) ctx->output_ids[i]*ctx->vocab.id_to_token.size();
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     return ctx->embedding.data();
 }
 
+float * llama_get_embeddings_ith(struct llama_context * ctx, int i) {
+    const int n_embd = ctx->model.hparams.n_embd;
+
+    if (ctx->pooling_type != LLAMA_POOLING_TYPE_NONE || i < 0 || (size_t) n_embd*(i + 1) > ctx->embedding.size()) {
+        return nullptr;
+    }
+
+    return ctx->embedding.data() + (size_t) n_embd*i;
+}
+
+float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id) {
+    const auto & embedding_seq = ctx->embedding_seq;
+
+    const auto it = std::find(embedding_seq.begin(), embedding_seq.end(), seq_id);
+    if (ctx->pooling_type == LLAMA_POOLING_TYPE_NONE || it == embedding_seq.end()) {
+        return nullptr;
+    }
+
+    return ctx->embedding.data() + (size_t) ctx->model.hparams.n_embd*(it - embedding_seq.begin());
+}
+
 const char * llama_token_to_str(struct llama_context * ctx, llama_token token) {
     if (token >= llama_n_vocab(ctx)) {
         return nullptr;
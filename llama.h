@@ -22,6 +22,9 @@
 #define LLAMA_FILE_VERSION 1
 #define LLAMA_FILE_MAGIC 0x67676a74 // 'ggjt' in hex
 #define LLAMA_FILE_MAGIC_UNVERSIONED 0x67676d6c // pre-versioned files
+#define LLAMA_SESSION_MAGIC 0x6767736e // 'ggsn' in hex
+#define LLAMA_SESSION_VERSION 2
+#define LLAMA_PREFIX_CACHE_SEQ_ID 0x40000000 // sequence ids from this one on are used by the prefix cache
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,6 +39,8 @@ extern "C" {
     struct llama_context;
 
     typedef int llama_token;
+    typedef int llama_pos;
+    typedef int llama_seq_id;
 
     typedef struct llama_token_data {
         llama_token id;  // token id
@@ -47,17 +52,77 @@ extern "C" {
 
     typedef void (*llama_progress_callback)(float progress, void *ctx);
 
+    // Input for llama_decode(): tokens from any number of sequences that are
+    // evaluated in one pass over the weights
+    typedef struct llama_batch {
+        int n_tokens;
+
+        const llama_token  * token;  // [n_tokens] token ids
+        const llama_pos    * pos;    // [n_tokens] position of each token within its sequence
+        const llama_seq_id * seq_id; // [n_tokens] sequence of each token
+        const bool         * logits; // [n_tokens] compute logits for this token, NULL for just the last token
+                                     // only these tokens go through the output projection
+    } llama_batch;
+
+    // KV cache element types
+    enum llama_kv_type {
+        LLAMA_KV_TYPE_DEFAULT = 0, // F16 if f16_kv is set, otherwise F32
+        LLAMA_KV_TYPE_F32     = 1,
+        LLAMA_KV_TYPE_F16     = 2,
+        LLAMA_KV_TYPE_Q8_0    = 3, // 8-bit blocks, about half the size of F16
+        LLAMA_KV_TYPE_Q4_0    = 4, // 4-bit blocks, about a quarter of the size of F16
+    };
+
+    // How llama_decode() in embedding mode returns the hidden states
+    enum llama_pooling_type {
+        LLAMA_POOLING_TYPE_LAST = 0, // hidden state of the last token of each sequence
+        LLAMA_POOLING_TYPE_MEAN = 1, // mean of the hidden states of the tokens of each sequence
+        LLAMA_POOLING_TYPE_NONE = 2, // hidden state of every token
+    };
+
+    struct llama_prefix_cache_stats {
+        int     n_lookups;
+        int     n_hits;          // lookups that reused at least one token
+        int64_t n_tokens_reused;
+        size_t  size_reused;     // bytes of K/V that were reused instead of computed
+        size_t  size;            // bytes of K/V the cache holds
+        int     n_evictions;
+    };
+
+    // Where the K/V of a sequence is
+    enum llama_kv_location {
+        LLAMA_KV_LOCATION_CACHE  = 0, // in the KV cache, or the sequence has no tokens
+        LLAMA_KV_LOCATION_MEMORY = 1, // swapped out to memory
+        LLAMA_KV_LOCATION_DISK   = 2, // swapped out to a file
+    };
+
+    struct llama_kv_swap_stats {
+        int    n_swap_out;
+        int    n_swap_in;
+        int    n_disk_writes;
+        int    n_disk_reads;
+        size_t size_memory; // bytes of swapped out K/V in memory
+        size_t size_disk;   // bytes of swapped out K/V in files
+    };
+
     struct llama_context_params {
         int n_ctx;   // text context
         int n_parts; // -1 for default
         int seed;    // RNG seed, 0 for random
 
         bool f16_kv;     // use fp16 for KV cache
+        enum llama_kv_type kv_type; // KV cache element type, overrides f16_kv unless DEFAULT
+        int    prefix_cache_tokens; // tokens of K/V the prefix cache may keep, 0 to disable it
+        size_t kv_swap_size;        // bytes of swapped out K/V kept in memory, the rest goes to files in kv_swap_dir
+        const char * kv_swap_dir;   // directory for swapped out K/V, NULL to keep all of it in memory
         bool logits_all; // the llama_eval() call computes all logits, not just the last one
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
+        bool fuse_weights; // load wq/wk/wv and w1/w3 of each layer as one matrix each, needs the model in memory instead of mmap
+        bool pin_threads; // pin each compute thread to a core
         bool embedding;  // embedding mode only
+        enum llama_pooling_type pooling_type; // embedding mode: per token or pooled per sequence
 
         // called with a progress value between 0 and 1, pass NULL to disable
         llama_progress_callback progress_callback;
@@ -98,21 +163,56 @@ extern "C" {
 
     // Returns the KV cache that will contain the context for the
     // ongoing prediction with the model.
+    // This is the whole allocated buffer, see llama_copy_state_data() for a compact copy
     LLAMA_API const uint8_t * llama_get_kv_cache(struct llama_context * ctx);
 
-    // Returns the size of the KV cache
+    // Returns the size in bytes of the KV cache
+    // The cache is allocated in blocks of cells as tokens are added. Blocks are
+    // released once evaluations have used at most a quarter of the cache for a
+    // while, or by llama_kv_cache_shrink(), so the size follows usage
     LLAMA_API size_t llama_get_kv_cache_size(struct llama_context * ctx);
 
-    // Returns the number of tokens in the KV cache
+    // Returns the number of tokens in the KV cache, over all sequences
     LLAMA_API int llama_get_kv_cache_token_count(struct llama_context * ctx);
 
     // Sets the KV cache containing the current context for the model
+    // n_size is the size returned by llama_get_kv_cache_size() when the cache was saved
     LLAMA_API void llama_set_kv_cache(
             struct llama_context * ctx,
                    const uint8_t * kv_cache,
                           size_t   n_size,
                              int   n_token_count);
 
+    // Returns the size in bytes of the state: the rng, the outputs of the last
+    // evaluation and the used cells of the KV cache with their sequences
+    LLAMA_API size_t llama_get_state_size(struct llama_context * ctx);
+
+    // Copies the state to dst, which must have room for llama_get_state_size() bytes.
+    // The KV cache is compacted first, so only the used cells are copied.
+    // Returns the number of bytes copied, 0 on failure
+    LLAMA_API size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst);
+
+    // Replaces the state with one copied by llama_copy_state_data() from a
+    // context with the same model and KV cache type
+    // Returns the number of bytes read, 0 if src does not hold a valid state
+    LLAMA_API size_t llama_set_state_data(struct llama_context * ctx, const uint8_t * src, size_t n_size);
+
+    // Saves the state to a file together with the tokens it was computed from
+    LLAMA_API bool llama_save_session_file(
+            struct llama_context * ctx,
+                      const char * path_session,
+               const llama_token * tokens,
+                          size_t   n_token_count);
+
+    // Loads a file written by llama_save_session_file(), memory mapped when possible.
+    // The tokens are written to tokens_out, which has room for n_token_capacity tokens
+    LLAMA_API bool llama_load_session_file(
+            struct llama_context * ctx,
+                      const char * path_session,
+                     llama_token * tokens_out,
+                          size_t   n_token_capacity,
+                          size_t * n_token_count_out);
+
     // Run the llama inference to obtain the logits and probabilities for the next token.
     // tokens + n_tokens is the provided batch of new tokens to process
     // n_past is the number of tokens to use from previous eval calls
@@ -124,6 +224,128 @@ extern "C" {
                              int   n_past,
                              int   n_threads);
 
+    // Evaluate a batch of tokens that may belong to different sequences.
+    // Each token attends to the cached tokens of its own sequence at positions
+    // up to and including its own, and its K/V are added to the cache.
+    // Returns 0 on success
+    // Returns 1 if there is no free space in the KV cache for the batch
+    // Returns < 0 on error
+    LLAMA_API int llama_decode(
+            struct llama_context * ctx,
+              struct llama_batch   batch,
+                             int   n_threads);
+
+    // Logits of batch token i from the last llama_decode() call.
+    // The token must have been flagged in batch.logits (or be the last token).
+    // Returns NULL if no logits were computed for it
+    LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int i);
+
+    // Removes all tokens from the KV cache
+    LLAMA_API void llama_kv_cache_clear(struct llama_context * ctx);
+
+    // Releases the blocks of the KV cache that the used cells do not need, keeping one spare block
+    // Returns false if the smaller cache could not be allocated
+    LLAMA_API bool llama_kv_cache_shrink(struct llama_context * ctx);
+
+    // Removes the tokens of a sequence with positions in [p0, p1)
+    // seq_id < 0 matches any sequence, p1 < 0 means no upper bound
+    LLAMA_API void llama_kv_cache_seq_rm(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    // Makes the tokens of seq_id_src with positions in [p0, p1) part of
+    // seq_id_dst as well, without copying any K/V data
+    // p1 < 0 means no upper bound
+    LLAMA_API void llama_kv_cache_seq_cp(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id_src,
+                    llama_seq_id   seq_id_dst,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    // Adds delta to the positions of the tokens of a sequence with positions in [p0, p1)
+    // seq_id < 0 matches any sequence, p1 < 0 means no upper bound
+    // Tokens that end up at a negative position are removed. The cached keys are
+    // rotated to the new positions in place on the next llama_decode(), so this is
+    // how to make room in a full context without evaluating the kept tokens again:
+    //   llama_kv_cache_seq_rm   (ctx, seq, n_keep, n_keep + n_discard);
+    //   llama_kv_cache_seq_shift(ctx, seq, n_keep + n_discard, n_past, -n_discard);
+    // Cells that seq_id shares with other sequences or cached prefixes are copied to free
+    // cells first, so only seq_id moves. Returns false if there is no room for the copies,
+    // no sequence is changed then
+    LLAMA_API bool llama_kv_cache_seq_shift(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1,
+                       llama_pos   delta);
+
+    // The prefix cache keeps the K/V of evaluated prompts in the KV cache, so that
+    // later prompts starting with the same tokens do not have to evaluate them again.
+    // Prompts are kept in a token trie. A hit shares the cached cells with the
+    // sequence, no K/V data is copied. The least recently used prompts are dropped
+    // when the cache holds more than prefix_cache_tokens tokens, or when llama_decode()
+    // needs their cells for a batch.
+
+    // Makes the longest cached prefix of tokens the content of seq_id, at positions [0, n)
+    // Any tokens of seq_id are removed first.
+    // Returns n, the number of tokens that do not have to be evaluated. Leave the last
+    // token of a prompt out of tokens to always get its logits from llama_decode()
+    // Returns 0 and changes nothing if seq_id is negative or a prefix cache sequence
+    LLAMA_API int llama_prefix_cache_lookup(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                             int   n_tokens);
+
+    // Adds tokens to the cache. seq_id must hold them at positions [0, n_tokens)
+    // Only the first prefix_cache_tokens of them are kept, the rest would evict them again
+    // Returns false if the cache is disabled or the sequence does not hold the tokens
+    LLAMA_API bool llama_prefix_cache_store(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                             int   n_tokens);
+
+    // Drops every cached prompt
+    LLAMA_API void llama_prefix_cache_clear(struct llama_context * ctx);
+
+    LLAMA_API struct llama_prefix_cache_stats llama_prefix_cache_get_stats(struct llama_context * ctx);
+
+    // Swapping moves the K/V of an idle sequence out of the KV cache, so that the
+    // cells can be used by other sequences. Only the cells of the sequence are kept,
+    // in the element type of the cache, and with a quantized cache the whole V blocks
+    // they are in. Swapping in is lossless when the cache has as many free V blocks;
+    // otherwise the blocks the cells land in are quantized again. Once more than kv_swap_size bytes are
+    // swapped out, the least recently used sequences are written to kv_swap_dir.
+    // llama_decode() swaps the sequences of a batch back in before evaluating it,
+    // which costs a copy instead of evaluating the tokens again. When either
+    // kv_swap_size or kv_swap_dir is set, llama_decode() also swaps out the least
+    // recently used sequences that are not in the batch when it needs their cells.
+    // Swapped out sequences are not part of the state.
+
+    // Returns false if the sequence has no tokens in the KV cache
+    LLAMA_API bool llama_kv_cache_seq_swap_out(struct llama_context * ctx, llama_seq_id seq_id);
+
+    // Returns false if the KV cache has no room for the sequence or it could not be read
+    LLAMA_API bool llama_kv_cache_seq_swap_in(struct llama_context * ctx, llama_seq_id seq_id);
+
+    LLAMA_API enum llama_kv_location llama_kv_cache_seq_location(struct llama_context * ctx, llama_seq_id seq_id);
+
+    LLAMA_API struct llama_kv_swap_stats llama_kv_swap_get_stats(struct llama_context * ctx);
+
+    // Restricts the logits of the following evaluations to a subset of the vocabulary,
+    // for example the tokens a grammar allows next. Only the rows of the output matrix
+    // for these tokens are multiplied, the logits of the other tokens are -INFINITY.
+    // n_tokens = 0 computes all logits again.
+    // Returns false if a token is out of range
+    LLAMA_API bool llama_set_output_vocab(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                             int   n_tokens);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -143,14 +365,27 @@ extern "C" {
     // Token logits obtained from the last call to llama_eval()
     // The logits for the last token are stored in the last row
     // Can be mutated in order to change the probabilities of the next token
-    // Rows: n_tokens
+    // Rows: one per token that logits were computed for, in batch order
+    //       (n_tokens with logits_all, otherwise 1 for llama_eval())
     // Cols: n_vocab
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
     // Get the embeddings for the input
-    // shape: [n_embd] (1-dimensional)
+    // shape: [n_embd] (1-dimensional), the pooled embedding of the first sequence of the batch
+    //        with LLAMA_POOLING_TYPE_NONE: [n_tokens*n_embd], one row per batch token
+    // In embedding mode, llama_decode() with batch.logits == NULL only computes the
+    // embeddings and skips the output projection; llama_eval() still computes the logits
     LLAMA_API float * llama_get_embeddings(struct llama_context * ctx);
 
+    // Hidden state of batch token i from the last llama_decode() call
+    // Returns NULL unless the pooling type is LLAMA_POOLING_TYPE_NONE
+    LLAMA_API float * llama_get_embeddings_ith(struct llama_context * ctx, int i);
+
+    // Pooled embedding of a sequence from the last llama_decode() call, computed from
+    // the tokens of that sequence in the batch only
+    // Returns NULL if the sequence was not in the batch or the pooling type is LLAMA_POOLING_TYPE_NONE
+    LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
+
     // Token Id -> String. Uses the vocabulary in the provided context
     LLAMA_API const char * llama_token_to_str(struct llama_context * ctx, llama_token token);
 
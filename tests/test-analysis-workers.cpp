@@ -0,0 +1,182 @@
+// Several analysis worker processes share one work queue and one set of cache
+// files, as they do when started with the same --queue-dir and --cache-dir
+
+#include "work_queue.hpp"
+#include "extraction_cache.hpp"
+#include "function_record.hpp"
+#include "shared_file.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+
+#undef NDEBUG
+#include <assert.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace analysis;
+
+static const int k_n_files    = 40;
+static const int k_batch_size = 3;
+static const int k_n_workers  = 4;
+
+static std::vector<FunctionRecord> records_of(const std::string & file_path) {
+    FunctionRecord record;
+    record.SourceHash = hash_string(file_path);
+    return { record };
+}
+
+// Scans its batches like main_analysis does, saving the shared cache after
+// every batch so that the workers' saves overlap
+static int run_worker(const std::string & dir, const std::vector<std::string> & files, bool die_after_claim) {
+    LeaseWorkQueue queue;
+    if (!queue.Initialize(dir + "/queue", files, k_batch_size, 1)) {
+        return 1;
+    }
+
+    ExtractionCache cache;
+    if (!cache.Load(dir + "/extract.cache")) {
+        return 1;
+    }
+
+    int batch = 0;
+    std::vector<std::string> file_paths;
+    while (queue.ClaimBatch(batch, file_paths)) {
+        if (die_after_claim) {
+            // leaves its lease behind for another worker to take over
+            return 0;
+        }
+
+        ScanResults results;
+        for (const auto & file_path : file_paths) {
+            std::vector<FunctionRecord> records;
+            if (!cache.Find(hash_string(file_path), records)) {
+                cache.Insert(hash_string(file_path), records_of(file_path));
+            }
+
+            results.FilesChecked++;
+            results.FunctionsChecked++;
+            results.Findings.push_back({ file_path + ":1", 0.1f, "" });
+        }
+
+        if (!queue.CompleteBatch(results) || !cache.Save()) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void run_workers(const std::string & dir, const std::vector<std::string> & files, int n_workers, bool die_after_claim) {
+    std::vector<pid_t> pids;
+    for (int i = 0; i < n_workers; i++) {
+        const pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            _exit(run_worker(dir, files, die_after_claim));
+        }
+        pids.push_back(pid);
+    }
+
+    for (pid_t pid : pids) {
+        int status = 0;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+}
+
+// a lock or lease file is only taken over when it is stale, and a worker whose lock was
+// taken over leaves the new owner's file alone
+static void test_stale_files(const std::string & dir) {
+    const std::string path = dir + "/stale.lock";
+    const auto old_time = std::filesystem::file_time_type::clock::now() - std::chrono::seconds(120);
+
+    std::string contents;
+    assert(create_exclusive(path, "other-worker"));
+    assert(!remove_stale_file(path, 60, contents));
+    assert(read_file(path) == "other-worker");
+
+    std::filesystem::last_write_time(path, old_time);
+    assert(remove_stale_file(path, 60, contents));
+    assert(contents == "other-worker" && !std::filesystem::exists(path));
+
+    assert(create_exclusive(path, "dead-worker"));
+    std::filesystem::last_write_time(path, old_time);
+    {
+        FileLock lock;
+        assert(lock.Lock(path, 60));
+        assert(read_file(path) == current_worker_id());
+
+        // another worker broke the lock after it went stale and holds it now
+        std::filesystem::remove(path);
+        assert(create_exclusive(path, "other-worker"));
+    }
+    assert(read_file(path) == "other-worker");
+
+    std::filesystem::remove(path);
+}
+
+int main(void) {
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::error);
+
+    char dir_template[] = "/tmp/test-analysis-workers-XXXXXX";
+    const char * dir_name = mkdtemp(dir_template);
+    assert(dir_name != NULL);
+    const std::string dir = dir_name;
+
+    std::vector<std::string> files;
+    for (int i = 0; i < k_n_files; i++) {
+        files.push_back("src/file" + std::to_string(i) + ".cpp");
+    }
+
+    test_stale_files(dir);
+
+    // a worker that dies holding a lease must not lose its batch
+    run_workers(dir, files, 1, true);
+    run_workers(dir, files, k_n_workers, false);
+
+    ScanResults merged;
+    int missing_batches = -1;
+    assert(merge_queue_results(dir + "/queue", merged, missing_batches));
+    assert(missing_batches == 0);
+    assert(merged.FilesChecked == k_n_files);
+
+    std::map<std::string, int> found;
+    for (const auto & finding : merged.Findings) {
+        found[finding.Location]++;
+    }
+    assert((int) found.size() == k_n_files);
+    for (const auto & it : found) {
+        assert(it.second == 1);
+    }
+
+    // every worker's entries survive the others saving the same cache file
+    {
+        ExtractionCache cache;
+        assert(cache.Load(dir + "/extract.cache"));
+        for (const auto & file_path : files) {
+            std::vector<FunctionRecord> records;
+            assert(cache.Find(hash_string(file_path), records));
+            assert(records.size() == 1 && records[0].SourceHash == hash_string(file_path));
+        }
+    }
+
+    // no temporary or lock files are left behind
+    for (const auto & entry : std::filesystem::directory_iterator(dir)) {
+        const std::string name = entry.path().filename().string();
+        assert(name == "queue" || name == "extract.cache");
+    }
+
+    std::filesystem::remove_all(dir);
+
+    return 0;
+}
@@ -0,0 +1,519 @@
+// Graph computation with fused nodes, concurrent nodes and a thread pool. The
+// nodes of a graph are checked against the same ops computed one graph each,
+// where nothing can be fused or computed together.
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define N_THREADS 4
+
+static struct ggml_threadpool * g_pool = NULL;
+
+static uint32_t g_rng = 1234;
+
+static float frand(void) {
+    g_rng = g_rng*1664525u + 1013904223u;
+    return (float) (g_rng >> 8)/(float) (1 << 23) - 1.0f;
+}
+
+static struct ggml_tensor * new_rand(struct ggml_context * ctx, int64_t ne0, int64_t ne1) {
+    struct ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+    for (int64_t i = 0; i < ne0*ne1; i++) {
+        ((float *) t->data)[i] = frand();
+    }
+    return t;
+}
+
+static struct ggml_tensor * new_rand_q4_0(struct ggml_context * ctx, int64_t ne0, int64_t ne1) {
+    struct ggml_tensor * f = new_rand(ctx, ne0, ne1);
+    struct ggml_tensor * q = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, ne0, ne1);
+    int64_t hist[16];
+    ggml_quantize_q4_0((const float *) f->data, q->data, (int) (ne0*ne1), (int) ne0, hist);
+    return q;
+}
+
+// a leaf with the values of a computed tensor
+static struct ggml_tensor * leaf_copy(struct ggml_context * ctx, const struct ggml_tensor * t) {
+    struct ggml_tensor * c = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, t->ne[0], t->ne[1]);
+    for (int64_t i1 = 0; i1 < t->ne[1]; i1++) {
+        memcpy((char *) c->data + i1*c->nb[1], (const char *) t->data + i1*t->nb[1], t->ne[0]*sizeof(float));
+    }
+    return c;
+}
+
+static void compute(struct ggml_context * ctx, struct ggml_cgraph * gf, int n_threads, struct ggml_threadpool * pool) {
+    gf->n_threads  = n_threads;
+    gf->threadpool = pool;
+    ggml_graph_compute(ctx, gf);
+}
+
+static void compute_tensor(struct ggml_context * ctx, struct ggml_tensor * t) {
+    struct ggml_cgraph gf = ggml_build_forward(t);
+    compute(ctx, &gf, N_THREADS, g_pool);
+}
+
+static bool is_fused(const struct ggml_tensor * t) {
+    return t->n_tasks == 0;
+}
+
+static bool equal(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    assert(a->ne[0] == b->ne[0] && a->ne[1] == b->ne[1]);
+    for (int64_t i1 = 0; i1 < a->ne[1]; i1++) {
+        if (memcmp((const char *) a->data + i1*a->nb[1], (const char *) b->data + i1*b->nb[1], a->ne[0]*sizeof(float)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static float max_diff(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    float diff = 0.0f;
+    for (int64_t i1 = 0; i1 < a->ne[1]; i1++) {
+        for (int64_t i0 = 0; i0 < a->ne[0]; i0++) {
+            const float x = *(const float *) ((const char *) a->data + i1*a->nb[1] + i0*sizeof(float));
+            const float y = *(const float *) ((const char *) b->data + i1*b->nb[1] + i0*sizeof(float));
+            diff = fmaxf(diff, fabsf(x - y));
+        }
+    }
+    return diff;
+}
+
+// silu(mul_mat(a, x) + bias), with the bias row broadcast over the rows of the product
+static void test_matmul_epilogue(struct ggml_context * ctx) {
+    struct ggml_tensor * a    = new_rand(ctx, 64, 48);
+    struct ggml_tensor * x    = new_rand(ctx, 64, 5);
+    struct ggml_tensor * bias = new_rand(ctx, 48, 1);
+
+    struct ggml_tensor * mm  = ggml_mul_mat(ctx, a, x);
+    struct ggml_tensor * add = ggml_add(ctx, mm, bias);
+    struct ggml_tensor * out = ggml_silu(ctx, add);
+    compute_tensor(ctx, out);
+
+    assert(!is_fused(mm) && is_fused(add) && is_fused(out));
+
+    struct ggml_tensor * mm_ref = ggml_mul_mat(ctx, a, x);
+    compute_tensor(ctx, mm_ref);
+    struct ggml_tensor * add_ref = ggml_add(ctx, leaf_copy(ctx, mm_ref), bias);
+    compute_tensor(ctx, add_ref);
+    struct ggml_tensor * out_ref = ggml_silu(ctx, leaf_copy(ctx, add_ref));
+    compute_tensor(ctx, out_ref);
+
+    assert(equal(mm, mm_ref) && equal(add, add_ref) && equal(out, out_ref));
+}
+
+// sqr(neg(gelu(x*w))) in the tasks of the mul
+static void test_elementwise_chain(struct ggml_context * ctx) {
+    struct ggml_tensor * x = new_rand(ctx, 32, 7);
+    struct ggml_tensor * w = new_rand(ctx, 32, 7);
+
+    struct ggml_tensor * mul  = ggml_mul(ctx, x, w);
+    struct ggml_tensor * gelu = ggml_gelu(ctx, mul);
+    struct ggml_tensor * neg  = ggml_neg(ctx, gelu);
+    struct ggml_tensor * out  = ggml_sqr(ctx, neg);
+    compute_tensor(ctx, out);
+
+    assert(!is_fused(mul) && is_fused(gelu) && is_fused(neg) && is_fused(out));
+
+    struct ggml_tensor * ref = ggml_mul(ctx, x, w);
+    compute_tensor(ctx, ref);
+    ref = ggml_gelu(ctx, leaf_copy(ctx, ref));
+    compute_tensor(ctx, ref);
+    ref = ggml_neg(ctx, leaf_copy(ctx, ref));
+    compute_tensor(ctx, ref);
+    ref = ggml_sqr(ctx, leaf_copy(ctx, ref));
+    compute_tensor(ctx, ref);
+
+    assert(equal(out, ref));
+}
+
+// silu(scale(mul_mat(a, x), 0.25)), the scale is in place and overwrites the rows of the product
+static void test_inplace(struct ggml_context * ctx) {
+    struct ggml_tensor * a = new_rand(ctx, 64, 40);
+    struct ggml_tensor * x = new_rand(ctx, 64, 3);
+    struct ggml_tensor * s = ggml_new_f32(ctx, 0.25f);
+
+    struct ggml_tensor * mm    = ggml_mul_mat(ctx, a, x);
+    struct ggml_tensor * scale = ggml_scale(ctx, mm, s);
+    struct ggml_tensor * out   = ggml_silu(ctx, scale);
+    compute_tensor(ctx, out);
+
+    assert(scale->data == mm->data);
+    assert(is_fused(scale) && is_fused(out));
+
+    struct ggml_tensor * ref = ggml_mul_mat(ctx, a, x);
+    compute_tensor(ctx, ref);
+    ref = ggml_scale(ctx, leaf_copy(ctx, ref), s);
+    compute_tensor(ctx, ref);
+    ref = ggml_silu(ctx, leaf_copy(ctx, ref));
+    compute_tensor(ctx, ref);
+
+    assert(equal(out, ref));
+}
+
+// a node whose src1 is computed in the chain needs all of its rows, it is not fused
+static void test_reject_src1_in_chain(struct ggml_context * ctx) {
+    // the product itself
+    {
+        struct ggml_tensor * a = new_rand(ctx, 64, 48);
+        struct ggml_tensor * x = new_rand(ctx, 64, 5);
+
+        struct ggml_tensor * mm  = ggml_mul_mat(ctx, a, x);
+        struct ggml_tensor * out = ggml_add(ctx, mm, mm);
+        compute_tensor(ctx, out);
+
+        assert(!is_fused(out));
+
+        struct ggml_tensor * ref = ggml_mul_mat(ctx, a, x);
+        compute_tensor(ctx, ref);
+        ref = ggml_add(ctx, leaf_copy(ctx, ref), leaf_copy(ctx, ref));
+        compute_tensor(ctx, ref);
+
+        assert(equal(out, ref));
+    }
+
+    // the last row of an elementwise node, broadcast over all rows
+    {
+        struct ggml_tensor * x = new_rand(ctx, 32, 9);
+
+        struct ggml_tensor * sqr  = ggml_sqr(ctx, x);
+        struct ggml_tensor * last = ggml_view_2d(ctx, sqr, 32, 1, sqr->nb[1], 8*sqr->nb[1]);
+        struct ggml_tensor * out  = ggml_add(ctx, sqr, last);
+        compute_tensor(ctx, out);
+
+        assert(!is_fused(out));
+
+        struct ggml_tensor * ref = ggml_sqr(ctx, x);
+        compute_tensor(ctx, ref);
+        struct ggml_tensor * ref_copy = leaf_copy(ctx, ref);
+        ref = ggml_add(ctx, ref_copy, ggml_view_2d(ctx, ref_copy, 32, 1, ref_copy->nb[1], 8*ref_copy->nb[1]));
+        compute_tensor(ctx, ref);
+
+        assert(equal(out, ref));
+    }
+}
+
+// a graph is computed again with new inputs, and a node used twice is computed once
+static void test_graph_reuse(struct ggml_context * ctx) {
+    struct ggml_tensor * a = new_rand(ctx, 64, 32);
+    struct ggml_tensor * x = new_rand(ctx, 64, 4);
+
+    struct ggml_tensor * mm  = ggml_mul_mat(ctx, a, x);
+    struct ggml_tensor * out = ggml_add(ctx, ggml_neg(ctx, mm), ggml_abs(ctx, mm));
+
+    struct ggml_cgraph gf = ggml_build_forward(out);
+    assert(gf.n_nodes == 4 && gf.n_leafs == 2);
+
+    for (int iter = 0; iter < 3; iter++) {
+        for (int64_t i = 0; i < ggml_nelements(x); i++) {
+            ((float *) x->data)[i] = frand();
+        }
+        compute(ctx, &gf, N_THREADS, g_pool);
+
+        struct ggml_tensor * ref = ggml_mul_mat(ctx, a, x);
+        compute_tensor(ctx, ref);
+        struct ggml_tensor * ref_copy = leaf_copy(ctx, ref);
+        struct ggml_tensor * ref_neg  = ggml_neg(ctx, ref_copy);
+        compute_tensor(ctx, ref_neg);
+        struct ggml_tensor * ref_abs  = ggml_abs(ctx, ref_copy);
+        compute_tensor(ctx, ref_abs);
+        ref = ggml_add(ctx, leaf_copy(ctx, ref_neg), leaf_copy(ctx, ref_abs));
+        compute_tensor(ctx, ref);
+
+        assert(equal(out, ref));
+    }
+}
+
+// one thread, threads started for the computation, and the pool give the same results
+static void test_threads(struct ggml_context * ctx) {
+    struct ggml_tensor * a    = new_rand(ctx, 128, 96);
+    struct ggml_tensor * x    = new_rand(ctx, 128, 7);
+    struct ggml_tensor * bias = new_rand(ctx, 96, 1);
+
+    struct ggml_tensor * out = ggml_silu(ctx, ggml_add(ctx, ggml_mul_mat(ctx, a, x), bias));
+    struct ggml_cgraph gf = ggml_build_forward(out);
+
+    compute(ctx, &gf, 1, NULL);
+    struct ggml_tensor * ref = leaf_copy(ctx, out);
+
+    for (int iter = 0; iter < 4; iter++) {
+        memset(out->data, 0, ggml_nbytes(out));
+        compute(ctx, &gf, iter % 2 ? N_THREADS : 3, iter % 2 ? g_pool : NULL);
+        assert(equal(out, ref));
+    }
+}
+
+// a matrix multiplication is split into more row chunks than threads, the last one shorter.
+// each row is computed by the same kernel either way, so the result is the one of a single task
+static void test_chunks(struct ggml_context * ctx) {
+    const int64_t n_rows[] = { 40, 1000 };
+
+    for (int i = 0; i < 2; i++) {
+        struct ggml_tensor * a   = new_rand(ctx, 256, n_rows[i]);
+        struct ggml_tensor * a16 = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, 256, n_rows[i]);
+        struct ggml_tensor * x   = new_rand(ctx, 256, 3);
+
+        compute_tensor(ctx, ggml_cpy(ctx, a, a16));
+
+        struct ggml_tensor * out   = ggml_mul_mat(ctx, a,   x);
+        struct ggml_tensor * out16 = ggml_mul_mat(ctx, a16, x);
+        struct ggml_cgraph gf = ggml_build_forward(out);
+        ggml_build_forward_expand(&gf, out16);
+
+        compute(ctx, &gf, 1, NULL);
+        assert(out->n_tasks == 1);
+        struct ggml_tensor * ref   = leaf_copy(ctx, out);
+        struct ggml_tensor * ref16 = leaf_copy(ctx, out16);
+
+        memset(out->data,   0, ggml_nbytes(out));
+        memset(out16->data, 0, ggml_nbytes(out16));
+        compute(ctx, &gf, N_THREADS, g_pool);
+        assert(n_rows[i] < 16*N_THREADS ? out->n_tasks == N_THREADS : out->n_tasks > N_THREADS);
+        assert(equal(out, ref) && equal(out16, ref16));
+    }
+}
+
+// nodes that do not depend on each other are computed together. a node that reads memory
+// that another node writes waits for it, also through another tensor, like the attention
+// reads the cache that the new keys are copied to. the copy is large enough for the threads
+// to still be copying when they would start on the product if it did not wait
+static void test_groups(struct ggml_context * ctx) {
+    const int n_embd = 4096;
+    const int n_kv   = 1024;
+
+    struct ggml_tensor * cache     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_kv);
+    struct ggml_tensor * cache_ref = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_kv);
+    struct ggml_tensor * k         = new_rand(ctx, n_embd, n_kv);
+    struct ggml_tensor * q         = new_rand(ctx, n_embd, 1);
+    struct ggml_tensor * a         = new_rand(ctx, n_embd, 48);
+
+    struct ggml_tensor * cpy = ggml_cpy(ctx, k, cache);
+    struct ggml_tensor * kq  = ggml_mul_mat(ctx, cache, q);
+    struct ggml_tensor * aq  = ggml_mul_mat(ctx, a, q);
+
+    struct ggml_cgraph gf = ggml_build_forward(cpy);
+    ggml_build_forward_expand(&gf, kq);
+    ggml_build_forward_expand(&gf, aq);
+
+    struct ggml_tensor * kq_ref = ggml_mul_mat(ctx, cache_ref, q);
+    struct ggml_tensor * aq_ref = ggml_mul_mat(ctx, a, q);
+
+    for (int iter = 0; iter < 8; iter++) {
+        for (int64_t i = 0; i < ggml_nelements(k); i++) {
+            ((float *) k->data)[i] = frand();
+        }
+        memset(cache->data, 0, ggml_nbytes(cache));
+        compute(ctx, &gf, N_THREADS, g_pool);
+
+        memcpy(cache_ref->data, k->data, ggml_nbytes(k));
+        compute_tensor(ctx, kq_ref);
+        compute_tensor(ctx, aq_ref);
+
+        assert(equal(kq, kq_ref) && equal(aq, aq_ref));
+    }
+}
+
+// independent products of the same input are computed together, with one quantized copy
+// of the input shared by both
+static void test_siblings(struct ggml_context * ctx) {
+    struct ggml_tensor * a1 = new_rand_q4_0(ctx, 128, 64);
+    struct ggml_tensor * a2 = new_rand_q4_0(ctx, 128, 64);
+    struct ggml_tensor * x  = new_rand(ctx, 128, 6);
+
+    struct ggml_tensor * m1  = ggml_mul_mat(ctx, a1, x);
+    struct ggml_tensor * m2  = ggml_mul_mat(ctx, a2, x);
+    struct ggml_tensor * out = ggml_add(ctx, m1, m2);
+    compute_tensor(ctx, out);
+
+    struct ggml_tensor * r1 = ggml_mul_mat(ctx, a1, x);
+    compute_tensor(ctx, r1);
+    struct ggml_tensor * r2 = ggml_mul_mat(ctx, a2, x);
+    compute_tensor(ctx, r2);
+    struct ggml_tensor * ref = ggml_add(ctx, leaf_copy(ctx, r1), leaf_copy(ctx, r2));
+    compute_tensor(ctx, ref);
+
+    assert(equal(m1, r1) && equal(m2, r2) && equal(out, ref));
+}
+
+// one product with the rows of two weights, and ops on views of the halves of its result
+static void test_fused_weights(struct ggml_context * ctx) {
+    const int n_in  = 64;
+    const int n_out = 32;
+
+    struct ggml_tensor * w  = new_rand(ctx, n_in, 2*n_out);
+    struct ggml_tensor * w1 = ggml_view_2d(ctx, w, n_in, n_out, w->nb[1], 0);
+    struct ggml_tensor * w3 = ggml_view_2d(ctx, w, n_in, n_out, w->nb[1], n_out*w->nb[1]);
+    struct ggml_tensor * x  = new_rand(ctx, n_in, 5);
+
+    struct ggml_tensor * w13 = ggml_mul_mat(ctx, w, x);
+    struct ggml_tensor * h1  = ggml_view_2d(ctx, w13, n_out, 5, w13->nb[1], 0);
+    struct ggml_tensor * h3  = ggml_view_2d(ctx, w13, n_out, 5, w13->nb[1], n_out*sizeof(float));
+    struct ggml_tensor * out = ggml_mul(ctx, ggml_silu(ctx, h1), h3);
+    compute_tensor(ctx, out);
+
+    struct ggml_tensor * r1 = ggml_mul_mat(ctx, leaf_copy(ctx, w1), x);
+    compute_tensor(ctx, r1);
+    struct ggml_tensor * r3 = ggml_mul_mat(ctx, leaf_copy(ctx, w3), x);
+    compute_tensor(ctx, r3);
+    struct ggml_tensor * ref = ggml_mul(ctx, ggml_silu(ctx, r1), r3);
+    compute_tensor(ctx, ref);
+
+    assert(equal(h1, r1) && equal(h3, r3) && equal(out, ref));
+}
+
+// add and mul broadcast a row, and the RMS norm with its scale is the same in one pass
+static void test_broadcast(struct ggml_context * ctx) {
+    struct ggml_tensor * x = new_rand(ctx, 64, 6);
+    struct ggml_tensor * b = new_rand(ctx, 64, 1);
+
+    struct ggml_tensor * add = ggml_add(ctx, x, b);
+    compute_tensor(ctx, add);
+    struct ggml_tensor * add_ref = ggml_add(ctx, x, ggml_repeat(ctx, b, x));
+    compute_tensor(ctx, add_ref);
+    assert(equal(add, add_ref));
+
+    struct ggml_tensor * norm = ggml_rms_norm_mul(ctx, x, b);
+    compute_tensor(ctx, norm);
+    struct ggml_tensor * norm_ref = ggml_mul(ctx, ggml_rms_norm(ctx, x), ggml_repeat(ctx, b, x));
+    compute_tensor(ctx, norm_ref);
+    assert(max_diff(norm, norm_ref) < 1e-5f);
+}
+
+// the attention softmax with its scale and mask in one pass, against the scale, the add of the
+// mask broadcast over the heads and the softmax as separate ops. the masked cells are those of
+// another sequence inside a row and those after the last visible one at its end
+static void test_soft_max_ext(struct ggml_context * ctx) {
+    const int n_kv     = 40;
+    const int n_tokens = 5;
+    const int n_head   = 4;
+
+    struct ggml_tensor * kq   = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, n_tokens, n_head);
+    struct ggml_tensor * mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_kv, n_tokens);
+    for (int64_t i = 0; i < ggml_nelements(kq); i++) {
+        ((float *) kq->data)[i] = 8.0f*frand();
+    }
+    for (int t = 0; t < n_tokens; t++) {
+        for (int j = 0; j < n_kv; j++) {
+            const bool visible = j <= 30 + t && j % 7 != 3;
+            ((float *) mask->data)[t*n_kv + j] = visible ? 0.0f : -INFINITY;
+        }
+    }
+
+    const float scale = 0.125f;
+
+    struct ggml_tensor * kq_ext = ggml_dup_tensor(ctx, kq);
+    struct ggml_tensor * kq_ref = ggml_dup_tensor(ctx, kq);
+    memcpy(kq_ext->data, kq->data, ggml_nbytes(kq));
+    memcpy(kq_ref->data, kq->data, ggml_nbytes(kq));
+
+    struct ggml_tensor * out = ggml_soft_max_ext(ctx, kq_ext, mask, scale);
+    compute_tensor(ctx, out);
+
+    struct ggml_tensor * ref = ggml_soft_max(ctx, ggml_add(ctx, ggml_scale(ctx, kq_ref, ggml_new_f32(ctx, scale)), mask));
+    compute_tensor(ctx, ref);
+
+    for (int h = 0; h < n_head; h++) {
+        for (int t = 0; t < n_tokens; t++) {
+            const float * y = (const float *) ((const char *) out->data + h*out->nb[2] + t*out->nb[1]);
+            const float * r = (const float *) ((const char *) ref->data + h*ref->nb[2] + t*ref->nb[1]);
+            const float * m = (const float *) mask->data + t*n_kv;
+            for (int j = 0; j < n_kv; j++) {
+                assert(m[j] == -INFINITY ? y[j] == 0.0f : fabsf(y[j] - r[j]) < 1e-6f);
+            }
+        }
+    }
+}
+
+// attention of a single token to a Q4_0 V, against the softmax computed here with V dequantized:
+// the weights of V are not rounded. 96 cells are not a multiple of two blocks
+static void test_attn_decode(struct ggml_context * ctx) {
+    const int64_t D    = 32;
+    const int64_t H    = 2;
+    const int64_t n_kv = 96;
+
+    struct ggml_tensor * q    = ggml_reshape_3d(ctx, new_rand(ctx, D, H), D, H, 1);
+    struct ggml_tensor * k    = ggml_reshape_3d(ctx, new_rand(ctx, D, H*n_kv), D, H, n_kv);
+    struct ggml_tensor * v    = ggml_reshape_3d(ctx, new_rand_q4_0(ctx, n_kv, D*H), n_kv, D, H);
+    struct ggml_tensor * mask = new_rand(ctx, n_kv, 1);
+    for (int64_t j = 40; j < n_kv; j += 3) {
+        ((float *) mask->data)[j] = -INFINITY;
+    }
+
+    const float scale = 0.125f;
+
+    struct ggml_tensor * out = ggml_attn_decode(ctx, q, k, v, mask, scale);
+    compute_tensor(ctx, out);
+
+    quantize_fns_t fns = ggml_internal_get_quantize_fn(GGML_TYPE_Q4_0);
+
+    float vf[96];
+    float w[96];
+    for (int64_t h = 0; h < H; h++) {
+        float max = -INFINITY;
+        for (int64_t j = 0; j < n_kv; j++) {
+            const float * kj = (const float *) ((const char *) k->data + h*k->nb[1] + j*k->nb[2]);
+            const float * qh = (const float *) ((const char *) q->data + h*q->nb[1]);
+            float dot = 0.0f;
+            for (int64_t i = 0; i < D; i++) {
+                dot += kj[i]*qh[i];
+            }
+            w[j] = dot*scale + ((const float *) mask->data)[j];
+            max  = fmaxf(max, w[j]);
+        }
+
+        float sum = 0.0f;
+        for (int64_t j = 0; j < n_kv; j++) {
+            w[j] = expf(w[j] - max);
+            sum += w[j];
+        }
+
+        for (int64_t i = 0; i < D; i++) {
+            fns.dequantize_row_q((const char *) v->data + i*v->nb[1] + h*v->nb[2], vf, (int) n_kv);
+
+            float y = 0.0f;
+            for (int64_t j = 0; j < n_kv; j++) {
+                y += vf[j]*w[j];
+            }
+
+            const float o = *(const float *) ((const char *) out->data + h*out->nb[1] + i*sizeof(float));
+            assert(fabsf(o - y/sum) < 1e-5f);
+        }
+    }
+}
+
+int main(void) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 256*1024*1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+    assert(ctx != NULL);
+
+    g_pool = ggml_threadpool_new(N_THREADS, false);
+
+    test_matmul_epilogue(ctx);
+    test_elementwise_chain(ctx);
+    test_inplace(ctx);
+    test_reject_src1_in_chain(ctx);
+    test_graph_reuse(ctx);
+    test_threads(ctx);
+    test_chunks(ctx);
+    test_groups(ctx);
+    test_siblings(ctx);
+    test_fused_weights(ctx);
+    test_broadcast(ctx);
+    test_soft_max_ext(ctx);
+    test_attn_decode(ctx);
+
+    ggml_threadpool_free(g_pool);
+    ggml_free(ctx);
+
+    return 0;
+}
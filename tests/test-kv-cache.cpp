@@ -0,0 +1,646 @@
+// Operations on the KV cache of a context with several sequences, on a small
+// model with random weights that the test writes itself
+
+#include "llama.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char * k_model_path = "test-kv-cache-model.bin";
+
+static const int k_n_vocab = 256;
+static const int k_n_embd  = 128;
+static const int k_n_mult  = 32;
+static const int k_n_head  = 2;
+static const int k_n_layer = 32; // the smallest model type llama.cpp knows has 32 layers
+static const int k_n_ctx   = 128;
+
+static const llama_kv_type k_kv_types[] = { LLAMA_KV_TYPE_F32, LLAMA_KV_TYPE_F16, LLAMA_KV_TYPE_Q8_0, LLAMA_KV_TYPE_Q4_0 };
+
+// writes an F32 model in the ggjt format
+static void write_model(const char * path) {
+    FILE * f = fopen(path, "wb");
+    assert(f != NULL);
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    auto write_u32 = [&](uint32_t val) { fwrite(&val, sizeof(val), 1, f); };
+
+    write_u32(LLAMA_FILE_MAGIC);
+    write_u32(LLAMA_FILE_VERSION);
+
+    const uint32_t hparams[] = { k_n_vocab, k_n_embd, k_n_mult, k_n_head, k_n_layer, k_n_embd/k_n_head, LLAMA_FTYPE_ALL_F32 };
+    for (uint32_t val : hparams) {
+        write_u32(val);
+    }
+
+    for (int i = 0; i < k_n_vocab; i++) {
+        const std::string word = "t" + std::to_string(i);
+        const float score = 0.0f;
+        write_u32(word.size());
+        fwrite(word.data(), 1, word.size(), f);
+        fwrite(&score, sizeof(score), 1, f);
+    }
+
+    auto write_tensor = [&](const std::string & name, std::vector<uint32_t> ne, float scale, float base) {
+        write_u32(ne.size());
+        write_u32(name.size());
+        write_u32(0); // F32
+        size_t n = 1;
+        for (uint32_t d : ne) {
+            write_u32(d);
+            n *= d;
+        }
+        fwrite(name.data(), 1, name.size(), f);
+
+        // tensor data is aligned to 32 bytes
+        const long pad = -ftell(f) & 31;
+        for (long i = 0; i < pad; i++) {
+            fputc(0, f);
+        }
+
+        std::vector<float> data(n);
+        for (float & x : data) {
+            x = base + scale*dist(rng);
+        }
+        fwrite(data.data(), sizeof(float), n, f);
+    };
+
+    const uint32_t n_ff = ((2*(4*k_n_embd)/3 + k_n_mult - 1)/k_n_mult)*k_n_mult;
+
+    write_tensor("tok_embeddings.weight", { k_n_embd, k_n_vocab }, 1.0f, 0.0f);
+    write_tensor("norm.weight",           { k_n_embd },            0.1f, 1.0f);
+    write_tensor("output.weight",         { k_n_embd, k_n_vocab }, 0.3f, 0.0f);
+
+    for (int il = 0; il < k_n_layer; il++) {
+        const std::string layer = "layers." + std::to_string(il) + ".";
+        write_tensor(layer + "attention_norm.weight", { k_n_embd }, 0.1f, 1.0f);
+        for (const char * w : { "wq", "wk" }) {
+            write_tensor(layer + "attention." + w + ".weight", { k_n_embd, k_n_embd }, 0.15f, 0.0f);
+        }
+        for (const char * w : { "wv", "wo" }) {
+            write_tensor(layer + "attention." + w + ".weight", { k_n_embd, k_n_embd }, 0.1f, 0.0f);
+        }
+        write_tensor(layer + "ffn_norm.weight",        { k_n_embd },       0.1f,  1.0f);
+        write_tensor(layer + "feed_forward.w1.weight", { k_n_embd, n_ff }, 0.1f,  0.0f);
+        write_tensor(layer + "feed_forward.w2.weight", { n_ff, k_n_embd }, 0.05f, 0.0f);
+        write_tensor(layer + "feed_forward.w3.weight", { k_n_embd, n_ff }, 0.1f,  0.0f);
+    }
+
+    fclose(f);
+}
+
+static llama_context * new_context(llama_kv_type kv_type = LLAMA_KV_TYPE_DEFAULT, int prefix_cache_tokens = 0) {
+    auto lparams = llama_context_default_params();
+
+    lparams.n_ctx   = k_n_ctx;
+    lparams.seed    = 1;
+    lparams.kv_type = kv_type;
+    lparams.prefix_cache_tokens = prefix_cache_tokens;
+
+    llama_context * ctx = llama_init_from_file(k_model_path, lparams);
+    assert(ctx != NULL);
+
+    return ctx;
+}
+
+// tokens of one llama_decode() call
+struct test_batch {
+    std::vector<llama_token>  token;
+    std::vector<llama_pos>    pos;
+    std::vector<llama_seq_id> seq_id;
+    bool logits[k_n_ctx] = {};
+
+    // adds the tokens [t0, t0 + n) of a sequence at positions [p0, p0 + n), with logits for the last one
+    void add(llama_seq_id seq, llama_token t0, llama_pos p0, int n) {
+        for (int i = 0; i < n; i++) {
+            logits[token.size()] = i == n - 1;
+            token.push_back((t0 + i) % k_n_vocab);
+            pos.push_back(p0 + i);
+            seq_id.push_back(seq);
+        }
+    }
+
+    void decode(llama_context * ctx) const {
+        const llama_batch batch = { (int) token.size(), token.data(), pos.data(), seq_id.data(), logits };
+        assert(llama_decode(ctx, batch, 1) == 0);
+    }
+};
+
+// the logits of the next token of each sequence, after the one at pos_next[seq]
+static std::vector<float> next_logits(llama_context * ctx, const std::vector<llama_pos> & pos_next) {
+    test_batch batch;
+    for (size_t seq = 0; seq < pos_next.size(); seq++) {
+        batch.add(seq, 100, pos_next[seq], 1);
+    }
+    batch.decode(ctx);
+
+    std::vector<float> logits;
+    for (size_t seq = 0; seq < pos_next.size(); seq++) {
+        const float * l = llama_get_logits_ith(ctx, seq);
+        assert(l != NULL);
+        logits.insert(logits.end(), l, l + k_n_vocab);
+    }
+
+    return logits;
+}
+
+// a state saved with holes between the used cells and several sequences sharing cells
+// is as large as llama_get_state_size() says, and restores the same sequences
+static void test_state(llama_kv_type kv_type) {
+    llama_context * ctx = new_context(kv_type);
+
+    test_batch batch;
+    batch.add(0,  0, 0, 20);
+    batch.add(1, 20, 0, 10);
+    batch.decode(ctx);
+
+    llama_kv_cache_seq_cp(ctx, 0, 2, 0, 5);
+    llama_kv_cache_seq_rm(ctx, 0, 5, 10);
+    llama_kv_cache_seq_rm(ctx, 1, 8, -1);
+
+    const size_t size = llama_get_state_size(ctx);
+
+    std::vector<uint8_t> buf(size + 64, 0xab);
+    const size_t n_written = llama_copy_state_data(ctx, buf.data());
+    assert(n_written == size);
+    for (size_t i = size; i < buf.size(); i++) {
+        assert(buf[i] == 0xab);
+    }
+
+    // the size does not depend on whether the cache was compacted already
+    assert(llama_get_state_size(ctx) == size);
+
+    llama_context * ctx_restored = new_context(kv_type);
+    assert(llama_set_state_data(ctx_restored, buf.data(), n_written) == n_written);
+    assert(llama_get_state_size(ctx_restored) == size);
+    assert(llama_get_kv_cache_token_count(ctx_restored) == llama_get_kv_cache_token_count(ctx));
+
+    const std::vector<llama_pos> pos_next = { 20, 8, 5 };
+    assert(next_logits(ctx, pos_next) == next_logits(ctx_restored, pos_next));
+
+    llama_free(ctx_restored);
+    llama_free(ctx);
+}
+
+static float max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    assert(a.size() == b.size());
+    float diff = 0.0f;
+    for (size_t i = 0; i < a.size(); i++) {
+        diff = std::max(diff, std::fabs(a[i] - b[i]));
+    }
+    return diff;
+}
+
+static std::vector<float> logits_ith(llama_context * ctx, int i) {
+    const float * l = llama_get_logits_ith(ctx, i);
+    assert(l != NULL);
+    return std::vector<float>(l, l + k_n_vocab);
+}
+
+// sequences decoded together in one batch see only their own cells, and copying or
+// removing the cells of a sequence changes what it sees and nothing else. the cells of
+// a sequence are at other places than when it is decoded alone, so the dot products
+// add up in another order
+static void test_sequences() {
+    llama_context * ctx = new_context();
+    {
+        test_batch batch;
+        batch.add(0,  0, 0, 20);
+        batch.add(1, 20, 0, 10);
+        batch.decode(ctx);
+    }
+    assert(llama_get_kv_cache_token_count(ctx) == 30);
+    assert(llama_get_logits_ith(ctx, 0) == NULL);
+
+    const std::vector<float> logits_0 = logits_ith(ctx, 19);
+    const std::vector<float> logits_1 = logits_ith(ctx, 29);
+
+    llama_context * ctx_0 = new_context();
+    llama_context * ctx_1 = new_context();
+    {
+        test_batch batch;
+        batch.add(0, 0, 0, 20);
+        batch.decode(ctx_0);
+        assert(max_diff(logits_0, logits_ith(ctx_0, 19)) < 1e-3f);
+    }
+    {
+        test_batch batch;
+        batch.add(0, 20, 0, 10);
+        batch.decode(ctx_1);
+        assert(max_diff(logits_1, logits_ith(ctx_1, 9)) < 1e-3f);
+    }
+
+    // sequence 2 starts like sequence 0, which is then cut back to the same tokens. the cells
+    // of the removed positions are freed, the shared ones are not
+    llama_kv_cache_seq_cp(ctx, 0, 2, 0, 10);
+    llama_kv_cache_seq_rm(ctx, 0, 10, -1);
+    assert(llama_get_kv_cache_token_count(ctx) == 20);
+
+    llama_context * ctx_2 = new_context();
+    {
+        test_batch batch;
+        batch.add(0, 0, 0, 10);
+        batch.add(0, 100, 10, 1);
+        batch.decode(ctx_2);
+    }
+    {
+        test_batch batch;
+        batch.add(0, 100, 10, 1);
+        batch.decode(ctx_1);
+    }
+
+    test_batch batch;
+    batch.add(0, 100, 10, 1);
+    batch.add(1, 100, 10, 1);
+    batch.add(2, 100, 10, 1);
+    batch.decode(ctx);
+
+    assert(max_diff(logits_ith(ctx, 0), logits_ith(ctx_2, 10)) < 1e-3f);
+    assert(max_diff(logits_ith(ctx, 1), logits_ith(ctx_1, 0))  < 1e-3f);
+    assert(max_diff(logits_ith(ctx, 2), logits_ith(ctx_2, 10)) < 1e-3f);
+
+    // a negative seq_id matches every sequence
+    llama_kv_cache_seq_rm(ctx, -1, 0, -1);
+    assert(llama_get_kv_cache_token_count(ctx) == 0);
+
+    llama_free(ctx_2);
+    llama_free(ctx_1);
+    llama_free(ctx_0);
+    llama_free(ctx);
+}
+
+// logits restricted to a subset of the vocabulary are the full logits for the tokens of the
+// subset and -INFINITY for the others, whether the rows of the subset are gathered from the
+// output matrix or picked from the full projection
+static void test_output_vocab() {
+    llama_context * ctx_full = new_context();
+    llama_context * ctx      = new_context();
+
+    std::vector<llama_token> small_a;
+    std::vector<llama_token> small_b;
+    std::vector<llama_token> large;
+    std::vector<llama_token> all;
+    std::vector<llama_token> none;
+    for (llama_token t = 0; t < k_n_vocab; t++) {
+        if (t % 13 == 0) {
+            small_a.push_back(t);
+        }
+        if (t % 13 == 1) {
+            small_b.push_back(t);
+        }
+        if (t % 3 == 0) {
+            large.push_back(t);
+        }
+        all.push_back(t);
+    }
+    assert(small_a.size() == small_b.size() && (int) small_a.size() <= k_n_vocab/8);
+    assert((int) large.size() > k_n_vocab/8);
+
+    const llama_token invalid = k_n_vocab;
+    assert(!llama_set_output_vocab(ctx, &invalid, 1));
+
+    llama_pos pos = 0;
+    // small_b replaces small_a in the graph built for small_a, and the empty list after the one
+    // with every token computes all logits again
+    for (const std::vector<llama_token> * vocab : { &small_a, &small_b, &large, &all, &none }) {
+        assert(llama_set_output_vocab(ctx, vocab->data(), (int) vocab->size()));
+
+        // two tokens with logits in each batch
+        test_batch batch;
+        batch.add(0, pos, pos, 2);
+        batch.logits[0] = true;
+        batch.decode(ctx_full);
+        batch.decode(ctx);
+        pos += 2;
+
+        std::vector<bool> in_vocab(k_n_vocab, vocab->empty());
+        for (llama_token t : *vocab) {
+            in_vocab[t] = true;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            const std::vector<float> logits_full = logits_ith(ctx_full, i);
+            const std::vector<float> logits      = logits_ith(ctx, i);
+            for (llama_token t = 0; t < k_n_vocab; t++) {
+                assert(in_vocab[t] ? logits[t] == logits_full[t] : logits[t] == -INFINITY);
+            }
+        }
+    }
+
+    llama_free(ctx);
+    llama_free(ctx_full);
+}
+
+static llama_context * new_embedding_context(llama_pooling_type pooling_type) {
+    auto lparams = llama_context_default_params();
+
+    lparams.n_ctx        = k_n_ctx;
+    lparams.seed         = 1;
+    lparams.embedding    = true;
+    lparams.pooling_type = pooling_type;
+
+    llama_context * ctx = llama_init_from_file(k_model_path, lparams);
+    assert(ctx != NULL);
+
+    return ctx;
+}
+
+// embeddings of a batch with the tokens of several sequences interleaved are those of each
+// sequence decoded alone: the hidden state of every token, of the last token of a sequence,
+// or the mean over the tokens of a sequence
+static void test_embeddings() {
+    test_batch batch;
+    batch.add(0,  0, 0, 6);
+    batch.add(1, 30, 0, 7);
+    batch.add(0,  6, 6, 6);
+    batch.add(2, 60, 0, 5);
+
+    const int n_seq = 3;
+
+    // the hidden states of the tokens of each sequence decoded alone
+    std::vector<std::vector<float>> states_ref(n_seq);
+    for (int seq = 0; seq < n_seq; seq++) {
+        llama_context * ctx = new_embedding_context(LLAMA_POOLING_TYPE_NONE);
+
+        test_batch alone;
+        for (size_t i = 0; i < batch.token.size(); i++) {
+            if (batch.seq_id[i] == seq) {
+                alone.add(0, batch.token[i], batch.pos[i], 1);
+            }
+        }
+        const llama_batch b = { (int) alone.token.size(), alone.token.data(), alone.pos.data(), alone.seq_id.data(), NULL };
+        assert(llama_decode(ctx, b, 1) == 0);
+
+        for (size_t i = 0; i < alone.token.size(); i++) {
+            const float * e = llama_get_embeddings_ith(ctx, i);
+            assert(e != NULL);
+            states_ref[seq].insert(states_ref[seq].end(), e, e + k_n_embd);
+        }
+
+        llama_free(ctx);
+    }
+
+    for (llama_pooling_type pooling_type : { LLAMA_POOLING_TYPE_LAST, LLAMA_POOLING_TYPE_MEAN, LLAMA_POOLING_TYPE_NONE }) {
+        llama_context * ctx = new_embedding_context(pooling_type);
+
+        const llama_batch b = { (int) batch.token.size(), batch.token.data(), batch.pos.data(), batch.seq_id.data(), NULL };
+        assert(llama_decode(ctx, b, 1) == 0);
+
+        std::vector<int> n_seen(n_seq, 0);
+        for (size_t i = 0; i < batch.token.size(); i++) {
+            const int seq = batch.seq_id[i];
+            const float * e = llama_get_embeddings_ith(ctx, i);
+            if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
+                assert(e != NULL);
+                const std::vector<float> ref(states_ref[seq].begin() + n_seen[seq]*k_n_embd, states_ref[seq].begin() + (n_seen[seq] + 1)*k_n_embd);
+                assert(max_diff(std::vector<float>(e, e + k_n_embd), ref) < 1e-3f);
+            } else {
+                assert(e == NULL);
+            }
+            n_seen[seq]++;
+        }
+
+        for (int seq = 0; seq < n_seq; seq++) {
+            const float * e = llama_get_embeddings_seq(ctx, seq);
+            if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
+                assert(e == NULL);
+                continue;
+            }
+            assert(e != NULL);
+
+            std::vector<float> ref(k_n_embd, 0.0f);
+            for (int j = 0; j < k_n_embd; j++) {
+                if (pooling_type == LLAMA_POOLING_TYPE_LAST) {
+                    ref[j] = states_ref[seq][(n_seen[seq] - 1)*k_n_embd + j];
+                } else {
+                    for (int i = 0; i < n_seen[seq]; i++) {
+                        ref[j] += states_ref[seq][i*k_n_embd + j];
+                    }
+                    ref[j] /= n_seen[seq];
+                }
+            }
+            assert(max_diff(std::vector<float>(e, e + k_n_embd), ref) < 1e-3f);
+        }
+
+        // a sequence that is not in the batch has no embedding
+        assert(llama_get_embeddings_seq(ctx, n_seq) == NULL);
+
+        llama_free(ctx);
+    }
+}
+
+// shifting a sequence re-rotates the cached keys to the new positions, and leaves the
+// sequences that shared the shifted cells where they were
+static void test_shift(llama_kv_type kv_type, float tolerance) {
+    const int n_tokens = 24;
+    const int delta    = 8;
+
+    // RoPE encodes relative positions, so the tokens evaluated where they are shifted to are the reference
+    llama_context * ctx_ref = new_context(kv_type);
+    {
+        test_batch batch;
+        batch.add(0, 0, 0, n_tokens);
+        batch.add(1, 0, delta, n_tokens);
+        batch.decode(ctx_ref);
+    }
+    const std::vector<float> logits_ref = next_logits(ctx_ref, { n_tokens, delta + n_tokens });
+
+    llama_context * ctx = new_context(kv_type);
+    {
+        test_batch batch;
+        batch.add(0, 0, delta, n_tokens);
+        batch.decode(ctx);
+    }
+    llama_kv_cache_seq_cp(ctx, 0, 1, -1, -1);
+
+    assert(llama_kv_cache_seq_shift(ctx, 0, -1, -1, -delta));
+    assert(llama_get_kv_cache_token_count(ctx) == 2*n_tokens);
+
+    const std::vector<float> logits = next_logits(ctx, { n_tokens, delta + n_tokens });
+    assert(max_diff(logits, logits_ref) < tolerance);
+
+    llama_free(ctx);
+    llama_free(ctx_ref);
+}
+
+// swapping a sequence out and back in keeps its K/V as it is when the cache has free
+// V blocks for it, and spreads it over free cells when it does not
+static void test_swap(llama_kv_type kv_type, float tolerance) {
+    llama_context * ctx_ref = new_context(kv_type);
+    llama_context * ctx     = new_context(kv_type);
+    for (llama_context * c : { ctx_ref, ctx }) {
+        test_batch batch;
+        batch.add(0,  0, 0, 32);
+        batch.add(1, 32, 0, 10);
+        batch.decode(c);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        assert(llama_kv_cache_seq_swap_out(ctx, 1));
+        assert(llama_kv_cache_seq_location(ctx, 1) == LLAMA_KV_LOCATION_MEMORY);
+        assert(llama_get_kv_cache_token_count(ctx) == 32);
+
+        assert(llama_kv_cache_seq_swap_in(ctx, 1));
+        assert(llama_kv_cache_seq_location(ctx, 1) == LLAMA_KV_LOCATION_CACHE);
+        assert(llama_get_kv_cache_token_count(ctx) == 42);
+    }
+
+    assert(next_logits(ctx, { 32, 10 }) == next_logits(ctx_ref, { 32, 10 }));
+
+    // the cells the sequence leaves are taken while it is swapped out
+    assert(llama_kv_cache_seq_swap_out(ctx, 1));
+    for (llama_context * c : { ctx_ref, ctx }) {
+        test_batch batch;
+        batch.add(2, 50, 0, 80);
+        batch.decode(c);
+    }
+    assert(llama_kv_cache_seq_swap_in(ctx, 1));
+    assert(llama_get_kv_cache_token_count(ctx) == 124);
+
+    assert(max_diff(next_logits(ctx, { 33, 11, 80 }), next_logits(ctx_ref, { 33, 11, 80 })) < tolerance);
+
+    const llama_kv_swap_stats stats = llama_kv_swap_get_stats(ctx);
+    assert(stats.n_swap_out == 3 && stats.n_swap_in == 3 && stats.size_memory == 0);
+
+    llama_free(ctx);
+    llama_free(ctx_ref);
+}
+
+static std::vector<llama_token> tokens_from(llama_token t0, int n) {
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < n; i++) {
+        tokens.push_back((t0 + i) % k_n_vocab);
+    }
+    return tokens;
+}
+
+// prompts stored in the prefix cache are shared by later prompts that start the same way,
+// and the least recently used ones are dropped once the cache is full. a prompt longer than
+// the cache keeps its first tokens
+static void test_prefix_cache() {
+    const int    n_tokens   = 24;
+    const int    n_common   = 16;
+    const int    n_max      = 40;
+    const size_t token_size = 2*k_n_embd*k_n_layer*sizeof(float);
+
+    llama_context * ctx = new_context(LLAMA_KV_TYPE_F32, n_max);
+
+    const std::vector<llama_token> prompt_a = tokens_from(0, n_tokens);
+    {
+        test_batch batch;
+        batch.add(0, 0, 0, n_tokens);
+        batch.decode(ctx);
+    }
+    assert(llama_prefix_cache_store(ctx, 0, prompt_a.data(), n_tokens));
+    assert(llama_prefix_cache_get_stats(ctx).size == n_tokens*token_size);
+
+    // no sequence of the cache is removed for an invalid seq_id
+    assert(llama_prefix_cache_lookup(ctx, -1, prompt_a.data(), n_tokens - 1) == 0);
+    assert(llama_prefix_cache_lookup(ctx, LLAMA_PREFIX_CACHE_SEQ_ID, prompt_a.data(), n_tokens - 1) == 0);
+    assert(!llama_prefix_cache_store(ctx, -1, prompt_a.data(), n_tokens));
+    assert(!llama_prefix_cache_store(ctx, LLAMA_PREFIX_CACHE_SEQ_ID, prompt_a.data(), n_tokens));
+    assert(llama_get_kv_cache_token_count(ctx) == n_tokens);
+    assert(llama_prefix_cache_get_stats(ctx).size == n_tokens*token_size);
+
+    // a prompt that starts like the stored one evaluates only the rest
+    std::vector<llama_token> prompt_b = tokens_from(0, n_common);
+    for (llama_token t : tokens_from(200, n_tokens - n_common)) {
+        prompt_b.push_back(t);
+    }
+    assert(llama_prefix_cache_lookup(ctx, 1, prompt_b.data(), n_tokens - 1) == n_common);
+    {
+        test_batch batch;
+        batch.add(1, 200, n_common, n_tokens - n_common);
+        batch.decode(ctx);
+    }
+    const float * l = llama_get_logits_ith(ctx, n_tokens - n_common - 1);
+    const std::vector<float> logits(l, l + k_n_vocab);
+
+    llama_context * ctx_ref = new_context(LLAMA_KV_TYPE_F32);
+    {
+        test_batch batch;
+        batch.add(0, 0, 0, n_common);
+        batch.add(0, 200, n_common, n_tokens - n_common);
+        batch.decode(ctx_ref);
+    }
+    l = llama_get_logits_ith(ctx_ref, n_tokens - 1);
+    assert(max_diff(logits, std::vector<float>(l, l + k_n_vocab)) < 1e-3f);
+    llama_free(ctx_ref);
+
+    // the common tokens are kept once
+    assert(llama_prefix_cache_store(ctx, 1, prompt_b.data(), n_tokens));
+    assert(llama_prefix_cache_get_stats(ctx).size == (2*n_tokens - n_common)*token_size);
+
+    // a third prompt does not fit, the two tails are dropped and the common tokens stay
+    const std::vector<llama_token> prompt_c = tokens_from(50, n_tokens);
+    {
+        test_batch batch;
+        batch.add(2, 50, 0, n_tokens);
+        batch.decode(ctx);
+    }
+    const int n_cells = llama_get_kv_cache_token_count(ctx);
+    assert(llama_prefix_cache_store(ctx, 2, prompt_c.data(), n_tokens));
+
+    const llama_prefix_cache_stats stats = llama_prefix_cache_get_stats(ctx);
+    assert(stats.n_evictions == 2);
+    assert(stats.size == (n_common + n_tokens)*token_size);
+
+    // the sequences still hold the cells of the dropped prompts
+    assert(llama_get_kv_cache_token_count(ctx) == n_cells);
+
+    assert(llama_prefix_cache_lookup(ctx, 3, prompt_a.data(), n_tokens - 1) == n_common);
+    assert(llama_prefix_cache_lookup(ctx, 3, prompt_c.data(), n_tokens - 1) == n_tokens - 1);
+
+    const int n_long = n_max + 10;
+    const std::vector<llama_token> prompt_d = tokens_from(120, n_long);
+    {
+        test_batch batch;
+        batch.add(4, 120, 0, n_long);
+        batch.decode(ctx);
+    }
+    assert(llama_prefix_cache_store(ctx, 4, prompt_d.data(), n_long));
+    assert(llama_prefix_cache_get_stats(ctx).size == n_max*token_size);
+    assert(llama_prefix_cache_lookup(ctx, 5, prompt_d.data(), n_long - 1) == n_max);
+    assert(llama_prefix_cache_lookup(ctx, 5, prompt_a.data(), n_tokens - 1) == 0);
+
+    llama_free(ctx);
+}
+
+int main(void) {
+    write_model(k_model_path);
+
+    for (llama_kv_type kv_type : k_kv_types) {
+        test_state(kv_type);
+    }
+
+    // the shifted keys are rotated once more and stored in the cache type again
+    // without the rotation the logits are about 1.0 off, Q4_0 rounds them about as much
+    test_shift(LLAMA_KV_TYPE_F32,  1e-2f);
+    test_shift(LLAMA_KV_TYPE_F16,  5e-2f);
+    test_shift(LLAMA_KV_TYPE_Q8_0, 2e-1f);
+
+    test_prefix_cache();
+    test_sequences();
+    test_output_vocab();
+    test_embeddings();
+
+    // spread over other cells the V of the sequence is quantized again in blocks shared with
+    // another sequence, and the attention adds the cells up in another order
+    test_swap(LLAMA_KV_TYPE_F32,  1e-2f);
+    test_swap(LLAMA_KV_TYPE_F16,  1e-2f);
+    test_swap(LLAMA_KV_TYPE_Q8_0, 2e-1f);
+    test_swap(LLAMA_KV_TYPE_Q4_0, 1.0f);
+
+    remove(k_model_path);
+
+    return 0;
+}
@@ -38,5 +38,41 @@ int main(void) {
         assert(q4_result == q4_expected);
     }
 
+    quantize_fns_t q8_0 = ggml_internal_get_quantize_fn(GGML_TYPE_Q8_0);
+    uint8_t dst8[36];
+    q8_0.quantize_row_q_reference(src, dst8, QK);
+    float delta8_result = ((float *)dst8)[0];
+    float delta8_expected = src[31] / ((1 << 7) - 1);
+    assert(delta8_result == delta8_expected);
+    for (int i = 0; i < QK; i++) {
+        int8_t q8_result = (int8_t) dst8[sizeof(float) + i];
+        int8_t q8_expected = roundf(src[i] / delta8_expected);
+        assert(q8_result == q8_expected);
+    }
+
+    float dot_result;
+    float dot_expected = 0.0f;
+    q8_0.vec_dot_q(QK, &dot_result, dst8, dst8);
+    for (int i = 0; i < QK; i++) {
+        dot_expected += src[i]*src[i];
+    }
+    assert(fabsf(dot_result - dot_expected) < 0.01f*dot_expected);
+
+    // the F32 operand of vec_dot_q_f32 is used as it is
+    const enum ggml_type types[3] = { GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q8_0 };
+    for (int t = 0; t < 3; t++) {
+        quantize_fns_t fns = ggml_internal_get_quantize_fn(types[t]);
+        float deq[QK];
+        fns.quantize_row_q_reference(src, dst8, QK);
+        fns.dequantize_row_q(dst8, deq, QK);
+
+        dot_expected = 0.0f;
+        for (int i = 0; i < QK; i++) {
+            dot_expected += deq[i]*src[i];
+        }
+        fns.vec_dot_q_f32(QK, &dot_result, dst8, src);
+        assert(fabsf(dot_result - dot_expected) < 1e-5f*dot_expected);
+    }
+
     return 0;
 }